@@ -4,4 +4,9 @@ if(ACQUIRE_MSVC_USE_MD)
     set(CMAKE_MSVC_RUNTIME_LIBRARY "MultiThreaded$<$<CONFIG:Debug>:Debug>DLL")
 else()
     set(CMAKE_MSVC_RUNTIME_LIBRARY "MultiThreaded$<$<CONFIG:Debug>:Debug>")
-endif()
\ No newline at end of file
+endif()
+
+if(MSVC)
+    # The HAL and platform libraries use C11 <stdatomic.h>.
+    add_compile_options($<$<COMPILE_LANGUAGE:C>:/experimental:c11atomics>)
+endif()
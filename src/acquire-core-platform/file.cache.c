@@ -0,0 +1,488 @@
+#include "file.cache.h"
+#include "logger.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define containerof(P, T, F) ((T*)(((char*)(P)) - offsetof(T, F)))
+
+#define LOG(...) aq_logger(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOGE(...) aq_logger(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            LOGE(__VA_ARGS__);                                                 \
+            goto Error;                                                        \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false:\n\t%s", #e)
+
+struct file_cache_entry
+{
+    struct file file;
+    uint64_t hash;
+    // Acquires that haven't been released. Entries are only on the LRU list
+    // while this is 0.
+    uint32_t pins;
+    // Set while the file is closed outside the lock. The entry stays in its
+    // bucket until then, so the file is never open twice.
+    int is_closing;
+    // Next entry in the same hash bucket.
+    struct file_cache_entry* chain;
+    // The LRU list. `older` is closer to eviction.
+    struct file_cache_entry* older;
+    struct file_cache_entry* newer;
+    size_t bytes_of_path;
+    char path[];
+};
+
+struct file_cache_impl
+{
+    struct lock lock;
+    // Notified when an entry finishes closing.
+    struct condition_variable closed;
+    enum FileCreateFlag flags;
+    size_t capacity;
+    // Includes entries that are closing.
+    size_t open_count;
+    size_t closing_count;
+    uint64_t hits, misses, evictions;
+
+    // Power of two.
+    size_t bucket_count;
+    struct file_cache_entry** buckets;
+
+    // Unpinned entries, oldest first.
+    struct file_cache_entry* oldest;
+    struct file_cache_entry* newest;
+};
+
+// FNV-1a
+static uint64_t
+hash_of(const char* path, size_t n)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < n; ++i) {
+        h ^= (uint8_t)path[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static struct file_cache_entry**
+slot_of(struct file_cache_impl* self, const char* path, size_t n, uint64_t h)
+{
+    struct file_cache_entry** slot =
+      self->buckets + (h & (self->bucket_count - 1));
+    while (*slot && !((*slot)->hash == h && (*slot)->bytes_of_path == n + 1 &&
+                      memcmp((*slot)->path, path, n) == 0)) // NOLINT
+        slot = &(*slot)->chain;
+    return slot;
+}
+
+static void
+lru_remove(struct file_cache_impl* self, struct file_cache_entry* entry)
+{
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        self->oldest = entry->newer;
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        self->newest = entry->older;
+    entry->older = entry->newer = 0;
+}
+
+static void
+lru_push(struct file_cache_impl* self, struct file_cache_entry* entry)
+{
+    entry->older = self->newest;
+    entry->newer = 0;
+    if (self->newest)
+        self->newest->newer = entry;
+    else
+        self->oldest = entry;
+    self->newest = entry;
+}
+
+// Starts closing an unpinned entry. Call with the lock held, then
+// close_finish().
+static void
+close_begin(struct file_cache_impl* self, struct file_cache_entry* entry)
+{
+    entry->is_closing = 1;
+    lru_remove(self, entry);
+    ++self->closing_count;
+}
+
+// Closes the entry's file and takes the entry out of the cache. Closing can
+// wait on writes in flight, so the lock is released while it happens. Call
+// with the lock held. It's held again on return.
+static void
+close_finish(struct file_cache_impl* self, struct file_cache_entry* entry)
+{
+    lock_release(&self->lock);
+    file_close(&entry->file);
+    lock_acquire(&self->lock);
+    struct file_cache_entry** slot =
+      slot_of(self, entry->path, entry->bytes_of_path - 1, entry->hash);
+    *slot = entry->chain;
+    --self->open_count;
+    --self->closing_count;
+    condition_variable_notify_all(&self->closed);
+    free(entry);
+}
+
+int
+file_cache_init(struct file_cache* self,
+                size_t capacity,
+                enum FileCreateFlag flags)
+{
+    struct file_cache_impl* impl = 0;
+    CHECK(self);
+    self->impl = 0;
+    EXPECT(!(flags & FileCreateFlag_Direct),
+           "Files created with FileCreateFlag_Direct can't be cached.");
+
+    const size_t limit = file_get_handle_limit();
+    const size_t cap = (limit == SIZE_MAX) ? ((size_t)1 << 16) : limit / 2;
+    if (capacity == 0 || capacity > cap) {
+        if (capacity)
+            LOG("Caching %llu files instead of %llu, to stay within the open "
+                "file limit of %llu.",
+                (unsigned long long)cap,
+                (unsigned long long)capacity,
+                (unsigned long long)limit);
+        capacity = cap;
+    }
+    CHECK(capacity > 0);
+
+    CHECK(impl = calloc(1, sizeof(*impl)));
+    lock_init(&impl->lock);
+    condition_variable_init(&impl->closed);
+    impl->flags = flags | FileCreateFlag_Keep;
+    impl->capacity = capacity;
+    impl->bucket_count = 1;
+    while (impl->bucket_count < 2 * capacity)
+        impl->bucket_count <<= 1;
+    CHECK(impl->buckets = calloc(impl->bucket_count, sizeof(*impl->buckets)));
+    self->impl = impl;
+    return 1;
+Error:
+    free(impl);
+    return 0;
+}
+
+struct file*
+file_cache_acquire(struct file_cache* self,
+                   const char* path,
+                   size_t bytes_of_path)
+{
+    struct file_cache_entry* entry = 0;
+    struct file_cache_entry* evicted = 0;
+    struct file_cache_impl* impl = 0;
+    CHECK(self && (impl = (struct file_cache_impl*)self->impl));
+    CHECK(path);
+    const size_t n = strlen(path);
+    EXPECT(bytes_of_path == n + 1,
+           "Expected %llu bytes of path. Got %llu.",
+           (unsigned long long)(n + 1),
+           (unsigned long long)bytes_of_path);
+    const uint64_t h = hash_of(path, n);
+
+    lock_acquire(&impl->lock);
+    for (;;) {
+        entry = *slot_of(impl, path, n, h);
+        if (entry && !entry->is_closing) {
+            ++impl->hits;
+            if (entry->pins++ == 0)
+                lru_remove(impl, entry);
+            lock_release(&impl->lock);
+            return &entry->file;
+        }
+        // Wait for this file to finish closing, or for room.
+        if (!entry && impl->open_count < impl->capacity)
+            break;
+        if (!entry && (evicted = impl->oldest))
+            break;
+        if (!entry && !impl->closing_count) {
+            ++impl->misses;
+            lock_release(&impl->lock);
+            EXPECT(0,
+                   "Can't open \"%s\". All %llu cached files are in use.",
+                   path,
+                   (unsigned long long)impl->capacity);
+        }
+        condition_variable_wait(&impl->closed, &impl->lock);
+    }
+
+    ++impl->misses;
+    if (evicted) {
+        close_begin(impl, evicted);
+        ++impl->evictions;
+    }
+    // Opened under the lock, so two threads never open the same file.
+    if ((entry = malloc(sizeof(*entry) + n + 1))) {
+        *entry = (struct file_cache_entry){ .hash = h,
+                                            .pins = 1,
+                                            .bytes_of_path = n + 1 };
+        memcpy(entry->path, path, n + 1); // NOLINT
+        if (file_create_with_flags(&entry->file, path, n + 1, impl->flags)) {
+            *slot_of(impl, path, n, h) = entry;
+            ++impl->open_count;
+        } else {
+            free(entry);
+            entry = 0;
+        }
+    }
+    if (evicted)
+        close_finish(impl, evicted);
+    lock_release(&impl->lock);
+    EXPECT(entry, "Failed to open \"%s\" for the cache.", path);
+    return &entry->file;
+Error:
+    return 0;
+}
+
+void
+file_cache_release(struct file_cache* self, struct file* file)
+{
+    CHECK(self && self->impl);
+    CHECK(file);
+    struct file_cache_impl* impl = (struct file_cache_impl*)self->impl;
+    struct file_cache_entry* entry =
+      containerof(file, struct file_cache_entry, file);
+    lock_acquire(&impl->lock);
+    const int is_acquired = entry->pins > 0;
+    if (is_acquired && --entry->pins == 0)
+        lru_push(impl, entry);
+    lock_release(&impl->lock);
+    EXPECT(is_acquired,
+           "\"%s\" was released more times than it was acquired.",
+           entry->path);
+Error:;
+}
+
+int
+file_cache_evict(struct file_cache* self,
+                 const char* path,
+                 size_t bytes_of_path)
+{
+    struct file_cache_entry* entry = 0;
+    CHECK(self && self->impl);
+    CHECK(path);
+    struct file_cache_impl* impl = (struct file_cache_impl*)self->impl;
+    const size_t n = strlen(path);
+    EXPECT(bytes_of_path == n + 1,
+           "Expected %llu bytes of path. Got %llu.",
+           (unsigned long long)(n + 1),
+           (unsigned long long)bytes_of_path);
+
+    lock_acquire(&impl->lock);
+    // Another thread may be closing it already.
+    while ((entry = *slot_of(impl, path, n, hash_of(path, n))) &&
+           entry->is_closing)
+        condition_variable_wait(&impl->closed, &impl->lock);
+    const int is_idle = !(entry && entry->pins);
+    if (entry && is_idle) {
+        close_begin(impl, entry);
+        close_finish(impl, entry);
+    }
+    lock_release(&impl->lock);
+    return is_idle;
+Error:
+    return 0;
+}
+
+int
+file_cache_get_stats(const struct file_cache* self,
+                     struct file_cache_stats* stats)
+{
+    CHECK(self && self->impl);
+    CHECK(stats);
+    struct file_cache_impl* impl = (struct file_cache_impl*)self->impl;
+    lock_acquire(&impl->lock);
+    *stats = (struct file_cache_stats){
+        .hits = impl->hits,
+        .misses = impl->misses,
+        .evictions = impl->evictions,
+        .open_count = impl->open_count,
+        .capacity = impl->capacity,
+    };
+    lock_release(&impl->lock);
+    return 1;
+Error:
+    return 0;
+}
+
+void
+file_cache_destroy(struct file_cache* self)
+{
+    if (!(self && self->impl))
+        return;
+    struct file_cache_impl* impl = (struct file_cache_impl*)self->impl;
+    for (size_t i = 0; i < impl->bucket_count; ++i) {
+        struct file_cache_entry* entry = impl->buckets[i];
+        while (entry) {
+            struct file_cache_entry* next = entry->chain;
+            if (entry->pins)
+                LOGE("\"%s\" is closed while still acquired.", entry->path);
+            file_close(&entry->file);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(impl->buckets);
+    free(impl);
+    self->impl = 0;
+}
+
+//
+//  UNIT TESTS
+//
+
+#ifndef NO_UNIT_TESTS
+
+#include <stdio.h>
+
+int
+unit_test__file_cache_evicts_least_recently_used()
+{
+    const char* paths[] = {
+        "file-cache-unit-test.0.bin",
+        "file-cache-unit-test.1.bin",
+        "file-cache-unit-test.2.bin",
+    };
+    const uint8_t data[] = { 1, 2, 3, 4 };
+    struct file_cache cache = { 0 };
+    struct file_cache_stats stats = { 0 };
+    struct file* a = 0;
+    struct file* b = 0;
+    struct file* c = 0;
+    uint64_t nbytes = 0;
+
+    for (int i = 0; i < 3; ++i)
+        remove(paths[i]);
+    CHECK(file_cache_init(&cache, 2, FileCreateFlag_Default));
+
+    CHECK(a = file_cache_acquire(&cache, paths[0], strlen(paths[0]) + 1));
+    CHECK(file_write(a, 0, data, data + 2));
+    file_cache_release(&cache, a);
+    CHECK(b = file_cache_acquire(&cache, paths[1], strlen(paths[1]) + 1));
+    file_cache_release(&cache, b);
+    // Using the first file again makes the second the oldest.
+    CHECK(file_cache_acquire(&cache, paths[0], strlen(paths[0]) + 1) == a);
+    file_cache_release(&cache, a);
+    CHECK(c = file_cache_acquire(&cache, paths[2], strlen(paths[2]) + 1));
+
+    CHECK(file_cache_get_stats(&cache, &stats));
+    CHECK(stats.hits == 1);
+    CHECK(stats.misses == 3);
+    CHECK(stats.evictions == 1);
+    CHECK(stats.open_count == 2);
+    CHECK(stats.capacity == 2);
+
+    // Both slots are taken while `a` and `c` are in use.
+    CHECK(a = file_cache_acquire(&cache, paths[0], strlen(paths[0]) + 1));
+    CHECK(!file_cache_acquire(&cache, paths[1], strlen(paths[1]) + 1));
+    CHECK(!file_cache_evict(&cache, paths[0], strlen(paths[0]) + 1));
+    file_cache_release(&cache, a);
+    file_cache_release(&cache, c);
+
+    // Closing a file and opening it again keeps what was written.
+    CHECK(file_cache_evict(&cache, paths[0], strlen(paths[0]) + 1));
+    CHECK(a = file_cache_acquire(&cache, paths[0], strlen(paths[0]) + 1));
+    CHECK(file_write(a, 2, data + 2, data + 4));
+    CHECK(file_get_size(a, &nbytes));
+    CHECK(nbytes == sizeof(data));
+    file_cache_release(&cache, a);
+
+    file_cache_destroy(&cache);
+    for (int i = 0; i < 3; ++i)
+        remove(paths[i]);
+    return 1;
+Error:
+    file_cache_destroy(&cache);
+    for (int i = 0; i < 3; ++i)
+        remove(paths[i]);
+    return 0;
+}
+
+struct file_cache_unit_test_worker
+{
+    struct file_cache* cache;
+    const char** paths;
+    int offset;
+    int failures;
+};
+
+static void
+file_cache_unit_test_churn(void* arg)
+{
+    struct file_cache_unit_test_worker* w =
+      (struct file_cache_unit_test_worker*)arg;
+    const uint8_t byte = 1;
+    for (int i = 0; i < 10000; ++i) {
+        const char* path = w->paths[(i + w->offset) % 3];
+        struct file* file =
+          file_cache_acquire(w->cache, path, strlen(path) + 1);
+        if (!file || !file_write(file, 0, &byte, &byte + 1))
+            ++w->failures;
+        if (file)
+            file_cache_release(w->cache, file);
+        // The other thread may be using it, so this can return 0.
+        if (i % 2)
+            file_cache_evict(w->cache, path, strlen(path) + 1);
+    }
+}
+
+int
+unit_test__file_cache_reacquires_while_evicting()
+{
+    const char* paths[] = {
+        "file-cache-unit-test.3.bin",
+        "file-cache-unit-test.4.bin",
+        "file-cache-unit-test.5.bin",
+    };
+    struct file_cache cache = { 0 };
+    struct file_cache_unit_test_worker workers[2] = { 0 };
+    struct thread threads[2];
+    int nthreads = 0;
+
+    for (int i = 0; i < 3; ++i)
+        remove(paths[i]);
+    CHECK(file_cache_init(&cache, 2, FileCreateFlag_Default));
+
+    // Each thread reopens files the other one is closing, whether it closed
+    // them by evicting them or by opening a third file.
+    for (; nthreads < 2; ++nthreads) {
+        workers[nthreads] = (struct file_cache_unit_test_worker){
+            .cache = &cache, .paths = paths, .offset = nthreads
+        };
+        thread_init(threads + nthreads);
+        CHECK(thread_create(
+          threads + nthreads, file_cache_unit_test_churn, workers + nthreads));
+    }
+    for (int i = 0; i < nthreads; ++i)
+        thread_join(threads + i);
+    nthreads = 0;
+    CHECK(workers[0].failures == 0);
+    CHECK(workers[1].failures == 0);
+
+    file_cache_destroy(&cache);
+    for (int i = 0; i < 3; ++i)
+        remove(paths[i]);
+    return 1;
+Error:
+    for (int i = 0; i < nthreads; ++i)
+        thread_join(threads + i);
+    file_cache_destroy(&cache);
+    for (int i = 0; i < 3; ++i)
+        remove(paths[i]);
+    return 0;
+}
+
+#endif // NO_UNIT_TESTS
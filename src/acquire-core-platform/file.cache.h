@@ -0,0 +1,86 @@
+#ifndef H_ACQUIRE_PLATFORM_FILE_CACHE_V0
+#define H_ACQUIRE_PLATFORM_FILE_CACHE_V0
+
+#include "platform.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// Keeps recently used files open, so writers that keep coming back to
+    /// the same files, like sharded stores, don't pay for opening, locking
+    /// and closing them every time.
+    ///
+    /// Files are looked up by path. When the cache is full, the least
+    /// recently used file that isn't in use is closed to make room. Files
+    /// are opened with `FileCreateFlag_Keep`, so a file that's closed and
+    /// opened again keeps what was written to it. Any thread may use the
+    /// cache.
+    struct file_cache
+    {
+        void* impl;
+    };
+
+    struct file_cache_stats
+    {
+        /// Acquires that found the file already open.
+        uint64_t hits;
+        /// Acquires that had to open the file.
+        uint64_t misses;
+        /// Files closed to make room for others.
+        uint64_t evictions;
+        /// Files open now.
+        size_t open_count;
+        /// The most files the cache keeps open.
+        size_t capacity;
+    };
+
+    /// @brief Create a cache that keeps up to `capacity` files open.
+    /// @details The capacity is capped at half of `file_get_handle_limit()`,
+    ///          which leaves room for the process' other files.
+    /// @param capacity The most files to keep open, or 0 for as many as the
+    ///                 cap allows.
+    /// @param flags Passed to `file_create_with_flags()`.
+    ///              `FileCreateFlag_Direct` isn't supported.
+    /// @return 1 on success, otherwise 0
+    int file_cache_init(struct file_cache* self,
+                        size_t capacity,
+                        enum FileCreateFlag flags);
+
+    /// @brief Get the open file at `path`, opening it if needed.
+    /// @details The file stays open until it's released, and it's released
+    ///          once for each acquire. Acquiring a file that's already in
+    ///          use is fine. Fails when the cache is full of files in use.
+    /// @param path NULL-terminated path string
+    /// @param bytes_of_path length of the path string in bytes, including
+    ///                      the terminating NULL
+    /// @return The file, or NULL on failure.
+    struct file* file_cache_acquire(struct file_cache* self,
+                                    const char* path,
+                                    size_t bytes_of_path);
+
+    /// @brief Let the cache close `file` when it needs the room.
+    void file_cache_release(struct file_cache* self, struct file* file);
+
+    /// @brief Close the file at `path` now, for example when a shard is
+    ///        finished.
+    /// @return 1 when the file was closed or wasn't open, or 0 when it's
+    ///         still in use.
+    int file_cache_evict(struct file_cache* self,
+                         const char* path,
+                         size_t bytes_of_path);
+
+    /// @brief Read the cache's counters into `stats`.
+    /// @return 1 on success, otherwise 0
+    int file_cache_get_stats(const struct file_cache* self,
+                             struct file_cache_stats* stats);
+
+    /// @brief Close every file and free the cache.
+    void file_cache_destroy(struct file_cache* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H_ACQUIRE_PLATFORM_FILE_CACHE_V0
@@ -0,0 +1,397 @@
+#include "file.coalescer.h"
+#include "logger.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG(...) aq_logger(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOGE(...) aq_logger(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            LOGE(__VA_ARGS__);                                                 \
+            goto Error;                                                        \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false:\n\t%s", #e)
+
+// Blocks start on a page, so they suit direct and page cache writes alike.
+#define COALESCER_BLOCK_ALIGNMENT (4096)
+
+struct coalescer_block
+{
+    uint8_t* data;
+    // Where `data` goes in the file.
+    uint64_t offset;
+    size_t nbytes;
+    // Started at the block's first byte.
+    struct clock age;
+};
+
+struct file_coalescer_impl
+{
+    struct file* file;
+    size_t bytes_of_block;
+    float max_delay_ms;
+    // Guards everything below. Besides writing blocks, the writer thread
+    // hands over the block being filled once it's waited `max_delay_ms`.
+    struct lock lock;
+    // Notified when a block is handed over or written, when a block gets its
+    // first byte, and when the writer should stop.
+    struct condition_variable changed;
+    struct coalescer_block blocks[2];
+    // The block being filled.
+    int current;
+    // The block handed to the writer, or -1. Only one is at a time.
+    int busy;
+    int is_stopping;
+    struct thread thread;
+    int is_running;
+    // Set by the writer when a write fails. Cleared by a flush.
+    _Atomic int is_failed;
+    uint64_t writes, bytes, file_writes;
+};
+
+// Waits until the writer has written the block it was handed. Call with the
+// lock held.
+static void
+wait_for_writer(struct file_coalescer_impl* self)
+{
+    while (self->busy >= 0)
+        condition_variable_wait(&self->changed, &self->lock);
+}
+
+// Hands the block being filled to the writer, and starts filling the other
+// one. Call with the lock held.
+static void
+submit(struct file_coalescer_impl* self)
+{
+    if (self->blocks[self->current].nbytes == 0)
+        return;
+    wait_for_writer(self);
+    self->busy = self->current;
+    self->current ^= 1;
+    ++self->file_writes;
+    condition_variable_notify_all(&self->changed);
+}
+
+static void
+coalescer_writer(void* arg)
+{
+    struct file_coalescer_impl* self = (struct file_coalescer_impl*)arg;
+    lock_acquire(&self->lock);
+    for (;;) {
+        if (self->busy >= 0) {
+            struct coalescer_block* block = self->blocks + self->busy;
+            // Only the writer touches a block that's been handed over.
+            lock_release(&self->lock);
+            if (!file_write(self->file,
+                            block->offset,
+                            block->data,
+                            block->data + block->nbytes))
+                atomic_store(&self->is_failed, 1);
+            lock_acquire(&self->lock);
+            block->nbytes = 0;
+            self->busy = -1;
+            condition_variable_notify_all(&self->changed);
+            continue;
+        }
+        if (self->is_stopping)
+            break;
+        struct coalescer_block* block = self->blocks + self->current;
+        if (block->nbytes && self->max_delay_ms > 0.0f) {
+            // Writes may have stopped, so the delay is kept here.
+            const double waited_ms = clock_toc_ms(&block->age);
+            if (waited_ms >= self->max_delay_ms)
+                submit(self);
+            else
+                condition_variable_wait_for(
+                  &self->changed,
+                  &self->lock,
+                  (uint64_t)(1e6 * (self->max_delay_ms - waited_ms)) + 1);
+        } else {
+            condition_variable_wait(&self->changed, &self->lock);
+        }
+    }
+    lock_release(&self->lock);
+}
+
+static void
+file_coalescer_free(struct file_coalescer_impl* self)
+{
+    if (!self)
+        return;
+    if (self->is_running) {
+        lock_acquire(&self->lock);
+        self->is_stopping = 1;
+        condition_variable_notify_all(&self->changed);
+        lock_release(&self->lock);
+        thread_join(&self->thread);
+    }
+    for (int i = 0; i < 2; ++i)
+        if (self->blocks[i].data)
+            memory_free(self->blocks[i].data);
+    free(self);
+}
+
+int
+file_coalescer_init(struct file_coalescer* self,
+                    struct file* file,
+                    size_t bytes_of_block,
+                    float max_delay_ms)
+{
+    struct file_coalescer_impl* impl = 0;
+    CHECK(self);
+    self->impl = 0;
+    CHECK(file);
+    CHECK(bytes_of_block > 0);
+    CHECK(max_delay_ms >= 0.0f);
+
+    CHECK(impl = calloc(1, sizeof(*impl)));
+    impl->file = file;
+    impl->bytes_of_block = bytes_of_block;
+    impl->max_delay_ms = max_delay_ms;
+    lock_init(&impl->lock);
+    condition_variable_init(&impl->changed);
+    impl->busy = -1;
+    atomic_init(&impl->is_failed, 0);
+    for (int i = 0; i < 2; ++i) {
+        CHECK(impl->blocks[i].data =
+                memory_alloc_aligned(bytes_of_block,
+                                     COALESCER_BLOCK_ALIGNMENT,
+                                     AllocatorHint_Default));
+    }
+    thread_init(&impl->thread);
+    CHECK(impl->is_running =
+            thread_create(&impl->thread, coalescer_writer, impl));
+    self->impl = impl;
+    return 1;
+Error:
+    file_coalescer_free(impl);
+    return 0;
+}
+
+// The body of file_coalescer_write(). Call with the lock held.
+static int
+write_locked(struct file_coalescer_impl* impl,
+             uint64_t offset,
+             const uint8_t* beg,
+             const uint8_t* end)
+{
+    const uint64_t bytes_of_block = impl->bytes_of_block;
+    ++impl->writes;
+    impl->bytes += (uint64_t)(end - beg);
+
+    struct coalescer_block* block = impl->blocks + impl->current;
+    if (block->nbytes && offset != block->offset + block->nbytes)
+        submit(impl);
+
+    while (beg < end) {
+        block = impl->blocks + impl->current;
+        const uint64_t n = (uint64_t)(end - beg);
+        if (block->nbytes == 0 && offset % bytes_of_block == 0 &&
+            n >= bytes_of_block) {
+            // Whole blocks are written as they are. Waiting for the writer
+            // first keeps writes to the same bytes in order.
+            const uint64_t nbytes = n - n % bytes_of_block;
+            wait_for_writer(impl);
+            ++impl->file_writes;
+            CHECK(file_write(impl->file, offset, beg, beg + nbytes));
+            offset += nbytes;
+            beg += nbytes;
+            continue;
+        }
+        if (block->nbytes == 0) {
+            block->offset = offset;
+            clock_init(&block->age);
+            // Starts the writer's clock on this block.
+            if (impl->max_delay_ms > 0.0f)
+                condition_variable_notify_all(&impl->changed);
+        }
+        // The block ends on the next multiple of the block size.
+        const uint64_t limit = bytes_of_block - block->offset % bytes_of_block;
+        const uint64_t room = limit - block->nbytes;
+        const size_t nbytes = (size_t)(n < room ? n : room);
+        memcpy(block->data + block->nbytes, beg, nbytes); // NOLINT
+        block->nbytes += nbytes;
+        offset += nbytes;
+        beg += nbytes;
+        if (block->nbytes == limit)
+            submit(impl);
+    }
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_coalescer_write(struct file_coalescer* self,
+                     uint64_t offset,
+                     const uint8_t* beg,
+                     const uint8_t* end)
+{
+    CHECK(self && self->impl);
+    CHECK(beg <= end);
+    struct file_coalescer_impl* impl = (struct file_coalescer_impl*)self->impl;
+    EXPECT(!atomic_load(&impl->is_failed), "An earlier write failed.");
+    if (beg == end)
+        return 1;
+    lock_acquire(&impl->lock);
+    const int is_ok = write_locked(impl, offset, beg, end);
+    lock_release(&impl->lock);
+    return is_ok;
+Error:
+    return 0;
+}
+
+int
+file_coalescer_flush(struct file_coalescer* self)
+{
+    CHECK(self && self->impl);
+    struct file_coalescer_impl* impl = (struct file_coalescer_impl*)self->impl;
+    lock_acquire(&impl->lock);
+    submit(impl);
+    wait_for_writer(impl);
+    lock_release(&impl->lock);
+    EXPECT(!atomic_exchange(&impl->is_failed, 0),
+           "Failed to write coalesced blocks.");
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_coalescer_get_stats(const struct file_coalescer* self,
+                         struct file_coalescer_stats* stats)
+{
+    CHECK(self && self->impl);
+    CHECK(stats);
+    // The writer counts the blocks it hands over itself.
+    struct file_coalescer_impl* impl = (struct file_coalescer_impl*)self->impl;
+    lock_acquire(&impl->lock);
+    *stats = (struct file_coalescer_stats){
+        .writes = impl->writes,
+        .bytes = impl->bytes,
+        .file_writes = impl->file_writes,
+        .coalescing_ratio =
+          impl->file_writes ? (float)impl->writes / (float)impl->file_writes
+                            : 0.0f,
+    };
+    lock_release(&impl->lock);
+    return 1;
+Error:
+    return 0;
+}
+
+void
+file_coalescer_destroy(struct file_coalescer* self)
+{
+    if (!(self && self->impl))
+        return;
+    file_coalescer_flush(self);
+    file_coalescer_free((struct file_coalescer_impl*)self->impl);
+    self->impl = 0;
+}
+
+//
+//  UNIT TESTS
+//
+
+#ifndef NO_UNIT_TESTS
+
+#include <stdio.h>
+
+int
+unit_test__file_coalescer_gathers_sequential_writes()
+{
+    const char path[] = "file-coalescer-unit-test.bin";
+    struct file file = { 0 };
+    struct file_coalescer coalescer = { 0 };
+    struct file_coalescer_stats stats = { 0 };
+    uint8_t expected[256] = { 0 };
+    uint8_t actual[256] = { 0 };
+    int is_open = 0;
+
+    for (int i = 0; i < 256; ++i)
+        expected[i] = (uint8_t)i;
+    remove(path);
+    CHECK(is_open = file_create(&file, path, sizeof(path)));
+    CHECK(file_coalescer_init(&coalescer, &file, 64, 0.0f));
+
+    // Ten 4-byte records fill one block that stops at byte 40.
+    for (int i = 0; i < 10; ++i)
+        CHECK(file_coalescer_write(
+          &coalescer, 4 * i, expected + 4 * i, expected + 4 * i + 4));
+    // Skipping ahead writes that block. The next one stops at 64, the first
+    // multiple of the block size.
+    CHECK(file_coalescer_write(&coalescer, 50, expected + 50, expected + 70));
+    // Fills [64,128), then [128,192) goes straight to the file.
+    CHECK(file_coalescer_write(&coalescer, 70, expected + 70, expected + 200));
+    // Going back to fill the gap writes [192,200).
+    CHECK(file_coalescer_write(&coalescer, 40, expected + 40, expected + 50));
+    CHECK(file_coalescer_flush(&coalescer));
+
+    CHECK(file_coalescer_get_stats(&coalescer, &stats));
+    CHECK(stats.writes == 13);
+    CHECK(stats.bytes == 200);
+    // [0,40) [50,64) [64,128) [128,192) [192,200) [40,50)
+    CHECK(stats.file_writes == 6);
+
+    CHECK(file_read(&file, 0, actual, actual + 200));
+    CHECK(memcmp(actual, expected, 200) == 0);
+
+    file_coalescer_destroy(&coalescer);
+    file_close(&file);
+    remove(path);
+    return 1;
+Error:
+    file_coalescer_destroy(&coalescer);
+    if (is_open)
+        file_close(&file);
+    remove(path);
+    return 0;
+}
+
+int
+unit_test__file_coalescer_writes_after_max_delay()
+{
+    const char path[] = "file-coalescer-delay-unit-test.bin";
+    const uint8_t expected[] = { 1, 2, 3, 4 };
+    uint8_t actual[4] = { 0 };
+    struct file file = { 0 };
+    struct file_coalescer coalescer = { 0 };
+    struct file_coalescer_stats stats = { 0 };
+    int is_open = 0;
+
+    remove(path);
+    CHECK(is_open = file_create(&file, path, sizeof(path)));
+    CHECK(file_coalescer_init(&coalescer, &file, 64, 5.0f));
+
+    // Nothing else is written and nothing flushes, so only the delay gets
+    // the bytes to the file.
+    CHECK(file_coalescer_write(&coalescer, 0, expected, expected + 4));
+    uint64_t nbytes = 0;
+    for (int i = 0; i < 500 && nbytes < sizeof(expected); ++i) {
+        clock_sleep_ms(0, 2.0f);
+        CHECK(file_get_size(&file, &nbytes));
+    }
+    CHECK(nbytes == sizeof(expected));
+    CHECK(file_read(&file, 0, actual, actual + 4));
+    CHECK(memcmp(actual, expected, 4) == 0);
+    CHECK(file_coalescer_get_stats(&coalescer, &stats));
+    CHECK(stats.file_writes == 1);
+
+    file_coalescer_destroy(&coalescer);
+    file_close(&file);
+    remove(path);
+    return 1;
+Error:
+    file_coalescer_destroy(&coalescer);
+    if (is_open)
+        file_close(&file);
+    remove(path);
+    return 0;
+}
+
+#endif // NO_UNIT_TESTS
@@ -0,0 +1,83 @@
+#ifndef H_ACQUIRE_PLATFORM_FILE_COALESCER_V0
+#define H_ACQUIRE_PLATFORM_FILE_COALESCER_V0
+
+#include "platform.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// Gathers small sequential writes to a file into large blocks, so
+    /// per-frame metadata or tiny frames at kHz rates don't each cost a
+    /// system call.
+    ///
+    /// Writes take the same offsets they would take with `file_write()`.
+    /// Bytes that follow on from the previous write are copied into the
+    /// block being filled. Blocks end on multiples of `bytes_of_block` in the
+    /// file, so after the first one every block is aligned. There are two
+    /// blocks: a writer thread writes one while the other fills.
+    ///
+    /// A block is written when it's full, when a write doesn't follow on from
+    /// the last one, when its first byte has waited longer than
+    /// `max_delay_ms`, or on `file_coalescer_flush()`. The writer thread
+    /// keeps track of the delay, so it holds even after writes stop.
+    ///
+    /// Only one thread at a time may use a coalescer.
+    struct file_coalescer
+    {
+        void* impl;
+    };
+
+    struct file_coalescer_stats
+    {
+        /// Calls to `file_coalescer_write()` with at least one byte.
+        uint64_t writes;
+        /// Bytes passed to `file_coalescer_write()`.
+        uint64_t bytes;
+        /// Writes to the file itself.
+        uint64_t file_writes;
+        /// `writes / file_writes`, or 0 before anything was written.
+        float coalescing_ratio;
+    };
+
+    /// @brief Start coalescing writes to `file`.
+    /// @details `file` must stay open until the coalescer is destroyed.
+    /// @param bytes_of_block The size of each block. A multiple of the page
+    ///                       size, say 1 MiB, suits most filesystems.
+    /// @param max_delay_ms The longest a byte waits in a block before it's
+    ///                     written, or 0 to only write full blocks.
+    /// @return 1 on success, otherwise 0
+    int file_coalescer_init(struct file_coalescer* self,
+                            struct file* file,
+                            size_t bytes_of_block,
+                            float max_delay_ms);
+
+    /// @brief Write `[beg,end)` to the file at `offset`, eventually.
+    /// @details `[beg,end)` may be reused as soon as this returns. Writes of
+    ///          whole aligned blocks skip the copy and go straight to the
+    ///          file.
+    /// @return 0 when this write, or an earlier one, failed. Otherwise 1.
+    int file_coalescer_write(struct file_coalescer* self,
+                             uint64_t offset,
+                             const uint8_t* beg,
+                             const uint8_t* end);
+
+    /// @brief Write the block being filled, and wait for every block to be
+    ///        written.
+    /// @return 1 when every write since the last flush succeeded, otherwise 0
+    int file_coalescer_flush(struct file_coalescer* self);
+
+    /// @brief Read the coalescer's counters into `stats`.
+    /// @return 1 on success, otherwise 0
+    int file_coalescer_get_stats(const struct file_coalescer* self,
+                                 struct file_coalescer_stats* stats);
+
+    /// @brief Flush, then stop the writer thread. The file stays open.
+    void file_coalescer_destroy(struct file_coalescer* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H_ACQUIRE_PLATFORM_FILE_COALESCER_V0
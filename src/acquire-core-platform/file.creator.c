@@ -0,0 +1,289 @@
+#include "file.creator.h"
+#include "queue.h"
+#include "logger.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG(...) aq_logger(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOGE(...) aq_logger(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            LOGE(__VA_ARGS__);                                                 \
+            goto Error;                                                        \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false:\n\t%s", #e)
+
+// Files waiting for a thread. Submitting more waits.
+#define FILE_CREATOR_QUEUE_CAPACITY (1024)
+
+enum file_creation_state
+{
+    FileCreationState_Pending,
+    FileCreationState_Created,
+    FileCreationState_Failed,
+};
+
+struct file_creation
+{
+    _Atomic uint32_t state;
+    // Only used while `state` is pending, so the creator is still running.
+    struct file_creator_impl* creator;
+    struct file file;
+    size_t bytes_of_path;
+    char path[];
+};
+
+struct file_creator_worker
+{
+    struct file_creator_impl* creator;
+    struct thread thread;
+    int is_running;
+    // The last directory this thread created.
+    char* directory;
+    size_t bytes_of_directory;
+};
+
+struct file_creator_impl
+{
+    enum FileCreateFlag flags;
+    struct queue requests;
+    // Counts finished creations. A creation is freed as soon as its taker
+    // sees it's done, so takers sleep on this instead. Workers only wake it
+    // while `waiter_count` says someone is asleep.
+    _Atomic uint32_t done_count;
+    _Atomic uint32_t waiter_count;
+    struct file_creator_worker* workers;
+    size_t worker_count;
+};
+
+// Returns the length of the directory part of `path`, without the last
+// separator, or 0 when `path` has no directory part.
+static size_t
+directory_length(const char* path, size_t n)
+{
+    while (n > 0 && path[n - 1] != '/' && path[n - 1] != '\\')
+        --n;
+    while (n > 1 && (path[n - 1] == '/' || path[n - 1] == '\\'))
+        --n;
+    return n;
+}
+
+// Makes sure the directory holding `path` exists.
+static int
+ensure_directory(struct file_creator_worker* self, const char* path)
+{
+    const size_t n = directory_length(path, strlen(path));
+    if (n == 0 || (n == self->bytes_of_directory &&
+                   memcmp(self->directory, path, n) == 0)) // NOLINT
+        return 1;
+
+    char* directory = realloc(self->directory, n + 1);
+    CHECK(directory);
+    self->directory = directory;
+    memcpy(directory, path, n); // NOLINT
+    directory[n] = '\0';
+    // Forget it until it's made, so a failure is tried again next time.
+    self->bytes_of_directory = 0;
+    CHECK(directory_create(directory));
+    self->bytes_of_directory = n;
+    return 1;
+Error:
+    return 0;
+}
+
+static void
+file_creator_worker(void* arg)
+{
+    struct file_creator_worker* self = (struct file_creator_worker*)arg;
+    struct file_creation* creation = 0;
+    while ((creation = queue_pop(&self->creator->requests))) {
+        const int is_ok =
+          ensure_directory(self, creation->path) &&
+          file_create_with_flags(&creation->file,
+                                 creation->path,
+                                 creation->bytes_of_path,
+                                 self->creator->flags);
+        atomic_store(&creation->state,
+                     is_ok ? FileCreationState_Created
+                           : FileCreationState_Failed);
+        // Pairs with file_creation_take(). Either the taker sees the new
+        // state, or this sees the taker.
+        struct file_creator_impl* creator = self->creator;
+        atomic_fetch_add(&creator->done_count, 1);
+        if (atomic_load(&creator->waiter_count))
+            address_wake_all((volatile uint32_t*)&creator->done_count);
+    }
+}
+
+static void
+file_creator_free(struct file_creator_impl* self)
+{
+    if (!self)
+        return;
+    for (size_t i = 0; self->workers && i < self->worker_count; ++i)
+        if (self->workers[i].is_running)
+            queue_push(&self->requests, 0);
+    for (size_t i = 0; self->workers && i < self->worker_count; ++i) {
+        struct file_creator_worker* worker = self->workers + i;
+        if (worker->is_running)
+            thread_join(&worker->thread);
+        free(worker->directory);
+    }
+    queue_destroy(&self->requests);
+    free(self->workers);
+    free(self);
+}
+
+int
+file_creator_init(struct file_creator* self,
+                  size_t thread_count,
+                  enum FileCreateFlag flags)
+{
+    struct file_creator_impl* impl = 0;
+    CHECK(self);
+    self->impl = 0;
+    CHECK(thread_count > 0);
+
+    CHECK(impl = calloc(1, sizeof(*impl)));
+    impl->flags = flags;
+    impl->worker_count = thread_count;
+    CHECK(queue_init(&impl->requests, FILE_CREATOR_QUEUE_CAPACITY));
+    CHECK(impl->workers = calloc(thread_count, sizeof(*impl->workers)));
+    for (size_t i = 0; i < thread_count; ++i) {
+        struct file_creator_worker* worker = impl->workers + i;
+        worker->creator = impl;
+        thread_init(&worker->thread);
+        CHECK(worker->is_running =
+                thread_create(&worker->thread, file_creator_worker, worker));
+    }
+    self->impl = impl;
+    return 1;
+Error:
+    file_creator_free(impl);
+    return 0;
+}
+
+struct file_creation*
+file_creator_submit(struct file_creator* self, const char* path)
+{
+    struct file_creation* creation = 0;
+    CHECK(self && self->impl);
+    CHECK(path);
+    const size_t n = strlen(path);
+    CHECK(creation = malloc(sizeof(*creation) + n + 1));
+    atomic_init(&creation->state, FileCreationState_Pending);
+    creation->creator = (struct file_creator_impl*)self->impl;
+    creation->bytes_of_path = n + 1;
+    memcpy(creation->path, path, n + 1); // NOLINT
+    queue_push(&((struct file_creator_impl*)self->impl)->requests, creation);
+    return creation;
+Error:
+    return 0;
+}
+
+int
+file_creation_take(struct file_creation* creation, struct file* out)
+{
+    CHECK(creation);
+    struct file_creator_impl* creator = creation->creator;
+    uint32_t state = 0;
+    while ((state = atomic_load(&creation->state)) ==
+           FileCreationState_Pending) {
+        // Read before checking `state` again, so a creation finishing in
+        // between changes it.
+        const uint32_t seen = atomic_load(&creator->done_count);
+        atomic_fetch_add(&creator->waiter_count, 1);
+        if (atomic_load(&creation->state) == FileCreationState_Pending)
+            address_wait(
+              (volatile uint32_t*)&creator->done_count, seen, UINT64_MAX);
+        atomic_fetch_sub(&creator->waiter_count, 1);
+    }
+    const int is_ok = (state == FileCreationState_Created);
+    if (is_ok && out)
+        *out = creation->file;
+    else if (is_ok)
+        file_close(&creation->file);
+    free(creation);
+    return is_ok;
+Error:
+    return 0;
+}
+
+void
+file_creator_destroy(struct file_creator* self)
+{
+    if (self && self->impl) {
+        file_creator_free((struct file_creator_impl*)self->impl);
+        self->impl = 0;
+    }
+}
+
+//
+//  UNIT TESTS
+//
+
+#ifndef NO_UNIT_TESTS
+
+#include <stdio.h>
+
+int
+unit_test__file_creator_creates_files_and_directories()
+{
+    const char* paths[] = {
+        "file-creator-unit-test/a/0.bin",
+        "file-creator-unit-test/a/1.bin",
+        "file-creator-unit-test/b/c/2.bin",
+        "file-creator-unit-test/3.bin",
+    };
+    const size_t count = sizeof(paths) / sizeof(paths[0]);
+    struct file_creator creator = { 0 };
+    struct file_creation* creations[sizeof(paths) / sizeof(paths[0])] = { 0 };
+    const char* directories[] = {
+        "file-creator-unit-test/b/c",
+        "file-creator-unit-test/b",
+        "file-creator-unit-test/a",
+        "file-creator-unit-test",
+    };
+    const uint8_t byte = 'x';
+    struct file file = { 0 };
+
+    CHECK(directory_length("a/b/c.bin", 9) == 3);
+    CHECK(directory_length("a//c.bin", 8) == 1);
+    CHECK(directory_length("c.bin", 5) == 0);
+    CHECK(directory_length("/c.bin", 6) == 1);
+
+    CHECK(file_creator_init(&creator, 2, FileCreateFlag_NoLock));
+    for (size_t i = 0; i < count; ++i)
+        CHECK(creations[i] = file_creator_submit(&creator, paths[i]));
+    for (size_t i = 0; i < count; ++i) {
+        struct file_creation* creation = creations[i];
+        creations[i] = 0;
+        CHECK(file_creation_take(creation, &file));
+        CHECK(file_write(&file, 0, &byte, &byte + 1));
+        file_close(&file);
+        CHECK(file_exists(paths[i], strlen(paths[i]) + 1));
+    }
+    file_creator_destroy(&creator);
+
+    for (size_t i = 0; i < count; ++i)
+        remove(paths[i]);
+    for (size_t i = 0; i < 4; ++i)
+        remove(directories[i]);
+    return 1;
+Error:
+    for (size_t i = 0; i < count; ++i)
+        if (creations[i])
+            file_creation_take(creations[i], 0);
+    file_creator_destroy(&creator);
+    for (size_t i = 0; i < count; ++i)
+        remove(paths[i]);
+    for (size_t i = 0; i < 4; ++i)
+        remove(directories[i]);
+    return 0;
+}
+
+#endif // NO_UNIT_TESTS
@@ -0,0 +1,62 @@
+#ifndef H_ACQUIRE_PLATFORM_FILE_CREATOR_V0
+#define H_ACQUIRE_PLATFORM_FILE_CREATOR_V0
+
+#include "platform.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// Creates files, and the directories that hold them, on a pool of
+    /// threads.
+    ///
+    /// Chunked and sharded stores create thousands of small files a second.
+    /// Creating each one on the writer's thread serializes the `open()`
+    /// calls behind the writes. Instead, a store submits the files it'll
+    /// need next, say the chunks of the next few frames, and takes each one
+    /// when it's ready to write.
+    ///
+    /// Each thread remembers the last directory it created, so files that
+    /// share a directory only create it once per thread.
+    struct file_creator
+    {
+        void* impl;
+    };
+
+    /// One file submitted to a `file_creator`. Belongs to the caller until
+    /// it's passed to `file_creation_take()`.
+    struct file_creation;
+
+    /// @brief Start `thread_count` threads that create files with `flags`.
+    /// @details `FileCreateFlag_NoLock` suits files that only this process
+    ///          writes.
+    /// @return 1 on success, otherwise 0
+    int file_creator_init(struct file_creator* self,
+                          size_t thread_count,
+                          enum FileCreateFlag flags);
+
+    /// @brief Create the file at `path`, and its parent directory, on one of
+    ///        the creator's threads.
+    /// @details Waits when too many files are already waiting to be created.
+    /// @param path NULL-terminated path string
+    /// @return The submitted file, or NULL on failure.
+    struct file_creation* file_creator_submit(struct file_creator* self,
+                                              const char* path);
+
+    /// @brief Wait for `creation` to be created, and move it into `out`.
+    /// @details `creation` is freed either way.
+    /// @return 1 when the file was created, otherwise 0
+    int file_creation_take(struct file_creation* creation, struct file* out);
+
+    /// @brief Wait for the files that have been submitted to be created,
+    ///        then stop the threads.
+    /// @details Files that haven't been taken can still be taken afterwards,
+    ///          but not by another thread while this runs.
+    void file_creator_destroy(struct file_creator* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H_ACQUIRE_PLATFORM_FILE_CREATOR_V0
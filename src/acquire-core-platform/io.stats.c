@@ -0,0 +1,217 @@
+#include "io.stats.h"
+#include "logger.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define LOG(...) aq_logger(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOGE(...) aq_logger(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            LOGE(__VA_ARGS__);                                                 \
+            goto Error;                                                        \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false:\n\t%s", #e)
+
+// Relaxed, since the counters are independent and only ever added to.
+#define ADD(counter, n)                                                        \
+    atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
+#define LOAD(counter) atomic_load_explicit(&(counter), memory_order_relaxed)
+
+struct io_stats
+{
+    _Atomic uint64_t bytes_written;
+    _Atomic uint64_t write_count;
+    _Atomic uint64_t short_write_count;
+    _Atomic uint64_t zero_write_count;
+    _Atomic uint64_t retry_count;
+    _Atomic uint64_t error_count;
+    _Atomic uint64_t latency_ns_total;
+    _Atomic uint64_t latency_ns_max;
+    _Atomic uint64_t latency_histogram[FILE_IO_STATS_BUCKET_COUNT];
+};
+
+// Bucket 0 holds calls under 1 us. Bucket i holds [2^(i-1), 2^i) us. The
+// last bucket holds everything longer.
+static int
+latency_bucket(uint64_t elapsed_ns)
+{
+    uint64_t us = elapsed_ns / 1000;
+    int i = 0;
+    while (us && i < FILE_IO_STATS_BUCKET_COUNT - 1) {
+        us >>= 1;
+        ++i;
+    }
+    return i;
+}
+
+struct io_stats*
+io_stats_create(void)
+{
+    struct io_stats* self = 0;
+    CHECK(self = calloc(1, sizeof(*self)));
+    return self;
+Error:
+    return 0;
+}
+
+void
+io_stats_destroy(struct io_stats* self)
+{
+    free(self);
+}
+
+void
+io_stats_record(struct io_stats* self,
+                uint64_t requested,
+                int64_t result,
+                uint64_t elapsed_ns)
+{
+    if (!self)
+        return;
+    ADD(self->write_count, 1);
+    if (result < 0) {
+        ADD(self->error_count, 1);
+    } else {
+        ADD(self->bytes_written, (uint64_t)result);
+        if (result == 0 && requested > 0)
+            ADD(self->zero_write_count, 1);
+        else if ((uint64_t)result < requested)
+            ADD(self->short_write_count, 1);
+    }
+    ADD(self->latency_ns_total, elapsed_ns);
+    ADD(self->latency_histogram[latency_bucket(elapsed_ns)], 1);
+    uint64_t max = LOAD(self->latency_ns_max);
+    while (max < elapsed_ns && !atomic_compare_exchange_weak(
+                                 &self->latency_ns_max, &max, elapsed_ns))
+        ;
+}
+
+void
+io_stats_record_retry(struct io_stats* self)
+{
+    if (self)
+        ADD(self->retry_count, 1);
+}
+
+void
+io_stats_snapshot(const struct io_stats* self, struct file_io_stats* out)
+{
+    *out = (struct file_io_stats){ 0 };
+    if (!self)
+        return;
+    struct io_stats* s = (struct io_stats*)self;
+    out->bytes_written = LOAD(s->bytes_written);
+    out->write_count = LOAD(s->write_count);
+    out->short_write_count = LOAD(s->short_write_count);
+    out->zero_write_count = LOAD(s->zero_write_count);
+    out->retry_count = LOAD(s->retry_count);
+    out->error_count = LOAD(s->error_count);
+    out->latency_ns_total = LOAD(s->latency_ns_total);
+    out->latency_ns_max = LOAD(s->latency_ns_max);
+    for (int i = 0; i < FILE_IO_STATS_BUCKET_COUNT; ++i)
+        out->latency_histogram[i] = LOAD(s->latency_histogram[i]);
+}
+
+// The counters are never replaced while the file is open, since writes in
+// flight may still refer to them.
+int
+file_enable_io_stats(struct file* file)
+{
+    CHECK(file);
+    if (!file->stats_)
+        CHECK(file->stats_ = io_stats_create());
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_get_io_stats(const struct file* file, struct file_io_stats* stats)
+{
+    CHECK(file);
+    CHECK(stats);
+    io_stats_snapshot((const struct io_stats*)file->stats_, stats);
+    return 1;
+Error:
+    return 0;
+}
+
+uint64_t
+file_io_stats_latency_us(const struct file_io_stats* stats, double quantile)
+{
+    CHECK(stats);
+    uint64_t total = 0;
+    for (int i = 0; i < FILE_IO_STATS_BUCKET_COUNT; ++i)
+        total += stats->latency_histogram[i];
+    if (!total)
+        return 0;
+    quantile = quantile < 0.0 ? 0.0 : (quantile > 1.0 ? 1.0 : quantile);
+    uint64_t rank = (uint64_t)(quantile * (double)total);
+    rank = rank ? rank : 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < FILE_IO_STATS_BUCKET_COUNT - 1; ++i) {
+        seen += stats->latency_histogram[i];
+        if (seen >= rank)
+            return (uint64_t)1 << i;
+    }
+    return (stats->latency_ns_max + 999) / 1000;
+Error:
+    return 0;
+}
+
+//
+//  UNIT TESTS
+//
+
+#ifndef NO_UNIT_TESTS
+
+int
+unit_test__io_stats_buckets_latencies_by_powers_of_two()
+{
+    struct io_stats* stats = 0;
+    struct file_io_stats snapshot = { 0 };
+
+    CHECK(latency_bucket(0) == 0);
+    CHECK(latency_bucket(999) == 0);
+    CHECK(latency_bucket(1000) == 1);
+    CHECK(latency_bucket(1999) == 1);
+    CHECK(latency_bucket(2000) == 2);
+    CHECK(latency_bucket(1000000) == 10); // 1 ms is in [512,1024) us
+    CHECK(latency_bucket(UINT64_MAX) == FILE_IO_STATS_BUCKET_COUNT - 1);
+
+    CHECK(stats = io_stats_create());
+    io_stats_record(stats, 100, 100, 500);
+    io_stats_record(stats, 100, 60, 1500);
+    io_stats_record(stats, 40, 0, 1500);
+    io_stats_record(stats, 40, -1, 3000000);
+    io_stats_record_retry(stats);
+    io_stats_snapshot(stats, &snapshot);
+    io_stats_destroy(stats);
+    stats = 0;
+
+    CHECK(snapshot.bytes_written == 160);
+    CHECK(snapshot.write_count == 4);
+    CHECK(snapshot.short_write_count == 1);
+    CHECK(snapshot.zero_write_count == 1);
+    CHECK(snapshot.retry_count == 1);
+    CHECK(snapshot.error_count == 1);
+    CHECK(snapshot.latency_ns_total == 3003500);
+    CHECK(snapshot.latency_ns_max == 3000000);
+    CHECK(snapshot.latency_histogram[0] == 1);
+    CHECK(snapshot.latency_histogram[1] == 2);
+    CHECK(snapshot.latency_histogram[12] == 1); // [2048,4096) us
+
+    // Quantiles report the upper edge of the bucket they land in.
+    CHECK(file_io_stats_latency_us(&snapshot, 0.0) == 1);
+    CHECK(file_io_stats_latency_us(&snapshot, 0.5) == 2);
+    CHECK(file_io_stats_latency_us(&snapshot, 1.0) == 4096);
+    return 1;
+Error:
+    io_stats_destroy(stats);
+    return 0;
+}
+
+#endif // NO_UNIT_TESTS
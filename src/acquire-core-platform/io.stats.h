@@ -0,0 +1,43 @@
+#ifndef H_ACQUIRE_PLATFORM_IO_STATS_V0
+#define H_ACQUIRE_PLATFORM_IO_STATS_V0
+
+#include "platform.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// Counters behind `file_get_io_stats()`.
+    /// Used by the platform backends, which time each write system call and
+    /// report it here. Any thread may record, and snapshots don't block
+    /// writers.
+    struct io_stats;
+
+    struct io_stats* io_stats_create(void);
+
+    void io_stats_destroy(struct io_stats* self);
+
+    /// @brief Count one write system call that was asked to write `requested`
+    ///        bytes.
+    /// @param result The bytes written, or a negative value when the call
+    ///               failed.
+    /// @param elapsed_ns How long the call took.
+    void io_stats_record(struct io_stats* self,
+                         uint64_t requested,
+                         int64_t result,
+                         uint64_t elapsed_ns);
+
+    /// @brief Count a write that was interrupted (`EINTR`) or would have
+    ///        blocked (`EAGAIN`), and is being tried again.
+    void io_stats_record_retry(struct io_stats* self);
+
+    /// @brief Copy the counters into `out`.
+    void io_stats_snapshot(const struct io_stats* self,
+                           struct file_io_stats* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H_ACQUIRE_PLATFORM_IO_STATS_V0
@@ -2,13 +2,44 @@
 
 #include "platform.h"
 #include "logger.h"
+#include "write.pool.h"
+#include "io.stats.h"
 
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <sched.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_TSC (1)
+#else
+#define HAVE_TSC (0)
+#endif
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define countof(e) (sizeof(e) / sizeof(*(e)))
 
 #define L (aq_logger)
 #define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
@@ -34,110 +65,1948 @@
         }                                                                      \
     } while (0)
 
+//
+//  Direct (uncached) files
+//
+
+// O_DIRECT wants offsets, addresses and lengths aligned to the device's
+// logical block size. This covers every device we expect to see.
+#define FILE_DIRECT_ALIGNMENT (4096)
+
+struct file_direct
+{
+    struct lock lock;
+    // The unaligned end of the file, held back until file_close().
+    uint8_t* tail;
+    uint64_t tail_offset;
+    size_t bytes_of_tail;
+    // One past the last byte written so far.
+    uint64_t size;
+};
+
+static void
+file_direct_free(struct file_direct* direct)
+{
+    if (direct) {
+        memory_free(direct->tail);
+        free(direct);
+    }
+}
+
+static struct file_direct*
+file_direct_create(void)
+{
+    struct file_direct* direct = 0;
+    CHECK(direct = calloc(1, sizeof(*direct)));
+    lock_init(&direct->lock);
+    CHECK(direct->tail = memory_alloc_aligned(
+            FILE_DIRECT_ALIGNMENT,
+            FILE_DIRECT_ALIGNMENT,
+            AllocatorHint_Default));
+    return direct;
+Error:
+    file_direct_free(direct);
+    return 0;
+}
+
+// Checks a write to a direct file is aligned, and trims `*end` so only whole
+// blocks are written. The rest is kept for file_close().
+static int
+file_direct_prepare(const struct file* file,
+                    uint64_t offset,
+                    const uint8_t* beg,
+                    const uint8_t** end)
+{
+    struct file_direct* direct = (struct file_direct*)file->direct_;
+    if (!direct)
+        return 1;
+    const size_t nbytes = *end - beg;
+    const size_t bytes_of_body =
+      nbytes & ~(size_t)(FILE_DIRECT_ALIGNMENT - 1);
+    const size_t bytes_of_tail = nbytes - bytes_of_body;
+    EXPECT(offset % FILE_DIRECT_ALIGNMENT == 0,
+           "Writes to a direct file must start at a multiple of %d bytes. "
+           "Got offset %llu.",
+           FILE_DIRECT_ALIGNMENT,
+           (unsigned long long)offset);
+    EXPECT(!bytes_of_body || (uintptr_t)beg % FILE_DIRECT_ALIGNMENT == 0,
+           "Writes to a direct file must come from an address that's a "
+           "multiple of %d bytes. Got %p.",
+           FILE_DIRECT_ALIGNMENT,
+           beg);
+
+    // The tail is written over its whole block when the file is closed, so
+    // nothing else may land in or after that block, whichever write comes
+    // first.
+    lock_acquire(&direct->lock);
+    const int is_past_tail =
+      direct->bytes_of_tail &&
+      (bytes_of_tail || offset + nbytes > direct->tail_offset);
+    const int is_tail_before_end =
+      bytes_of_tail && direct->size > offset + bytes_of_body;
+    const int is_ok = !is_past_tail && !is_tail_before_end;
+    if (is_ok) {
+        if (bytes_of_tail) {
+            memcpy(direct->tail, beg + bytes_of_body, bytes_of_tail);
+            direct->tail_offset = offset + bytes_of_body;
+            direct->bytes_of_tail = bytes_of_tail;
+        }
+        if (offset + nbytes > direct->size)
+            direct->size = offset + nbytes;
+    }
+    lock_release(&direct->lock);
+    EXPECT(is_ok,
+           "Only the final write to a direct file may have a length that "
+           "isn't a multiple of %d bytes, and nothing may be written past it.",
+           FILE_DIRECT_ALIGNMENT);
+
+    *end = beg + bytes_of_body;
+    return 1;
+Error:
+    return 0;
+}
+
+// Writes out the held-back tail, padded to a whole block, then trims the
+// padding off again.
+static void
+file_direct_destroy(struct file* file)
+{
+    struct file_direct* direct = (struct file_direct*)file->direct_;
+    if (!direct)
+        return;
+    file->direct_ = 0;
+    if (direct->bytes_of_tail) {
+        memset(direct->tail + direct->bytes_of_tail,
+               0,
+               FILE_DIRECT_ALIGNMENT - direct->bytes_of_tail);
+        if (pwrite(file->fid,
+                   direct->tail,
+                   FILE_DIRECT_ALIGNMENT,
+                   (off_t)direct->tail_offset) != FILE_DIRECT_ALIGNMENT)
+            LOGE("Failed to write the last %llu bytes of a direct file.",
+                 (unsigned long long)direct->bytes_of_tail);
+        if (ftruncate(file->fid, (off_t)direct->size) < 0)
+            LOGE("Failed to trim a direct file to %llu bytes: %s",
+                 (unsigned long long)direct->size,
+                 strerror(errno));
+    }
+    file_direct_free(direct);
+}
+
+// Only reads the clock when `stats` are being kept.
+static uint64_t
+io_now_ns(const struct io_stats* stats)
+{
+    struct timespec t = { 0 };
+    if (!stats)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+//
+//  Page cache write-back
+//
+
+struct file_writeback
+{
+    struct lock lock;
+    int fid;
+    uint64_t bytes_of_window;
+    // Write-back has been started for everything before this offset.
+    uint64_t started;
+    // Everything before this offset is on disk and out of the page cache.
+    uint64_t retired;
+    uint64_t wait_count;
+};
+
+// Called after `[.., end)` has been written.
+static void
+file_writeback_advance(struct file_writeback* self, uint64_t end)
+{
+    if (!self)
+        return;
+    lock_acquire(&self->lock);
+    const uint64_t window = self->bytes_of_window;
+    // Hand every window the writes have moved past to the disk, without
+    // waiting.
+    while (window && self->started + window <= end) {
+        if (sync_file_range(self->fid,
+                            (off64_t)self->started,
+                            (off64_t)window,
+                            SYNC_FILE_RANGE_WRITE) < 0)
+            goto Error;
+        self->started += window;
+    }
+    // Keep one window in flight. Older ones have usually reached the disk by
+    // now, so waiting for them is cheap. Then they can be dropped.
+    while (window && self->retired + window < self->started) {
+        if (sync_file_range(self->fid,
+                            (off64_t)self->retired,
+                            (off64_t)window,
+                            SYNC_FILE_RANGE_WAIT_BEFORE |
+                              SYNC_FILE_RANGE_WRITE |
+                              SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+            goto Error;
+        posix_fadvise(self->fid,
+                      (off_t)self->retired,
+                      (off_t)window,
+                      POSIX_FADV_DONTNEED);
+        self->retired += window;
+        ++self->wait_count;
+    }
+    lock_release(&self->lock);
+    return;
+Error:
+    LOGE("Write-back failed, and is turned off for this file: %s",
+         strerror(errno));
+    self->bytes_of_window = 0;
+    lock_release(&self->lock);
+}
+
+int
+file_set_writeback_window(struct file* file, uint64_t bytes_of_window)
+{
+    struct file_writeback* writeback = 0;
+    CHECK(file);
+    if (!file->writeback_) {
+        CHECK(writeback = calloc(1, sizeof(*writeback)));
+        lock_init(&writeback->lock);
+        writeback->fid = file->fid;
+        file->writeback_ = writeback;
+    }
+    // The state is never replaced while the file is open, since writes in
+    // flight may still refer to it.
+    writeback = (struct file_writeback*)file->writeback_;
+    lock_acquire(&writeback->lock);
+    writeback->bytes_of_window = bytes_of_window;
+    lock_release(&writeback->lock);
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_get_writeback_stats(const struct file* file,
+                         struct file_writeback_stats* stats)
+{
+    CHECK(file);
+    CHECK(stats);
+    *stats = (struct file_writeback_stats){ 0 };
+    struct file_writeback* writeback =
+      (struct file_writeback*)file->writeback_;
+    if (writeback) {
+        lock_acquire(&writeback->lock);
+        *stats = (struct file_writeback_stats){
+            .bytes_started = writeback->started,
+            .bytes_retired = writeback->retired,
+            .bytes_in_flight = writeback->started - writeback->retired,
+            .wait_count = writeback->wait_count,
+        };
+        lock_release(&writeback->lock);
+    }
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_create(struct file* file, const char* filename, size_t bytesof_filename)
+{
+    return file_create_with_flags(
+      file, filename, bytesof_filename, FileCreateFlag_Default);
+}
+
+int
+file_create_with_flags(struct file* file,
+                       const char* filename,
+                       size_t bytesof_filename,
+                       enum FileCreateFlag flags)
+{
+    int oflags = O_RDWR | O_CREAT | O_NONBLOCK;
+    file->async_ = 0;
+    file->direct_ = 0;
+    file->writeback_ = 0;
+    file->stats_ = 0;
+    if (flags & FileCreateFlag_Direct) {
+        CHECK(file->direct_ = file_direct_create());
+        oflags |= O_DIRECT;
+    }
+    file->fid = open(filename, oflags, 0666);
+    if (file->fid < 0 && errno == EINVAL && (oflags & O_DIRECT)) {
+        // Some filesystems, like tmpfs, don't do O_DIRECT. Writes still have
+        // to be aligned, so code that works here works everywhere.
+        LOG("\"%s\" can't be opened with O_DIRECT. Writes will be cached.",
+            filename);
+        file->fid = open(filename, oflags & ~O_DIRECT, 0666);
+    }
+    if (file->fid < 0) {
+        CHECK_POSIX(errno);
+    } else if (!(flags & FileCreateFlag_NoLock)) {
+        int ret = flock(file->fid, LOCK_EX | LOCK_NB);
+        if (ret < 0) {
+            LOGE("Failed to create existing file \"%s\"", filename);
+            int tmp = errno;
+            close(file->fid);
+            CHECK_POSIX(tmp);
+        }
+    }
+    return 1;
+Error:
+    LOGE("Failed to create \"%s\"", filename);
+    file_direct_free((struct file_direct*)file->direct_);
+    file->direct_ = 0;
+    return 0;
+}
+
+int
+file_open_read(struct file* file, const char* filename, size_t bytesof_filename)
+{
+    *file = (struct file){ .fid = -1 };
+    // No lock, so files can be read while they're still being written.
+    file->fid = open(filename, O_RDONLY);
+    if (file->fid < 0)
+        CHECK_POSIX(errno);
+    return 1;
+Error:
+    LOGE("Failed to open \"%s\" for reading", filename);
+    return 0;
+}
+
+static void
+file_async_destroy(struct file* file);
+
+void
+file_close(struct file* file)
+{
+    file_async_destroy(file);
+    file_direct_destroy(file);
+    free(file->writeback_);
+    file->writeback_ = 0;
+    io_stats_destroy((struct io_stats*)file->stats_);
+    file->stats_ = 0;
+    if (close(file->fid) < 0)
+        CHECK_POSIX(errno);
+Error:;
+}
+
+int
+file_write(const struct file* file,
+           uint64_t offset,
+           const uint8_t* cur,
+           const uint8_t* end)
+{
+    int retries = 0;
+    CHECK(cur <= end);
+    CHECK(file_direct_prepare(file, offset, cur, &end));
+    struct io_stats* stats = (struct io_stats*)file->stats_;
+    while (cur < end && retries < 3) {
+        const size_t remaining = end - cur;
+        const uint64_t t0 = io_now_ns(stats);
+        const ssize_t written = pwrite(file->fid, cur, remaining, offset);
+        const int ecode = errno;
+        if (written < 0 && (ecode == EINTR || ecode == EAGAIN)) {
+            io_stats_record_retry(stats);
+            continue;
+        }
+        io_stats_record(stats, remaining, written, io_now_ns(stats) - t0);
+        if (written < 0) {
+            CHECK_POSIX(ecode);
+        }
+        retries += (written == 0);
+        offset += written;
+        cur += written;
+    }
+    EXPECT(retries < 3,
+           "Gave up with %llu bytes left to write at offset %llu. Three "
+           "writes wrote nothing.",
+           (unsigned long long)(end - cur),
+           (unsigned long long)offset);
+    file_writeback_advance(file->writeback_, offset);
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_read(const struct file* file,
+          uint64_t offset,
+          uint8_t* cur,
+          uint8_t* end)
+{
+    CHECK(file);
+    CHECK(cur <= end);
+    while (cur < end) {
+        const ssize_t nread = pread(file->fid, cur, end - cur, (off_t)offset);
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            CHECK_POSIX(errno);
+        }
+        EXPECT(nread > 0,
+               "Reached the end of the file at offset %llu with %llu bytes "
+               "left to read.",
+               (unsigned long long)offset,
+               (unsigned long long)(end - cur));
+        offset += (uint64_t)nread;
+        cur += nread;
+    }
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_get_size(const struct file* file, uint64_t* nbytes)
+{
+    struct stat st = { 0 };
+    CHECK(file);
+    CHECK(nbytes);
+    if (fstat(file->fid, &st) < 0)
+        CHECK_POSIX(errno);
+    *nbytes = (uint64_t)st.st_size;
+    return 1;
+Error:
+    return 0;
+}
+
+// Segments passed to each pwritev2() call. Well under IOV_MAX.
+#define FILE_WRITEV_BATCH (64)
+
+int
+file_writev(const struct file* file,
+            uint64_t offset,
+            const struct file_segment* segments,
+            size_t count)
+{
+    CHECK(file);
+    CHECK(segments || !count);
+    for (size_t i = 0; i < count; ++i)
+        CHECK(segments[i].beg <= segments[i].end);
+    if (file->direct_) {
+        // Each segment has to be checked and trimmed on its own.
+        for (size_t i = 0; i < count; ++i) {
+            CHECK(file_write(file, offset, segments[i].beg, segments[i].end));
+            offset += segments[i].end - segments[i].beg;
+        }
+        return 1;
+    }
+
+    // The next byte to write is `cur`, in `segments[i]`.
+    size_t i = 0;
+    const uint8_t* cur = count ? segments[0].beg : 0;
+    struct io_stats* stats = (struct io_stats*)file->stats_;
+    int retries = 0;
+    while (retries < 3) {
+        // Skip segments that are done or empty.
+        while (i < count && cur == segments[i].end)
+            if (++i < count)
+                cur = segments[i].beg;
+        if (i == count) {
+            file_writeback_advance(file->writeback_, offset);
+            return 1;
+        }
+
+        struct iovec iov[FILE_WRITEV_BATCH];
+        int n = 0;
+        size_t requested = 0;
+        for (size_t j = i; j < count && n < FILE_WRITEV_BATCH; ++j) {
+            const uint8_t* beg = (j == i) ? cur : segments[j].beg;
+            iov[n++] = (struct iovec){ .iov_base = (void*)beg,
+                                       .iov_len = segments[j].end - beg };
+            requested += iov[n - 1].iov_len;
+        }
+        const uint64_t t0 = io_now_ns(stats);
+        ssize_t written = pwritev2(file->fid, iov, n, (off_t)offset, 0);
+        const int ecode = errno;
+        if (written < 0 && (ecode == EINTR || ecode == EAGAIN)) {
+            io_stats_record_retry(stats);
+            continue;
+        }
+        io_stats_record(stats, requested, written, io_now_ns(stats) - t0);
+        if (written < 0) {
+            CHECK_POSIX(ecode);
+        }
+        retries += (written == 0);
+        offset += (uint64_t)written;
+
+        // A short write may stop anywhere, even inside a segment.
+        while (written > 0) {
+            const size_t remaining = segments[i].end - cur;
+            if ((size_t)written < remaining) {
+                cur += written;
+                written = 0;
+            } else {
+                written -= (ssize_t)remaining;
+                cur = segments[i].end;
+                if (++i < count)
+                    cur = segments[i].beg;
+            }
+        }
+    }
+    LOGE("Gave up writing at offset %llu. Three writes wrote nothing.",
+         (unsigned long long)offset);
+Error:
+    return 0;
+}
+
+//
+//  Asynchronous writes
+//
+
+// Writes in flight per file when io_uring is used.
+#define URING_DEPTH (64)
+// Longer writes are split into pieces of at most this many bytes.
+#define URING_MAX_BYTES_OF_WRITE ((size_t)1 << 30)
+#define URING_MAX_BUFFER_COUNT (8)
+
+struct uring_request
+{
+    struct uring_request* next; // free list
+    uint64_t offset;
+    const uint8_t* cur;
+    const uint8_t* end;
+    /// Index of the registered buffer holding `[cur,end)`, otherwise -1.
+    int buffer_index;
+    /// The file's write-back state, if it has any.
+    struct file_writeback* writeback;
+    /// The file's write counters, if it has any.
+    struct io_stats* stats;
+    /// When the write was last handed to the kernel.
+    uint64_t submitted_ns;
+    file_write_callback_t on_done;
+    void* ctx;
+};
+
+// One io_uring instance, driven through the raw system calls so liburing
+// isn't required.
+struct uring
+{
+    int fd;
+
+    // Submission queue, shared with the kernel.
+    void* sq_ring;
+    size_t bytes_of_sq_ring;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    size_t bytes_of_sqes;
+
+    // Completion queue, shared with the kernel. May be the same mapping as
+    // the submission queue.
+    void* cq_ring;
+    size_t bytes_of_cq_ring;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    // Prepared entries the kernel hasn't been told about yet.
+    unsigned to_submit;
+    unsigned in_flight;
+    int is_failed;
+    struct uring_request* free;
+    struct uring_request requests[URING_DEPTH];
+    struct iovec buffers[URING_MAX_BUFFER_COUNT];
+    unsigned buffer_count;
+};
+
+struct file_async
+{
+    /// NULL when io_uring isn't available.
+    struct uring* uring;
+    /// Tracks writes handed to the thread pool when there's no `uring`.
+    struct write_tracker* tracker;
+};
+
+static void
+uring_teardown(struct uring* self)
+{
+    if (self->sqes != MAP_FAILED)
+        munmap(self->sqes, self->bytes_of_sqes);
+    if (self->cq_ring != MAP_FAILED && self->cq_ring != self->sq_ring)
+        munmap(self->cq_ring, self->bytes_of_cq_ring);
+    if (self->sq_ring != MAP_FAILED)
+        munmap(self->sq_ring, self->bytes_of_sq_ring);
+    if (self->fd >= 0)
+        close(self->fd);
+    self->fd = -1;
+}
+
+static void*
+uring_map(struct uring* self, size_t bytes, off_t offset)
+{
+    return mmap(0,
+                bytes,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE,
+                self->fd,
+                offset);
+}
+
+static int
+uring_setup(struct uring* self, int fid)
+{
+    struct io_uring_params params = { 0 };
+    *self = (struct uring){
+        .sq_ring = MAP_FAILED,
+        .cq_ring = MAP_FAILED,
+        .sqes = MAP_FAILED,
+    };
+    // Containers and older kernels often block io_uring. That's expected, so
+    // it isn't reported.
+    self->fd = (int)syscall(SYS_io_uring_setup, URING_DEPTH, &params);
+    if (self->fd < 0)
+        goto Error;
+    // IORING_OP_WRITE was added in the same release (5.6) as this feature.
+    EXPECT(params.features & IORING_FEAT_RW_CUR_POS,
+           "io_uring doesn't support IORING_OP_WRITE. Using threads for "
+           "asynchronous writes.");
+
+    self->bytes_of_sq_ring =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    self->bytes_of_cq_ring =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (self->bytes_of_cq_ring > self->bytes_of_sq_ring)
+            self->bytes_of_sq_ring = self->bytes_of_cq_ring;
+        self->bytes_of_cq_ring = self->bytes_of_sq_ring;
+    }
+    self->sq_ring = uring_map(self, self->bytes_of_sq_ring, IORING_OFF_SQ_RING);
+    if (self->sq_ring == MAP_FAILED)
+        CHECK_POSIX(errno);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        self->cq_ring = self->sq_ring;
+    } else {
+        self->cq_ring =
+          uring_map(self, self->bytes_of_cq_ring, IORING_OFF_CQ_RING);
+        if (self->cq_ring == MAP_FAILED)
+            CHECK_POSIX(errno);
+    }
+    self->bytes_of_sqes = params.sq_entries * sizeof(struct io_uring_sqe);
+    self->sqes = uring_map(self, self->bytes_of_sqes, IORING_OFF_SQES);
+    if (self->sqes == MAP_FAILED)
+        CHECK_POSIX(errno);
+
+    uint8_t* sq = (uint8_t*)self->sq_ring;
+    self->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    self->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    self->sq_array = (unsigned*)(sq + params.sq_off.array);
+    uint8_t* cq = (uint8_t*)self->cq_ring;
+    self->cq_head = (unsigned*)(cq + params.cq_off.head);
+    self->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    self->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    self->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // Registering the file saves looking up the descriptor on every write.
+    if (syscall(
+          SYS_io_uring_register, self->fd, IORING_REGISTER_FILES, &fid, 1))
+        CHECK_POSIX(errno);
+
+    for (int i = URING_DEPTH - 1; i >= 0; --i) {
+        self->requests[i].next = self->free;
+        self->free = self->requests + i;
+    }
+    return 1;
+Error:
+    uring_teardown(self);
+    return 0;
+}
+
+static void
+uring_prepare(struct uring* self, struct uring_request* request)
+{
+    // This is the only thread that writes the tail.
+    const unsigned tail = *self->sq_tail;
+    const unsigned index = tail & *self->sq_mask;
+    size_t nbytes = request->end - request->cur;
+    if (nbytes > URING_MAX_BYTES_OF_WRITE)
+        nbytes = URING_MAX_BYTES_OF_WRITE;
+
+    struct io_uring_sqe* sqe = self->sqes + index;
+    *sqe = (struct io_uring_sqe){
+        .opcode = IORING_OP_WRITE,
+        .flags = IOSQE_FIXED_FILE,
+        .fd = 0, // index of the registered file
+        .off = request->offset,
+        .addr = (uintptr_t)request->cur,
+        .len = (uint32_t)nbytes,
+        .user_data = (uintptr_t)request,
+    };
+    if (request->buffer_index >= 0) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = (uint16_t)request->buffer_index;
+    }
+    self->sq_array[index] = index;
+    __atomic_store_n(self->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++self->to_submit;
+    request->submitted_ns = io_now_ns(request->stats);
+}
+
+static void
+uring_complete(struct uring* self, struct uring_request* request, int is_ok)
+{
+    const file_write_callback_t on_done = request->on_done;
+    void* ctx = request->ctx;
+    if (is_ok)
+        file_writeback_advance(request->writeback, request->offset);
+    self->is_failed |= !is_ok;
+    --self->in_flight;
+    request->next = self->free;
+    self->free = request;
+    if (on_done)
+        on_done(ctx, is_ok);
+}
+
+// Handles every completion that's ready, without waiting. Short writes are
+// resubmitted.
+static void
+uring_reap(struct uring* self)
+{
+    unsigned head = *self->cq_head;
+    while (head != __atomic_load_n(self->cq_tail, __ATOMIC_ACQUIRE)) {
+        const struct io_uring_cqe cqe = self->cqes[head & *self->cq_mask];
+        // Release the entry before calling back, in case the callback starts
+        // another write.
+        __atomic_store_n(self->cq_head, ++head, __ATOMIC_RELEASE);
+
+        struct uring_request* request =
+          (struct uring_request*)(uintptr_t)cqe.user_data;
+        if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+            io_stats_record_retry(request->stats);
+            uring_prepare(self, request);
+            continue;
+        }
+        if (request->stats) {
+            // Latency here includes time spent queued in the ring.
+            const size_t remaining = request->end - request->cur;
+            io_stats_record(request->stats,
+                            remaining < URING_MAX_BYTES_OF_WRITE
+                              ? remaining
+                              : URING_MAX_BYTES_OF_WRITE,
+                            cqe.res,
+                            io_now_ns(request->stats) - request->submitted_ns);
+        }
+        if (cqe.res <= 0) {
+            LOGE("Failed to write %llu bytes at offset %llu: %s",
+                 (unsigned long long)(request->end - request->cur),
+                 (unsigned long long)request->offset,
+                 cqe.res ? strerror(-cqe.res) : "Nothing was written");
+            uring_complete(self, request, 0);
+        } else {
+            request->cur += cqe.res;
+            request->offset += (uint64_t)cqe.res;
+            if (request->cur < request->end)
+                uring_prepare(self, request);
+            else
+                uring_complete(self, request, 1);
+        }
+    }
+}
+
+// Submits prepared entries. When `min_complete` is non-zero, also waits for
+// that many completions.
+static int
+uring_enter(struct uring* self, unsigned min_complete)
+{
+    for (;;) {
+        const long ret = syscall(SYS_io_uring_enter,
+                                 self->fd,
+                                 self->to_submit,
+                                 min_complete,
+                                 min_complete ? IORING_ENTER_GETEVENTS : 0,
+                                 0,
+                                 0);
+        if (ret >= 0) {
+            self->to_submit -= (unsigned)ret;
+            return 1;
+        }
+        switch (errno) {
+            case EINTR:
+                break;
+            case EAGAIN:
+            case EBUSY: // the completion queue is full
+                uring_reap(self);
+                break;
+            default:
+                CHECK_POSIX(errno);
+        }
+    }
+Error:
+    return 0;
+}
+
+static int
+uring_drain(struct uring* self)
+{
+    uring_reap(self);
+    while (self->in_flight) {
+        CHECK(uring_enter(self, 1));
+        uring_reap(self);
+    }
+    return 1;
+Error:
+    return 0;
+}
+
+static int
+uring_buffer_index_of(const struct uring* self,
+                      const uint8_t* beg,
+                      const uint8_t* end)
+{
+    for (unsigned i = 0; i < self->buffer_count; ++i) {
+        const uint8_t* base = (const uint8_t*)self->buffers[i].iov_base;
+        if (base <= beg && end <= base + self->buffers[i].iov_len)
+            return (int)i;
+    }
+    return -1;
+}
+
+static int
+uring_register_buffer(struct uring* self,
+                      const uint8_t* beg,
+                      const uint8_t* end)
+{
+    CHECK(uring_drain(self));
+    EXPECT(self->buffer_count < URING_MAX_BUFFER_COUNT,
+           "Can't register more than %d buffers per file.",
+           URING_MAX_BUFFER_COUNT);
+    // The whole table is registered at once, so replace the old one.
+    if (self->buffer_count)
+        syscall(
+          SYS_io_uring_register, self->fd, IORING_UNREGISTER_BUFFERS, 0, 0);
+    self->buffers[self->buffer_count++] = (struct iovec){
+        .iov_base = (void*)beg,
+        .iov_len = (size_t)(end - beg),
+    };
+    if (syscall(SYS_io_uring_register,
+                self->fd,
+                IORING_REGISTER_BUFFERS,
+                self->buffers,
+                self->buffer_count)) {
+        // Pinning may exceed RLIMIT_MEMLOCK. Writes still work without
+        // registered buffers.
+        const int ecode = errno;
+        self->buffer_count = 0;
+        CHECK_POSIX(ecode);
+    }
+    return 1;
+Error:
+    return 0;
+}
+
+static struct file_async*
+file_async_of(struct file* file)
+{
+    struct file_async* async = (struct file_async*)file->async_;
+    if (async)
+        return async;
+    CHECK(async = calloc(1, sizeof(*async)));
+    CHECK(async->uring = malloc(sizeof(*async->uring)));
+    if (!uring_setup(async->uring, file->fid)) {
+        free(async->uring);
+        async->uring = 0;
+        CHECK(async->tracker = write_tracker_create());
+    }
+    file->async_ = async;
+    return async;
+Error:
+    if (async)
+        free(async->uring);
+    free(async);
+    return 0;
+}
+
+static void
+file_async_destroy(struct file* file)
+{
+    struct file_async* async = (struct file_async*)file->async_;
+    if (async) {
+        if (async->uring) {
+            uring_drain(async->uring);
+            uring_teardown(async->uring);
+            free(async->uring);
+        }
+        write_tracker_destroy(async->tracker);
+        free(async);
+        file->async_ = 0;
+    }
+}
+
+int
+file_write_async(struct file* file,
+                 uint64_t offset,
+                 const uint8_t* beg,
+                 const uint8_t* end,
+                 file_write_callback_t on_done,
+                 void* ctx)
+{
+    struct file_async* async = 0;
+    CHECK(file);
+    CHECK(beg <= end);
+    CHECK(file_direct_prepare(file, offset, beg, &end));
+    CHECK(async = file_async_of(file));
+    if (!async->uring) {
+        return write_pool_submit(
+          async->tracker, file, offset, beg, end, on_done, ctx);
+    }
+
+    struct uring* uring = async->uring;
+    uring_reap(uring);
+    while (!uring->free) {
+        CHECK(uring_enter(uring, 1));
+        uring_reap(uring);
+    }
+    struct uring_request* request = uring->free;
+    uring->free = request->next;
+    *request = (struct uring_request){
+        .offset = offset,
+        .cur = beg,
+        .end = end,
+        .buffer_index = uring_buffer_index_of(uring, beg, end),
+        .writeback = (struct file_writeback*)file->writeback_,
+        .stats = (struct io_stats*)file->stats_,
+        .on_done = on_done,
+        .ctx = ctx,
+    };
+    ++uring->in_flight;
+    if (beg == end) {
+        uring_complete(uring, request, 1);
+        return 1;
+    }
+    uring_prepare(uring, request);
+    CHECK(uring_enter(uring, 0));
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_wait(struct file* file)
+{
+    CHECK(file);
+    struct file_async* async = (struct file_async*)file->async_;
+    if (!async)
+        return 1;
+    if (!async->uring)
+        return write_tracker_wait(async->tracker);
+    CHECK(uring_drain(async->uring));
+    const int is_ok = !async->uring->is_failed;
+    async->uring->is_failed = 0;
+    return is_ok;
+Error:
+    return 0;
+}
+
+int
+file_flush(struct file* file)
+{
+    const int is_ok = file_wait(file);
+    if (fdatasync(file->fid) < 0)
+        CHECK_POSIX(errno);
+    return is_ok;
+Error:
+    return 0;
+}
+
+int
+file_register_buffer(struct file* file,
+                     const uint8_t* beg,
+                     const uint8_t* end)
+{
+    struct file_async* async = 0;
+    CHECK(file);
+    CHECK(beg < end);
+    CHECK(async = file_async_of(file));
+    return async->uring ? uring_register_buffer(async->uring, beg, end) : 1;
+Error:
+    return 0;
+}
+
+int
+file_reserve(struct file* file, uint64_t offset, uint64_t nbytes)
+{
+    CHECK(file);
+    if (!nbytes)
+        return 1;
+    // FALLOC_FL_KEEP_SIZE leaves the size alone, so the reservation never
+    // shows up as zeros at the end of the file.
+    if (fallocate(file->fid,
+                  FALLOC_FL_KEEP_SIZE,
+                  (off_t)offset,
+                  (off_t)nbytes) < 0) {
+        if (errno == EOPNOTSUPP) {
+            LOG("This filesystem can't reserve space for files.");
+            return 0;
+        }
+        CHECK_POSIX(errno);
+    }
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_truncate(struct file* file, uint64_t nbytes)
+{
+    CHECK(file);
+    struct file_direct* direct = (struct file_direct*)file->direct_;
+    if (direct) {
+        // Otherwise closing the file would restore the old size.
+        lock_acquire(&direct->lock);
+        direct->size = nbytes;
+        lock_release(&direct->lock);
+    }
+    if (ftruncate(file->fid, (off_t)nbytes) < 0)
+        CHECK_POSIX(errno);
+    return 1;
+Error:
+    return 0;
+}
+
+// Mappings start on a page boundary, so the start of the mapping can be
+// found again from the address that was handed out.
+static size_t
+bytes_of_mapping_granularity(void)
+{
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void*
+file_map_for_write(struct file* file, uint64_t offset, size_t nbytes)
+{
+    CHECK(file);
+    CHECK(nbytes);
+    EXPECT(!file->direct_,
+           "Files created with FileCreateFlag_Direct can't be mapped.");
+    // Allocating the space, rather than just setting the size, means a full
+    // disk is reported here instead of as a SIGBUS on first touch.
+    // fallocate() never shrinks the file, so concurrent mappings are safe.
+    if (fallocate(file->fid, 0, (off_t)offset, (off_t)nbytes) < 0) {
+        EXPECT(errno == EOPNOTSUPP,
+               "Failed to grow the file to %llu bytes: %s",
+               (unsigned long long)(offset + nbytes),
+               strerror(errno));
+        struct stat st = { 0 };
+        if (fstat(file->fid, &st) < 0)
+            CHECK_POSIX(errno);
+        if ((uint64_t)st.st_size < offset + nbytes &&
+            ftruncate(file->fid, (off_t)(offset + nbytes)) < 0)
+            CHECK_POSIX(errno);
+    }
+    const size_t granularity = bytes_of_mapping_granularity();
+    const size_t lead = (size_t)(offset % granularity);
+    uint8_t* base = mmap(0,
+                         lead + nbytes,
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED,
+                         file->fid,
+                         (off_t)(offset - lead));
+    if (base == MAP_FAILED)
+        CHECK_POSIX(errno);
+    // Frames are written front to back. Read ahead, and drop pages behind.
+    madvise(base, lead + nbytes, MADV_SEQUENTIAL);
+    return base + lead;
+Error:
+    return 0;
+}
+
+const void*
+file_map_for_read(const struct file* file,
+                  uint64_t offset,
+                  size_t nbytes,
+                  enum FileReadHint hint)
+{
+    uint64_t bytes_of_file = 0;
+    CHECK(file);
+    CHECK(nbytes);
+    CHECK(file_get_size(file, &bytes_of_file));
+    // Touching a page past the end of the file raises SIGBUS.
+    EXPECT(offset + nbytes <= bytes_of_file,
+           "Can't map %llu bytes at offset %llu from a file of %llu bytes.",
+           (unsigned long long)nbytes,
+           (unsigned long long)offset,
+           (unsigned long long)bytes_of_file);
+    const size_t granularity = bytes_of_mapping_granularity();
+    const size_t lead = (size_t)(offset % granularity);
+    uint8_t* base = mmap(0,
+                         lead + nbytes,
+                         PROT_READ,
+                         MAP_SHARED,
+                         file->fid,
+                         (off_t)(offset - lead));
+    if (base == MAP_FAILED)
+        CHECK_POSIX(errno);
+    int advice = MADV_NORMAL;
+    switch (hint) {
+        case FileReadHint_Sequential:
+            advice = MADV_SEQUENTIAL;
+            break;
+        case FileReadHint_Random:
+            advice = MADV_RANDOM;
+            break;
+        case FileReadHint_WillNeed:
+            advice = MADV_WILLNEED;
+            break;
+    }
+    madvise(base, lead + nbytes, advice);
+    return base + lead;
+Error:
+    return 0;
+}
+
+int
+file_unmap(const void* address, size_t nbytes)
+{
+    CHECK(address);
+    const size_t granularity = bytes_of_mapping_granularity();
+    const size_t lead = (uintptr_t)address % granularity;
+    uint8_t* base = (uint8_t*)address - lead;
+    // MS_ASYNC schedules the dirty pages for write-back and returns.
+    if (msync(base, lead + nbytes, MS_ASYNC) < 0)
+        CHECK_POSIX(errno);
+    if (munmap(base, lead + nbytes) < 0)
+        CHECK_POSIX(errno);
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_exists(const char* filename, size_t nbytes)
+{
+    int ret = access(filename, F_OK);
+    if (ret < 0) {
+        if (errno == ENOENT)
+            return 0;
+        CHECK_POSIX(errno);
+    }
+    return ret == 0;
+Error:
+    return 0;
+}
+
+int
+file_is_writable(const char* filename, size_t nbytes)
+{
+    if (file_exists(filename, nbytes)) {
+        int ret = access(filename, W_OK);
+        if (ret < 0)
+            CHECK_POSIX(errno);
+    } else {
+        // file doesn't exist, try to create
+        int fid = open(filename, O_RDWR | O_CREAT | O_NONBLOCK, 0666);
+        if (fid < 0)
+            CHECK_POSIX(errno);
+        close(fid);
+        unlink(filename);
+    }
+    return 1;
+Error:
+    LOGE("path \"%s\" not writable", filename);
+    return 0;
+}
+
+// Creates `path`, which is `n` bytes long and is changed in place but put
+// back, and any parents it's missing. The parents are only looked at when
+// `path` can't be created.
+static int
+directory_create_inner(char* path, size_t n)
+{
+    struct stat st = { 0 };
+    if (mkdir(path, 0777) == 0)
+        return 1;
+    if (errno == EEXIST)
+        return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    if (errno != ENOENT)
+        CHECK_POSIX(errno);
+
+    // Cut `path` at the separator before its last component.
+    size_t i = n;
+    while (i > 0 && path[i - 1] != '/')
+        --i;
+    while (i > 1 && path[i - 1] == '/')
+        --i;
+    CHECK(i > 0 && path[i - 1] != '/' && path[i] == '/');
+    path[i] = '\0';
+    const int is_ok = directory_create_inner(path, i);
+    path[i] = '/';
+    CHECK(is_ok);
+    if (mkdir(path, 0777) < 0 && errno != EEXIST)
+        CHECK_POSIX(errno);
+    return 1;
+Error:
+    return 0;
+}
+
+int
+directory_create(const char* path)
+{
+    char* copy = 0;
+    CHECK(path);
+    size_t n = strlen(path);
+    while (n > 1 && path[n - 1] == '/')
+        --n;
+    CHECK(n > 0);
+    CHECK(copy = malloc(n + 1));
+    memcpy(copy, path, n); // NOLINT
+    copy[n] = '\0';
+    EXPECT(directory_create_inner(copy, n),
+           "Failed to create the directory \"%s\"",
+           copy);
+    free(copy);
+    return 1;
+Error:
+    free(copy);
+    return 0;
+}
+
+size_t
+file_get_handle_limit(void)
+{
+    struct rlimit limit = { 0 };
+    CHECK(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+    return (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > SIZE_MAX)
+             ? SIZE_MAX
+             : (size_t)limit.rlim_cur;
+Error:
+    return SIZE_MAX;
+}
+
+// Describes how a block returned by memory_alloc() was obtained, for
+// memory_free() and memory_query(). Every block is prefixed by its header.
+// Mapped blocks keep theirs at the end of a page of its own just below the
+// block, so a block that's a whole number of pages maps exactly that many
+// pages, and freeing any block doesn't need a lookup.
+struct memory_header
+{
+    /// Start of the underlying region.
+    void* base;
+    /// Bytes of the underlying region when it was mmap()'d, otherwise 0 when
+    /// the region was malloc()'d.
+    size_t bytes_of_region;
+    struct memory_info info;
+};
+
+// Bytes reserved for the header in front of every block.
+#define MEMORY_HEADER_BYTES (64)
+_Static_assert(sizeof(struct memory_header) <= MEMORY_HEADER_BYTES,
+               "The memory header must fit in front of the block");
+
+static size_t
+round_up(size_t n, size_t multiple)
+{
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+static struct memory_header*
+memory_header_of(const void* address)
+{
+    return (struct memory_header*)((uint8_t*)address - MEMORY_HEADER_BYTES);
+}
+
+// The number of bytes to reserve in front of a block so that it can start at
+// a multiple of `alignment` with room for its header. `base_alignment` is the
+// alignment of the start of the underlying region.
+static size_t
+bytes_of_prefix(size_t alignment, size_t base_alignment)
+{
+    return (alignment <= base_alignment)
+             ? round_up(MEMORY_HEADER_BYTES, alignment)
+             : MEMORY_HEADER_BYTES + alignment;
+}
+
+// Writes the header of a heap block in front of it.
+static void*
+memory_publish(void* base, size_t alignment, struct memory_info info)
+{
+    uint8_t* out =
+      (uint8_t*)round_up((uintptr_t)base + MEMORY_HEADER_BYTES, alignment);
+    *memory_header_of(out) = (struct memory_header){
+        .base = base,
+        .info = info,
+    };
+    return out;
+}
+
+// Bytes to map for a block of `capacity` bytes made of pages of `page`
+// bytes.
+static size_t
+bytes_of_mapping(size_t capacity, size_t page)
+{
+    return round_up(capacity ? capacity : 1, page);
+}
+
+// Fills `h` for a mapped region that starts with the block.
+static void*
+memory_describe(void* base,
+                size_t bytes_of_region,
+                struct memory_info info,
+                struct memory_header* h)
+{
+    *h = (struct memory_header){
+        .base = base,
+        .bytes_of_region = bytes_of_region,
+        .info = info,
+    };
+    return base;
+}
+
+static size_t
+bytes_of_default_page()
+{
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// The page size used for transparent huge pages.
+static size_t
+bytes_of_transparent_huge_page()
+{
+    static size_t bytes = 0;
+    if (!bytes) {
+        unsigned long long v = 0;
+        FILE* fp = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size",
+                         "r");
+        if (fp) {
+            if (fscanf(fp, "%llu", &v) != 1)
+                v = 0;
+            fclose(fp);
+        }
+        bytes = v ? (size_t)v : (2ULL << 20);
+    }
+    return bytes;
+}
+
+// Maps `bytes` of anonymous memory starting at an address that is a multiple
+// of `alignment`, and one more default page just below it for the block's
+// header. `flags` are added to the mmap() flags of the block, and `bytes` and
+// `alignment` must be multiples of the page size they ask for.
+static void*
+map_aligned(size_t bytes, size_t alignment, int flags)
+{
+    const size_t page = bytes_of_default_page();
+    const size_t padded = page + bytes + alignment;
+    // Reserve the address range first, so the aligned block and its header
+    // page can be put in it.
+    uint8_t* const p = mmap(0,
+                            padded,
+                            PROT_NONE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                            -1,
+                            0);
+    if (p == MAP_FAILED)
+        return 0;
+    uint8_t* const beg = (uint8_t*)round_up((uintptr_t)p + page, alignment);
+    uint8_t* const end = beg + bytes;
+    if (mmap(beg,
+             bytes,
+             PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | flags,
+             -1,
+             0) == MAP_FAILED ||
+        mmap(beg - page,
+             page,
+             PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+             -1,
+             0) == MAP_FAILED) {
+        const int ecode = errno;
+        munmap(p, padded);
+        errno = ecode;
+        return 0;
+    }
+    if (beg - page > p)
+        munmap(p, beg - page - p);
+    if (p + padded > end)
+        munmap(end, p + padded - end);
+    return beg;
+}
+
+// Unmaps a block from map_aligned(), along with its header page.
+static int
+unmap_aligned(void* beg, size_t bytes)
+{
+    const size_t page = bytes_of_default_page();
+    return munmap((uint8_t*)beg - page, page + bytes);
+}
+
+static void*
+memory_alloc_default(size_t capacity, size_t alignment)
+{
+    void* base =
+      malloc(capacity + bytes_of_prefix(alignment, alignof(max_align_t)));
+    if (!base)
+        return 0;
+    return memory_publish(
+      base,
+      alignment,
+      (struct memory_info){ .page_kind = MemoryPageKind_Default,
+                            .bytes_of_page = bytes_of_default_page(),
+                            .node = -1 });
+}
+
+static void*
+memory_alloc_mapped(size_t capacity,
+                    size_t alignment,
+                    struct memory_header* h)
+{
+    const size_t page = bytes_of_default_page();
+    const size_t n = bytes_of_mapping(capacity, page);
+    void* p = map_aligned(n, (alignment > page) ? alignment : page, 0);
+    if (!p)
+        return 0;
+    return memory_describe(
+      p,
+      n,
+      (struct memory_info){ .page_kind = MemoryPageKind_Default,
+                            .bytes_of_page = page },
+      h);
+}
+
+// Tries, in order:
+// 1. Explicit huge pages (MAP_HUGETLB). 1 GiB pages are only tried for
+//    requests of at least 1 GiB. These come from the pool reserved by the
+//    administrator (see /proc/sys/vm/nr_hugepages), so this fails whenever
+//    the pool is exhausted.
+// 2. Transparent huge pages via madvise(MADV_HUGEPAGE).
+// 3. Regular pages.
+static void*
+memory_alloc_large_page(size_t capacity,
+                        size_t alignment,
+                        struct memory_header* h)
+{
+    const struct
+    {
+        size_t bytes_of_page;
+        int flags;
+    } huge[] = {
+        { .bytes_of_page = 1ULL << 30, .flags = MAP_HUGE_1GB },
+        { .bytes_of_page = 2ULL << 20, .flags = MAP_HUGE_2MB },
+    };
+    for (size_t i = 0; i < countof(huge); ++i) {
+        if (i == 0 && capacity < huge[i].bytes_of_page)
+            continue;
+        const size_t page = huge[i].bytes_of_page;
+        const size_t n = bytes_of_mapping(capacity, page);
+        void* p = map_aligned(n,
+                              (alignment > page) ? alignment : page,
+                              MAP_HUGETLB | huge[i].flags);
+        if (p) {
+            return memory_describe(
+              p,
+              n,
+              (struct memory_info){ .page_kind = MemoryPageKind_Large,
+                                    .bytes_of_page = huge[i].bytes_of_page },
+              h);
+        }
+        TRACE("MAP_HUGETLB (%llu byte pages) failed: %s",
+              (unsigned long long)huge[i].bytes_of_page,
+              strerror(errno));
+    }
+
+    {
+        const size_t page = bytes_of_transparent_huge_page();
+        const size_t n = bytes_of_mapping(capacity, page);
+        void* p = map_aligned(n, (alignment > page) ? alignment : page, 0);
+        if (p) {
+            struct memory_info info = {
+                .page_kind = MemoryPageKind_TransparentHuge,
+                .bytes_of_page = page,
+            };
+            if (madvise(p, n, MADV_HUGEPAGE) < 0) {
+                TRACE("madvise(MADV_HUGEPAGE) failed: %s", strerror(errno));
+                info = (struct memory_info){
+                    .page_kind = MemoryPageKind_Default,
+                    .bytes_of_page = bytes_of_default_page(),
+                };
+            }
+            return memory_describe(p, n, info, h);
+        }
+    }
+
+    return memory_alloc_mapped(capacity, alignment, h);
+}
+
+// Writes to every page in the block's region so they're all faulted in.
+static void
+memory_prefault(struct memory_header* h)
+{
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(h->base, h->bytes_of_region, MADV_POPULATE_WRITE) == 0) {
+        h->info.is_prefaulted = 1;
+        return;
+    }
+#endif
+    // The region is freshly mapped anonymous memory, so it's already zero.
+    const size_t step = bytes_of_default_page();
+    volatile uint8_t* const beg = (volatile uint8_t*)h->base;
+    for (size_t i = 0; i < h->bytes_of_region; i += step)
+        beg[i] = 0;
+    h->info.is_prefaulted = 1;
+}
+
+// Pins the block's region in memory. Locking also faults in every page.
+static void
+memory_lock(struct memory_header* h)
+{
+    if (mlock(h->base, h->bytes_of_region) == 0) {
+        h->info.is_locked = 1;
+        h->info.is_prefaulted = 1;
+        return;
+    }
+    const int ecode = errno;
+    struct rlimit limit = { 0 };
+    getrlimit(RLIMIT_MEMLOCK, &limit);
+    LOGE("Allocated %llu bytes but could not lock them in memory: %s. "
+         "RLIMIT_MEMLOCK allows %llu bytes (see `ulimit -l`). The block will "
+         "be prefaulted, but it may be paged out.",
+         (unsigned long long)h->bytes_of_region,
+         strerror(ecode),
+         (unsigned long long)limit.rlim_cur);
+}
+
+void*
+memory_alloc(size_t capacity_bytes, enum AllocatorHint hint)
+{
+    return memory_alloc_aligned(capacity_bytes, alignof(max_align_t), hint);
+}
+
+void*
+memory_alloc_aligned(size_t capacity_bytes,
+                     size_t alignment,
+                     enum AllocatorHint hint)
+{
+    return memory_alloc_on_node(capacity_bytes, alignment, hint, -1);
+}
+
+// Calls `f` for every index in a sysfs list formatted like "0-3,8,10-11".
+// Returns 1 if a list was read from `path`, otherwise 0.
+static int
+read_sysfs_list(const char* path, void (*f)(int index, void* ctx), void* ctx)
+{
+    FILE* fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+    int n = 0, lo = 0, hi = 0, c = 0;
+    while (fscanf(fp, "%d", &lo) == 1) {
+        hi = lo;
+        if ((c = fgetc(fp)) == '-') {
+            if (fscanf(fp, "%d", &hi) != 1)
+                break;
+            c = fgetc(fp);
+        }
+        for (int i = lo; i <= hi; ++i)
+            f(i, ctx);
+        ++n;
+        if (c != ',')
+            break;
+    }
+    fclose(fp);
+    return n > 0;
+}
+
+static void
+track_max(int index, void* ctx)
+{
+    int* mx = (int*)ctx;
+    if (index > *mx)
+        *mx = index;
+}
+
+static void
+add_cpu(int index, void* ctx)
+{
+    if (index < CPU_SETSIZE)
+        CPU_SET(index, (cpu_set_t*)ctx);
+}
+
 int
-file_create(struct file* file, const char* filename, size_t bytesof_filename)
+memory_node_count(void)
 {
-    file->fid = open(filename, O_RDWR | O_CREAT | O_NONBLOCK, 0666);
-    if (file->fid < 0) {
-        CHECK_POSIX(errno);
-    } else {
-        int ret = flock(file->fid, LOCK_EX | LOCK_NB);
-        if (ret < 0) {
-            LOGE("Failed to create existing file \"%s\"", filename);
-            int tmp = errno;
-            close(file->fid);
-            CHECK_POSIX(tmp);
+    static int count = 0;
+    if (!count) {
+        int mx = 0;
+        read_sysfs_list("/sys/devices/system/node/online", track_max, &mx);
+        count = mx + 1;
+    }
+    return count;
+}
+
+// Bit mask of NUMA nodes, as taken by the mbind() and set_mempolicy()
+// syscalls.
+struct node_mask
+{
+    unsigned long bits[1024 / (8 * sizeof(unsigned long))];
+};
+
+static struct node_mask
+node_mask_of(int node)
+{
+    const int nbits = 8 * sizeof(unsigned long);
+    struct node_mask mask = { 0 };
+    mask.bits[node / nbits] = 1UL << (node % nbits);
+    return mask;
+}
+
+// Asks the kernel to place the block's pages on `node`. This uses the
+// preferred policy, so allocation still succeeds when the node is out of
+// memory. Any page that's already been touched is migrated.
+static void
+memory_bind(struct memory_header* h, int node)
+{
+    // With a single node, there's nowhere else for the pages to go.
+    if (memory_node_count() > 1) {
+        const struct node_mask mask = node_mask_of(node);
+        if (syscall(SYS_mbind,
+                    h->base,
+                    h->bytes_of_region,
+                    MPOL_PREFERRED,
+                    mask.bits,
+                    8 * sizeof(mask.bits),
+                    MPOL_MF_MOVE) < 0) {
+            LOGE("Could not place %llu bytes on NUMA node %d: %s",
+                 (unsigned long long)h->bytes_of_region,
+                 node,
+                 strerror(errno));
+            return;
         }
     }
-    return 1;
+    h->info.node = node;
+}
+
+void*
+memory_alloc_on_node(size_t capacity_bytes,
+                     size_t alignment,
+                     enum AllocatorHint hint,
+                     int node)
+{
+    EXPECT(alignment && (alignment & (alignment - 1)) == 0,
+           "Alignment must be a power of two. Got %llu.",
+           (unsigned long long)alignment);
+    const int all = AllocatorHint_LargePage | AllocatorHint_Prefault |
+                    AllocatorHint_Locked | AllocatorHint_NodeLocal;
+    EXPECT((hint & ~all) == 0, "Unknown allocator hint: %d", (int)hint);
+    EXPECT(node >= -1 && node < memory_node_count() && node < 1024,
+           "Expected a NUMA node in [0, %d). Got %d.",
+           memory_node_count(),
+           node);
+    if (node < 0 && (hint & AllocatorHint_NodeLocal))
+        node = thread_current_node();
+
+    // Pages have to be mapped here, not malloc()'d, for placement,
+    // prefaulting and locking to cover exactly this block.
+    void* out = 0;
+    struct memory_header h = { 0 };
+    if (hint & AllocatorHint_LargePage)
+        out = memory_alloc_large_page(capacity_bytes, alignment, &h);
+    else if ((hint & (AllocatorHint_Prefault | AllocatorHint_Locked)) ||
+             node >= 0)
+        out = memory_alloc_mapped(capacity_bytes, alignment, &h);
+    else
+        return memory_alloc_default(capacity_bytes, alignment);
+
+    if (out) {
+        h.info.node = -1;
+        // Placement has to be decided before the pages are faulted in.
+        if (node >= 0)
+            memory_bind(&h, node);
+        if (hint & AllocatorHint_Locked)
+            memory_lock(&h);
+        if ((hint & (AllocatorHint_Prefault | AllocatorHint_Locked)) &&
+            !h.info.is_prefaulted)
+            memory_prefault(&h);
+        *memory_header_of(out) = h;
+    }
+    return out;
 Error:
-    LOGE("Failed to create \"%s\"", filename);
     return 0;
 }
 
 void
-file_close(struct file* file)
+memory_free(void* address)
 {
-    if (close(file->fid) < 0)
-        CHECK_POSIX(errno);
+    if (!address)
+        return;
+    const struct memory_header* const h = memory_header_of(address);
+    if (h->bytes_of_region) {
+        if (unmap_aligned(h->base, h->bytes_of_region) < 0)
+            CHECK_POSIX(errno);
+    } else {
+        free(h->base);
+    }
 Error:;
 }
 
 int
-file_write(const struct file* file,
-           uint64_t offset,
-           const uint8_t* cur,
-           const uint8_t* end)
+memory_query(const void* address, struct memory_info* info)
 {
-    int retries = 0;
-    while (cur < end && retries < 3) {
-        size_t remaining = end - cur;
-        ssize_t written = pwrite(file->fid, cur, remaining, offset);
-        if (written < 0) {
-            CHECK_POSIX(errno);
-        }
-        retries += (written == 0);
-        offset += written;
-        cur += written;
-    }
-    return (retries < 3);
+    CHECK(address);
+    CHECK(info);
+    const struct memory_header* const h = memory_header_of(address);
+    *info = h->info;
+    info->bytes_of_mapping = h->bytes_of_region;
+    return 1;
 Error:
     return 0;
 }
 
-int
-file_exists(const char* filename, size_t nbytes)
+void*
+memory_map_mirrored(size_t* capacity_bytes)
 {
-    int ret = access(filename, F_OK);
-    if (ret < 0) {
-        if (errno == ENOENT)
-            return 0;
+    int fd = -1;
+    uint8_t* base = MAP_FAILED;
+    size_t n = 0;
+    CHECK(capacity_bytes && *capacity_bytes);
+    n = round_up(*capacity_bytes, bytes_of_default_page());
+
+    if ((fd = memfd_create("acquire-mirrored", MFD_CLOEXEC)) < 0)
+        CHECK_POSIX(errno);
+    if (ftruncate(fd, (off_t)n) < 0)
+        CHECK_POSIX(errno);
+    // Reserve the address range first so nothing else can land in between
+    // the two views.
+    base = mmap(0, 2 * n, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
         CHECK_POSIX(errno);
+    for (int i = 0; i < 2; ++i) {
+        if (mmap(base + i * n,
+                 n,
+                 PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED,
+                 fd,
+                 0) == MAP_FAILED)
+            CHECK_POSIX(errno);
     }
-    return ret == 0;
+    // The mappings keep the memory alive.
+    close(fd);
+    *capacity_bytes = n;
+    return base;
 Error:
+    if (base != MAP_FAILED)
+        munmap(base, 2 * n);
+    if (fd >= 0)
+        close(fd);
     return 0;
 }
 
-int
-file_is_writable(const char* filename, size_t nbytes)
+void
+memory_unmap_mirrored(void* address, size_t capacity_bytes)
 {
-    if (file_exists(filename, nbytes)) {
-        int ret = access(filename, W_OK);
-        if (ret < 0)
-            CHECK_POSIX(errno);
-    } else {
-        // file doesn't exist, try to create
-        int fid = open(filename, O_RDWR | O_CREAT | O_NONBLOCK, 0666);
-        if (fid < 0)
-            CHECK_POSIX(errno);
-        close(fid);
-        unlink(filename);
+    if (address && munmap(address, 2 * capacity_bytes) < 0)
+        CHECK_POSIX(errno);
+Error:;
+}
+
+//
+//  Clock
+//
+
+static uint64_t
+monotonic_raw_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+// How long clock_enable_tsc() compares the TSC to CLOCK_MONOTONIC_RAW. The
+// error in the rate is about 50 ns over this, so about 1 us per second.
+#define TSC_CALIBRATION_NS (50000000ULL)
+
+// How often clock_now_ns() compares the TSC to CLOCK_MONOTONIC_RAW again, so
+// the rate's error can't add up.
+#define TSC_REANCHOR_NS (1000000000ULL)
+
+// Set by tsc_calibrate(), then moved forward by tsc_reanchor(). Times are
+// `ns0` plus the ticks since `tsc0` times `ns_per_tick`, which is fixed
+// point, with 32 fractional bits, so converting is a multiply and a shift.
+static struct
+{
+    pthread_once_t once;
+    int is_enabled;
+    // Odd while the anchor is being moved.
+    uint32_t seq;
+    uint64_t tsc0;
+    uint64_t ns0;
+    uint64_t ns_per_tick;
+    // Where calibration started. Rates are measured from here, so their
+    // error shrinks as time goes on.
+    uint64_t tsc_start;
+    uint64_t ns_start;
+    uint64_t reanchor_ticks;
+} g_tsc = { .once = PTHREAD_ONCE_INIT };
+
+#if HAVE_TSC
+static int
+tsc_is_invariant(void)
+{
+    unsigned a = 0, b = 0, c = 0, d = 0;
+    if (!__get_cpuid(0x80000000, &a, &b, &c, &d) || a < 0x80000007)
+        return 0;
+    __get_cpuid(0x80000007, &a, &b, &c, &d);
+    return (d >> 8) & 1;
+}
+
+// The kernel only picks the TSC when it's synchronized across CPUs.
+static int
+kernel_uses_tsc(void)
+{
+    char name[16] = { 0 };
+    FILE* fp =
+      fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource",
+            "r");
+    if (!fp)
+        return 0;
+    const int is_read = fgets(name, sizeof(name), fp) != 0;
+    fclose(fp);
+    return is_read && strncmp(name, "tsc", 3) == 0;
+}
+
+// Reads both clocks close together. Keeps the pair with the shortest gap
+// between the two TSC reads around the clock_gettime() call.
+static void
+tsc_sample(uint64_t* tsc, uint64_t* ns)
+{
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 16; ++i) {
+        const uint64_t a = __rdtsc();
+        const uint64_t t = monotonic_raw_ns();
+        const uint64_t b = __rdtsc();
+        if (b - a < best) {
+            best = b - a;
+            *tsc = a + (b - a) / 2;
+            *ns = t;
+        }
     }
-    return 1;
+}
+
+static void
+tsc_calibrate(void)
+{
+    uint64_t tsc0 = 0, ns0 = 0, tsc1 = 0, ns1 = 0;
+    EXPECT(tsc_is_invariant(), "The TSC isn't invariant on this CPU.");
+    EXPECT(kernel_uses_tsc(), "The kernel doesn't use the TSC as its clock.");
+
+    tsc_sample(&tsc0, &ns0);
+    const struct timespec t = { .tv_nsec = (long)TSC_CALIBRATION_NS };
+    nanosleep(&t, 0);
+    tsc_sample(&tsc1, &ns1);
+    CHECK(tsc1 > tsc0 && ns1 > ns0);
+
+    g_tsc.tsc0 = tsc1;
+    g_tsc.ns0 = ns1;
+    g_tsc.ns_per_tick = ((ns1 - ns0) << 32) / (tsc1 - tsc0);
+    g_tsc.tsc_start = tsc0;
+    g_tsc.ns_start = ns0;
+    g_tsc.reanchor_ticks = (TSC_REANCHOR_NS << 32) / g_tsc.ns_per_tick;
+    __atomic_store_n(&g_tsc.is_enabled, 1, __ATOMIC_RELEASE);
+    LOG("Clock reads the TSC at %.3f MHz.",
+        1e3 * (double)(tsc1 - tsc0) / (double)(ns1 - ns0));
+    return;
 Error:
-    LOGE("path \"%s\" not writable", filename);
-    return 0;
+    LOG("Clock reads CLOCK_MONOTONIC_RAW.");
 }
 
-void*
-memory_alloc(size_t capacity_bytes, enum AllocatorHint hint)
+// Moves the anchor to now. Rather than stepping to CLOCK_MONOTONIC_RAW, which
+// could send time backwards, it starts where the old anchor says it is and
+// sets the rate to catch up with CLOCK_MONOTONIC_RAW over the next period.
+// `seq` is the sequence number the caller read the anchor under. When
+// another thread got there first, nothing changes.
+static void
+tsc_reanchor(uint32_t seq)
+{
+    uint64_t tsc1 = 0, ns1 = 0;
+    tsc_sample(&tsc1, &ns1);
+    if (!__atomic_compare_exchange_n(
+          &g_tsc.seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    const unsigned __int128 dt = tsc1 - g_tsc.tsc0;
+    const uint64_t at = g_tsc.ns0 + (uint64_t)((dt * g_tsc.ns_per_tick) >> 32);
+    const uint64_t rate =
+      (uint64_t)(((unsigned __int128)(ns1 - g_tsc.ns_start) << 32) /
+                 (tsc1 - g_tsc.tsc_start));
+    const uint64_t period =
+      (uint64_t)(((unsigned __int128)g_tsc.reanchor_ticks * rate) >> 32);
+    // When it's far ahead, it catches up at no less than half speed.
+    uint64_t target = ns1 + period;
+    if (target < at + period / 2)
+        target = at + period / 2;
+    __atomic_store_n(&g_tsc.tsc0, tsc1, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_tsc.ns0, at, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_tsc.ns_per_tick,
+                     (uint64_t)(((unsigned __int128)(target - at) << 32) /
+                                g_tsc.reanchor_ticks),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&g_tsc.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static uint64_t
+tsc_now_ns(void)
+{
+    uint32_t seq = 0;
+    uint64_t tsc = 0, tsc0 = 0, ns0 = 0, ns_per_tick = 0;
+    do {
+        seq = __atomic_load_n(&g_tsc.seq, __ATOMIC_ACQUIRE);
+        tsc0 = __atomic_load_n(&g_tsc.tsc0, __ATOMIC_RELAXED);
+        ns0 = __atomic_load_n(&g_tsc.ns0, __ATOMIC_RELAXED);
+        ns_per_tick = __atomic_load_n(&g_tsc.ns_per_tick, __ATOMIC_RELAXED);
+        tsc = __rdtsc();
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&g_tsc.seq, __ATOMIC_RELAXED));
+
+    const uint64_t dt = tsc - tsc0;
+    if (dt > g_tsc.reanchor_ticks)
+        tsc_reanchor(seq);
+    return ns0 + (uint64_t)(((unsigned __int128)dt * ns_per_tick) >> 32);
+}
+#else
+static void
+tsc_calibrate(void)
+{
+    LOG("Clock reads CLOCK_MONOTONIC_RAW. There's no TSC on this CPU.");
+}
+#endif
+
+uint64_t
+clock_now_ns(void)
+{
+#if HAVE_TSC
+    if (__atomic_load_n(&g_tsc.is_enabled, __ATOMIC_ACQUIRE))
+        return tsc_now_ns();
+#endif
+    return monotonic_raw_ns();
+}
+
+int
+clock_enable_tsc(void)
 {
-    return malloc(capacity_bytes);
+    pthread_once(&g_tsc.once, tsc_calibrate);
+    return __atomic_load_n(&g_tsc.is_enabled, __ATOMIC_ACQUIRE);
 }
 
 void
-memory_free(void* address)
+clock_sleep_until_ns(uint64_t deadline_ns)
 {
-    free(address);
+    uint64_t now = 0;
+    while ((now = clock_now_ns()) < deadline_ns) {
+        // clock_nanosleep() can't wait on CLOCK_MONOTONIC_RAW, so this waits
+        // on CLOCK_MONOTONIC for what's left. The two only differ by NTP's
+        // slewing, a few parts per million, so waking early just loops.
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        const uint64_t until = (uint64_t)t.tv_sec * 1000000000ULL +
+                               (uint64_t)t.tv_nsec + (deadline_ns - now);
+        t.tv_sec = (time_t)(until / 1000000000ULL);
+        t.tv_nsec = (long)(until % 1000000000ULL);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, 0);
+    }
 }
 
 void
 clock_init(struct clock* clock)
 {
-    struct timespec t;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
-    clock->origin = (uint64_t)(t.tv_sec * 1e9) + (uint64_t)t.tv_nsec;
+    clock->origin = clock_now_ns();
 }
 
 #ifndef NO_UNIT_TESTS
@@ -172,21 +2041,16 @@ clock_shift_ms(struct clock* clock, double ms)
 uint64_t
 clock_tic(struct clock* clock)
 {
-    struct timespec t;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+    const uint64_t t = clock_now_ns();
     if (clock)
-        clock->origin = (uint64_t)(1e9 * t.tv_sec) + (uint64_t)t.tv_nsec;
-    return (uint64_t)(1e9 * t.tv_sec) + (uint64_t)t.tv_nsec;
+        clock->origin = t;
+    return t;
 }
 
 int64_t
 clock_toc(struct clock* clock)
 {
-    struct timespec t;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
-    const int64_t dt =
-      (uint64_t)(t.tv_sec * 1e9) + (uint64_t)t.tv_nsec - clock->origin;
-    return dt;
+    return (int64_t)(clock_now_ns() - clock->origin);
 }
 
 double
@@ -206,10 +2070,7 @@ clock_cmp(struct clock* clock, uint64_t timestamp)
 int8_t
 clock_cmp_now(struct clock* clock)
 {
-    struct timespec t;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
-    const uint64_t now = (uint64_t)(t.tv_sec * 1e9) + (uint64_t)t.tv_nsec;
-    return clock_cmp(clock, now);
+    return clock_cmp(clock, clock_now_ns());
 }
 
 void
@@ -221,18 +2082,9 @@ clock_sleep_ms(struct clock* clock, float delay_ms)
         clock = &dummy;
     }
 
-    const float remaining_ms = delay_ms - (float)clock_toc_ms(clock);
-    if (remaining_ms > 1.0f) {
-        const int seconds = (int)(1e-3 * remaining_ms);
-        const int nsec = (int)(1e6f * (remaining_ms - 1e3f * (float)seconds));
-        const struct timespec t = { .tv_sec = seconds, .tv_nsec = nsec };
-        TRACE("\nsleep delay: %g ms - remaining: %g ms - %d %d",
-              (double)delay_ms,
-              (double)remaining_ms,
-              seconds,
-              nsec);
-
-        nanosleep(&t, 0);
+    const int64_t delay_ns = (int64_t)(1e6 * (double)delay_ms);
+    if (clock_toc(clock) < delay_ns) {
+        clock_sleep_until_ns(clock->origin + (uint64_t)delay_ns);
         clock_tic(clock);
     }
 }
@@ -273,10 +2125,36 @@ lock_release(struct lock* self)
 Error:;
 }
 
+// Condition variables time out on CLOCK_MONOTONIC instead of the default
+// CLOCK_REALTIME, which jumps when the wall clock is set.
+static void
+cond_init_monotonic(pthread_cond_t* cond)
+{
+    pthread_condattr_t attr;
+    CHECK_POSIX(pthread_condattr_init(&attr));
+    CHECK_POSIX(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC));
+    CHECK_POSIX(pthread_cond_init(cond, &attr));
+    pthread_condattr_destroy(&attr);
+    return;
+Error:
+    *cond = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+}
+
+static struct timespec
+monotonic_deadline(uint64_t timeout_ns)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    const uint64_t ns = (uint64_t)t.tv_nsec + timeout_ns % 1000000000ULL;
+    t.tv_sec += (time_t)(timeout_ns / 1000000000ULL + ns / 1000000000ULL);
+    t.tv_nsec = (long)(ns % 1000000000ULL);
+    return t;
+}
+
 void
 condition_variable_init(struct condition_variable* self)
 {
-    self->inner_ = (pthread_cond_t)PTHREAD_COND_INITIALIZER;
+    cond_init_monotonic(&self->inner_);
 }
 
 void
@@ -287,6 +2165,22 @@ condition_variable_wait(struct condition_variable* restrict self,
 Error:;
 }
 
+int
+condition_variable_wait_for(struct condition_variable* restrict self,
+                            struct lock* restrict lock,
+                            uint64_t timeout_ns)
+{
+    const struct timespec deadline = monotonic_deadline(timeout_ns);
+    const int ecode =
+      pthread_cond_timedwait(&self->inner_, &lock->inner_, &deadline);
+    if (ecode == ETIMEDOUT)
+        return 0;
+    CHECK_POSIX(ecode);
+    return 1;
+Error:
+    return 0;
+}
+
 void
 condition_variable_notify_all(struct condition_variable* self)
 {
@@ -299,9 +2193,9 @@ event_init(struct event* self)
 {
     *self = (struct event){
         .lock_ = PTHREAD_MUTEX_INITIALIZER,
-        .cond_ = PTHREAD_COND_INITIALIZER,
         .state_ = 0,
     };
+    cond_init_monotonic(&self->cond_);
 }
 
 void
@@ -332,6 +2226,71 @@ event_wait(struct event* self)
 Error:;
 }
 
+int
+event_wait_for(struct event* self, uint64_t timeout_ns)
+{
+    const struct timespec deadline = monotonic_deadline(timeout_ns);
+    int is_set = 0;
+    CHECK_POSIX(pthread_mutex_lock(&self->lock_));
+    while (!self->state_) {
+        const int ecode =
+          pthread_cond_timedwait(&self->cond_, &self->lock_, &deadline);
+        if (ecode == ETIMEDOUT)
+            break;
+        CHECK_POSIX(ecode);
+    }
+    is_set = self->state_;
+    self->state_ = 0; // reset
+    CHECK_POSIX(pthread_mutex_unlock(&self->lock_));
+Error:
+    return is_set;
+}
+
+int
+address_wait(volatile uint32_t* address, uint32_t expected, uint64_t timeout_ns)
+{
+    const struct timespec timeout = {
+        .tv_sec = (time_t)(timeout_ns / 1000000000ULL),
+        .tv_nsec = (long)(timeout_ns % 1000000000ULL),
+    };
+    if (syscall(SYS_futex,
+                address,
+                FUTEX_WAIT_PRIVATE,
+                expected,
+                (timeout_ns != UINT64_MAX) ? &timeout : 0,
+                0,
+                0) < 0) {
+        switch (errno) {
+            case ETIMEDOUT:
+                return 0;
+            case EAGAIN: // *address != expected
+            case EINTR:
+                break;
+            default:
+                CHECK_POSIX(errno);
+        }
+    }
+Error:
+    return 1;
+}
+
+void
+address_wake_one(volatile uint32_t* address)
+{
+    if (syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0) < 0)
+        CHECK_POSIX(errno);
+Error:;
+}
+
+void
+address_wake_all(volatile uint32_t* address)
+{
+    const int everyone = INT32_MAX;
+    if (syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, everyone, 0, 0, 0) < 0)
+        CHECK_POSIX(errno);
+Error:;
+}
+
 void
 thread_init(struct thread* self)
 {
@@ -373,6 +2332,65 @@ Error:
     return;
 }
 
+int
+thread_bind_to_node(struct thread* self, int node)
+{
+    int is_locked = 0;
+    char path[64] = { 0 };
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+
+    EXPECT(node >= 0 && node < memory_node_count() && node < 1024,
+           "Expected a NUMA node in [0, %d). Got %d.",
+           memory_node_count(),
+           node);
+    snprintf(
+      path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (!read_sysfs_list(path, add_cpu, &cpus)) {
+        // Without node information from sysfs, the machine is treated as a
+        // single node containing every processor. There's nothing to do.
+        return 1;
+    }
+
+    if (self) {
+        pthread_mutex_lock(&self->lock_);
+        is_locked = 1;
+        EXPECT(self->is_live_, "Expected a running thread.");
+        CHECK_POSIX(
+          pthread_setaffinity_np(self->inner_, sizeof(cpus), &cpus));
+        pthread_mutex_unlock(&self->lock_);
+        is_locked = 0;
+    } else {
+        CHECK_POSIX(
+          pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus));
+        if (memory_node_count() > 1) {
+            const struct node_mask mask = node_mask_of(node);
+            if (syscall(SYS_set_mempolicy,
+                        MPOL_PREFERRED,
+                        mask.bits,
+                        8 * sizeof(mask.bits)) < 0) {
+                LOGE("Could not prefer allocations from NUMA node %d: %s",
+                     node,
+                     strerror(errno));
+            }
+        }
+    }
+    return 1;
+Error:
+    if (is_locked)
+        pthread_mutex_unlock(&self->lock_);
+    return 0;
+}
+
+int
+thread_current_node(void)
+{
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, 0) < 0)
+        return 0;
+    return (int)node;
+}
+
 int
 lib_open(struct lib* self, const char* absolute_path)
 {
@@ -43,15 +43,95 @@ extern "C"
         uint64_t origin;
     };
 
+    /// Hints for `memory_alloc()`. These are bit flags and may be combined.
     enum AllocatorHint
     {
-        AllocatorHint_Default,
-        AllocatorHint_LargePage
+        AllocatorHint_Default = 0,
+        AllocatorHint_LargePage = 1,
+        /// Fault in every page before returning so first touches during
+        /// acquisition don't stall.
+        AllocatorHint_Prefault = 2,
+        /// Pin the block in physical memory. Implies `AllocatorHint_Prefault`.
+        AllocatorHint_Locked = 4,
+        /// Place the block on the NUMA node of the calling thread.
+        /// See `memory_alloc_on_node()` to choose a node explicitly.
+        AllocatorHint_NodeLocal = 8,
+    };
+
+    /// Describes the pages that actually back a block returned by
+    /// `memory_alloc()`.
+    enum MemoryPageKind
+    {
+        /// Regular pages.
+        MemoryPageKind_Default,
+        /// Transparent huge pages were requested for the block. The kernel
+        /// promotes the block when it can, so parts of it may still be backed
+        /// by regular pages.
+        MemoryPageKind_TransparentHuge,
+        /// Explicit large pages.
+        MemoryPageKind_Large,
+    };
+
+    struct memory_info
+    {
+        enum MemoryPageKind page_kind;
+        /// The size of the pages backing the block.
+        size_t bytes_of_page;
+        /// 1 when every page was faulted in at allocation, otherwise 0.
+        uint8_t is_prefaulted;
+        /// 1 when the block is pinned in physical memory, otherwise 0.
+        /// May be 0 even when `AllocatorHint_Locked` was requested, for
+        /// example when the request exceeds the process' locked memory limit.
+        uint8_t is_locked;
+        /// The NUMA node the block was placed on, or -1 when the block follows
+        /// the system's default placement.
+        int node;
+        /// Bytes mapped for the block: its capacity rounded up to whole pages.
+        /// The block's bookkeeping takes one more regular page below it,
+        /// which isn't counted. 0 when the block came from the heap.
+        size_t bytes_of_mapping;
+    };
+
+    /// Options for `file_create_with_flags()`. These are bit flags and may be
+    /// combined.
+    enum FileCreateFlag
+    {
+        FileCreateFlag_Default = 0,
+        /// Bypass the page cache, so long acquisitions don't evict
+        /// everything else and writes go out at a steady rate.
+        ///
+        /// On Linux and Windows, every write must start at a multiple of
+        /// 4096 bytes, and write from an address that's a multiple of 4096
+        /// bytes (see `memory_alloc_aligned()`). The length must be a multiple
+        /// of 4096 bytes too, except for a file's final write: its last few
+        /// bytes are held back and written when the file is closed, and
+        /// nothing may be written past them. On macOS, caching is turned off
+        /// with `F_NOCACHE` and there are no alignment requirements.
+        FileCreateFlag_Direct = 1,
+        /// Skip the exclusive lock `file_create()` takes on the file. For
+        /// callers that already know no one else is writing it, like a
+        /// store creating its own chunk files. Saves a system call per file
+        /// on Linux. On Windows, other handles may open the file for writing
+        /// too.
+        FileCreateFlag_NoLock = 2,
+        /// Keep what an existing file holds instead of truncating it, so a
+        /// file can be closed and opened again to write more. Linux and
+        /// macOS always keep it. Windows truncates unless this is set.
+        FileCreateFlag_Keep = 4,
     };
 
     struct file
     {
         int fid;
+        /// State for `file_write_async()`. NULL until it's first used.
+        void* async_;
+        /// State for `FileCreateFlag_Direct`. NULL for other files.
+        void* direct_;
+        /// State for `file_set_writeback_window()`. NULL until it's first
+        /// used.
+        void* writeback_;
+        /// State for `file_enable_io_stats()`. NULL until it's first used.
+        void* stats_;
     };
 
     struct lib
@@ -102,6 +182,22 @@ extern "C"
                     const char* filename,
                     size_t bytes_of_filename);
 
+    /// @brief Like `file_create()`, with options.
+    /// @param flags A combination of `FileCreateFlag` values.
+    /// @return 1 on success, otherwise 0
+    int file_create_with_flags(struct file* file,
+                               const char* filename,
+                               size_t bytes_of_filename,
+                               enum FileCreateFlag flags);
+
+    /// @brief Opens an existing file for reading.
+    /// @details Other processes may keep writing to the file. The `file` is
+    ///          released with `file_close()`.
+    /// @return 1 on success, otherwise 0
+    int file_open_read(struct file* file,
+                       const char* filename,
+                       size_t bytes_of_filename);
+
     void file_close(struct file* file);
 
     /// @brief Write the memory in `[beg,end)` to `file` starting at `offset`.
@@ -115,6 +211,222 @@ extern "C"
                    const uint8_t* beg,
                    const uint8_t* end);
 
+    /// @brief Fill `[beg,end)` with bytes read from `file` starting at
+    ///        `offset`.
+    /// @details Several threads may read from the same file at once.
+    /// @return 1 when every byte was read, otherwise 0. Running into the end
+    ///         of the file is an error.
+    int file_read(const struct file* file,
+                  uint64_t offset,
+                  uint8_t* beg,
+                  uint8_t* end);
+
+    /// @brief Get the size of `file` in bytes.
+    /// @return 1 on success, otherwise 0
+    int file_get_size(const struct file* file, uint64_t* nbytes);
+
+    /// The bytes in `[beg,end)`. See `file_writev()`.
+    struct file_segment
+    {
+        const uint8_t* beg;
+        const uint8_t* end;
+    };
+
+    /// @brief Write `count` segments to `file`, back to back, starting at
+    ///        `offset`.
+    /// @details Writes a header, payload and footer that live in different
+    ///          buffers without copying them together first. On Linux, this
+    ///          is one `pwritev2()` call for up to 64 segments at a time.
+    /// @return 1 on success, otherwise 0
+    int file_writev(const struct file* file,
+                    uint64_t offset,
+                    const struct file_segment* segments,
+                    size_t count);
+
+    /// Called when a write started by `file_write_async()` finishes.
+    /// @param ctx The `ctx` passed to `file_write_async()`.
+    /// @param is_ok 1 when every byte was written, otherwise 0.
+    typedef void (*file_write_callback_t)(void* ctx, int is_ok);
+
+    /// @brief Start writing `[beg,end)` to `file` at `offset`, and return
+    ///        without waiting for the write to finish.
+    /// @details The bytes in `[beg,end)` must stay valid and unchanged until
+    ///          the write finishes. Writes may finish in any order.
+    ///          `on_done` may be called on another thread, or on this one
+    ///          from inside `file_write_async()` or `file_wait()`. It must not
+    ///          block.
+    ///          Only one thread at a time may start writes or wait on a file.
+    /// @param on_done Called when the write finishes. May be NULL.
+    /// @param ctx Passed to `on_done`.
+    /// @return 1 when the write was started, otherwise 0
+    int file_write_async(struct file* file,
+                         uint64_t offset,
+                         const uint8_t* beg,
+                         const uint8_t* end,
+                         file_write_callback_t on_done,
+                         void* ctx);
+
+    /// @brief Wait for every write started by `file_write_async()` to finish.
+    /// @return 1 when all of those writes succeeded, otherwise 0
+    int file_wait(struct file* file);
+
+    /// @brief Like `file_wait()`, then commit the file's data to the device.
+    /// @return 1 on success, otherwise 0
+    int file_flush(struct file* file);
+
+    /// @brief Hint that many writes will come from memory in `[beg,end)`, for
+    ///        example a frame pool or ring.
+    /// @details On Linux, the memory is registered with io_uring, so writes
+    ///          from it skip mapping and pinning pages each time. Elsewhere,
+    ///          this does nothing. Waits for writes in flight.
+    /// @return 1 on success, otherwise 0. Writes work either way.
+    int file_register_buffer(struct file* file,
+                             const uint8_t* beg,
+                             const uint8_t* end);
+
+    /// @brief Allocate disk space for `[offset,offset+nbytes)` of `file` ahead
+    ///        of writing it.
+    /// @details Reserving a whole acquisition up front keeps the file in a few
+    ///          large extents, and keeps block allocation out of the write
+    ///          path. The file's size doesn't change. Space that isn't written
+    ///          is released by `file_truncate()`. Uses `fallocate()` on Linux,
+    ///          `F_PREALLOCATE` on macOS and the allocation size on Windows.
+    /// @return 1 on success, otherwise 0. Filesystems that can't reserve
+    ///         space return 0, but the file is still usable.
+    int file_reserve(struct file* file, uint64_t offset, uint64_t nbytes);
+
+    /// @brief Set the size of `file` to `nbytes`, and release any space
+    ///        reserved past that by `file_reserve()`.
+    /// @return 1 on success, otherwise 0
+    int file_truncate(struct file* file, uint64_t nbytes);
+
+    /// Write-back counters for one file. See `file_set_writeback_window()`.
+    struct file_writeback_stats
+    {
+        /// Bytes handed to the disk so far.
+        uint64_t bytes_started;
+        /// Bytes known to be on the disk and dropped from the page cache.
+        uint64_t bytes_retired;
+        /// Bytes handed to the disk that may not have reached it yet.
+        uint64_t bytes_in_flight;
+        /// Times a write had to wait for an earlier window to reach the disk.
+        uint64_t wait_count;
+    };
+
+    /// @brief Keep the dirty data `file` holds in the page cache bounded.
+    /// @details Each time writes move past a window of `bytes_of_window`
+    ///          bytes, that window is handed to the disk, and the window
+    ///          before it is waited for and dropped from the page cache. That
+    ///          keeps the kernel from building up gigabytes of dirty pages
+    ///          during long sequential writes and then stalling on them all
+    ///          at once. Works best when writes move steadily forward.
+    ///
+    ///          Only Linux acts on the window, with `sync_file_range()` and
+    ///          `posix_fadvise()`. Elsewhere write-back is left to the system
+    ///          and the counters stay at zero.
+    /// @param bytes_of_window Bytes per window, or 0 to turn this off. Off by
+    ///                        default.
+    /// @return 1 on success, otherwise 0
+    int file_set_writeback_window(struct file* file, uint64_t bytes_of_window);
+
+    /// @brief Read `file`'s write-back counters into `stats`.
+    /// @return 1 on success, otherwise 0
+    int file_get_writeback_stats(const struct file* file,
+                                 struct file_writeback_stats* stats);
+
+    /// Buckets in `file_io_stats::latency_histogram`.
+#define FILE_IO_STATS_BUCKET_COUNT (32)
+
+    /// Write counters for one file. See `file_enable_io_stats()`.
+    struct file_io_stats
+    {
+        uint64_t bytes_written;
+        /// Write system calls, including ones that failed.
+        uint64_t write_count;
+        /// Calls that wrote some, but not all, of what they were asked to.
+        uint64_t short_write_count;
+        /// Calls that wrote nothing. Three in a row fail the write.
+        uint64_t zero_write_count;
+        /// Calls that were interrupted or would have blocked, and were tried
+        /// again.
+        uint64_t retry_count;
+        /// Calls that failed.
+        uint64_t error_count;
+        uint64_t latency_ns_total;
+        uint64_t latency_ns_max;
+        /// Calls by how long they took. Bucket 0 counts calls under 1 us.
+        /// Bucket `i` counts calls that took `[2^(i-1),2^i)` us, except for
+        /// the last, which counts everything longer.
+        uint64_t latency_histogram[FILE_IO_STATS_BUCKET_COUNT];
+    };
+
+    /// @brief Start counting the writes made to `file`.
+    /// @details Every write system call is counted and timed, including
+    ///          those made for `file_writev()` and `file_write_async()`.
+    ///          Off by default, and then writes don't pay for the clock
+    ///          reads. Call before writes start, from the thread that
+    ///          created the file.
+    /// @return 1 on success, otherwise 0
+    int file_enable_io_stats(struct file* file);
+
+    /// @brief Read `file`'s write counters into `stats`.
+    /// @details Cheap, and doesn't block writers, so it can be polled while
+    ///          writes are under way. The counters are read one at a time,
+    ///          so they may be a write or two apart. All zero when
+    ///          `file_enable_io_stats()` hasn't been called.
+    /// @return 1 on success, otherwise 0
+    int file_get_io_stats(const struct file* file,
+                          struct file_io_stats* stats);
+
+    /// @returns An upper bound, in microseconds, on the latency of the
+    ///          fraction `quantile` of calls counted in `stats`. For example,
+    ///          0.99 gives the 99th percentile. 0 when nothing was counted.
+    uint64_t file_io_stats_latency_us(const struct file_io_stats* stats,
+                                      double quantile);
+
+    /// @brief Map `[offset,offset+nbytes)` of `file` into memory for writing.
+    /// @details For formats with a fixed-size slot per frame, the returned
+    ///          pointer can be passed as the `im` buffer to
+    ///          `camera_get_frame()`, so frames land in the file without an
+    ///          extra copy. The file grows first if it's too short. On Linux
+    ///          the new space is allocated up front, so a full disk fails here
+    ///          instead of faulting later. On Linux and macOS the mapping is
+    ///          marked for sequential access. Files created with
+    ///          `FileCreateFlag_Direct` can't be mapped.
+    /// @return The address of the byte at `offset`, or NULL on failure.
+    /// @see file_unmap()
+    void* file_map_for_write(struct file* file, uint64_t offset, size_t nbytes);
+
+    /// How a view from `file_map_for_read()` is going to be read.
+    enum FileReadHint
+    {
+        /// Front to back. Reads well ahead, and drops pages that were read.
+        FileReadHint_Sequential,
+        /// In no particular order. Reads no further than needed.
+        FileReadHint_Random,
+        /// All of it, soon. Starts reading the whole view in right away.
+        FileReadHint_WillNeed,
+    };
+
+    /// @brief Map `[offset,offset+nbytes)` of `file` into memory for reading.
+    /// @details The range has to be inside the file. `hint` tells the system
+    ///          how to read ahead.
+    /// @return The address of the byte at `offset`, or NULL on failure.
+    /// @see file_unmap()
+    const void* file_map_for_read(const struct file* file,
+                                  uint64_t offset,
+                                  size_t nbytes,
+                                  enum FileReadHint hint);
+
+    /// @brief Unmap a view from `file_map_for_write()` or
+    ///        `file_map_for_read()`.
+    /// @details Changes to a writable view start going to disk, but this
+    ///          doesn't wait for them to get there.
+    /// @param address The address returned when the view was mapped.
+    /// @param nbytes The `nbytes` passed when the view was mapped.
+    /// @return 1 on success, otherwise 0
+    int file_unmap(const void* address, size_t nbytes);
+
     /// @param filename NULL-terminated path string
     /// @param nbytes length of the filename string in bytes
     /// @return 1 if the file exists, otherwise 0
@@ -125,10 +437,75 @@ extern "C"
     /// @return 1 if the file is writable, otherwise 0
     int file_is_writable(const char* filename, size_t nbytes);
 
+    /// @brief Create the directory `path`, along with any of its parents that
+    ///        don't exist yet, like `mkdir -p`.
+    /// @details Costs one system call when the parents already exist.
+    /// @param path NULL-terminated path string
+    /// @return 1 when `path` is a directory afterwards, otherwise 0
+    int directory_create(const char* path);
+
+    /// @returns The number of files this process may have open at once, or
+    ///          `SIZE_MAX` when there's no practical limit. On Linux and
+    ///          macOS this is the soft `RLIMIT_NOFILE` (see `ulimit -n`).
+    size_t file_get_handle_limit(void);
+
     void* memory_alloc(size_t capacity_bytes, enum AllocatorHint hint);
 
+    /// @brief Allocate a block that starts at a multiple of `alignment`.
+    /// @details Use this for SIMD kernels or for buffers used with direct
+    ///          (unbuffered) file I/O. Combine with `AllocatorHint_LargePage`
+    ///          to get a large-page-backed block that is also suitably
+    ///          aligned. Release the block with `memory_free()`.
+    /// @param[in] capacity_bytes The size of the block.
+    /// @param[in] alignment Must be a power of two.
+    /// @param[in] hint Combination of `AllocatorHint` flags.
+    /// @return The block on success, otherwise 0.
+    void* memory_alloc_aligned(size_t capacity_bytes,
+                               size_t alignment,
+                               enum AllocatorHint hint);
+
+    /// @brief Allocate a block on a specific NUMA node.
+    /// @details Like `memory_alloc_aligned()`, but the block's pages are
+    ///          placed on `node`, when possible, instead of wherever they are
+    ///          first touched. Release the block with `memory_free()`.
+    /// @param[in] node A NUMA node in `[0, memory_node_count())`, or -1 for
+    ///                 the default placement.
+    /// @return The block on success, otherwise 0.
+    void* memory_alloc_on_node(size_t capacity_bytes,
+                               size_t alignment,
+                               enum AllocatorHint hint,
+                               int node);
+
+    /// @returns the number of NUMA nodes. This is 1 on machines without NUMA.
+    int memory_node_count(void);
+
     void memory_free(void* address);
 
+    /// @brief Query how the block at `address` was actually allocated.
+    /// @details Hints passed to `memory_alloc()` are only requests. For
+    ///          example, `AllocatorHint_LargePage` falls back to regular pages
+    ///          when large pages are unavailable.
+    /// @param[in] address A block returned by `memory_alloc()`.
+    /// @param[out] info Describes the memory backing the block.
+    /// @return 1 on success, otherwise 0
+    int memory_query(const void* address, struct memory_info* info);
+
+    /// @brief Map the same memory twice, back to back.
+    /// @details The byte at `p + i` is the byte at `p + i + *capacity_bytes`,
+    ///          so any run of up to `*capacity_bytes` that starts in the first
+    ///          half is contiguous, even when it wraps around. Useful for ring
+    ///          buffers.
+    /// @param[in,out] capacity_bytes The number of bytes requested. On return,
+    ///                the size of one half, rounded up to a whole number of
+    ///                pages (the allocation granularity on Windows).
+    /// @returns The start of the `2 * *capacity_bytes` mapping, or NULL on
+    ///          failure. Release it with `memory_unmap_mirrored()`.
+    void* memory_map_mirrored(size_t* capacity_bytes);
+
+    /// @param[in] capacity_bytes The size of one half, as returned by
+    ///                           `memory_map_mirrored()`.
+    void memory_unmap_mirrored(void* address, size_t capacity_bytes);
+
     void clock_init(struct clock* clock);
 
     void clock_shift_ms(struct clock* clock, double ms);
@@ -158,6 +535,33 @@ extern "C"
     /// @param[in] delay_ms Time to sleep in milliseconds.
     void clock_sleep_ms(struct clock* clock, float delay_ms);
 
+    /// @brief Read the CPU's time-stamp counter (TSC) in `clock_tic()`,
+    ///        `clock_toc()` and the other clock functions, instead of calling
+    ///        `clock_gettime()`.
+    /// @details Only an invariant TSC, that the kernel also uses as its clock
+    ///          source, qualifies. The first call compares the TSC to
+    ///          `CLOCK_MONOTONIC_RAW` for about 50 ms. Afterwards, times are
+    ///          converted to ns with integer math and stay on the same
+    ///          timeline. About once a second, reading the clock compares the
+    ///          two again and adjusts the rate, so it stays within a few
+    ///          microseconds of `CLOCK_MONOTONIC_RAW` without stepping back.
+    ///          Affects every thread, and can't be undone.
+    /// @return 1 when the clock functions read the TSC, otherwise 0 and they
+    ///         are unchanged.
+    int clock_enable_tsc(void);
+
+    /// @returns The time in nanoseconds, on the same timeline as
+    ///          `clock_tic()`.
+    uint64_t clock_now_ns(void);
+
+    /// @brief Sleep until `clock_now_ns()` reaches `deadline_ns`.
+    /// @details Uses `clock_nanosleep()` with an absolute deadline, so
+    ///          deadlines computed from a fixed start don't drift. Wakes late
+    ///          by however long the kernel takes, usually tens of
+    ///          microseconds (see `PR_SET_TIMERSLACK`). Returns right away
+    ///          when the deadline has passed.
+    void clock_sleep_until_ns(uint64_t deadline_ns);
+
     void lock_init(struct lock* self);
 
     void lock_acquire(struct lock* self);
@@ -171,6 +575,19 @@ extern "C"
     void condition_variable_wait(struct condition_variable* __restrict self,
                                  struct lock* __restrict lock);
 
+    /// @brief Like `condition_variable_wait()`, but give up after
+    ///        `timeout_ns`.
+    /// @details The timeout is measured on `CLOCK_MONOTONIC`, so changes to
+    ///          the wall clock don't stretch or cut it short.
+    ///          May return spuriously, so callers re-check their condition
+    ///          in a loop.
+    /// @returns 1 when woken, or 0 when the wait timed out or failed.
+    ///          A failure is logged.
+    int condition_variable_wait_for(
+      struct condition_variable* __restrict self,
+      struct lock* __restrict lock,
+      uint64_t timeout_ns);
+
     void condition_variable_notify_all(struct condition_variable* self);
 
     void event_init(struct event* self);
@@ -181,14 +598,48 @@ extern "C"
 
     void event_wait(struct event* self);
 
+    /// @brief Like `event_wait()`, but give up after `timeout_ns`.
+    /// @returns 1 when the event was set, which resets it, or 0 when the
+    ///          wait timed out.
+    int event_wait_for(struct event* self, uint64_t timeout_ns);
+
     void event_notify_all(struct event* self);
 
+    /// @brief Block while `*address == expected`.
+    /// @details Returns early when another thread calls `address_wake_one()`
+    ///          or `address_wake_all()` on `address`, and may also return
+    ///          spuriously, so callers re-check their condition in a loop.
+    ///          Only the calling thread sleeps; no lock is held.
+    /// @param[in] timeout_ns The longest time to wait. `UINT64_MAX` to wait
+    ///                       without a timeout.
+    /// @returns 0 when the wait timed out, otherwise 1.
+    int address_wait(volatile uint32_t* address,
+                     uint32_t expected,
+                     uint64_t timeout_ns);
+
+    /// @brief Wake at least one thread waiting on `address`.
+    void address_wake_one(volatile uint32_t* address);
+
+    /// @brief Wake every thread waiting on `address`.
+    void address_wake_all(volatile uint32_t* address);
+
     void thread_init(struct thread* self);
 
     uint8_t thread_create(struct thread* self, void (*proc)(void*), void* args);
 
     void thread_join(struct thread* self);
 
+    /// @brief Restrict a thread to the processors of a NUMA node.
+    /// @details When `self` is NULL, the calling thread is bound and its
+    ///          subsequent allocations prefer `node` as well.
+    /// @param[in] self A running thread, or NULL for the calling thread.
+    /// @param[in] node A NUMA node in `[0, memory_node_count())`.
+    /// @return 1 on success, otherwise 0
+    int thread_bind_to_node(struct thread* self, int node);
+
+    /// @returns the NUMA node of the processor running the calling thread.
+    int thread_current_node(void);
+
 #ifdef __cplusplus
 }
 #endif
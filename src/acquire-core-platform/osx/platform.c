@@ -1,6 +1,11 @@
 #include "platform.h"
 #include "logger.h"
+#include "write.pool.h"
+#include "io.stats.h"
 
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -10,6 +15,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #define L (aq_logger)
 #define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
@@ -44,24 +53,73 @@
 int
 file_create(struct file* file, const char* filename, size_t bytesof_filename)
 {
-    file->fid = open(filename, O_RDWR | O_CREAT | O_EXLOCK | O_NONBLOCK, 0666);
+    return file_create_with_flags(
+      file, filename, bytesof_filename, FileCreateFlag_Default);
+}
+
+int
+file_create_with_flags(struct file* file,
+                       const char* filename,
+                       size_t bytesof_filename,
+                       enum FileCreateFlag flags)
+{
+    file->async_ = 0;
+    file->direct_ = 0;
+    file->stats_ = 0;
+    const int lock = (flags & FileCreateFlag_NoLock) ? 0 : O_EXLOCK;
+    file->fid = open(filename, O_RDWR | O_CREAT | lock | O_NONBLOCK, 0666);
     if (file->fid < 0) {
         CHECK_POSIX(errno);
     }
+    // There's no O_DIRECT. F_NOCACHE keeps the data out of the unified buffer
+    // cache, and doesn't care about alignment.
+    if ((flags & FileCreateFlag_Direct) && fcntl(file->fid, F_NOCACHE, 1) < 0)
+        LOG("Failed to turn off caching for \"%s\". Writes will be cached.",
+            filename);
     return 1;
 Error:
     LOGE("Failed to create \"%s\"", filename);
     return 0;
 }
 
+int
+file_open_read(struct file* file, const char* filename, size_t bytesof_filename)
+{
+    *file = (struct file){ .fid = -1 };
+    // No lock, so files can be read while they're still being written.
+    file->fid = open(filename, O_RDONLY);
+    if (file->fid < 0)
+        CHECK_POSIX(errno);
+    return 1;
+Error:
+    LOGE("Failed to open \"%s\" for reading", filename);
+    return 0;
+}
+
 void
 file_close(struct file* file)
 {
+    // Waits for writes in flight.
+    write_tracker_destroy((struct write_tracker*)file->async_);
+    file->async_ = 0;
+    io_stats_destroy((struct io_stats*)file->stats_);
+    file->stats_ = 0;
     if (close(file->fid) < 0)
         CHECK_POSIX(errno);
 Error:;
 }
 
+// Only reads the clock when `stats` are being kept.
+static uint64_t
+io_now_ns(const struct io_stats* stats)
+{
+    struct timespec t = { 0 };
+    if (!stats)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
 int
 file_write(const struct file* file,
            uint64_t offset,
@@ -69,17 +127,309 @@ file_write(const struct file* file,
            const uint8_t* end)
 {
     int retries = 0;
+    struct io_stats* stats = (struct io_stats*)file->stats_;
     while (cur < end && retries < 3) {
-        size_t remaining = end - cur;
-        ssize_t written = pwrite(file->fid, cur, remaining, offset);
+        const size_t remaining = end - cur;
+        const uint64_t t0 = io_now_ns(stats);
+        const ssize_t written = pwrite(file->fid, cur, remaining, offset);
+        const int ecode = errno;
+        if (written < 0 && (ecode == EINTR || ecode == EAGAIN)) {
+            io_stats_record_retry(stats);
+            continue;
+        }
+        io_stats_record(stats, remaining, written, io_now_ns(stats) - t0);
         if (written < 0) {
-            CHECK_POSIX(errno);
+            CHECK_POSIX(ecode);
         }
         retries += (written == 0);
         offset += written;
         cur += written;
     }
-    return (retries < 3);
+    EXPECT(retries < 3,
+           "Gave up with %llu bytes left to write at offset %llu. Three "
+           "writes wrote nothing.",
+           (unsigned long long)(end - cur),
+           (unsigned long long)offset);
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_read(const struct file* file,
+          uint64_t offset,
+          uint8_t* cur,
+          uint8_t* end)
+{
+    CHECK(file);
+    CHECK(cur <= end);
+    while (cur < end) {
+        const ssize_t nread = pread(file->fid, cur, end - cur, (off_t)offset);
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            CHECK_POSIX(errno);
+        }
+        EXPECT(nread > 0,
+               "Reached the end of the file at offset %llu with %llu bytes "
+               "left to read.",
+               (unsigned long long)offset,
+               (unsigned long long)(end - cur));
+        offset += (uint64_t)nread;
+        cur += nread;
+    }
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_get_size(const struct file* file, uint64_t* nbytes)
+{
+    struct stat st = { 0 };
+    CHECK(file);
+    CHECK(nbytes);
+    if (fstat(file->fid, &st) < 0)
+        CHECK_POSIX(errno);
+    *nbytes = (uint64_t)st.st_size;
+    return 1;
+Error:
+    return 0;
+}
+
+// pwritev() needs macOS 11, so write one segment at a time.
+int
+file_writev(const struct file* file,
+            uint64_t offset,
+            const struct file_segment* segments,
+            size_t count)
+{
+    CHECK(file);
+    CHECK(segments || !count);
+    for (size_t i = 0; i < count; ++i) {
+        const struct file_segment s = segments[i];
+        CHECK(s.beg <= s.end);
+        CHECK(file_write(file, offset, s.beg, s.end));
+        offset += (uint64_t)(s.end - s.beg);
+    }
+    return 1;
+Error:
+    return 0;
+}
+
+// There's no io_uring here, so asynchronous writes are file_write() calls
+// on a shared pool of threads.
+int
+file_write_async(struct file* file,
+                 uint64_t offset,
+                 const uint8_t* beg,
+                 const uint8_t* end,
+                 file_write_callback_t on_done,
+                 void* ctx)
+{
+    CHECK(file);
+    if (!file->async_)
+        CHECK(file->async_ = write_tracker_create());
+    return write_pool_submit((struct write_tracker*)file->async_,
+                             file,
+                             offset,
+                             beg,
+                             end,
+                             on_done,
+                             ctx);
+Error:
+    return 0;
+}
+
+int
+file_wait(struct file* file)
+{
+    CHECK(file);
+    return file->async_
+             ? write_tracker_wait((struct write_tracker*)file->async_)
+             : 1;
+Error:
+    return 0;
+}
+
+int
+file_flush(struct file* file)
+{
+    const int is_ok = file_wait(file);
+    if (fsync(file->fid) < 0)
+        CHECK_POSIX(errno);
+    return is_ok;
+Error:
+    return 0;
+}
+
+int
+file_register_buffer(struct file* file,
+                     const uint8_t* beg,
+                     const uint8_t* end)
+{
+    CHECK(file);
+    CHECK(beg < end);
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_reserve(struct file* file, uint64_t offset, uint64_t nbytes)
+{
+    struct stat st = { 0 };
+    CHECK(file);
+    if (fstat(file->fid, &st) < 0)
+        CHECK_POSIX(errno);
+    // F_PREALLOCATE counts from the end of the space that's already
+    // allocated, not from the start of the file.
+    const uint64_t bytes_allocated = (uint64_t)st.st_blocks * 512;
+    if (offset + nbytes <= bytes_allocated)
+        return 1;
+    fstore_t store = {
+        .fst_flags = F_ALLOCATECONTIG | F_ALLOCATEALL,
+        .fst_posmode = F_PEOFPOSMODE,
+        .fst_offset = 0,
+        .fst_length = (off_t)(offset + nbytes - bytes_allocated),
+    };
+    if (fcntl(file->fid, F_PREALLOCATE, &store) < 0) {
+        // There might not be enough contiguous space. Take what there is.
+        store.fst_flags = F_ALLOCATEALL;
+        if (fcntl(file->fid, F_PREALLOCATE, &store) < 0)
+            CHECK_POSIX(errno);
+    }
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_truncate(struct file* file, uint64_t nbytes)
+{
+    CHECK(file);
+    if (ftruncate(file->fid, (off_t)nbytes) < 0)
+        CHECK_POSIX(errno);
+    return 1;
+Error:
+    return 0;
+}
+
+// There's no sync_file_range() here, so write-back is left to the system.
+int
+file_set_writeback_window(struct file* file, uint64_t bytes_of_window)
+{
+    CHECK(file);
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_get_writeback_stats(const struct file* file,
+                         struct file_writeback_stats* stats)
+{
+    CHECK(file);
+    CHECK(stats);
+    *stats = (struct file_writeback_stats){ 0 };
+    return 1;
+Error:
+    return 0;
+}
+
+// Mappings start on a page boundary, so the start of the mapping can be
+// found again from the address that was handed out.
+static size_t
+bytes_of_mapping_granularity(void)
+{
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void*
+file_map_for_write(struct file* file, uint64_t offset, size_t nbytes)
+{
+    CHECK(file);
+    CHECK(nbytes);
+    struct stat st = { 0 };
+    if (fstat(file->fid, &st) < 0)
+        CHECK_POSIX(errno);
+    if ((uint64_t)st.st_size < offset + nbytes &&
+        ftruncate(file->fid, (off_t)(offset + nbytes)) < 0)
+        CHECK_POSIX(errno);
+    const size_t granularity = bytes_of_mapping_granularity();
+    const size_t lead = (size_t)(offset % granularity);
+    uint8_t* base = mmap(0,
+                         lead + nbytes,
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED,
+                         file->fid,
+                         (off_t)(offset - lead));
+    if (base == MAP_FAILED)
+        CHECK_POSIX(errno);
+    // Frames are written front to back. Read ahead, and drop pages behind.
+    madvise(base, lead + nbytes, MADV_SEQUENTIAL);
+    return base + lead;
+Error:
+    return 0;
+}
+
+const void*
+file_map_for_read(const struct file* file,
+                  uint64_t offset,
+                  size_t nbytes,
+                  enum FileReadHint hint)
+{
+    uint64_t bytes_of_file = 0;
+    CHECK(file);
+    CHECK(nbytes);
+    CHECK(file_get_size(file, &bytes_of_file));
+    // Touching a page past the end of the file raises SIGBUS.
+    EXPECT(offset + nbytes <= bytes_of_file,
+           "Can't map %llu bytes at offset %llu from a file of %llu bytes.",
+           (unsigned long long)nbytes,
+           (unsigned long long)offset,
+           (unsigned long long)bytes_of_file);
+    const size_t granularity = bytes_of_mapping_granularity();
+    const size_t lead = (size_t)(offset % granularity);
+    uint8_t* base = mmap(0,
+                         lead + nbytes,
+                         PROT_READ,
+                         MAP_SHARED,
+                         file->fid,
+                         (off_t)(offset - lead));
+    if (base == MAP_FAILED)
+        CHECK_POSIX(errno);
+    int advice = MADV_NORMAL;
+    switch (hint) {
+        case FileReadHint_Sequential:
+            advice = MADV_SEQUENTIAL;
+            break;
+        case FileReadHint_Random:
+            advice = MADV_RANDOM;
+            break;
+        case FileReadHint_WillNeed:
+            advice = MADV_WILLNEED;
+            break;
+    }
+    madvise(base, lead + nbytes, advice);
+    return base + lead;
+Error:
+    return 0;
+}
+
+int
+file_unmap(const void* address, size_t nbytes)
+{
+    CHECK(address);
+    const size_t granularity = bytes_of_mapping_granularity();
+    const size_t lead = (uintptr_t)address % granularity;
+    uint8_t* base = (uint8_t*)address - lead;
+    // MS_ASYNC schedules the dirty pages for write-back and returns.
+    if (msync(base, lead + nbytes, MS_ASYNC) < 0)
+        CHECK_POSIX(errno);
+    if (munmap(base, lead + nbytes) < 0)
+        CHECK_POSIX(errno);
+    return 1;
 Error:
     return 0;
 }
@@ -119,16 +469,403 @@ Error:
     return 0;
 }
 
+// Creates `path`, which is `n` bytes long and is changed in place but put
+// back, and any parents it's missing. The parents are only looked at when
+// `path` can't be created.
+static int
+directory_create_inner(char* path, size_t n)
+{
+    struct stat st = { 0 };
+    if (mkdir(path, 0777) == 0)
+        return 1;
+    if (errno == EEXIST)
+        return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    if (errno != ENOENT)
+        CHECK_POSIX(errno);
+
+    // Cut `path` at the separator before its last component.
+    size_t i = n;
+    while (i > 0 && path[i - 1] != '/')
+        --i;
+    while (i > 1 && path[i - 1] == '/')
+        --i;
+    CHECK(i > 0 && path[i - 1] != '/' && path[i] == '/');
+    path[i] = '\0';
+    const int is_ok = directory_create_inner(path, i);
+    path[i] = '/';
+    CHECK(is_ok);
+    if (mkdir(path, 0777) < 0 && errno != EEXIST)
+        CHECK_POSIX(errno);
+    return 1;
+Error:
+    return 0;
+}
+
+int
+directory_create(const char* path)
+{
+    char* copy = 0;
+    CHECK(path);
+    size_t n = strlen(path);
+    while (n > 1 && path[n - 1] == '/')
+        --n;
+    CHECK(n > 0);
+    CHECK(copy = malloc(n + 1));
+    memcpy(copy, path, n); // NOLINT
+    copy[n] = '\0';
+    EXPECT(directory_create_inner(copy, n),
+           "Failed to create the directory \"%s\"",
+           copy);
+    free(copy);
+    return 1;
+Error:
+    free(copy);
+    return 0;
+}
+
+size_t
+file_get_handle_limit(void)
+{
+    struct rlimit limit = { 0 };
+    CHECK(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+    return (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > SIZE_MAX)
+             ? SIZE_MAX
+             : (size_t)limit.rlim_cur;
+Error:
+    return SIZE_MAX;
+}
+
+// Describes how a block returned by memory_alloc() was obtained, for
+// memory_free() and memory_query(). Every block is prefixed by its header.
+// Mapped blocks keep theirs at the end of a page of its own just below the
+// block, so a block that's a whole number of pages maps exactly that many
+// pages, and freeing any block doesn't need a lookup.
+struct memory_header
+{
+    /// Start of the underlying region.
+    void* base;
+    /// Bytes of the underlying region when it was mmap()'d, otherwise 0 when
+    /// the region was malloc()'d.
+    size_t bytes_of_region;
+    struct memory_info info;
+};
+
+// Bytes reserved for the header in front of every block.
+#define MEMORY_HEADER_BYTES (64)
+_Static_assert(sizeof(struct memory_header) <= MEMORY_HEADER_BYTES,
+               "The memory header must fit in front of the block");
+
+static size_t
+round_up(size_t n, size_t multiple)
+{
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+static struct memory_header*
+memory_header_of(const void* address)
+{
+    return (struct memory_header*)((uint8_t*)address - MEMORY_HEADER_BYTES);
+}
+
+// The number of bytes to reserve in front of a block so that it can start at
+// a multiple of `alignment` with room for its header. `base_alignment` is the
+// alignment of the start of the underlying region.
+static size_t
+bytes_of_prefix(size_t alignment, size_t base_alignment)
+{
+    return (alignment <= base_alignment)
+             ? round_up(MEMORY_HEADER_BYTES, alignment)
+             : MEMORY_HEADER_BYTES + alignment;
+}
+
+// Writes the header of a heap block in front of it.
+static void*
+memory_publish(void* base, size_t alignment, struct memory_info info)
+{
+    uint8_t* out =
+      (uint8_t*)round_up((uintptr_t)base + MEMORY_HEADER_BYTES, alignment);
+    *memory_header_of(out) = (struct memory_header){
+        .base = base,
+        .info = info,
+    };
+    return out;
+}
+
+// Maps `bytes` of anonymous memory starting at an address that is a multiple
+// of `alignment`, and one more page just below it for the block's header.
+// `bytes` and `alignment` must be multiples of the page size.
+static void*
+map_aligned(size_t bytes, size_t alignment)
+{
+    const size_t page = (size_t)getpagesize();
+    const size_t padded = page + bytes + alignment;
+    uint8_t* const p = mmap(0,
+                            padded,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANON,
+                            -1,
+                            0);
+    if (p == MAP_FAILED)
+        return 0;
+    uint8_t* const beg = (uint8_t*)round_up((uintptr_t)p + page, alignment);
+    uint8_t* const end = beg + bytes;
+    if (beg - page > p)
+        munmap(p, beg - page - p);
+    if (p + padded > end)
+        munmap(end, p + padded - end);
+    return beg;
+}
+
+// Unmaps a block from map_aligned(), along with its header page.
+static int
+unmap_aligned(void* beg, size_t bytes)
+{
+    const size_t page = (size_t)getpagesize();
+    return munmap((uint8_t*)beg - page, page + bytes);
+}
+
+static void*
+memory_alloc_default(size_t capacity, size_t alignment)
+{
+    void* base =
+      malloc(capacity + bytes_of_prefix(alignment, alignof(max_align_t)));
+    if (!base)
+        return 0;
+    return memory_publish(
+      base,
+      alignment,
+      (struct memory_info){ .page_kind = MemoryPageKind_Default,
+                            .bytes_of_page = (size_t)getpagesize() });
+}
+
+// Fills `h` for the mapped region, and returns the block in it.
+static void*
+memory_alloc_mapped(size_t capacity,
+                    size_t alignment,
+                    struct memory_header* h)
+{
+    const size_t page = (size_t)getpagesize();
+    const size_t n = round_up(capacity ? capacity : 1, page);
+    void* p = map_aligned(n, (alignment > page) ? alignment : page);
+    if (!p)
+        return 0;
+    *h = (struct memory_header){
+        .base = p,
+        .bytes_of_region = n,
+        .info = { .page_kind = MemoryPageKind_Default, .bytes_of_page = page },
+    };
+    return p;
+}
+
+// Writes to every page in the block's region so they're all faulted in.
+static void
+memory_prefault(struct memory_header* h)
+{
+    // The region is freshly mapped anonymous memory, so it's already zero.
+    const size_t step = (size_t)getpagesize();
+    volatile uint8_t* const beg = (volatile uint8_t*)h->base;
+    for (size_t i = 0; i < h->bytes_of_region; i += step)
+        beg[i] = 0;
+    h->info.is_prefaulted = 1;
+}
+
+// Pins the block's region in memory. Locking also faults in every page.
+static void
+memory_lock(struct memory_header* h)
+{
+    if (mlock(h->base, h->bytes_of_region) == 0) {
+        h->info.is_locked = 1;
+        h->info.is_prefaulted = 1;
+        return;
+    }
+    const int ecode = errno;
+    struct rlimit limit = { 0 };
+    getrlimit(RLIMIT_MEMLOCK, &limit);
+    LOGE("Allocated %llu bytes but could not lock them in memory: %s. "
+         "RLIMIT_MEMLOCK allows %llu bytes (see `ulimit -l`). The block will "
+         "be prefaulted, but it may be paged out.",
+         (unsigned long long)h->bytes_of_region,
+         strerror(ecode),
+         (unsigned long long)limit.rlim_cur);
+}
+
 void*
 memory_alloc(size_t capacity_bytes, enum AllocatorHint hint)
 {
-    return malloc(capacity_bytes);
+    return memory_alloc_aligned(capacity_bytes, alignof(max_align_t), hint);
+}
+
+void*
+memory_alloc_aligned(size_t capacity_bytes,
+                     size_t alignment,
+                     enum AllocatorHint hint)
+{
+    return memory_alloc_on_node(capacity_bytes, alignment, hint, -1);
+}
+
+int
+memory_node_count(void)
+{
+    return 1;
+}
+
+void*
+memory_alloc_on_node(size_t capacity_bytes,
+                     size_t alignment,
+                     enum AllocatorHint hint,
+                     int node)
+{
+    EXPECT(alignment && (alignment & (alignment - 1)) == 0,
+           "Alignment must be a power of two. Got %llu.",
+           (unsigned long long)alignment);
+    const int all = AllocatorHint_LargePage | AllocatorHint_Prefault |
+                    AllocatorHint_Locked | AllocatorHint_NodeLocal;
+    EXPECT((hint & ~all) == 0, "Unknown allocator hint: %d", (int)hint);
+    EXPECT(node >= -1 && node < memory_node_count(),
+           "Expected a NUMA node in [0, %d). Got %d.",
+           memory_node_count(),
+           node);
+    if (node < 0 && (hint & AllocatorHint_NodeLocal))
+        node = thread_current_node();
+
+    // Large pages aren't supported here, so AllocatorHint_LargePage falls
+    // back to regular pages.
+    // Pages have to be mapped here, not malloc()'d, for prefaulting and
+    // locking to cover exactly this block.
+    void* out = 0;
+    struct memory_header h = { 0 };
+    if (hint & (AllocatorHint_Prefault | AllocatorHint_Locked)) {
+        out = memory_alloc_mapped(capacity_bytes, alignment, &h);
+    } else {
+        out = memory_alloc_default(capacity_bytes, alignment);
+        // There's only one node, so every block is trivially placed on it.
+        if (out)
+            memory_header_of(out)->info.node = node;
+        return out;
+    }
+
+    if (out) {
+        h.info.node = node;
+        if (hint & AllocatorHint_Locked)
+            memory_lock(&h);
+        if (!h.info.is_prefaulted)
+            memory_prefault(&h);
+        *memory_header_of(out) = h;
+    }
+    return out;
+Error:
+    return 0;
 }
 
 void
 memory_free(void* address)
 {
-    free(address);
+    if (!address)
+        return;
+    const struct memory_header* const h = memory_header_of(address);
+    if (h->bytes_of_region) {
+        if (unmap_aligned(h->base, h->bytes_of_region) < 0)
+            CHECK_POSIX(errno);
+    } else {
+        free(h->base);
+    }
+Error:;
+}
+
+int
+memory_query(const void* address, struct memory_info* info)
+{
+    CHECK(address);
+    CHECK(info);
+    const struct memory_header* const h = memory_header_of(address);
+    *info = h->info;
+    info->bytes_of_mapping = h->bytes_of_region;
+    return 1;
+Error:
+    return 0;
+}
+
+void*
+memory_map_mirrored(size_t* capacity_bytes)
+{
+    static _Atomic int counter = 0;
+    int fd = -1;
+    uint8_t* base = MAP_FAILED;
+    size_t n = 0;
+    CHECK(capacity_bytes && *capacity_bytes);
+    n = round_up(*capacity_bytes, (size_t)getpagesize());
+
+    // There's no memfd_create() on macOS. Use a shared memory object instead,
+    // and unlink it right away so it goes away with the mappings.
+    char name[32] = { 0 };
+    snprintf(name,
+             sizeof(name),
+             "/acquire-%d-%d",
+             (int)getpid(),
+             atomic_fetch_add(&counter, 1));
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+        CHECK_POSIX(errno);
+    shm_unlink(name);
+    if (ftruncate(fd, (off_t)n) < 0)
+        CHECK_POSIX(errno);
+    // Reserve the address range first so nothing else can land in between
+    // the two views.
+    base = mmap(0, 2 * n, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (base == MAP_FAILED)
+        CHECK_POSIX(errno);
+    for (int i = 0; i < 2; ++i) {
+        if (mmap(base + i * n,
+                 n,
+                 PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED,
+                 fd,
+                 0) == MAP_FAILED)
+            CHECK_POSIX(errno);
+    }
+    // The mappings keep the memory alive.
+    close(fd);
+    *capacity_bytes = n;
+    return base;
+Error:
+    if (base != MAP_FAILED)
+        munmap(base, 2 * n);
+    if (fd >= 0)
+        close(fd);
+    return 0;
+}
+
+void
+memory_unmap_mirrored(void* address, size_t capacity_bytes)
+{
+    if (address && munmap(address, 2 * capacity_bytes) < 0)
+        CHECK_POSIX(errno);
+Error:;
+}
+
+int
+clock_enable_tsc(void)
+{
+    return 0;
+}
+
+uint64_t
+clock_now_ns(void)
+{
+    return clock_gettime_nsec_np(CLOCK_MONOTONIC_RAW);
+}
+
+void
+clock_sleep_until_ns(uint64_t deadline_ns)
+{
+    uint64_t now = 0;
+    // There's no absolute sleep, so this sleeps for what's left until the
+    // deadline has passed.
+    while ((now = clock_now_ns()) < deadline_ns) {
+        const uint64_t dt = deadline_ns - now;
+        const struct timespec t = { .tv_sec = (time_t)(dt / 1000000000ULL),
+                                    .tv_nsec = (long)(dt % 1000000000ULL) };
+        nanosleep(&t, 0);
+    }
 }
 
 void
@@ -213,18 +950,9 @@ clock_sleep_ms(struct clock* clock, float delay_ms)
         clock = &dummy;
     }
 
-    const float remaining_ms = delay_ms - (float)clock_toc_ms(clock);
-    if (remaining_ms > 1.0f) {
-        const int seconds = (int)(1e-3 * remaining_ms);
-        const int nsec = (int)(1e6f * (remaining_ms - 1e3f * (float)seconds));
-        const struct timespec t = { .tv_sec = seconds, .tv_nsec = nsec };
-        TRACE("\nsleep delay: %g ms - remaining: %g ms - %d %d",
-              (double)delay_ms,
-              (double)remaining_ms,
-              seconds,
-              nsec);
-
-        nanosleep(&t, 0);
+    const int64_t delay_ns = (int64_t)(1e6 * (double)delay_ms);
+    if (clock_toc(clock) < delay_ns) {
+        clock_sleep_until_ns(clock->origin + (uint64_t)delay_ns);
         clock_tic(clock);
     }
 }
@@ -279,6 +1007,31 @@ condition_variable_wait(struct condition_variable* restrict self,
 Error:;
 }
 
+static struct timespec
+timespec_of_ns(uint64_t ns)
+{
+    return (struct timespec){ .tv_sec = (time_t)(ns / 1000000000ULL),
+                              .tv_nsec = (long)(ns % 1000000000ULL) };
+}
+
+// macOS has no pthread_condattr_setclock(), but its relative timed wait
+// isn't affected by changes to the wall clock.
+int
+condition_variable_wait_for(struct condition_variable* restrict self,
+                            struct lock* restrict lock,
+                            uint64_t timeout_ns)
+{
+    const struct timespec t = timespec_of_ns(timeout_ns);
+    const int ecode =
+      pthread_cond_timedwait_relative_np(&self->inner_, &lock->inner_, &t);
+    if (ecode == ETIMEDOUT)
+        return 0;
+    CHECK_POSIX(ecode);
+    return 1;
+Error:
+    return 0;
+}
+
 void
 condition_variable_notify_all(struct condition_variable* self)
 {
@@ -324,6 +1077,100 @@ event_wait(struct event* self)
 Error:;
 }
 
+int
+event_wait_for(struct event* self, uint64_t timeout_ns)
+{
+    const uint64_t deadline = clock_now_ns() + timeout_ns;
+    int is_set = 0;
+    CHECK_POSIX(pthread_mutex_lock(&self->lock_));
+    uint64_t now = 0;
+    while (!self->state_ && (now = clock_now_ns()) < deadline) {
+        const struct timespec t = timespec_of_ns(deadline - now);
+        const int ecode =
+          pthread_cond_timedwait_relative_np(&self->cond_, &self->lock_, &t);
+        if (ecode != ETIMEDOUT)
+            CHECK_POSIX(ecode);
+    }
+    is_set = self->state_;
+    self->state_ = 0; // reset
+    CHECK_POSIX(pthread_mutex_unlock(&self->lock_));
+Error:
+    return is_set;
+}
+
+// macOS has no public futex, so waiters park on one of a fixed set of
+// mutex/condition variable pairs chosen by hashing the address. Addresses
+// that share a bucket share the condition variable, so wakes always
+// broadcast.
+#define PARKING_BUCKET_COUNT (64)
+
+static struct parking_bucket
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} parking_lot[PARKING_BUCKET_COUNT];
+static pthread_once_t parking_lot_once = PTHREAD_ONCE_INIT;
+
+static void
+parking_lot_init(void)
+{
+    for (int i = 0; i < PARKING_BUCKET_COUNT; ++i) {
+        pthread_mutex_init(&parking_lot[i].lock, 0);
+        pthread_cond_init(&parking_lot[i].cond, 0);
+    }
+}
+
+static struct parking_bucket*
+parking_bucket_of(volatile uint32_t* address)
+{
+    pthread_once(&parking_lot_once, parking_lot_init);
+    const uintptr_t a = (uintptr_t)address;
+    return parking_lot + ((a >> 2) ^ (a >> 8)) % PARKING_BUCKET_COUNT;
+}
+
+int
+address_wait(volatile uint32_t* address, uint32_t expected, uint64_t timeout_ns)
+{
+    int is_timeout = 0;
+    struct parking_bucket* bucket = parking_bucket_of(address);
+    CHECK_POSIX(pthread_mutex_lock(&bucket->lock));
+    // Wakers take the bucket lock, so a wake can't slip in between this
+    // check and the wait.
+    if (*address == expected) {
+        if (timeout_ns == UINT64_MAX) {
+            CHECK_POSIX(pthread_cond_wait(&bucket->cond, &bucket->lock));
+        } else {
+            const struct timespec timeout = {
+                .tv_sec = (time_t)(timeout_ns / 1000000000ULL),
+                .tv_nsec = (long)(timeout_ns % 1000000000ULL),
+            };
+            is_timeout = (ETIMEDOUT == pthread_cond_timedwait_relative_np(
+                                         &bucket->cond,
+                                         &bucket->lock,
+                                         &timeout));
+        }
+    }
+    CHECK_POSIX(pthread_mutex_unlock(&bucket->lock));
+Error:
+    return !is_timeout;
+}
+
+void
+address_wake_one(volatile uint32_t* address)
+{
+    address_wake_all(address);
+}
+
+void
+address_wake_all(volatile uint32_t* address)
+{
+    struct parking_bucket* bucket = parking_bucket_of(address);
+    CHECK_POSIX(pthread_mutex_lock(&bucket->lock));
+    CHECK_POSIX(pthread_cond_broadcast(&bucket->cond));
+    CHECK_POSIX(pthread_mutex_unlock(&bucket->lock));
+Error:;
+}
+
 void
 thread_init(struct thread* self)
 {
@@ -350,6 +1197,25 @@ thread_join(struct thread* self)
 Error:;
 }
 
+int
+thread_bind_to_node(struct thread* self, int node)
+{
+    // There's only one node, so every thread already runs on it.
+    EXPECT(node >= 0 && node < memory_node_count(),
+           "Expected a NUMA node in [0, %d). Got %d.",
+           memory_node_count(),
+           node);
+    return 1;
+Error:
+    return 0;
+}
+
+int
+thread_current_node(void)
+{
+    return 0;
+}
+
 int
 lib_open(struct lib* self, const char* absolute_path)
 {
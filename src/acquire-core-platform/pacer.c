@@ -0,0 +1,141 @@
+#include "pacer.h"
+#include "logger.h"
+
+#include <math.h>
+
+#define LOG(...) aq_logger(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOGE(...) aq_logger(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            LOGE(__VA_ARGS__);                                                 \
+            goto Error;                                                        \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false:\n\t%s", #e)
+
+// Covers how late Linux wakes a thread with the default timer slack of 50 us,
+// with room to spare.
+#define PACER_DEFAULT_SPIN_NS (200000ULL)
+
+void
+pacer_init(struct pacer* self, uint64_t period_ns, uint64_t spin_ns)
+{
+    *self = (struct pacer){
+        .period_ns = period_ns,
+        .spin_ns = spin_ns ? spin_ns : PACER_DEFAULT_SPIN_NS,
+        .start_ns = clock_now_ns(),
+        .index = 1,
+        .min_period_ns = UINT64_MAX,
+    };
+}
+
+static void
+record(struct pacer* self, uint64_t now, uint64_t deadline)
+{
+    const uint64_t lateness = now - deadline;
+    if (lateness > self->max_lateness_ns)
+        self->max_lateness_ns = lateness;
+    if (self->last_ns) {
+        const uint64_t period = now - self->last_ns;
+        if (period < self->min_period_ns)
+            self->min_period_ns = period;
+        if (period > self->max_period_ns)
+            self->max_period_ns = period;
+        // The first tick has no period, so periods are one fewer than ticks.
+        const double n = (double)self->ticks;
+        const double delta = (double)period - self->mean_period_ns;
+        self->mean_period_ns += delta / n;
+        self->m2_period_ns += delta * ((double)period - self->mean_period_ns);
+    }
+    self->last_ns = now;
+    ++self->ticks;
+}
+
+int
+pacer_wait(struct pacer* self)
+{
+    int is_on_time = 1;
+    uint64_t deadline = self->start_ns + self->index * self->period_ns;
+    uint64_t now = clock_now_ns();
+
+    if (now >= deadline + self->period_ns) {
+        const uint64_t n = (now - deadline) / self->period_ns;
+        self->missed += n;
+        self->index += n;
+        deadline += n * self->period_ns;
+        is_on_time = 0;
+    }
+    if (now < deadline) {
+        if (deadline - now > self->spin_ns)
+            clock_sleep_until_ns(deadline - self->spin_ns);
+        while ((now = clock_now_ns()) < deadline)
+            ;
+    }
+    ++self->index;
+    record(self, now, deadline);
+    return is_on_time;
+}
+
+void
+pacer_get_stats(const struct pacer* self, struct pacer_stats* stats)
+{
+    const int has_periods = self->ticks > 1;
+    *stats = (struct pacer_stats){
+        .ticks = self->ticks,
+        .missed = self->missed,
+        .min_period_ns = has_periods ? self->min_period_ns : 0,
+        .max_period_ns = self->max_period_ns,
+        .mean_period_ns = self->mean_period_ns,
+        .stddev_period_ns =
+          has_periods ? sqrt(self->m2_period_ns / (double)(self->ticks - 1))
+                      : 0.0,
+        .max_lateness_ns = self->max_lateness_ns,
+    };
+}
+
+//
+//  UNIT TESTS
+//
+
+#ifndef NO_UNIT_TESTS
+
+int
+unit_test__pacer_never_returns_early_and_skips_missed_ticks()
+{
+    const uint64_t period_ns = 1000000;
+    struct pacer pacer;
+    struct pacer_stats stats;
+    pacer_init(&pacer, period_ns, 0);
+
+    for (uint64_t i = 1; i <= 10; ++i) {
+        pacer_wait(&pacer);
+        const uint64_t now = clock_now_ns();
+        EXPECT(now >= pacer.start_ns + i * period_ns,
+               "Tick %llu returned %llu ns early.",
+               (unsigned long long)i,
+               (unsigned long long)(pacer.start_ns + i * period_ns - now));
+    }
+    pacer_get_stats(&pacer, &stats);
+    CHECK(stats.ticks == 10);
+    CHECK(stats.min_period_ns > 0);
+    CHECK(stats.min_period_ns <= stats.max_period_ns);
+
+    // Falling 4.5 periods behind skips at least 3 ticks, then keeps the
+    // original phase.
+    const uint64_t missed = stats.missed;
+    const uint64_t late = clock_now_ns() + 9 * period_ns / 2;
+    while (clock_now_ns() < late)
+        ;
+    CHECK(pacer_wait(&pacer) == 0);
+    pacer_get_stats(&pacer, &stats);
+    CHECK(stats.missed >= missed + 3);
+    CHECK(stats.ticks == 11);
+    pacer_wait(&pacer);
+    CHECK(clock_now_ns() >= pacer.start_ns + (pacer.index - 1) * period_ns);
+    return 1;
+Error:
+    return 0;
+}
+
+#endif // NO_UNIT_TESTS
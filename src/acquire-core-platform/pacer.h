@@ -0,0 +1,81 @@
+#ifndef H_ACQUIRE_PLATFORM_PACER_V0
+#define H_ACQUIRE_PLATFORM_PACER_V0
+
+#include "platform.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// Runs a loop at a fixed rate, for example to call
+    /// `camera_execute_trigger()` at 1 kHz.
+    ///
+    /// Tick `k` is due at `start + k * period`, so late ticks don't push the
+    /// ones after them back. `pacer_wait()` sleeps until shortly before the
+    /// tick with `clock_sleep_until_ns()`, then spins for the rest, so it
+    /// returns within a few microseconds of the deadline instead of whenever
+    /// the OS gets around to waking the thread. Spinning keeps a core busy
+    /// for `spin_ns` of each period.
+    ///
+    /// When a tick is already overdue by a whole period, the ticks that were
+    /// missed are counted and skipped, instead of being run back to back.
+    ///
+    /// Only one thread at a time may use a pacer.
+    struct pacer
+    {
+        uint64_t period_ns;
+        uint64_t spin_ns;
+        uint64_t start_ns;
+        // The next tick.
+        uint64_t index;
+        // When the last tick returned, or 0 before the first.
+        uint64_t last_ns;
+
+        uint64_t ticks;
+        uint64_t missed;
+        uint64_t min_period_ns;
+        uint64_t max_period_ns;
+        uint64_t max_lateness_ns;
+        // Welford's running mean of the periods between ticks, and sum of
+        // squared differences from it.
+        double mean_period_ns;
+        double m2_period_ns;
+    };
+
+    struct pacer_stats
+    {
+        /// Ticks `pacer_wait()` returned for.
+        uint64_t ticks;
+        /// Ticks that were skipped because they were already overdue.
+        uint64_t missed;
+        /// Time between consecutive returns from `pacer_wait()`.
+        uint64_t min_period_ns;
+        uint64_t max_period_ns;
+        double mean_period_ns;
+        double stddev_period_ns;
+        /// The latest `pacer_wait()` returned after its deadline.
+        uint64_t max_lateness_ns;
+    };
+
+    /// @brief Start ticking every `period_ns`. The first tick is due one
+    ///        period from now.
+    /// @param spin_ns How long before each tick to stop sleeping and start
+    ///                spinning. Should cover how late the OS wakes threads.
+    ///                0 picks 200 us.
+    void pacer_init(struct pacer* self, uint64_t period_ns, uint64_t spin_ns);
+
+    /// @brief Wait for the next tick, or return right away when it's
+    ///        overdue.
+    /// @return 0 when ticks were skipped because this was called too late,
+    ///         otherwise 1
+    int pacer_wait(struct pacer* self);
+
+    /// @brief Summarize the ticks so far into `stats`.
+    void pacer_get_stats(const struct pacer* self, struct pacer_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H_ACQUIRE_PLATFORM_PACER_V0
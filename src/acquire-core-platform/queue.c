@@ -0,0 +1,315 @@
+#include "queue.h"
+#include "platform.h"
+#include "logger.h"
+
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#define LOG(...) aq_logger(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOGE(...) aq_logger(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            LOGE(__VA_ARGS__);                                                 \
+            goto Error;                                                        \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false:\n\t%s", #e)
+
+// Times to retry a failed push or pop before going to sleep.
+#define SPIN_COUNT (64)
+
+// A cell is ready to be pushed into when `sequence` equals the push position,
+// and ready to be popped when it equals the pop position + 1.
+// See Dmitry Vyukov's bounded MPMC queue.
+struct cell
+{
+    _Atomic size_t sequence;
+    void* item;
+};
+
+// Threads sleeping until the queue changes. When `count` says someone might
+// be asleep, a change bumps `generation` and wakes the sleepers.
+// `is_pending` is set by that wake and cleared once a waiter runs again, so a
+// burst of changes before anyone wakes up only costs one system call.
+struct waiters
+{
+    alignas(64) _Atomic uint32_t generation;
+    _Atomic uint32_t count;
+    _Atomic uint32_t is_pending;
+};
+
+struct queue_impl
+{
+    struct cell* cells;
+    size_t mask;
+
+    alignas(64) _Atomic size_t push_position;
+    alignas(64) _Atomic size_t pop_position;
+
+    struct waiters not_full;  // producers waiting for room
+    struct waiters not_empty; // consumers waiting for items
+};
+
+static void
+notify(struct waiters* waiters)
+{
+    // Pairs with the fence in keep_trying(). Either the waiter sees the change
+    // that was just made, or this sees the waiter.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&waiters->count, memory_order_relaxed) &&
+        !atomic_exchange(&waiters->is_pending, 1)) {
+        atomic_fetch_add(&waiters->generation, 1);
+        address_wake_all((volatile uint32_t*)&waiters->generation);
+    }
+}
+
+// Repeats `op` until it succeeds, sleeping on `waiters` between attempts.
+// Returns 0 if it didn't succeed within `timeout_ns`. `UINT64_MAX` waits
+// without a timeout.
+static int
+keep_trying(struct queue* self,
+            struct waiters* waiters,
+            int (*op)(struct queue*, void**),
+            void** item,
+            uint64_t timeout_ns)
+{
+    for (int i = 0; i < SPIN_COUNT; ++i)
+        if (op(self, item))
+            return 1;
+
+    struct clock clock;
+    clock_init(&clock);
+    int is_done = 0;
+    while (!is_done) {
+        const uint32_t generation = atomic_load(&waiters->generation);
+        // Clear this only after reading `generation`. A wake that's skipped
+        // because it's still set must have bumped `generation` after that
+        // read, so the wait below returns right away.
+        atomic_store(&waiters->is_pending, 0);
+        atomic_fetch_add_explicit(&waiters->count, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (op(self, item)) {
+            atomic_fetch_sub_explicit(&waiters->count, 1, memory_order_relaxed);
+            return 1;
+        }
+        uint64_t remaining_ns = UINT64_MAX;
+        if (timeout_ns != UINT64_MAX) {
+            const uint64_t elapsed_ns = (uint64_t)(1e6 * clock_toc_ms(&clock));
+            is_done = (elapsed_ns >= timeout_ns);
+            remaining_ns = timeout_ns - elapsed_ns;
+        }
+        if (!is_done) {
+            address_wait((volatile uint32_t*)&waiters->generation,
+                         generation,
+                         remaining_ns);
+        }
+        atomic_fetch_sub_explicit(&waiters->count, 1, memory_order_relaxed);
+    }
+    // The deadline passed. Give it one last try.
+    return op(self, item);
+}
+
+static int
+try_push(struct queue* self, void** item)
+{
+    struct queue_impl* q = (struct queue_impl*)self->impl;
+    size_t position =
+      atomic_load_explicit(&q->push_position, memory_order_relaxed);
+    for (;;) {
+        struct cell* cell = q->cells + (position & q->mask);
+        const size_t sequence =
+          atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        const intptr_t d = (intptr_t)sequence - (intptr_t)position;
+        if (d == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->push_position,
+                                                      &position,
+                                                      position + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                cell->item = *item;
+                atomic_store_explicit(
+                  &cell->sequence, position + 1, memory_order_release);
+                return 1;
+            }
+        } else if (d < 0) {
+            return 0; // full
+        } else {
+            position =
+              atomic_load_explicit(&q->push_position, memory_order_relaxed);
+        }
+    }
+}
+
+static int
+try_pop(struct queue* self, void** item)
+{
+    struct queue_impl* q = (struct queue_impl*)self->impl;
+    size_t position =
+      atomic_load_explicit(&q->pop_position, memory_order_relaxed);
+    for (;;) {
+        struct cell* cell = q->cells + (position & q->mask);
+        const size_t sequence =
+          atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        const intptr_t d = (intptr_t)sequence - (intptr_t)(position + 1);
+        if (d == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->pop_position,
+                                                      &position,
+                                                      position + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                *item = cell->item;
+                atomic_store_explicit(&cell->sequence,
+                                      position + q->mask + 1,
+                                      memory_order_release);
+                return 1;
+            }
+        } else if (d < 0) {
+            return 0; // empty
+        } else {
+            position =
+              atomic_load_explicit(&q->pop_position, memory_order_relaxed);
+        }
+    }
+}
+
+int
+queue_init(struct queue* self, size_t capacity)
+{
+    struct queue_impl* q = 0;
+    CHECK(self);
+    self->impl = 0;
+    EXPECT(capacity > 0 && capacity <= (SIZE_MAX >> 2),
+           "Invalid queue capacity: %llu",
+           (unsigned long long)capacity);
+    size_t n = 1;
+    while (n < capacity)
+        n <<= 1;
+
+    CHECK(q = memory_alloc_aligned(
+            sizeof(*q), alignof(struct queue_impl), AllocatorHint_Default));
+    *q = (struct queue_impl){ .mask = n - 1 };
+    CHECK(q->cells = memory_alloc_aligned(
+            n * sizeof(struct cell), 64, AllocatorHint_Default));
+    for (size_t i = 0; i < n; ++i) {
+        atomic_init(&q->cells[i].sequence, i);
+        q->cells[i].item = 0;
+    }
+    atomic_init(&q->push_position, 0);
+    atomic_init(&q->pop_position, 0);
+    atomic_init(&q->not_full.generation, 0);
+    atomic_init(&q->not_full.count, 0);
+    atomic_init(&q->not_full.is_pending, 0);
+    atomic_init(&q->not_empty.generation, 0);
+    atomic_init(&q->not_empty.count, 0);
+    atomic_init(&q->not_empty.is_pending, 0);
+    self->impl = q;
+    return 1;
+Error:
+    memory_free(q);
+    return 0;
+}
+
+void
+queue_destroy(struct queue* self)
+{
+    if (self && self->impl) {
+        struct queue_impl* q = (struct queue_impl*)self->impl;
+        memory_free(q->cells);
+        memory_free(q);
+        self->impl = 0;
+    }
+}
+
+size_t
+queue_capacity(const struct queue* self)
+{
+    CHECK(self && self->impl);
+    return ((const struct queue_impl*)self->impl)->mask + 1;
+Error:
+    return 0;
+}
+
+int
+queue_try_push(struct queue* self, void* item)
+{
+    if (!try_push(self, &item))
+        return 0;
+    notify(&((struct queue_impl*)self->impl)->not_empty);
+    return 1;
+}
+
+int
+queue_try_pop(struct queue* self, void** item)
+{
+    if (!try_pop(self, item))
+        return 0;
+    notify(&((struct queue_impl*)self->impl)->not_full);
+    return 1;
+}
+
+void
+queue_push(struct queue* self, void* item)
+{
+    queue_push_timed(self, item, UINT64_MAX);
+}
+
+void*
+queue_pop(struct queue* self)
+{
+    void* item = 0;
+    queue_pop_timed(self, &item, UINT64_MAX);
+    return item;
+}
+
+int
+queue_push_timed(struct queue* self, void* item, uint64_t timeout_ns)
+{
+    struct queue_impl* q = (struct queue_impl*)self->impl;
+    if (!keep_trying(self, &q->not_full, try_push, &item, timeout_ns))
+        return 0;
+    notify(&q->not_empty);
+    return 1;
+}
+
+int
+queue_pop_timed(struct queue* self, void** item, uint64_t timeout_ns)
+{
+    struct queue_impl* q = (struct queue_impl*)self->impl;
+    if (!keep_trying(self, &q->not_empty, try_pop, item, timeout_ns))
+        return 0;
+    notify(&q->not_full);
+    return 1;
+}
+
+//
+//  UNIT TESTS
+//
+
+#ifndef NO_UNIT_TESTS
+
+int
+unit_test__queue_is_fifo_and_bounded()
+{
+    struct queue q = { 0 };
+    void* item = 0;
+    CHECK(queue_init(&q, 5));
+    CHECK(queue_capacity(&q) == 8);
+    CHECK(!queue_try_pop(&q, &item));
+    for (uintptr_t i = 1; i <= 8; ++i)
+        CHECK(queue_try_push(&q, (void*)i));
+    CHECK(!queue_try_push(&q, (void*)9));
+    CHECK(!queue_push_timed(&q, (void*)9, 1000000));
+    for (uintptr_t i = 1; i <= 8; ++i) {
+        CHECK(queue_try_pop(&q, &item));
+        CHECK(item == (void*)i);
+    }
+    CHECK(!queue_pop_timed(&q, &item, 1000000));
+    queue_destroy(&q);
+    return 1;
+Error:
+    queue_destroy(&q);
+    return 0;
+}
+
+#endif // NO_UNIT_TESTS
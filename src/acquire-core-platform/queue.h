@@ -0,0 +1,59 @@
+#ifndef H_ACQUIRE_PLATFORM_QUEUE_V0
+#define H_ACQUIRE_PLATFORM_QUEUE_V0
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// A bounded multi-producer, multi-consumer queue of pointers.
+    ///
+    /// Items are handles, for example `VideoFrame*`s from a `FramePool`, so
+    /// the queue never copies or owns the data they refer to. Any number of
+    /// threads may push and pop concurrently. Pushing and popping don't take
+    /// locks. Threads only sleep (see `address_wait()`) in the blocking and
+    /// timed variants, when the queue is full or empty.
+    struct queue
+    {
+        void* impl;
+    };
+
+    /// @brief Create a queue that holds at least `capacity` items.
+    /// @returns 1 on success, otherwise 0
+    int queue_init(struct queue* self, size_t capacity);
+
+    void queue_destroy(struct queue* self);
+
+    /// @returns The number of items the queue holds. This is `capacity`
+    ///          rounded up to a power of two.
+    size_t queue_capacity(const struct queue* self);
+
+    /// @returns 1 when `item` was pushed, or 0 when the queue is full.
+    int queue_try_push(struct queue* self, void* item);
+
+    /// @returns 1 when an item was popped into `*item`, or 0 when the queue
+    ///          is empty.
+    int queue_try_pop(struct queue* self, void** item);
+
+    /// @brief Push `item`, waiting for room when the queue is full.
+    void queue_push(struct queue* self, void* item);
+
+    /// @brief Pop an item, waiting for one when the queue is empty.
+    void* queue_pop(struct queue* self);
+
+    /// @brief Like `queue_push()`, but give up after `timeout_ns`.
+    /// @returns 1 when `item` was pushed, or 0 on timeout.
+    int queue_push_timed(struct queue* self, void* item, uint64_t timeout_ns);
+
+    /// @brief Like `queue_pop()`, but give up after `timeout_ns`.
+    /// @returns 1 when an item was popped into `*item`, or 0 on timeout.
+    int queue_pop_timed(struct queue* self, void** item, uint64_t timeout_ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H_ACQUIRE_PLATFORM_QUEUE_V0
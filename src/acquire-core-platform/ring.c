@@ -0,0 +1,263 @@
+#include "ring.h"
+#include "platform.h"
+#include "logger.h"
+
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#define LOG(...) aq_logger(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOGE(...) aq_logger(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            LOGE(__VA_ARGS__);                                                 \
+            goto Error;                                                        \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false:\n\t%s", #e)
+
+struct ring_impl
+{
+    uint8_t* base;
+    size_t capacity;
+
+    // Producer side.
+    // `head` counts every byte ever committed. Only the producer writes it.
+    alignas(64) _Atomic uint64_t head;
+    // The last value of `tail` the producer saw. Saves touching the
+    // consumer's cache line on every reservation.
+    uint64_t cached_tail;
+    size_t reserved;
+
+    // Consumer side.
+    // `tail` counts every byte ever released. Only the consumer writes it.
+    alignas(64) _Atomic uint64_t tail;
+    uint64_t cached_head;
+};
+
+int
+ring_init(struct ring* self, size_t capacity_bytes)
+{
+    struct ring_impl* ring = 0;
+    CHECK(self);
+    self->impl = 0;
+    CHECK(capacity_bytes);
+    CHECK(ring = memory_alloc_aligned(
+            sizeof(*ring), alignof(struct ring_impl), AllocatorHint_Default));
+    *ring = (struct ring_impl){ .capacity = capacity_bytes };
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    EXPECT(ring->base = memory_map_mirrored(&ring->capacity),
+           "Failed to map a ring of %llu bytes.",
+           (unsigned long long)capacity_bytes);
+    self->impl = ring;
+    return 1;
+Error:
+    memory_free(ring);
+    return 0;
+}
+
+void
+ring_destroy(struct ring* self)
+{
+    if (self && self->impl) {
+        struct ring_impl* ring = (struct ring_impl*)self->impl;
+        memory_unmap_mirrored(ring->base, ring->capacity);
+        memory_free(ring);
+        self->impl = 0;
+    }
+}
+
+size_t
+ring_capacity(const struct ring* self)
+{
+    CHECK(self && self->impl);
+    return ((const struct ring_impl*)self->impl)->capacity;
+Error:
+    return 0;
+}
+
+void*
+ring_reserve(struct ring* self, size_t nbytes)
+{
+    struct ring_impl* ring = (struct ring_impl*)self->impl;
+    const uint64_t head =
+      atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head + nbytes - ring->cached_tail > ring->capacity) {
+        ring->cached_tail =
+          atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head + nbytes - ring->cached_tail > ring->capacity)
+            return 0;
+    }
+    ring->reserved = nbytes;
+    return ring->base + head % ring->capacity;
+}
+
+void
+ring_commit(struct ring* self, size_t nbytes)
+{
+    struct ring_impl* ring = (struct ring_impl*)self->impl;
+    EXPECT(nbytes <= ring->reserved,
+           "Can't commit %llu bytes. Only %llu bytes were reserved.",
+           (unsigned long long)nbytes,
+           (unsigned long long)ring->reserved);
+    ring->reserved = 0;
+    atomic_fetch_add_explicit(&ring->head, nbytes, memory_order_release);
+Error:;
+}
+
+const void*
+ring_peek(struct ring* self, size_t* nbytes)
+{
+    struct ring_impl* ring = (struct ring_impl*)self->impl;
+    const uint64_t tail =
+      atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    *nbytes = (size_t)(ring->cached_head - tail);
+    return ring->base + tail % ring->capacity;
+}
+
+void
+ring_release(struct ring* self, size_t nbytes)
+{
+    struct ring_impl* ring = (struct ring_impl*)self->impl;
+    const uint64_t tail =
+      atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    EXPECT(nbytes <= ring->cached_head - tail,
+           "Can't release %llu bytes. Only %llu bytes were peeked.",
+           (unsigned long long)nbytes,
+           (unsigned long long)(ring->cached_head - tail));
+    atomic_store_explicit(&ring->tail, tail + nbytes, memory_order_release);
+Error:;
+}
+
+//
+//  UNIT TESTS
+//
+
+#ifndef NO_UNIT_TESTS
+
+#include <string.h>
+
+int
+unit_test__ring_reservations_wrap_contiguously()
+{
+    struct ring ring = { 0 };
+    CHECK(ring_init(&ring, 1000));
+    const size_t capacity = ring_capacity(&ring);
+    CHECK(capacity >= 1000);
+
+    // Move the head close to the end of the first mapping.
+    uint8_t* p = 0;
+    size_t n = 0;
+    CHECK(p = ring_reserve(&ring, capacity - 8));
+    ring_commit(&ring, capacity - 8);
+    CHECK(ring_reserve(&ring, 9) == 0);
+    CHECK(ring_peek(&ring, &n) == p && n == capacity - 8);
+    ring_release(&ring, n);
+    CHECK(ring_peek(&ring, &n) && n == 0);
+
+    // This reservation straddles the end of the ring.
+    uint8_t* q = 0;
+    CHECK(q = ring_reserve(&ring, 16));
+    CHECK(q == p + capacity - 8);
+    for (int i = 0; i < 16; ++i)
+        q[i] = (uint8_t)i;
+    ring_commit(&ring, 16);
+    // The last 8 bytes wrapped around to the start.
+    CHECK(p[0] == 8 && p[7] == 15);
+    const uint8_t* r = 0;
+    CHECK(r = ring_peek(&ring, &n));
+    CHECK(n == 16);
+    CHECK(memcmp(q, r, 16) == 0);
+    ring_release(&ring, 16);
+
+    ring_destroy(&ring);
+    return 1;
+Error:
+    ring_destroy(&ring);
+    return 0;
+}
+
+// Records are a size followed by a sequence number and then filler that
+// depends on the sequence number.
+struct ring_test_record
+{
+    uint32_t nbytes;
+    uint32_t sequence;
+    uint8_t data[];
+};
+
+#define RING_TEST_RECORD_COUNT (10000)
+
+struct ring_test_args
+{
+    struct ring ring;
+    _Atomic int is_done;
+};
+
+static void
+ring_test_producer(void* args_)
+{
+    struct ring_test_args* args = (struct ring_test_args*)args_;
+    struct ring* ring = &args->ring;
+    for (uint32_t i = 0; i < RING_TEST_RECORD_COUNT; ++i) {
+        // Keep records 8-byte aligned, like `VideoFrame`s.
+        const uint32_t nbytes =
+          (uint32_t)(sizeof(struct ring_test_record) + (i * 7919) % 1000 * 8);
+        struct ring_test_record* rec = 0;
+        while (!(rec = ring_reserve(ring, nbytes)))
+            ;
+        rec->nbytes = nbytes;
+        rec->sequence = i;
+        memset(rec->data, (int)(i & 0xff), nbytes - sizeof(*rec));
+        ring_commit(ring, nbytes);
+    }
+    atomic_store(&args->is_done, 1);
+}
+
+int
+unit_test__ring_passes_variable_sized_records_between_threads()
+{
+    struct ring_test_args args = { 0 };
+    struct ring* ring = &args.ring;
+    struct thread thread;
+    thread_init(&thread);
+    CHECK(ring_init(ring, 1 << 20));
+    CHECK(thread_create(&thread, ring_test_producer, &args));
+
+    uint32_t expected = 0;
+    while (expected < RING_TEST_RECORD_COUNT) {
+        size_t n = 0;
+        const uint8_t* beg = ring_peek(ring, &n);
+        const uint8_t* const end = beg + n;
+        // Records are consumed in whole packets, and never split by the end
+        // of the ring.
+        while (beg + sizeof(struct ring_test_record) <= end) {
+            const struct ring_test_record* rec =
+              (const struct ring_test_record*)beg;
+            CHECK(beg + rec->nbytes <= end);
+            CHECK(rec->sequence == expected);
+            for (size_t i = 0; i < rec->nbytes - sizeof(*rec); ++i)
+                CHECK(rec->data[i] == (expected & 0xff));
+            beg += rec->nbytes;
+            ++expected;
+        }
+        ring_release(ring, n);
+    }
+    thread_join(&thread);
+    ring_destroy(ring);
+    return 1;
+Error:
+    // Drain the ring so the producer can finish.
+    while (ring->impl && !atomic_load(&args.is_done)) {
+        size_t n = 0;
+        ring_peek(ring, &n);
+        ring_release(ring, n);
+    }
+    thread_join(&thread);
+    ring_destroy(ring);
+    return 0;
+}
+
+#endif // NO_UNIT_TESTS
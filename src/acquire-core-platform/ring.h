@@ -0,0 +1,64 @@
+#ifndef H_ACQUIRE_PLATFORM_RING_V0
+#define H_ACQUIRE_PLATFORM_RING_V0
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// A single-producer, single-consumer byte ring.
+    ///
+    /// The ring's memory is mapped twice, back to back (see
+    /// `memory_map_mirrored()`), so every reserved or readable run of bytes
+    /// is contiguous, even when it wraps around. Variable-sized records, like
+    /// `VideoFrame`s, can be written in place and read back as one packet
+    /// without copying.
+    ///
+    /// One thread may call `ring_reserve()` and `ring_commit()` while another
+    /// calls `ring_peek()` and `ring_release()`. Neither side takes a lock.
+    struct ring
+    {
+        void* impl;
+    };
+
+    /// @brief Create a ring that holds at least `capacity_bytes`.
+    /// @returns 1 on success, otherwise 0
+    int ring_init(struct ring* self, size_t capacity_bytes);
+
+    void ring_destroy(struct ring* self);
+
+    /// @returns The number of bytes the ring holds. This may be more than was
+    ///          requested by `ring_init()`.
+    size_t ring_capacity(const struct ring* self);
+
+    /// @brief Producer: get room for `nbytes` contiguous bytes.
+    /// @details The bytes aren't visible to the consumer until they're
+    ///          committed with `ring_commit()`. Reserving again before
+    ///          committing returns the same location.
+    /// @returns A pointer to `nbytes` writable bytes, or NULL when the ring
+    ///          doesn't have that much free space right now.
+    void* ring_reserve(struct ring* self, size_t nbytes);
+
+    /// @brief Producer: publish the first `nbytes` of the last reservation.
+    /// @details `nbytes` may be less than was reserved.
+    void ring_commit(struct ring* self, size_t nbytes);
+
+    /// @brief Consumer: get everything that's been committed but not
+    ///        released.
+    /// @param[out] nbytes The number of readable bytes. 0 when the ring is
+    ///                    empty.
+    /// @returns A pointer to `*nbytes` contiguous readable bytes.
+    const void* ring_peek(struct ring* self, size_t* nbytes);
+
+    /// @brief Consumer: return the first `nbytes` of the readable bytes to
+    ///        the producer.
+    void ring_release(struct ring* self, size_t nbytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H_ACQUIRE_PLATFORM_RING_V0
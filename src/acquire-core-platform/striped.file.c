@@ -0,0 +1,362 @@
+#include "striped.file.h"
+#include "platform.h"
+#include "queue.h"
+#include "logger.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG(...) aq_logger(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOGE(...) aq_logger(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            LOGE(__VA_ARGS__);                                                 \
+            goto Error;                                                        \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false:\n\t%s", #e)
+
+// Writes waiting for each device's thread.
+#define STRIPE_QUEUE_CAPACITY (64)
+
+// The pieces of one striped_file_write(), and how many devices are still
+// writing them. Lives on the caller's stack, so it's gone as soon as the
+// caller sees `remaining` reach 0. The last writer wakes the caller through
+// `finished`, which the file owns, instead.
+struct stripe_batch
+{
+    _Atomic uint32_t remaining;
+    _Atomic int is_failed;
+    _Atomic uint32_t* finished;
+};
+
+// Everything one device writes for one striped_file_write(). The segments
+// are contiguous in the device's file.
+struct stripe_request
+{
+    struct stripe_batch* batch;
+    uint64_t offset;
+    const struct file_segment* segments;
+    size_t count;
+};
+
+struct stripe_device
+{
+    struct file file;
+    struct queue requests;
+    struct thread thread;
+    int is_open;
+    int is_running;
+};
+
+struct striped_file_impl
+{
+    size_t bytes_of_stripe;
+    _Atomic uint64_t size;
+    // Counts finished batches. Writes wait on this for theirs.
+    _Atomic uint32_t finished;
+    char* manifest_path;
+    char** paths;
+    size_t count;
+    struct stripe_device* devices;
+};
+
+static void
+stripe_writer(void* arg)
+{
+    struct stripe_device* device = (struct stripe_device*)arg;
+    struct stripe_request* req = 0;
+    while ((req = queue_pop(&device->requests))) {
+        struct stripe_batch* batch = req->batch;
+        _Atomic uint32_t* finished = batch->finished;
+        if (!file_writev(
+              &device->file, req->offset, req->segments, req->count))
+            atomic_store(&batch->is_failed, 1);
+        if (atomic_fetch_sub(&batch->remaining, 1) == 1) {
+            atomic_fetch_add(finished, 1);
+            address_wake_all((volatile uint32_t*)finished);
+        }
+    }
+}
+
+static char*
+copy_path(const char* path)
+{
+    char* out = 0;
+    const size_t n = strlen(path) + 1;
+    CHECK(out = malloc(n));
+    memcpy(out, path, n);
+    return out;
+Error:
+    return 0;
+}
+
+static int
+write_manifest(const struct striped_file_impl* self)
+{
+    FILE* fp = 0;
+    EXPECT(fp = fopen(self->manifest_path, "w"),
+           "Failed to open the manifest \"%s\"",
+           self->manifest_path);
+    int ok = fprintf(fp,
+                     "acquire-striped-file 1\n"
+                     "bytes_of_stripe %llu\n"
+                     "bytes %llu\n"
+                     "count %llu\n",
+                     (unsigned long long)self->bytes_of_stripe,
+                     (unsigned long long)atomic_load(&self->size),
+                     (unsigned long long)self->count) > 0;
+    for (size_t i = 0; i < self->count; ++i)
+        ok &= fprintf(fp, "%s\n", self->paths[i]) > 0;
+    ok &= (fclose(fp) == 0);
+    EXPECT(ok, "Failed to write the manifest \"%s\"", self->manifest_path);
+    return 1;
+Error:
+    return 0;
+}
+
+static void
+striped_file_free(struct striped_file_impl* self)
+{
+    if (!self)
+        return;
+    for (size_t i = 0; self->devices && i < self->count; ++i) {
+        struct stripe_device* device = self->devices + i;
+        if (device->is_running) {
+            queue_push(&device->requests, 0);
+            thread_join(&device->thread);
+        }
+        queue_destroy(&device->requests);
+        if (device->is_open)
+            file_close(&device->file);
+    }
+    for (size_t i = 0; self->paths && i < self->count; ++i)
+        free(self->paths[i]);
+    free(self->paths);
+    free(self->devices);
+    free(self->manifest_path);
+    free(self);
+}
+
+int
+striped_file_create(struct striped_file* self,
+                    const char* manifest_path,
+                    const char* const* paths,
+                    size_t count,
+                    size_t bytes_of_stripe)
+{
+    struct striped_file_impl* impl = 0;
+    CHECK(self);
+    self->impl = 0;
+    CHECK(manifest_path);
+    CHECK(paths);
+    CHECK(count > 0);
+    CHECK(bytes_of_stripe > 0);
+
+    CHECK(impl = calloc(1, sizeof(*impl)));
+    impl->bytes_of_stripe = bytes_of_stripe;
+    impl->count = count;
+    atomic_init(&impl->size, 0);
+    atomic_init(&impl->finished, 0);
+    CHECK(impl->manifest_path = copy_path(manifest_path));
+    CHECK(impl->paths = calloc(count, sizeof(*impl->paths)));
+    CHECK(impl->devices = calloc(count, sizeof(*impl->devices)));
+    for (size_t i = 0; i < count; ++i) {
+        struct stripe_device* device = impl->devices + i;
+        CHECK(paths[i]);
+        CHECK(impl->paths[i] = copy_path(paths[i]));
+        CHECK(device->is_open =
+                file_create(&device->file, paths[i], strlen(paths[i]) + 1));
+        CHECK(queue_init(&device->requests, STRIPE_QUEUE_CAPACITY));
+        thread_init(&device->thread);
+        CHECK(device->is_running =
+                thread_create(&device->thread, stripe_writer, device));
+    }
+    // Written now too, so the layout survives a crash.
+    CHECK(write_manifest(impl));
+    self->impl = impl;
+    return 1;
+Error:
+    striped_file_free(impl);
+    return 0;
+}
+
+int
+striped_file_write(struct striped_file* self,
+                   uint64_t offset,
+                   const uint8_t* beg,
+                   const uint8_t* end)
+{
+    struct stripe_request* requests = 0;
+    CHECK(self && self->impl);
+    CHECK(beg <= end);
+    if (beg == end)
+        return 1;
+    struct striped_file_impl* impl = (struct striped_file_impl*)self->impl;
+    const uint64_t bytes_of_stripe = impl->bytes_of_stripe;
+    const uint64_t count = impl->count;
+    const uint64_t last_byte = offset + (uint64_t)(end - beg);
+    const uint64_t first = offset / bytes_of_stripe;
+    const uint64_t last = (last_byte - 1) / bytes_of_stripe;
+    const size_t nstripes = (size_t)(last - first + 1);
+    const size_t nrequests = (size_t)(nstripes < count ? nstripes : count);
+
+    CHECK(requests = malloc(nrequests * sizeof(*requests) +
+                            nstripes * sizeof(struct file_segment)));
+    struct file_segment* segments =
+      (struct file_segment*)(requests + nrequests);
+
+    // One request per device, holding every stripe it gets from this write.
+    struct stripe_batch batch;
+    atomic_init(&batch.remaining, (uint32_t)nrequests);
+    atomic_init(&batch.is_failed, 0);
+    batch.finished = &impl->finished;
+    size_t nsegments = 0;
+    for (size_t j = 0; j < nrequests; ++j) {
+        const uint64_t k0 = first + j;
+        struct stripe_request* req = requests + j;
+        *req = (struct stripe_request){
+            .batch = &batch,
+            // Only the first stripe can start part way in.
+            .offset = (k0 / count) * bytes_of_stripe +
+                      (j == 0 ? offset % bytes_of_stripe : 0),
+            .segments = segments + nsegments,
+        };
+        for (uint64_t k = k0; k <= last; k += count) {
+            const uint64_t lo =
+              (k * bytes_of_stripe > offset) ? k * bytes_of_stripe : offset;
+            const uint64_t hi = ((k + 1) * bytes_of_stripe < last_byte)
+                                  ? (k + 1) * bytes_of_stripe
+                                  : last_byte;
+            segments[nsegments++] = (struct file_segment){
+                .beg = beg + (lo - offset),
+                .end = beg + (hi - offset),
+            };
+            ++req->count;
+        }
+    }
+    for (size_t j = 0; j < nrequests; ++j)
+        queue_push(&impl->devices[(first + j) % count].requests, requests + j);
+
+    for (;;) {
+        // Read before `remaining`, so a batch finishing in between changes it.
+        const uint32_t seen = atomic_load(&impl->finished);
+        if (!atomic_load(&batch.remaining))
+            break;
+        address_wait((volatile uint32_t*)&impl->finished, seen, UINT64_MAX);
+    }
+    free(requests);
+    requests = 0;
+    EXPECT(!atomic_load(&batch.is_failed),
+           "Failed to write %llu bytes at offset %llu",
+           (unsigned long long)(end - beg),
+           (unsigned long long)offset);
+
+    uint64_t size = atomic_load(&impl->size);
+    while (size < last_byte &&
+           !atomic_compare_exchange_weak(&impl->size, &size, last_byte))
+        ;
+    return 1;
+Error:
+    free(requests);
+    return 0;
+}
+
+uint64_t
+striped_file_size(const struct striped_file* self)
+{
+    CHECK(self && self->impl);
+    return atomic_load(&((struct striped_file_impl*)self->impl)->size);
+Error:
+    return 0;
+}
+
+void
+striped_file_close(struct striped_file* self)
+{
+    if (self && self->impl) {
+        struct striped_file_impl* impl = (struct striped_file_impl*)self->impl;
+        write_manifest(impl);
+        striped_file_free(impl);
+        self->impl = 0;
+    }
+}
+
+//
+//  UNIT TESTS
+//
+
+#ifndef NO_UNIT_TESTS
+
+int
+unit_test__striped_file_deals_stripes_round_robin()
+{
+    const char manifest[] = "striped-file-unit-test.txt";
+    const char* paths[] = { "striped-file-unit-test.0.bin",
+                            "striped-file-unit-test.1.bin",
+                            "striped-file-unit-test.2.bin" };
+    const size_t bytes_of_stripe = 1000;
+    struct striped_file striped = { 0 };
+    FILE* fp = 0;
+    uint8_t data[10500];
+    uint8_t actual[sizeof(data)];
+
+    for (size_t i = 0; i < sizeof(data); ++i)
+        data[i] = (uint8_t)(i * 131 + 7);
+    for (int i = 0; i < 3; ++i)
+        remove(paths[i]);
+
+    CHECK(striped_file_create(&striped, manifest, paths, 3, bytes_of_stripe));
+    // Starts and ends part way into a stripe, and skips ahead of the start.
+    CHECK(striped_file_write(&striped, 2500, data + 2500, data + 7300));
+    CHECK(striped_file_write(&striped, 0, data, data + 2500));
+    CHECK(striped_file_write(&striped, 7300, data + 7300, data + sizeof(data)));
+    CHECK(striped_file_size(&striped) == sizeof(data));
+    striped_file_close(&striped);
+
+    // Stripe k is in file k % 3 at offset (k / 3) * bytes_of_stripe.
+    for (int i = 0; i < 3; ++i) {
+        CHECK(fp = fopen(paths[i], "rb"));
+        for (size_t k = i; k * bytes_of_stripe < sizeof(data); k += 3) {
+            const size_t lo = k * bytes_of_stripe;
+            size_t n = sizeof(data) - lo;
+            n = n < bytes_of_stripe ? n : bytes_of_stripe;
+            CHECK(fread(actual + lo, 1, n, fp) == n);
+        }
+        CHECK(fread(actual, 1, 1, fp) == 0);
+        fclose(fp);
+        fp = 0;
+    }
+    CHECK(memcmp(actual, data, sizeof(data)) == 0);
+
+    {
+        char line[256] = { 0 };
+        CHECK(fp = fopen(manifest, "r"));
+        CHECK(fgets(line, sizeof(line), fp));
+        CHECK(strcmp(line, "acquire-striped-file 1\n") == 0);
+        CHECK(fgets(line, sizeof(line), fp));
+        CHECK(strcmp(line, "bytes_of_stripe 1000\n") == 0);
+        CHECK(fgets(line, sizeof(line), fp));
+        CHECK(strcmp(line, "bytes 10500\n") == 0);
+        fclose(fp);
+        fp = 0;
+    }
+
+    remove(manifest);
+    for (int i = 0; i < 3; ++i)
+        remove(paths[i]);
+    return 1;
+Error:
+    striped_file_close(&striped);
+    if (fp)
+        fclose(fp);
+    remove(manifest);
+    for (int i = 0; i < 3; ++i)
+        remove(paths[i]);
+    return 0;
+}
+
+#endif // NO_UNIT_TESTS
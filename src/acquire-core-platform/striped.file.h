@@ -0,0 +1,69 @@
+#ifndef H_ACQUIRE_PLATFORM_STRIPED_FILE_V0
+#define H_ACQUIRE_PLATFORM_STRIPED_FILE_V0
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// One logical file spread over several files, usually one per drive, so
+    /// writes get the bandwidth of all of the drives together.
+    ///
+    /// The logical file is cut into stripes of `bytes_of_stripe` bytes, which
+    /// are dealt out to the files round-robin: stripe `k` is stored in file
+    /// `k % count`, at offset `(k / count) * bytes_of_stripe`. Each file has
+    /// its own writer thread.
+    ///
+    /// The layout is recorded in a small text manifest, so the logical file
+    /// can be put back together later. It lists the stripe size, the logical
+    /// size and the paths, one field per line:
+    ///
+    ///     acquire-striped-file 1
+    ///     bytes_of_stripe 1048576
+    ///     bytes 12345678
+    ///     count 2
+    ///     /mnt/nvme0/frames.bin
+    ///     /mnt/nvme1/frames.bin
+    struct striped_file
+    {
+        void* impl;
+    };
+
+    /// @brief Create `count` files at `paths`, and a manifest at
+    ///        `manifest_path` that describes how they fit together.
+    /// @param bytes_of_stripe Bytes per stripe. Something like 1 MiB keeps
+    ///                        every drive busy without splitting frames into
+    ///                        too many pieces.
+    /// @returns 1 on success, otherwise 0
+    int striped_file_create(struct striped_file* self,
+                            const char* manifest_path,
+                            const char* const* paths,
+                            size_t count,
+                            size_t bytes_of_stripe);
+
+    /// @brief Write `[beg,end)` to the logical file at `offset`.
+    /// @details The stripes are written by the writer threads in parallel,
+    ///          and this waits for all of them. Stripes that end up next to
+    ///          each other in a file go out in one `file_writev()` call.
+    ///          Several threads may write at once.
+    /// @returns 1 on success, otherwise 0
+    int striped_file_write(struct striped_file* self,
+                           uint64_t offset,
+                           const uint8_t* beg,
+                           const uint8_t* end);
+
+    /// @returns One past the last byte written to the logical file so far.
+    uint64_t striped_file_size(const struct striped_file* self);
+
+    /// @brief Stop the writer threads, close the files and update the
+    ///        manifest with the final size.
+    void striped_file_close(struct striped_file* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H_ACQUIRE_PLATFORM_STRIPED_FILE_V0
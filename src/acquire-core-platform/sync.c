@@ -0,0 +1,326 @@
+#include "sync.h"
+#include "logger.h"
+
+#include <stdatomic.h>
+
+#define LOG(...) aq_logger(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOGE(...) aq_logger(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            LOGE(__VA_ARGS__);                                                 \
+            goto Error;                                                        \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false:\n\t%s", #e)
+
+// The word is a count in the low bits and a number of waiters above it.
+#define SYNC_WAITER ((uint32_t)1 << 20)
+#define SYNC_COUNT_MASK (SYNC_WAITER - 1)
+
+// The headers keep the word as a plain `uint32_t`, so they work from C++.
+#define WORD(self) ((_Atomic uint32_t*)&(self)->word_)
+
+#define FOREVER (UINT64_MAX)
+
+static uint64_t
+deadline_of(uint64_t timeout_ns)
+{
+    const uint64_t now = clock_now_ns();
+    return (timeout_ns < FOREVER - now) ? now + timeout_ns : FOREVER;
+}
+
+// Registers as a waiter and sleeps while the word is still `seen`.
+// Returns 0 when `deadline_ns` has passed, otherwise 1, and the caller looks
+// at the word again.
+static int
+park(_Atomic uint32_t* word, uint32_t seen, uint64_t deadline_ns)
+{
+    uint64_t timeout_ns = FOREVER;
+    if (deadline_ns != FOREVER) {
+        const uint64_t now = clock_now_ns();
+        if (now >= deadline_ns)
+            return 0;
+        timeout_ns = deadline_ns - now;
+    }
+    if (atomic_compare_exchange_weak(word, &seen, seen + SYNC_WAITER)) {
+        address_wait((volatile uint32_t*)word, seen + SYNC_WAITER, timeout_ns);
+        atomic_fetch_sub(word, SYNC_WAITER);
+    }
+    return 1;
+}
+
+static void
+wake(_Atomic uint32_t* word, uint32_t before, uint32_t n)
+{
+    if (before >= SYNC_WAITER) {
+        if (n == 1)
+            address_wake_one((volatile uint32_t*)word);
+        else
+            address_wake_all((volatile uint32_t*)word);
+    }
+}
+
+// Takes one from the count when it isn't 0.
+static int
+try_take(_Atomic uint32_t* word)
+{
+    uint32_t s = atomic_load(word);
+    while (s & SYNC_COUNT_MASK)
+        if (atomic_compare_exchange_weak(word, &s, s - 1))
+            return 1;
+    return 0;
+}
+
+//
+//  Events
+//
+
+void
+sync_event_init(struct sync_event* self, int is_manual_reset)
+{
+    atomic_init(WORD(self), 0);
+    self->is_manual_reset_ = (is_manual_reset != 0);
+}
+
+void
+sync_event_set(struct sync_event* self)
+{
+    const uint32_t before = atomic_fetch_or(WORD(self), 1);
+    if (!(before & 1))
+        wake(WORD(self), before, self->is_manual_reset_ ? UINT32_MAX : 1);
+}
+
+void
+sync_event_reset(struct sync_event* self)
+{
+    atomic_fetch_and(WORD(self), ~(uint32_t)1);
+}
+
+static int
+event_wait_until(struct sync_event* self, uint64_t deadline_ns)
+{
+    _Atomic uint32_t* word = WORD(self);
+    for (;;) {
+        uint32_t s = atomic_load(word);
+        if (s & 1) {
+            if (self->is_manual_reset_ ||
+                atomic_compare_exchange_weak(word, &s, s & ~(uint32_t)1))
+                return 1;
+        } else if (!park(word, s, deadline_ns)) {
+            return 0;
+        }
+    }
+}
+
+void
+sync_event_wait(struct sync_event* self)
+{
+    event_wait_until(self, FOREVER);
+}
+
+int
+sync_event_wait_for(struct sync_event* self, uint64_t timeout_ns)
+{
+    return event_wait_until(self, deadline_of(timeout_ns));
+}
+
+//
+//  Semaphores
+//
+
+void
+sync_semaphore_init(struct sync_semaphore* self, uint32_t count)
+{
+    if (count > SYNC_COUNT_MASK) {
+        LOGE("A semaphore holds at most %u. Got %u.",
+             (unsigned)SYNC_COUNT_MASK,
+             (unsigned)count);
+        count = SYNC_COUNT_MASK;
+    }
+    atomic_init(WORD(self), count);
+}
+
+void
+sync_semaphore_post(struct sync_semaphore* self, uint32_t n)
+{
+    _Atomic uint32_t* word = WORD(self);
+    uint32_t before = atomic_load(word);
+    do {
+        EXPECT((before & SYNC_COUNT_MASK) + n <= SYNC_COUNT_MASK,
+               "Semaphore overflow: %u + %u",
+               (unsigned)(before & SYNC_COUNT_MASK),
+               (unsigned)n);
+    } while (!atomic_compare_exchange_weak(word, &before, before + n));
+    wake(word, before, n);
+Error:;
+}
+
+int
+sync_semaphore_try_wait(struct sync_semaphore* self)
+{
+    return try_take(WORD(self));
+}
+
+static int
+semaphore_wait_until(struct sync_semaphore* self, uint64_t deadline_ns)
+{
+    _Atomic uint32_t* word = WORD(self);
+    for (;;) {
+        if (try_take(word))
+            return 1;
+        const uint32_t s = atomic_load(word);
+        if (!(s & SYNC_COUNT_MASK) && !park(word, s, deadline_ns))
+            return 0;
+    }
+}
+
+void
+sync_semaphore_wait(struct sync_semaphore* self)
+{
+    semaphore_wait_until(self, FOREVER);
+}
+
+int
+sync_semaphore_wait_for(struct sync_semaphore* self, uint64_t timeout_ns)
+{
+    return semaphore_wait_until(self, deadline_of(timeout_ns));
+}
+
+//
+//  Latches
+//
+
+void
+sync_latch_init(struct sync_latch* self, uint32_t count)
+{
+    if (count > SYNC_COUNT_MASK) {
+        LOGE("A latch counts at most %u. Got %u.",
+             (unsigned)SYNC_COUNT_MASK,
+             (unsigned)count);
+        count = SYNC_COUNT_MASK;
+    }
+    atomic_init(WORD(self), count);
+}
+
+void
+sync_latch_count_down(struct sync_latch* self, uint32_t n)
+{
+    _Atomic uint32_t* word = WORD(self);
+    uint32_t s = atomic_load(word);
+    uint32_t count = 0;
+    do {
+        count = s & SYNC_COUNT_MASK;
+        if (count == 0)
+            return;
+        if (n > count)
+            n = count;
+    } while (!atomic_compare_exchange_weak(word, &s, s - n));
+    if (count == n)
+        wake(word, s, UINT32_MAX);
+}
+
+int
+sync_latch_try_wait(const struct sync_latch* self)
+{
+    return !(atomic_load(WORD(self)) & SYNC_COUNT_MASK);
+}
+
+static int
+latch_wait_until(struct sync_latch* self, uint64_t deadline_ns)
+{
+    _Atomic uint32_t* word = WORD(self);
+    uint32_t s = 0;
+    while ((s = atomic_load(word)) & SYNC_COUNT_MASK)
+        if (!park(word, s, deadline_ns))
+            return 0;
+    return 1;
+}
+
+void
+sync_latch_wait(struct sync_latch* self)
+{
+    latch_wait_until(self, FOREVER);
+}
+
+int
+sync_latch_wait_for(struct sync_latch* self, uint64_t timeout_ns)
+{
+    return latch_wait_until(self, deadline_of(timeout_ns));
+}
+
+//
+//  UNIT TESTS
+//
+
+#ifndef NO_UNIT_TESTS
+
+struct sync_unit_test
+{
+    struct sync_semaphore items;
+    struct sync_latch done;
+    _Atomic uint32_t consumed;
+};
+
+static void
+sync_unit_test_consumer(void* arg)
+{
+    struct sync_unit_test* t = (struct sync_unit_test*)arg;
+    for (int i = 0; i < 1000; ++i) {
+        sync_semaphore_wait(&t->items);
+        atomic_fetch_add(&t->consumed, 1);
+    }
+    sync_latch_count_down(&t->done, 1);
+}
+
+int
+unit_test__sync_primitives_wait_and_wake()
+{
+    struct sync_event event;
+    struct sync_unit_test t;
+    struct thread threads[2];
+    int nthreads = 0;
+
+    // An auto-reset event lets one wait through per set.
+    sync_event_init(&event, 0);
+    CHECK(!sync_event_wait_for(&event, 0));
+    sync_event_set(&event);
+    sync_event_set(&event);
+    CHECK(sync_event_wait_for(&event, 0));
+    CHECK(!sync_event_wait_for(&event, 1000000));
+
+    // A manual-reset one lets every wait through until it's reset.
+    sync_event_init(&event, 1);
+    sync_event_set(&event);
+    CHECK(sync_event_wait_for(&event, 0));
+    CHECK(sync_event_wait_for(&event, 0));
+    sync_event_reset(&event);
+    CHECK(!sync_event_wait_for(&event, 0));
+
+    // Two consumers take 2000 posts between them, then open the latch.
+    sync_semaphore_init(&t.items, 0);
+    sync_latch_init(&t.done, 2);
+    atomic_init(&t.consumed, 0);
+    CHECK(!sync_semaphore_try_wait(&t.items));
+    for (; nthreads < 2; ++nthreads) {
+        thread_init(threads + nthreads);
+        CHECK(thread_create(threads + nthreads, sync_unit_test_consumer, &t));
+    }
+    for (int i = 0; i < 1000; ++i)
+        sync_semaphore_post(&t.items, (i % 2) ? 1 : 3);
+    CHECK(!sync_latch_try_wait(&t.done));
+    CHECK(sync_latch_wait_for(&t.done, 10000000000ULL));
+    CHECK(atomic_load(&t.consumed) == 2000);
+    CHECK(!sync_semaphore_try_wait(&t.items));
+    for (int i = 0; i < nthreads; ++i)
+        thread_join(threads + i);
+    return 1;
+Error:
+    // Let the consumers finish.
+    sync_semaphore_post(&t.items, 2000);
+    for (int i = 0; i < nthreads; ++i)
+        thread_join(threads + i);
+    return 0;
+}
+
+#endif // NO_UNIT_TESTS
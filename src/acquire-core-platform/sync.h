@@ -0,0 +1,90 @@
+#ifndef H_ACQUIRE_PLATFORM_SYNC_V0
+#define H_ACQUIRE_PLATFORM_SYNC_V0
+
+#include "platform.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// Events, semaphores and latches that are each one 32-bit word.
+    ///
+    /// Setting, posting or counting down is one atomic operation, and only
+    /// makes a system call when a thread is waiting. Waiting only makes one
+    /// when it has to sleep, with `address_wait()`, which is a futex on
+    /// Linux. `struct event`, by contrast, takes a mutex and broadcasts on
+    /// every notify.
+    ///
+    /// The low 20 bits of the word hold the count, so a semaphore holds at
+    /// most 1048575. The rest count the threads waiting, up to 4095.
+    ///
+    /// Initialize with the `_init()` functions. Nothing needs destroying.
+
+    struct sync_event
+    {
+        uint32_t word_;
+        uint32_t is_manual_reset_;
+    };
+
+    struct sync_semaphore
+    {
+        uint32_t word_;
+    };
+
+    struct sync_latch
+    {
+        uint32_t word_;
+    };
+
+    /// @brief Start an event that isn't set.
+    /// @param is_manual_reset 0 for an event that lets one waiter through per
+    ///                        `sync_event_set()`, and resets as it does. 1
+    ///                        for one that lets every waiter through until
+    ///                        `sync_event_reset()`.
+    void sync_event_init(struct sync_event* self, int is_manual_reset);
+
+    void sync_event_set(struct sync_event* self);
+
+    void sync_event_reset(struct sync_event* self);
+
+    void sync_event_wait(struct sync_event* self);
+
+    /// @returns 1 when the event was set, or 0 when the wait timed out.
+    int sync_event_wait_for(struct sync_event* self, uint64_t timeout_ns);
+
+    void sync_semaphore_init(struct sync_semaphore* self, uint32_t count);
+
+    /// @brief Add `n` to the count, waking up to `n` waiters.
+    void sync_semaphore_post(struct sync_semaphore* self, uint32_t n);
+
+    /// @brief Take one from the count when it isn't 0, without waiting.
+    /// @returns 1 when one was taken, otherwise 0.
+    int sync_semaphore_try_wait(struct sync_semaphore* self);
+
+    /// @brief Wait for the count to be above 0, then take one from it.
+    void sync_semaphore_wait(struct sync_semaphore* self);
+
+    /// @returns 1 when one was taken, or 0 when the wait timed out.
+    int sync_semaphore_wait_for(struct sync_semaphore* self,
+                                uint64_t timeout_ns);
+
+    /// @brief Start a latch that opens after `count` count-downs.
+    void sync_latch_init(struct sync_latch* self, uint32_t count);
+
+    /// @brief Take `n` from the count. Opening the latch wakes every waiter.
+    void sync_latch_count_down(struct sync_latch* self, uint32_t n);
+
+    /// @returns 1 when the latch is open, otherwise 0.
+    int sync_latch_try_wait(const struct sync_latch* self);
+
+    void sync_latch_wait(struct sync_latch* self);
+
+    /// @returns 1 when the latch opened, or 0 when the wait timed out.
+    int sync_latch_wait_for(struct sync_latch* self, uint64_t timeout_ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H_ACQUIRE_PLATFORM_SYNC_V0
@@ -2,8 +2,12 @@
 
 #include "platform.h"
 #include "logger.h"
+#include "io.stats.h"
+
+#include <psapi.h>
 
 #include <stdint.h>
+#include <stdlib.h>
 #include <math.h>
 
 #define L aq_logger
@@ -64,36 +68,235 @@ errstr()
     return buf;
 }
 
+//
+//  Direct (uncached) files
+//
+
+// FILE_FLAG_NO_BUFFERING wants offsets, addresses and lengths aligned to the
+// volume's sector size. This covers every volume we expect to see.
+#define FILE_DIRECT_ALIGNMENT (4096)
+
+struct file_direct
+{
+    struct lock lock;
+    // The unaligned end of the file, held back until file_close().
+    uint8_t* tail;
+    uint64_t tail_offset;
+    size_t bytes_of_tail;
+    // One past the last byte written so far.
+    uint64_t size;
+};
+
+static void
+file_direct_free(struct file_direct* direct)
+{
+    if (direct) {
+        memory_free(direct->tail);
+        free(direct);
+    }
+}
+
+static struct file_direct*
+file_direct_create(void)
+{
+    struct file_direct* direct = 0;
+    CHECK(direct = calloc(1, sizeof(*direct)));
+    lock_init(&direct->lock);
+    CHECK(direct->tail = memory_alloc_aligned(
+            FILE_DIRECT_ALIGNMENT,
+            FILE_DIRECT_ALIGNMENT,
+            AllocatorHint_Default));
+    return direct;
+Error:
+    file_direct_free(direct);
+    return 0;
+}
+
+// Checks a write to a direct file is aligned, and trims `*end` so only whole
+// sectors are written. The rest is kept for file_close().
+static int
+file_direct_prepare(const struct file* file,
+                    uint64_t offset,
+                    const uint8_t* beg,
+                    const uint8_t** end)
+{
+    struct file_direct* direct = (struct file_direct*)file->direct_;
+    if (!direct)
+        return 1;
+    const size_t nbytes = *end - beg;
+    const size_t bytes_of_body =
+      nbytes & ~(size_t)(FILE_DIRECT_ALIGNMENT - 1);
+    const size_t bytes_of_tail = nbytes - bytes_of_body;
+    EXPECT(offset % FILE_DIRECT_ALIGNMENT == 0,
+           "Writes to a direct file must start at a multiple of %d bytes. "
+           "Got offset %llu.",
+           FILE_DIRECT_ALIGNMENT,
+           (unsigned long long)offset);
+    EXPECT(!bytes_of_body || (uintptr_t)beg % FILE_DIRECT_ALIGNMENT == 0,
+           "Writes to a direct file must come from an address that's a "
+           "multiple of %d bytes. Got %p.",
+           FILE_DIRECT_ALIGNMENT,
+           beg);
+
+    // The tail is written over its whole block when the file is closed, so
+    // nothing else may land in or after that block, whichever write comes
+    // first.
+    lock_acquire(&direct->lock);
+    const int is_past_tail =
+      direct->bytes_of_tail &&
+      (bytes_of_tail || offset + nbytes > direct->tail_offset);
+    const int is_tail_before_end =
+      bytes_of_tail && direct->size > offset + bytes_of_body;
+    const int is_ok = !is_past_tail && !is_tail_before_end;
+    if (is_ok) {
+        if (bytes_of_tail) {
+            memcpy(direct->tail, beg + bytes_of_body, bytes_of_tail);
+            direct->tail_offset = offset + bytes_of_body;
+            direct->bytes_of_tail = bytes_of_tail;
+        }
+        if (offset + nbytes > direct->size)
+            direct->size = offset + nbytes;
+    }
+    lock_release(&direct->lock);
+    EXPECT(is_ok,
+           "Only the final write to a direct file may have a length that "
+           "isn't a multiple of %d bytes, and nothing may be written past it.",
+           FILE_DIRECT_ALIGNMENT);
+
+    *end = beg + bytes_of_body;
+    return 1;
+Error:
+    return 0;
+}
+
+// Writes out the held-back tail, padded to a whole sector, then trims the
+// padding off again.
+static void
+file_direct_destroy(struct file* file)
+{
+    struct file_direct* direct = (struct file_direct*)file->direct_;
+    if (!direct)
+        return;
+    file->direct_ = 0;
+    if (direct->bytes_of_tail) {
+        memset(direct->tail + direct->bytes_of_tail,
+               0,
+               FILE_DIRECT_ALIGNMENT - direct->bytes_of_tail);
+        if (!file_write(file,
+                        direct->tail_offset,
+                        direct->tail,
+                        direct->tail + FILE_DIRECT_ALIGNMENT))
+            LOGE("Failed to write the last %llu bytes of a direct file.",
+                 (unsigned long long)direct->bytes_of_tail);
+        FILE_END_OF_FILE_INFO info = { 0 };
+        info.EndOfFile.QuadPart = (LONGLONG)direct->size;
+        CHECK_WARN(SetFileInformationByHandle(
+          file->hfile, FileEndOfFileInfo, &info, sizeof(info)));
+    }
+    file_direct_free(direct);
+}
+
 int
 file_create(struct file* file, const char* filename, size_t bytes_of_filename)
 {
+    return file_create_with_flags(
+      file, filename, bytes_of_filename, FileCreateFlag_Default);
+}
+
+int
+file_create_with_flags(struct file* file,
+                       const char* filename,
+                       size_t bytes_of_filename,
+                       enum FileCreateFlag flags)
+{
+    DWORD attributes = FILE_FLAG_OVERLAPPED;
     memset(file, 0, sizeof(*file));
+    if (flags & FileCreateFlag_Direct) {
+        CHECK(file->direct_ = file_direct_create());
+        attributes |= FILE_FLAG_NO_BUFFERING;
+    }
 
     file->overlapped.hEvent = CreateEvent(0, TRUE, FALSE, 0);
     CHECK(file->overlapped.hEvent != INVALID_HANDLE_VALUE);
 
+    const DWORD share = (flags & FileCreateFlag_NoLock)
+                          ? FILE_SHARE_READ | FILE_SHARE_WRITE
+                          : FILE_SHARE_READ;
+    // Reading too, so the file can be mapped.
     CHECK_HANDLE(file->hfile = CreateFileA(filename,
-                                           GENERIC_WRITE,
-                                           FILE_SHARE_READ,
+                                           GENERIC_READ | GENERIC_WRITE,
+                                           share,
                                            0,
-                                           CREATE_ALWAYS,
-                                           FILE_FLAG_OVERLAPPED,
+                                           (flags & FileCreateFlag_Keep)
+                                             ? OPEN_ALWAYS
+                                             : CREATE_ALWAYS,
+                                           attributes,
                                            0));
     return 1;
 Error:
     LOGE("Could not create \"%s\"", filename);
+    file_direct_free((struct file_direct*)file->direct_);
+    file->direct_ = 0;
     return 0;
 }
 
+int
+file_open_read(struct file* file,
+               const char* filename,
+               size_t bytes_of_filename)
+{
+    memset(file, 0, sizeof(*file));
+    file->hfile = INVALID_HANDLE_VALUE;
+
+    file->overlapped.hEvent = CreateEvent(0, TRUE, FALSE, 0);
+    CHECK(file->overlapped.hEvent != INVALID_HANDLE_VALUE);
+
+    // Sharing writes lets files be read while they're still being written.
+    CHECK_HANDLE(file->hfile = CreateFileA(filename,
+                                           GENERIC_READ,
+                                           FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                           0,
+                                           OPEN_EXISTING,
+                                           FILE_FLAG_OVERLAPPED,
+                                           0));
+    return 1;
+Error:
+    LOGE("Could not open \"%s\" for reading", filename);
+    if (file->overlapped.hEvent)
+        CloseHandle(file->overlapped.hEvent);
+    return 0;
+}
+
+static void
+file_async_destroy(struct file* file);
+
 void
 file_close(struct file* file)
 {
+    file_async_destroy(file);
+    file_direct_destroy(file);
+    io_stats_destroy((struct io_stats*)file->stats_);
+    file->stats_ = 0;
     CHECK_WARN(CloseHandle(file->hfile));
     CHECK_WARN(CloseHandle(file->overlapped.hEvent));
     file->hfile = INVALID_HANDLE_VALUE;
     file->overlapped.hEvent = INVALID_HANDLE_VALUE;
 }
 
+// Only reads the clock when `stats` are being kept.
+static uint64_t
+io_now_ns(const struct io_stats* stats)
+{
+    LARGE_INTEGER t = { 0 }, f = { 0 };
+    if (!stats)
+        return 0;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&t);
+    return (uint64_t)(t.QuadPart / f.QuadPart) * 1000000000ULL +
+           (uint64_t)(t.QuadPart % f.QuadPart) * 1000000000ULL /
+             (uint64_t)f.QuadPart;
+}
+
 int
 file_write(const struct file* file,
            uint64_t offset,
@@ -101,19 +304,517 @@ file_write(const struct file* file,
            const uint8_t* end)
 {
     int retries = 0;
+    struct io_stats* stats = (struct io_stats*)file->stats_;
     HANDLE hfile = file->hfile;
-    OVERLAPPED ovl = file->overlapped;
+    OVERLAPPED ovl = { 0 };
+    HANDLE event = 0;
+    CHECK(cur <= end);
+    CHECK(file_direct_prepare(file, offset, cur, &end));
+    // A private event lets several threads write to the file at once.
+    // Setting the event handle's low bit keeps the completion from being
+    // queued to the thread pool used by file_write_async().
+    CHECK(event = CreateEventA(0, TRUE, FALSE, 0));
+    ovl.hEvent = (HANDLE)((uintptr_t)event | 1);
     while (cur < end && retries < 3) {
         DWORD written = 0;
         DWORD remaining = (DWORD)(end - cur); // may truncate
+        const uint64_t t0 = io_now_ns(stats);
         ovl.Pointer = (void*)offset;
         WriteFile(hfile, cur, (DWORD)remaining, 0, &ovl);
-        CHECK(GetOverlappedResult(hfile, &ovl, &written, TRUE));
+        const BOOL is_ok = GetOverlappedResult(hfile, &ovl, &written, TRUE);
+        io_stats_record(stats,
+                        remaining,
+                        is_ok ? (int64_t)written : -1,
+                        io_now_ns(stats) - t0);
+        CHECK(is_ok);
         retries += (written == 0);
         offset += written;
         cur += written;
     }
-    return (retries < 3);
+    EXPECT(retries < 3,
+           "Gave up with %llu bytes left to write at offset %llu. Three "
+           "writes wrote nothing.",
+           (unsigned long long)(end - cur),
+           (unsigned long long)offset);
+    CloseHandle(event);
+    return 1;
+Error:
+    if (event)
+        CloseHandle(event);
+    return 0;
+}
+
+// Longer reads are split into pieces of at most this many bytes.
+#define MAX_BYTES_OF_READ (1UL << 30)
+
+int
+file_read(const struct file* file,
+          uint64_t offset,
+          uint8_t* cur,
+          uint8_t* end)
+{
+    OVERLAPPED ovl = { 0 };
+    HANDLE event = 0;
+    CHECK(file);
+    CHECK(cur <= end);
+    // A private event lets several threads read from the file at once. See
+    // file_write().
+    CHECK(event = CreateEventA(0, TRUE, FALSE, 0));
+    ovl.hEvent = (HANDLE)((uintptr_t)event | 1);
+    while (cur < end) {
+        DWORD nread = 0;
+        const uint64_t remaining = (uint64_t)(end - cur);
+        const DWORD nbytes = (DWORD)(remaining < MAX_BYTES_OF_READ
+                                       ? remaining
+                                       : MAX_BYTES_OF_READ);
+        ovl.Pointer = (void*)offset;
+        if (!ReadFile(file->hfile, cur, nbytes, 0, &ovl) &&
+            GetLastError() != ERROR_IO_PENDING)
+            break;
+        if (!GetOverlappedResult(file->hfile, &ovl, &nread, TRUE) || !nread)
+            break;
+        offset += nread;
+        cur += nread;
+    }
+    CloseHandle(event);
+    EXPECT(cur == end,
+           "Failed to read %llu bytes at offset %llu: %s",
+           (unsigned long long)(end - cur),
+           (unsigned long long)offset,
+           errstr());
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_get_size(const struct file* file, uint64_t* nbytes)
+{
+    LARGE_INTEGER size = { 0 };
+    CHECK(file);
+    CHECK(nbytes);
+    EXPECT(GetFileSizeEx(file->hfile, &size),
+           "Failed to get the size of a file: %s",
+           errstr());
+    *nbytes = (uint64_t)size.QuadPart;
+    return 1;
+Error:
+    return 0;
+}
+
+// WriteFileGather() only takes whole, page-aligned pages from unbuffered
+// files, so write one segment at a time.
+int
+file_writev(const struct file* file,
+            uint64_t offset,
+            const struct file_segment* segments,
+            size_t count)
+{
+    CHECK(file);
+    CHECK(segments || !count);
+    for (size_t i = 0; i < count; ++i) {
+        const struct file_segment s = segments[i];
+        CHECK(s.beg <= s.end);
+        CHECK(file_write(file, offset, s.beg, s.end));
+        offset += (uint64_t)(s.end - s.beg);
+    }
+    return 1;
+Error:
+    return 0;
+}
+
+//
+//  Asynchronous writes
+//
+//  The file is opened for overlapped I/O, so writes are issued directly and
+//  their completions run on the system thread pool.
+//
+
+// Longer writes are split into pieces of at most this many bytes.
+#define MAX_BYTES_OF_WRITE (1UL << 30)
+
+struct file_async
+{
+    HANDLE hfile;
+    PTP_IO io;
+    volatile LONG in_flight;
+    volatile LONG is_failed;
+};
+
+struct write_request
+{
+    OVERLAPPED overlapped;
+    struct file_async* async;
+    uint64_t offset;
+    const uint8_t* cur;
+    const uint8_t* end;
+    /// The file's write counters, if it has any.
+    struct io_stats* stats;
+    /// When the last piece was handed to the system, and its size.
+    uint64_t submitted_ns;
+    DWORD bytes_submitted;
+    file_write_callback_t on_done;
+    void* ctx;
+};
+
+static void
+write_request_finish(struct write_request* request, int is_ok)
+{
+    struct file_async* async = request->async;
+    if (!is_ok)
+        InterlockedExchange(&async->is_failed, 1);
+    if (request->on_done)
+        request->on_done(request->ctx, is_ok);
+    free(request);
+    if (InterlockedDecrement(&async->in_flight) == 0)
+        WakeByAddressAll((PVOID)&async->in_flight);
+}
+
+static int
+write_request_start(struct write_request* request)
+{
+    struct file_async* async = request->async;
+    const uint64_t remaining = (uint64_t)(request->end - request->cur);
+    const DWORD nbytes = (DWORD)(remaining < MAX_BYTES_OF_WRITE
+                                   ? remaining
+                                   : MAX_BYTES_OF_WRITE);
+    request->overlapped = (OVERLAPPED){ 0 };
+    request->overlapped.Pointer = (void*)request->offset;
+    request->submitted_ns = io_now_ns(request->stats);
+    request->bytes_submitted = nbytes;
+    StartThreadpoolIo(async->io);
+    if (!WriteFile(
+          async->hfile, request->cur, nbytes, 0, &request->overlapped) &&
+        GetLastError() != ERROR_IO_PENDING) {
+        CancelThreadpoolIo(async->io);
+        io_stats_record(request->stats,
+                        nbytes,
+                        -1,
+                        io_now_ns(request->stats) - request->submitted_ns);
+        LOGE("Failed to write %llu bytes at offset %llu: %s",
+             (unsigned long long)nbytes,
+             (unsigned long long)request->offset,
+             errstr());
+        return 0;
+    }
+    return 1;
+}
+
+static void CALLBACK
+write_request_done(PTP_CALLBACK_INSTANCE instance,
+                   PVOID context,
+                   PVOID overlapped,
+                   ULONG result,
+                   ULONG_PTR nbytes,
+                   PTP_IO io)
+{
+    struct write_request* request =
+      CONTAINING_RECORD(overlapped, struct write_request, overlapped);
+    io_stats_record(request->stats,
+                    request->bytes_submitted,
+                    result == NO_ERROR ? (int64_t)nbytes : -1,
+                    io_now_ns(request->stats) - request->submitted_ns);
+    if (result != NO_ERROR || nbytes == 0) {
+        LOGE("Failed to write at offset %llu. Error code %lu.",
+             (unsigned long long)request->offset,
+             (unsigned long)result);
+        write_request_finish(request, 0);
+        return;
+    }
+    request->cur += nbytes;
+    request->offset += nbytes;
+    if (request->cur == request->end)
+        write_request_finish(request, 1);
+    else if (!write_request_start(request)) // short write
+        write_request_finish(request, 0);
+}
+
+static struct file_async*
+file_async_of(struct file* file)
+{
+    struct file_async* async = (struct file_async*)file->async_;
+    if (async)
+        return async;
+    CHECK(async = calloc(1, sizeof(*async)));
+    async->hfile = file->hfile;
+    EXPECT(async->io =
+             CreateThreadpoolIo(file->hfile, write_request_done, async, 0),
+           "Failed to bind the file to the thread pool: %s",
+           errstr());
+    file->async_ = async;
+    return async;
+Error:
+    free(async);
+    return 0;
+}
+
+static void
+file_async_destroy(struct file* file)
+{
+    struct file_async* async = (struct file_async*)file->async_;
+    if (async) {
+        file_wait(file);
+        WaitForThreadpoolIoCallbacks(async->io, FALSE);
+        CloseThreadpoolIo(async->io);
+        free(async);
+        file->async_ = 0;
+    }
+}
+
+int
+file_write_async(struct file* file,
+                 uint64_t offset,
+                 const uint8_t* beg,
+                 const uint8_t* end,
+                 file_write_callback_t on_done,
+                 void* ctx)
+{
+    struct file_async* async = 0;
+    struct write_request* request = 0;
+    CHECK(file);
+    CHECK(beg <= end);
+    CHECK(file_direct_prepare(file, offset, beg, &end));
+    CHECK(async = file_async_of(file));
+    CHECK(request = malloc(sizeof(*request)));
+    *request = (struct write_request){
+        .async = async,
+        .offset = offset,
+        .cur = beg,
+        .end = end,
+        .stats = (struct io_stats*)file->stats_,
+        .on_done = on_done,
+        .ctx = ctx,
+    };
+    InterlockedIncrement(&async->in_flight);
+    if (beg == end) {
+        write_request_finish(request, 1);
+        return 1;
+    }
+    if (!write_request_start(request)) {
+        write_request_finish(request, 0);
+        return 0;
+    }
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_wait(struct file* file)
+{
+    CHECK(file);
+    struct file_async* async = (struct file_async*)file->async_;
+    if (!async)
+        return 1;
+    LONG n = 0;
+    while ((n = async->in_flight))
+        WaitOnAddress(&async->in_flight, &n, sizeof(n), INFINITE);
+    return !InterlockedExchange(&async->is_failed, 0);
+Error:
+    return 0;
+}
+
+int
+file_flush(struct file* file)
+{
+    const int is_ok = file_wait(file);
+    CHECK(FlushFileBuffers(file->hfile));
+    return is_ok;
+Error:
+    return 0;
+}
+
+int
+file_register_buffer(struct file* file,
+                     const uint8_t* beg,
+                     const uint8_t* end)
+{
+    CHECK(file);
+    CHECK(beg < end);
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_reserve(struct file* file, uint64_t offset, uint64_t nbytes)
+{
+    FILE_STANDARD_INFO standard = { 0 };
+    FILE_ALLOCATION_INFO info = { 0 };
+    CHECK(file);
+    CHECK(GetFileInformationByHandleEx(
+      file->hfile, FileStandardInfo, &standard, sizeof(standard)));
+    // Never shrink the allocation here. That would cut off the file.
+    if (offset + nbytes <= (uint64_t)standard.AllocationSize.QuadPart)
+        return 1;
+    info.AllocationSize.QuadPart = (LONGLONG)(offset + nbytes);
+    EXPECT(SetFileInformationByHandle(
+             file->hfile, FileAllocationInfo, &info, sizeof(info)),
+           "Failed to reserve %llu bytes: %s",
+           (unsigned long long)(offset + nbytes),
+           errstr());
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_truncate(struct file* file, uint64_t nbytes)
+{
+    FILE_END_OF_FILE_INFO eof = { 0 };
+    FILE_ALLOCATION_INFO allocation = { 0 };
+    CHECK(file);
+    struct file_direct* direct = (struct file_direct*)file->direct_;
+    if (direct) {
+        // Otherwise closing the file would restore the old size.
+        lock_acquire(&direct->lock);
+        direct->size = nbytes;
+        lock_release(&direct->lock);
+    }
+    eof.EndOfFile.QuadPart = (LONGLONG)nbytes;
+    EXPECT(SetFileInformationByHandle(
+             file->hfile, FileEndOfFileInfo, &eof, sizeof(eof)),
+           "Failed to set the size to %llu bytes: %s",
+           (unsigned long long)nbytes,
+           errstr());
+    // Give back whatever file_reserve() set aside past the end.
+    allocation.AllocationSize.QuadPart = (LONGLONG)nbytes;
+    CHECK_WARN(SetFileInformationByHandle(
+      file->hfile, FileAllocationInfo, &allocation, sizeof(allocation)));
+    return 1;
+Error:
+    return 0;
+}
+
+// There's no sync_file_range() here, so write-back is left to the system.
+int
+file_set_writeback_window(struct file* file, uint64_t bytes_of_window)
+{
+    CHECK(file);
+    return 1;
+Error:
+    return 0;
+}
+
+int
+file_get_writeback_stats(const struct file* file,
+                         struct file_writeback_stats* stats)
+{
+    CHECK(file);
+    CHECK(stats);
+    *stats = (struct file_writeback_stats){ 0 };
+    return 1;
+Error:
+    return 0;
+}
+
+// Views start on an allocation granularity boundary, so the start of the
+// view can be found again from the address that was handed out.
+static size_t
+bytes_of_mapping_granularity(void)
+{
+    SYSTEM_INFO sysinfo;
+    GetSystemInfo(&sysinfo);
+    return sysinfo.dwAllocationGranularity;
+}
+
+void*
+file_map_for_write(struct file* file, uint64_t offset, size_t nbytes)
+{
+    HANDLE mapping = 0;
+    uint8_t* base = 0;
+    CHECK(file);
+    CHECK(nbytes);
+    EXPECT(!file->direct_,
+           "Files created with FileCreateFlag_Direct can't be mapped.");
+    // A mapping larger than the file grows the file.
+    const uint64_t end = offset + nbytes;
+    CHECK(mapping = CreateFileMappingA(file->hfile,
+                                       0,
+                                       PAGE_READWRITE,
+                                       (DWORD)(end >> 32),
+                                       (DWORD)end,
+                                       0));
+    const size_t granularity = bytes_of_mapping_granularity();
+    const size_t lead = (size_t)(offset % granularity);
+    const uint64_t beg = offset - lead;
+    EXPECT(base = MapViewOfFile(mapping,
+                                FILE_MAP_WRITE,
+                                (DWORD)(beg >> 32),
+                                (DWORD)beg,
+                                lead + nbytes),
+           "Failed to map %llu bytes at offset %llu: %s",
+           (unsigned long long)nbytes,
+           (unsigned long long)offset,
+           errstr());
+    // The view keeps the mapping alive.
+    CloseHandle(mapping);
+    return base + lead;
+Error:
+    if (mapping)
+        CloseHandle(mapping);
+    return 0;
+}
+
+const void*
+file_map_for_read(const struct file* file,
+                  uint64_t offset,
+                  size_t nbytes,
+                  enum FileReadHint hint)
+{
+    HANDLE mapping = 0;
+    uint8_t* base = 0;
+    uint64_t bytes_of_file = 0;
+    CHECK(file);
+    CHECK(nbytes);
+    CHECK(file_get_size(file, &bytes_of_file));
+    EXPECT(offset + nbytes <= bytes_of_file,
+           "Can't map %llu bytes at offset %llu from a file of %llu bytes.",
+           (unsigned long long)nbytes,
+           (unsigned long long)offset,
+           (unsigned long long)bytes_of_file);
+    CHECK(mapping =
+            CreateFileMappingA(file->hfile, 0, PAGE_READONLY, 0, 0, 0));
+    const size_t granularity = bytes_of_mapping_granularity();
+    const size_t lead = (size_t)(offset % granularity);
+    const uint64_t beg = offset - lead;
+    EXPECT(base = MapViewOfFile(mapping,
+                                FILE_MAP_READ,
+                                (DWORD)(beg >> 32),
+                                (DWORD)beg,
+                                lead + nbytes),
+           "Failed to map %llu bytes at offset %llu: %s",
+           (unsigned long long)nbytes,
+           (unsigned long long)offset,
+           errstr());
+    CloseHandle(mapping);
+    mapping = 0;
+    // There's no advice for sequential or random access to a view. Reading
+    // it all in up front is the closest thing.
+    if (hint == FileReadHint_WillNeed) {
+        WIN32_MEMORY_RANGE_ENTRY range = { .VirtualAddress = base,
+                                           .NumberOfBytes = lead + nbytes };
+        CHECK_WARN(
+          PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0));
+    }
+    return base + lead;
+Error:
+    if (mapping)
+        CloseHandle(mapping);
+    return 0;
+}
+
+int
+file_unmap(const void* address, size_t nbytes)
+{
+    CHECK(address);
+    const size_t granularity = bytes_of_mapping_granularity();
+    const size_t lead = (uintptr_t)address % granularity;
+    uint8_t* base = (uint8_t*)address - lead;
+    // Starts writing the dirty pages, but doesn't wait for the disk.
+    CHECK_WARN(FlushViewOfFile(base, lead + nbytes));
+    EXPECT(UnmapViewOfFile(base), "Failed to unmap a file: %s", errstr());
+    return 1;
 Error:
     return 0;
 }
@@ -165,27 +866,232 @@ file_is_writable(const char* filename, size_t nbytes)
     return 0;
 }
 
+static int
+is_separator(char c)
+{
+    return c == '/' || c == '\\';
+}
+
+// Creates `path`, which is `n` bytes long and is changed in place but put
+// back, and any parents it's missing. The parents are only looked at when
+// `path` can't be created.
+static int
+directory_create_inner(char* path, size_t n)
+{
+    if (CreateDirectoryA(path, 0))
+        return 1;
+    const DWORD ecode = GetLastError();
+    if (ecode == ERROR_ALREADY_EXISTS) {
+        const DWORD attributes = GetFileAttributesA(path);
+        return attributes != INVALID_FILE_ATTRIBUTES &&
+               (attributes & FILE_ATTRIBUTE_DIRECTORY);
+    }
+    EXPECT(ecode == ERROR_PATH_NOT_FOUND, "%s", errstr());
+
+    // Cut `path` at the separator before its last component.
+    size_t i = n;
+    while (i > 0 && !is_separator(path[i - 1]))
+        --i;
+    while (i > 1 && is_separator(path[i - 1]))
+        --i;
+    CHECK(i > 0 && !is_separator(path[i - 1]) && is_separator(path[i]));
+    const char separator = path[i];
+    path[i] = '\0';
+    const int is_ok = directory_create_inner(path, i);
+    path[i] = separator;
+    CHECK(is_ok);
+    EXPECT(CreateDirectoryA(path, 0) ||
+             GetLastError() == ERROR_ALREADY_EXISTS,
+           "%s",
+           errstr());
+    return 1;
+Error:
+    return 0;
+}
+
+int
+directory_create(const char* path)
+{
+    char* copy = 0;
+    CHECK(path);
+    size_t n = strlen(path);
+    while (n > 1 && is_separator(path[n - 1]))
+        --n;
+    CHECK(n > 0);
+    CHECK(copy = malloc(n + 1));
+    memcpy(copy, path, n); // NOLINT
+    copy[n] = '\0';
+    EXPECT(directory_create_inner(copy, n),
+           "Failed to create the directory \"%s\"",
+           copy);
+    free(copy);
+    return 1;
+Error:
+    free(copy);
+    return 0;
+}
+
+// Handles are only limited by memory, to about 16 million per process.
+size_t
+file_get_handle_limit(void)
+{
+    return SIZE_MAX;
+}
+
 void*
-mem_alloc_default(size_t capacity);
+mem_alloc_default(void* address, size_t capacity, int node);
 
 void*
-mem_alloc_largepage(size_t capacity);
+mem_alloc_largepage(void* address, size_t capacity, int node);
+
+void
+mem_prefault(void* buf, size_t capacity);
+
+void
+mem_lock(void* buf, size_t capacity);
+
+// Allocates at `address`, or anywhere when `address` is NULL. When `node` is
+// not -1, the pages are placed on that NUMA node.
+static void*
+mem_alloc_at(void* address,
+             size_t capacity,
+             enum AllocatorHint hint,
+             int node)
+{
+    void* buf = (hint & AllocatorHint_LargePage)
+                  ? mem_alloc_largepage(address, capacity, node)
+                  : mem_alloc_default(address, capacity, node);
+    if (buf) {
+        if (hint & AllocatorHint_Locked)
+            mem_lock(buf, capacity);
+        if (hint & (AllocatorHint_Prefault | AllocatorHint_Locked))
+            mem_prefault(buf, capacity);
+    }
+    return buf;
+}
 
 void*
 memory_alloc(size_t capacity, enum AllocatorHint hint)
 {
-    switch (hint) {
-        case AllocatorHint_Default:
-            return mem_alloc_default(capacity);
-        case AllocatorHint_LargePage:
-            return mem_alloc_largepage(capacity);
-        default:
-            return 0;
+    return memory_alloc_on_node(capacity, 1, hint, -1);
+}
+
+void*
+memory_alloc_aligned(size_t capacity, size_t alignment, enum AllocatorHint hint)
+{
+    return memory_alloc_on_node(capacity, alignment, hint, -1);
+}
+
+int
+memory_node_count(void)
+{
+    ULONG highest = 0;
+    return GetNumaHighestNodeNumber(&highest) ? (int)highest + 1 : 1;
+}
+
+void*
+memory_alloc_on_node(size_t capacity,
+                     size_t alignment,
+                     enum AllocatorHint hint,
+                     int node)
+{
+    const int all = AllocatorHint_LargePage | AllocatorHint_Prefault |
+                    AllocatorHint_Locked | AllocatorHint_NodeLocal;
+    EXPECT((hint & ~all) == 0, "Unknown allocator hint: %d", (int)hint);
+    EXPECT(alignment && (alignment & (alignment - 1)) == 0,
+           "Alignment must be a power of two. Got %llu.",
+           (unsigned long long)alignment);
+    EXPECT(node >= -1 && node < memory_node_count(),
+           "Expected a NUMA node in [0, %d). Got %d.",
+           memory_node_count(),
+           node);
+    if (node < 0 && (hint & AllocatorHint_NodeLocal))
+        node = thread_current_node();
+
+    // VirtualAlloc() always returns addresses aligned to the allocation
+    // granularity (usually 64 kB).
+    SYSTEM_INFO sysinfo = { 0 };
+    GetSystemInfo(&sysinfo);
+    if (alignment <= sysinfo.dwAllocationGranularity)
+        return mem_alloc_at(NULL, capacity, hint, node);
+
+    // For coarser alignment, find a free range that's big enough, and then
+    // claim the aligned part of it. Another thread may claim the range in
+    // between, so retry a few times.
+    for (int attempt = 0; attempt < 8; ++attempt) {
+        uint8_t* p =
+          VirtualAlloc(NULL, capacity + alignment, MEM_RESERVE, PAGE_NOACCESS);
+        CHECK(p);
+        void* aligned =
+          (void*)(((uintptr_t)p + alignment - 1) & ~(uintptr_t)(alignment - 1));
+        VirtualFree(p, 0, MEM_RELEASE);
+        void* buf = mem_alloc_at(aligned, capacity, hint, node);
+        if (buf)
+            return buf;
     }
+    LOGE("Could not allocate %llu bytes aligned to %llu bytes",
+         (unsigned long long)capacity,
+         (unsigned long long)alignment);
+Error:
+    return 0;
+}
+
+// Writes to every page so they're all faulted in. Fresh VirtualAlloc()'d
+// memory is already zero. Large pages are always resident, so this is
+// cheap for them.
+void
+mem_prefault(void* buf, size_t capacity)
+{
+    SYSTEM_INFO sysinfo = { 0 };
+    GetSystemInfo(&sysinfo);
+    volatile uint8_t* const beg = (volatile uint8_t*)buf;
+    for (size_t i = 0; i < capacity; i += sysinfo.dwPageSize)
+        beg[i] = 0;
+}
+
+// Pins the pages in memory, growing the working set if the current quota is
+// too small. Large pages are never paged out, so there's nothing to do for
+// them.
+void
+mem_lock(void* buf, size_t capacity)
+{
+    PSAPI_WORKING_SET_EX_INFORMATION ws = { .VirtualAddress = buf };
+    if (QueryWorkingSetEx(GetCurrentProcess(), &ws, sizeof(ws)) &&
+        ws.VirtualAttributes.Valid && ws.VirtualAttributes.LargePage)
+        return;
+
+    if (VirtualLock(buf, capacity))
+        return;
+    if (GetLastError() == ERROR_WORKING_SET_QUOTA) {
+        SIZE_T mn = 0, mx = 0;
+        if (GetProcessWorkingSetSize(GetCurrentProcess(), &mn, &mx) &&
+            SetProcessWorkingSetSize(
+              GetCurrentProcess(), mn + capacity, mx + capacity) &&
+            VirtualLock(buf, capacity))
+            return;
+    }
+    LOGE("Allocated %llu bytes but could not lock them in memory: %s"
+         "The block will be prefaulted, but it may be paged out.",
+         (unsigned long long)capacity,
+         errstr());
+}
+
+// Reserves and commits pages at `address`, or anywhere when `address` is
+// NULL. When `node` is not -1, the pages are placed on that NUMA node.
+static void*
+mem_virtual_alloc(void* address, size_t capacity, DWORD type, int node)
+{
+    return (node < 0) ? VirtualAlloc(address, capacity, type, PAGE_READWRITE)
+                      : VirtualAllocExNuma(GetCurrentProcess(),
+                                           address,
+                                           capacity,
+                                           type,
+                                           PAGE_READWRITE,
+                                           (DWORD)node);
 }
 
 void*
-mem_alloc_largepage(size_t capacity_)
+mem_alloc_largepage(void* address, size_t capacity_, int node)
 {
 
     if (!globals.is_large_page_support_enabled_) {
@@ -206,27 +1112,27 @@ mem_alloc_largepage(size_t capacity_)
     }
 
     void* buf = 0;
-    if (globals.is_large_page_support_enabled_) {
-        const size_t capacity = (capacity_ < GetLargePageMinimum())
-                                  ? GetLargePageMinimum()
-                                  : capacity_;
+    if (globals.is_large_page_support_enabled_ && GetLargePageMinimum()) {
+        // Large page allocations must be a multiple of the large page size.
+        const size_t page = GetLargePageMinimum();
+        const size_t capacity = (capacity_ + page - 1) / page * page;
 
-        buf = VirtualAlloc(NULL,
-                           capacity,
-                           MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
-                           PAGE_READWRITE);
+        buf = mem_virtual_alloc(address,
+                                capacity,
+                                MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                                node);
     }
     if (!buf) {
-        buf = mem_alloc_default(capacity_);
+        buf = mem_alloc_default(address, capacity_, node);
     }
     return buf;
 }
 
 void*
-mem_alloc_default(size_t capacity)
+mem_alloc_default(void* address, size_t capacity, int node)
 {
-    return VirtualAlloc(
-      NULL, capacity, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    return mem_virtual_alloc(
+      address, capacity, MEM_RESERVE | MEM_COMMIT, node);
 }
 
 void
@@ -235,6 +1141,188 @@ memory_free(void* address)
     VirtualFree(address, 0, MEM_RELEASE);
 }
 
+int
+memory_query(const void* address, struct memory_info* info)
+{
+    CHECK(address);
+    CHECK(info);
+    PSAPI_WORKING_SET_EX_INFORMATION ws = { .VirtualAddress = (PVOID)address };
+    CHECK(QueryWorkingSetEx(GetCurrentProcess(), &ws, sizeof(ws)));
+    if (ws.VirtualAttributes.Valid && ws.VirtualAttributes.LargePage) {
+        *info = (struct memory_info){
+            .page_kind = MemoryPageKind_Large,
+            .bytes_of_page = GetLargePageMinimum(),
+            .is_prefaulted = 1,
+            .is_locked = 1,
+            .node = (int)ws.VirtualAttributes.Node,
+        };
+    } else {
+        SYSTEM_INFO sysinfo = { 0 };
+        GetSystemInfo(&sysinfo);
+        *info = (struct memory_info){
+            .page_kind = MemoryPageKind_Default,
+            .bytes_of_page = sysinfo.dwPageSize,
+            // Only the first page is inspected.
+            .is_prefaulted = (uint8_t)ws.VirtualAttributes.Valid,
+            .is_locked = (uint8_t)ws.VirtualAttributes.Locked,
+            // Reports where the first page resides, whether or not a node
+            // was requested.
+            .node = ws.VirtualAttributes.Valid
+                      ? (int)ws.VirtualAttributes.Node
+                      : -1,
+        };
+    }
+    // Blocks start their allocation, so this is the whole committed run.
+    MEMORY_BASIC_INFORMATION region = { 0 };
+    if (VirtualQuery(address, &region, sizeof(region)))
+        info->bytes_of_mapping = region.RegionSize;
+    return 1;
+Error:
+    return 0;
+}
+
+void*
+memory_map_mirrored(size_t* capacity_bytes)
+{
+    HANDLE mapping = NULL;
+    uint8_t* views[2] = { 0 };
+    size_t n = 0;
+    CHECK(capacity_bytes && *capacity_bytes);
+
+    // Views have to start on the allocation granularity (usually 64 kB).
+    SYSTEM_INFO sysinfo = { 0 };
+    GetSystemInfo(&sysinfo);
+    n = (*capacity_bytes + sysinfo.dwAllocationGranularity - 1) /
+        sysinfo.dwAllocationGranularity * sysinfo.dwAllocationGranularity;
+
+    CHECK(mapping = CreateFileMappingA(INVALID_HANDLE_VALUE,
+                                       NULL,
+                                       PAGE_READWRITE,
+                                       (DWORD)((uint64_t)n >> 32),
+                                       (DWORD)n,
+                                       NULL));
+
+    // Find a free range big enough for both views, then map the views into
+    // it. Another thread may claim the range in between, so retry a few
+    // times.
+    for (int attempt = 0; attempt < 8; ++attempt) {
+        uint8_t* p = VirtualAlloc(NULL, 2 * n, MEM_RESERVE, PAGE_NOACCESS);
+        CHECK(p);
+        VirtualFree(p, 0, MEM_RELEASE);
+        views[0] = MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, n, p);
+        views[1] =
+          MapViewOfFileEx(mapping, FILE_MAP_ALL_ACCESS, 0, 0, n, p + n);
+        if (views[0] == p && views[1] == p + n) {
+            // The views keep the mapping alive.
+            CloseHandle(mapping);
+            *capacity_bytes = n;
+            return p;
+        }
+        for (int i = 0; i < 2; ++i) {
+            if (views[i])
+                UnmapViewOfFile(views[i]);
+            views[i] = 0;
+        }
+    }
+    LOGE("Could not find room to map %llu bytes twice", (unsigned long long)n);
+Error:
+    if (mapping)
+        CloseHandle(mapping);
+    return 0;
+}
+
+void
+memory_unmap_mirrored(void* address, size_t capacity_bytes)
+{
+    if (address) {
+        CHECK_WARN(UnmapViewOfFile(address));
+        CHECK_WARN(UnmapViewOfFile((uint8_t*)address + capacity_bytes));
+    }
+}
+
+int
+clock_enable_tsc(void)
+{
+    return 0;
+}
+
+uint64_t
+clock_now_ns(void)
+{
+    LARGE_INTEGER t = { 0 }, f = { 0 };
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&t);
+    return (uint64_t)(t.QuadPart / f.QuadPart) * 1000000000ULL +
+           (uint64_t)(t.QuadPart % f.QuadPart) * 1000000000ULL /
+             (uint64_t)f.QuadPart;
+}
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION (0x00000002)
+#endif
+
+// Each thread keeps its own timer, in fiber-local storage, so it can be
+// closed when the thread exits. INVALID_HANDLE_VALUE marks a thread that
+// couldn't create one.
+static INIT_ONCE g_sleep_timer_once = INIT_ONCE_STATIC_INIT;
+static DWORD g_sleep_timer_index = FLS_OUT_OF_INDEXES;
+
+static void WINAPI
+sleep_timer_close(void* timer)
+{
+    if (timer && timer != INVALID_HANDLE_VALUE)
+        CloseHandle(timer);
+}
+
+static BOOL CALLBACK
+sleep_timer_index_init(INIT_ONCE* once, void* parameter, void** context)
+{
+    g_sleep_timer_index = FlsAlloc(sleep_timer_close);
+    return TRUE;
+}
+
+// Returns this thread's timer, or 0 when it doesn't have one.
+static HANDLE
+sleep_timer(void)
+{
+    InitOnceExecuteOnce(&g_sleep_timer_once, sleep_timer_index_init, 0, 0);
+    if (g_sleep_timer_index == FLS_OUT_OF_INDEXES)
+        return 0;
+    HANDLE timer = FlsGetValue(g_sleep_timer_index);
+    if (!timer) {
+        timer = CreateWaitableTimerExW(0,
+                                       0,
+                                       CREATE_WAITABLE_TIMER_HIGH_RESOLUTION,
+                                       TIMER_ALL_ACCESS);
+        if (!timer)
+            timer = INVALID_HANDLE_VALUE;
+        if (!FlsSetValue(g_sleep_timer_index, timer)) {
+            sleep_timer_close(timer);
+            return 0;
+        }
+    }
+    return (timer == INVALID_HANDLE_VALUE) ? 0 : timer;
+}
+
+void
+clock_sleep_until_ns(uint64_t deadline_ns)
+{
+    // High resolution timers wake within about half a millisecond. Windows
+    // before 10 (1803) doesn't have them, so falls back to Sleep(), which
+    // rounds up to the scheduler's tick.
+    HANDLE timer = sleep_timer();
+    uint64_t now = 0;
+    while ((now = clock_now_ns()) < deadline_ns) {
+        const uint64_t dt = deadline_ns - now;
+        // Negative is relative, in 100 ns units.
+        const LARGE_INTEGER due = { .QuadPart = -(LONGLONG)((dt + 99) / 100) };
+        if (timer && SetWaitableTimer(timer, &due, 0, 0, 0, FALSE))
+            WaitForSingleObject(timer, INFINITE);
+        else
+            Sleep((DWORD)((dt + 999999) / 1000000));
+    }
+}
+
 void
 clock_init(struct clock* clock)
 {
@@ -316,8 +1404,11 @@ clock_toc(struct clock* clock)
 double
 clock_toc_ms(struct clock* clock)
 {
-    int64_t ms = clock_toc(clock) * 1000 / clock->ticks_per_second.QuadPart;
-    return (double)ms;
+    // Split into whole seconds first, so sub-millisecond times aren't lost
+    // and large ones don't overflow.
+    const int64_t t = clock_toc(clock);
+    const int64_t f = clock->ticks_per_second.QuadPart;
+    return 1e3 * (double)(t / f) + 1e3 * (double)(t % f) / (double)f;
 }
 
 void
@@ -390,6 +1481,28 @@ condition_variable_wait(struct condition_variable* restrict self,
     SleepConditionVariableSRW(&self->inner_, &lock->inner_, INFINITE, 0);
 }
 
+// Rounds up, so waits are never cut short, and stays below INFINITE.
+static DWORD
+timeout_ms_of_ns(uint64_t timeout_ns)
+{
+    const uint64_t ms = timeout_ns / 1000000 + (timeout_ns % 1000000 != 0);
+    return (ms < INFINITE) ? (DWORD)ms : INFINITE - 1;
+}
+
+int
+condition_variable_wait_for(struct condition_variable* restrict self,
+                            struct lock* restrict lock,
+                            uint64_t timeout_ns)
+{
+    if (SleepConditionVariableSRW(
+          &self->inner_, &lock->inner_, timeout_ms_of_ns(timeout_ns), 0))
+        return 1;
+    if (GetLastError() == ERROR_TIMEOUT)
+        return 0;
+    LOGE("SleepConditionVariableSRW failed: %s", errstr());
+    return 0;
+}
+
 void
 event_init(struct event* self)
 {
@@ -414,6 +1527,43 @@ event_wait(struct event* self)
     WaitForSingleObject(self->inner_, INFINITE);
 }
 
+int
+event_wait_for(struct event* self, uint64_t timeout_ns)
+{
+    const DWORD ecode =
+      WaitForSingleObject(self->inner_, timeout_ms_of_ns(timeout_ns));
+    if (ecode == WAIT_OBJECT_0)
+        return 1;
+    if (ecode != WAIT_TIMEOUT)
+        LOGE("WaitForSingleObject failed: %s", errstr());
+    return 0;
+}
+
+int
+address_wait(volatile uint32_t* address, uint32_t expected, uint64_t timeout_ns)
+{
+    const DWORD ms =
+      (timeout_ns == UINT64_MAX) ? INFINITE : timeout_ms_of_ns(timeout_ns);
+    if (!WaitOnAddress(address, &expected, sizeof(expected), ms)) {
+        if (GetLastError() == ERROR_TIMEOUT)
+            return 0;
+        LOGE("WaitOnAddress failed: %s", errstr());
+    }
+    return 1;
+}
+
+void
+address_wake_one(volatile uint32_t* address)
+{
+    WakeByAddressSingle((PVOID)address);
+}
+
+void
+address_wake_all(volatile uint32_t* address)
+{
+    WakeByAddressAll((PVOID)address);
+}
+
 void
 thread_init(struct thread* self)
 {
@@ -444,6 +1594,35 @@ thread_join(struct thread* self)
     }
 }
 
+int
+thread_bind_to_node(struct thread* self, int node)
+{
+    GROUP_AFFINITY affinity = { 0 };
+    EXPECT(node >= 0 && node < memory_node_count(),
+           "Expected a NUMA node in [0, %d). Got %d.",
+           memory_node_count(),
+           node);
+    CHECK(GetNumaNodeProcessorMaskEx((USHORT)node, &affinity));
+    HANDLE thread = self ? self->inner_ : GetCurrentThread();
+    EXPECT(thread != INVALID_HANDLE_VALUE, "Expected a running thread.");
+    EXPECT(SetThreadGroupAffinity(thread, &affinity, NULL),
+           "Could not bind thread to NUMA node %d: %s",
+           node,
+           errstr());
+    return 1;
+Error:
+    return 0;
+}
+
+int
+thread_current_node(void)
+{
+    PROCESSOR_NUMBER processor = { 0 };
+    USHORT node = 0;
+    GetCurrentProcessorNumberEx(&processor);
+    return GetNumaProcessorNodeEx(&processor, &node) ? (int)node : 0;
+}
+
 int
 lib_open(struct lib* self, const char* absolute_path)
 {
@@ -498,7 +1677,7 @@ join(const char** strings)
         nbytes += strlen(*s);
         nstrings += 1;
     }
-    EXPECT(out = mem_alloc_default(nbytes + 1),
+    EXPECT(out = mem_alloc_default(NULL, nbytes + 1, -1),
            "Failed to allocate %llu bytes",
            nbytes);
     char* cur = out;
@@ -0,0 +1,248 @@
+#include "write.pool.h"
+#include "queue.h"
+#include "logger.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#define LOG(...) aq_logger(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOGE(...) aq_logger(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            LOGE(__VA_ARGS__);                                                 \
+            goto Error;                                                        \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false:\n\t%s", #e)
+
+#define countof(e) (sizeof(e) / sizeof(*(e)))
+
+// Enough to keep a few devices busy without oversubscribing small machines.
+#define WRITE_POOL_THREAD_COUNT (4)
+#define WRITE_POOL_QUEUE_CAPACITY (1024)
+
+struct write_tracker
+{
+    _Atomic uint32_t in_flight;
+    _Atomic int is_failed;
+};
+
+struct write_request
+{
+    struct write_tracker* tracker;
+    const struct file* file;
+    uint64_t offset;
+    const uint8_t* beg;
+    const uint8_t* end;
+    file_write_callback_t on_done;
+    void* ctx;
+};
+
+enum write_pool_state
+{
+    WritePoolState_Stopped,
+    WritePoolState_Starting,
+    WritePoolState_Running,
+    WritePoolState_Failed,
+};
+
+static struct
+{
+    _Atomic int state;
+    // Counts trackers whose writes have all finished. A tracker can be
+    // destroyed as soon as it sees none in flight, so waiters sleep on this
+    // instead, which lives as long as the process.
+    _Atomic uint32_t drained;
+    struct queue requests;
+    struct thread threads[WRITE_POOL_THREAD_COUNT];
+} g_write_pool;
+
+static void
+write_pool_worker(void* arg)
+{
+    (void)arg;
+    struct write_request* req = 0;
+    while ((req = queue_pop(&g_write_pool.requests))) {
+        struct write_tracker* tracker = req->tracker;
+        const int is_ok =
+          file_write(req->file, req->offset, req->beg, req->end);
+        if (!is_ok)
+            atomic_store(&tracker->is_failed, 1);
+        if (req->on_done)
+            req->on_done(req->ctx, is_ok);
+        free(req);
+        if (atomic_fetch_sub(&tracker->in_flight, 1) == 1) {
+            atomic_fetch_add(&g_write_pool.drained, 1);
+            address_wake_all((volatile uint32_t*)&g_write_pool.drained);
+        }
+    }
+}
+
+static int
+write_pool_start_threads(void)
+{
+    CHECK(queue_init(&g_write_pool.requests, WRITE_POOL_QUEUE_CAPACITY));
+    for (size_t i = 0; i < countof(g_write_pool.threads); ++i) {
+        thread_init(g_write_pool.threads + i);
+        CHECK(thread_create(g_write_pool.threads + i, write_pool_worker, 0));
+    }
+    return 1;
+Error:
+    return 0;
+}
+
+// Starts the threads the first time it's called. The threads run until the
+// process exits.
+static int
+write_pool_start(void)
+{
+    int state = WritePoolState_Stopped;
+    if (atomic_compare_exchange_strong(
+          &g_write_pool.state, &state, WritePoolState_Starting)) {
+        state = write_pool_start_threads() ? WritePoolState_Running
+                                           : WritePoolState_Failed;
+        atomic_store(&g_write_pool.state, state);
+    }
+    // Another thread may still be starting the pool.
+    while ((state = atomic_load(&g_write_pool.state)) ==
+           WritePoolState_Starting)
+        clock_sleep_ms(0, 2.0f);
+    return state == WritePoolState_Running;
+}
+
+struct write_tracker*
+write_tracker_create(void)
+{
+    struct write_tracker* self = 0;
+    CHECK(self = malloc(sizeof(*self)));
+    atomic_init(&self->in_flight, 0);
+    atomic_init(&self->is_failed, 0);
+    return self;
+Error:
+    return 0;
+}
+
+void
+write_tracker_destroy(struct write_tracker* self)
+{
+    if (self) {
+        write_tracker_wait(self);
+        free(self);
+    }
+}
+
+int
+write_tracker_wait(struct write_tracker* self)
+{
+    for (;;) {
+        // Read before `in_flight`, so a tracker draining in between changes
+        // it.
+        const uint32_t seen = atomic_load(&g_write_pool.drained);
+        if (!atomic_load(&self->in_flight))
+            break;
+        address_wait(
+          (volatile uint32_t*)&g_write_pool.drained, seen, UINT64_MAX);
+    }
+    return !atomic_exchange(&self->is_failed, 0);
+}
+
+int
+write_pool_submit(struct write_tracker* tracker,
+                  const struct file* file,
+                  uint64_t offset,
+                  const uint8_t* beg,
+                  const uint8_t* end,
+                  file_write_callback_t on_done,
+                  void* ctx)
+{
+    struct write_request* req = 0;
+    CHECK(tracker);
+    CHECK(beg <= end);
+    EXPECT(write_pool_start(), "Failed to start the file writer threads.");
+    CHECK(req = malloc(sizeof(*req)));
+    *req = (struct write_request){
+        .tracker = tracker,
+        .file = file,
+        .offset = offset,
+        .beg = beg,
+        .end = end,
+        .on_done = on_done,
+        .ctx = ctx,
+    };
+    atomic_fetch_add(&tracker->in_flight, 1);
+    queue_push(&g_write_pool.requests, req);
+    return 1;
+Error:
+    return 0;
+}
+
+//
+//  UNIT TESTS
+//
+
+#ifndef NO_UNIT_TESTS
+
+#include <stdio.h>
+#include <string.h>
+
+static void
+count_completion(void* ctx, int is_ok)
+{
+    if (is_ok)
+        atomic_fetch_add((_Atomic int*)ctx, 1);
+}
+
+int
+unit_test__write_pool_writes_every_request()
+{
+    const char filename[] = "write-pool-unit-test.bin";
+    struct file file = { 0 };
+    struct write_tracker* tracker = 0;
+    FILE* fp = 0;
+    int is_open = 0;
+    _Atomic int ncompleted = 0;
+    uint8_t buf[64][256];
+
+    for (int i = 0; i < 64; ++i)
+        memset(buf[i], i, sizeof(buf[i]));
+
+    remove(filename);
+    CHECK(is_open = file_create(&file, filename, sizeof(filename)));
+    CHECK(tracker = write_tracker_create());
+    for (int i = 0; i < 64; ++i) {
+        CHECK(write_pool_submit(tracker,
+                                &file,
+                                (uint64_t)i * sizeof(buf[i]),
+                                buf[i],
+                                buf[i] + sizeof(buf[i]),
+                                count_completion,
+                                &ncompleted));
+    }
+    CHECK(write_tracker_wait(tracker));
+    CHECK(atomic_load(&ncompleted) == 64);
+    write_tracker_destroy(tracker);
+    tracker = 0;
+    file_close(&file);
+    is_open = 0;
+
+    CHECK(fp = fopen(filename, "rb"));
+    for (int i = 0; i < 64; ++i) {
+        uint8_t actual[sizeof(buf[i])];
+        CHECK(fread(actual, 1, sizeof(actual), fp) == sizeof(actual));
+        CHECK(memcmp(actual, buf[i], sizeof(actual)) == 0);
+    }
+    fclose(fp);
+    remove(filename);
+    return 1;
+Error:
+    write_tracker_destroy(tracker);
+    if (is_open)
+        file_close(&file);
+    if (fp)
+        fclose(fp);
+    remove(filename);
+    return 0;
+}
+
+#endif // NO_UNIT_TESTS
@@ -0,0 +1,41 @@
+#ifndef H_ACQUIRE_PLATFORM_WRITE_POOL_V0
+#define H_ACQUIRE_PLATFORM_WRITE_POOL_V0
+
+#include "platform.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// Counts the writes in flight for one file, and whether any failed.
+    struct write_tracker;
+
+    /// Used by the platform backends to implement `file_write_async()` with
+    /// `file_write()` calls on a small set of threads shared by every file.
+    /// The threads are started the first time a write is submitted.
+
+    struct write_tracker* write_tracker_create(void);
+
+    /// @brief Waits for writes in flight, then frees `self`.
+    void write_tracker_destroy(struct write_tracker* self);
+
+    /// @brief Wait for all writes submitted with `self` to finish.
+    /// @return 1 when they all succeeded since the last wait, otherwise 0
+    int write_tracker_wait(struct write_tracker* self);
+
+    /// @brief Queue `[beg,end)` to be written to `file` at `offset`.
+    /// @return 1 when the write was queued, otherwise 0
+    int write_pool_submit(struct write_tracker* tracker,
+                          const struct file* file,
+                          uint64_t offset,
+                          const uint8_t* beg,
+                          const uint8_t* end,
+                          file_write_callback_t on_done,
+                          void* ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H_ACQUIRE_PLATFORM_WRITE_POOL_V0
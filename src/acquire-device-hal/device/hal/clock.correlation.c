@@ -0,0 +1,276 @@
+#include "clock.correlation.h"
+#include "logger.h"
+
+#include <stdlib.h>
+
+#define LOG(...) aq_logger(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOGE(...) aq_logger(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            LOGE(__VA_ARGS__);                                                 \
+            goto Error;                                                        \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false:\n\t%s", #e)
+
+// Samples fit with equal weight before outliers are looked for. The typical
+// residual is measured on them once the fit has settled.
+#define WARMUP_COUNT (16)
+
+// Residuals more than this many typical residuals from the fit are
+// down-weighted. The typical residual is a mean absolute residual, which is
+// about 0.8 standard deviations for normal noise.
+#define HUBER_K (3.0)
+
+// Host clock tics. Keeps a perfect fit from rejecting the next sample for
+// being off by rounding.
+#define MIN_RESIDUAL (1.0)
+
+struct clock_correlation
+{
+    uint64_t mask;
+    double nominal_rate;
+    // Each sample's weight decays by this much per later sample.
+    double lambda;
+
+    // Hardware times are unwrapped into `x`, tics since the first sample.
+    // Host times are kept as `y`, tics since the first sample.
+    uint64_t first_hardware;
+    uint64_t first_host;
+    uint64_t last_hardware;
+    int64_t last_x;
+
+    // The weighted fit, `y = my + rate * (x - mx)`, from running weighted
+    // means and co-moments.
+    double weight, mx, my, cxx, cxy;
+    double rate;
+    double residual;
+
+    double warmup_x[WARMUP_COUNT];
+    double warmup_y[WARMUP_COUNT];
+
+    uint64_t sample_count;
+    uint64_t outlier_count;
+    uint64_t wrap_count;
+};
+
+static double
+absd(double v)
+{
+    return v < 0 ? -v : v;
+}
+
+// Signed distance from the last hardware time to `hardware`, taking the
+// shorter way around the counter.
+static int64_t
+hardware_delta(const struct clock_correlation* self, uint64_t hardware)
+{
+    const uint64_t d = (hardware - self->last_hardware) & self->mask;
+    return (d > self->mask / 2) ? -(int64_t)(self->mask - d) - 1 : (int64_t)d;
+}
+
+static double
+predict(const struct clock_correlation* self, double x)
+{
+    return self->my + self->rate * (x - self->mx);
+}
+
+// Exponentially weighted incremental means and co-moments (West, 1979).
+static void
+fit(struct clock_correlation* self, double x, double y, double w)
+{
+    self->weight = self->lambda * self->weight + w;
+    const double dx = x - self->mx;
+    self->mx += w / self->weight * dx;
+    self->my += w / self->weight * (y - self->my);
+    self->cxx = self->lambda * self->cxx + w * dx * (x - self->mx);
+    self->cxy = self->lambda * self->cxy + w * dx * (y - self->my);
+    if (self->cxx > 0)
+        self->rate = self->cxy / self->cxx;
+}
+
+enum DeviceStatusCode
+clock_correlation_init(struct ClockCorrelation* self,
+                       uint8_t counter_bits,
+                       double nominal_rate,
+                       uint32_t window)
+{
+    struct clock_correlation* impl = 0;
+    CHECK(self);
+    self->impl = 0;
+    EXPECT(counter_bits >= 1 && counter_bits <= 64,
+           "Expected a counter width from 1 to 64 bits. Got %d.",
+           (int)counter_bits);
+    CHECK(nominal_rate >= 0);
+
+    CHECK(impl = calloc(1, sizeof(*impl)));
+    impl->mask =
+      (counter_bits == 64) ? UINT64_MAX : (((uint64_t)1 << counter_bits) - 1);
+    impl->nominal_rate = (nominal_rate > 0) ? nominal_rate : 1.0;
+    impl->rate = impl->nominal_rate;
+    impl->lambda = 1.0 - 1.0 / (double)(window ? window : 1000);
+    self->impl = impl;
+    return Device_Ok;
+Error:
+    return Device_Err;
+}
+
+void
+clock_correlation_destroy(struct ClockCorrelation* self)
+{
+    if (self) {
+        free(self->impl);
+        self->impl = 0;
+    }
+}
+
+int
+clock_correlation_update(struct ClockCorrelation* self,
+                         uint64_t hardware,
+                         uint64_t host)
+{
+    CHECK(self && self->impl);
+    struct clock_correlation* impl = (struct clock_correlation*)self->impl;
+
+    if (impl->sample_count == 0) {
+        impl->first_hardware = impl->last_hardware = hardware;
+        impl->first_host = host;
+    }
+    const int64_t delta = hardware_delta(impl, hardware);
+    if (delta > 0 && hardware < impl->last_hardware)
+        ++impl->wrap_count;
+    impl->last_x += delta;
+    impl->last_hardware = hardware;
+
+    const double x = (double)impl->last_x;
+    const double y = (double)(int64_t)(host - impl->first_host);
+    const uint64_t n = impl->sample_count++;
+    if (n < WARMUP_COUNT) {
+        impl->warmup_x[n] = x;
+        impl->warmup_y[n] = y;
+        fit(impl, x, y, 1.0);
+        if (n + 1 == WARMUP_COUNT) {
+            double sum = 0;
+            for (int i = 0; i < WARMUP_COUNT; ++i) {
+                const double p = predict(impl, impl->warmup_x[i]);
+                sum += absd(impl->warmup_y[i] - p);
+            }
+            impl->residual = sum / WARMUP_COUNT;
+        }
+        return 1;
+    }
+
+    const double r = absd(y - predict(impl, x));
+    const double limit =
+      HUBER_K * (impl->residual > MIN_RESIDUAL ? impl->residual : MIN_RESIDUAL);
+    const int is_inlier = r <= limit;
+    impl->outlier_count += !is_inlier;
+    fit(impl, x, y, is_inlier ? 1.0 : limit / r);
+    impl->residual = impl->lambda * impl->residual +
+                     (1.0 - impl->lambda) * (is_inlier ? r : limit);
+    return is_inlier;
+Error:
+    return 0;
+}
+
+int
+clock_correlation_update_from_frame(struct ClockCorrelation* self,
+                                    const struct VideoFrame* frame)
+{
+    CHECK(frame);
+    return clock_correlation_update(
+      self, frame->timestamps.hardware, frame->timestamps.acq_thread);
+Error:
+    return 0;
+}
+
+uint64_t
+clock_correlation_to_host(const struct ClockCorrelation* self,
+                          uint64_t hardware)
+{
+    const struct clock_correlation* impl =
+      (const struct clock_correlation*)self->impl;
+    if (!impl->sample_count)
+        return 0;
+    const double x = (double)(impl->last_x + hardware_delta(impl, hardware));
+    const double y = predict(impl, x);
+    return impl->first_host + (uint64_t)(int64_t)(y < 0 ? y - 0.5 : y + 0.5);
+}
+
+void
+clock_correlation_get_estimate(const struct ClockCorrelation* self,
+                               struct ClockCorrelationEstimate* estimate)
+{
+    const struct clock_correlation* impl =
+      (const struct clock_correlation*)self->impl;
+    *estimate = (struct ClockCorrelationEstimate){
+        .rate = impl->rate,
+        .offset = (double)impl->first_host + impl->my -
+                  impl->rate * (impl->mx + (double)impl->first_hardware),
+        .residual = impl->residual,
+        .sample_count = impl->sample_count,
+        .outlier_count = impl->outlier_count,
+        .wrap_count = impl->wrap_count,
+    };
+}
+
+//
+//  UNIT TESTS
+//
+
+#ifndef NO_UNIT_TESTS
+
+int
+unit_test__clock_correlation_follows_a_wrapping_counter()
+{
+    // A 16-bit, 1 MHz counter, read every 100 us, against a host clock in ns
+    // that runs 50 ppm fast. Frames arrive within 50 ns, except every 37th,
+    // which is 0.5 ms late.
+    const double rate = 1000.05;
+    const uint64_t origin = 5000000000ULL;
+    struct ClockCorrelation correlation = { 0 };
+    struct ClockCorrelationEstimate estimate = { 0 };
+    uint32_t seed = 1;
+    uint64_t ticks = 0;
+    int noutliers = 0;
+
+    CHECK(Device_Ok == clock_correlation_init(&correlation, 16, 1000.0, 0));
+    for (int i = 0; i < 3000; ++i, ticks += 100) {
+        seed = seed * 1664525u + 1013904223u;
+        const uint64_t jitter = (seed >> 16) % 50;
+        const uint64_t late = (i % 37 == 36) ? 500000 : 0;
+        const uint64_t host =
+          origin + (uint64_t)(rate * (double)ticks) + jitter + late;
+        noutliers +=
+          !clock_correlation_update(&correlation, ticks & 0xffff, host);
+    }
+
+    clock_correlation_get_estimate(&correlation, &estimate);
+    CHECK(estimate.sample_count == 3000);
+    CHECK(estimate.wrap_count == 4);
+    CHECK(noutliers >= 3000 / 37 - 1);
+    CHECK((uint64_t)noutliers == estimate.outlier_count);
+    EXPECT(absd(estimate.rate - rate) < 1e-3,
+           "Expected a rate of %f. Got %f.",
+           rate,
+           estimate.rate);
+
+    // A time just past the last sample, after the counter wrapped.
+    const uint64_t expected = origin + (uint64_t)(rate * (double)ticks);
+    const uint64_t actual =
+      clock_correlation_to_host(&correlation, ticks & 0xffff);
+    const double error = (double)(int64_t)(actual - expected);
+    EXPECT(absd(error) < 100,
+           "Expected %llu. Got %llu.",
+           (unsigned long long)expected,
+           (unsigned long long)actual);
+
+    clock_correlation_destroy(&correlation);
+    return 1;
+Error:
+    clock_correlation_destroy(&correlation);
+    return 0;
+}
+
+#endif // NO_UNIT_TESTS
@@ -0,0 +1,94 @@
+#ifndef H_ACQUIRE_HAL_CLOCK_CORRELATION_V0
+#define H_ACQUIRE_HAL_CLOCK_CORRELATION_V0
+
+#include "device/kit/camera.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// Relates a device's hardware clock to the host clock, so frames from
+    /// several cameras, or frames and stage positions, can be put on one
+    /// timeline.
+    ///
+    /// Feed it the pairs in each `VideoFrame`: `timestamps.hardware` and
+    /// `timestamps.acq_thread`, which comes from `clock_tic()`. It keeps a
+    /// running linear fit, `host = offset + rate * hardware`, that weighs
+    /// recent frames most, so it follows slow drift between the clocks.
+    ///
+    /// The host timestamp is taken when the frame reaches the host, so it
+    /// includes delivery delays. Most are small, but some frames arrive
+    /// late. Residuals far from the fit's typical residual are given less
+    /// weight (a Huber fit), so late frames barely move the fit.
+    ///
+    /// Hardware counters that are narrower than 64 bits wrap around. Each
+    /// counter value is unwrapped against the last one, so they must arrive
+    /// less than half the counter's range apart.
+    ///
+    /// Only one thread at a time may use a correlation.
+    struct ClockCorrelation
+    {
+        void* impl;
+    };
+
+    struct ClockCorrelationEstimate
+    {
+        /// Host clock tics per hardware clock tic.
+        double rate;
+        /// The host time of hardware time 0, after unwrapping.
+        double offset;
+        /// The typical distance of a sample from the fit, in host clock
+        /// tics.
+        double residual;
+        /// Samples passed to `clock_correlation_update()`.
+        uint64_t sample_count;
+        /// Samples that were far enough from the fit to be down-weighted.
+        uint64_t outlier_count;
+        /// Times the hardware counter wrapped around.
+        uint64_t wrap_count;
+    };
+
+    /// @brief Start a correlation with no samples.
+    /// @param[in] counter_bits The width of the hardware counter, from 1 to
+    ///                         64.
+    /// @param[in] nominal_rate Host clock tics per hardware clock tic, when
+    ///                         known, for converting before there are two
+    ///                         samples. 0 means 1.
+    /// @param[in] window Roughly how many recent samples the fit follows.
+    ///                   0 picks 1000.
+    /// @returns Device_Ok on success, otherwise Device_Err.
+    enum DeviceStatusCode clock_correlation_init(struct ClockCorrelation* self,
+                                                 uint8_t counter_bits,
+                                                 double nominal_rate,
+                                                 uint32_t window);
+
+    void clock_correlation_destroy(struct ClockCorrelation* self);
+
+    /// @brief Add the hardware and host times of one event to the fit.
+    /// @returns 1 when the sample was close to the fit, or 0 when it was
+    ///          down-weighted as an outlier.
+    int clock_correlation_update(struct ClockCorrelation* self,
+                                 uint64_t hardware,
+                                 uint64_t host);
+
+    /// @brief Add the timestamps of `frame` to the fit.
+    int clock_correlation_update_from_frame(struct ClockCorrelation* self,
+                                            const struct VideoFrame* frame);
+
+    /// @brief Convert a hardware time to host time with the current fit.
+    /// @details A handful of arithmetic operations, cheap enough to call for
+    ///          every frame.
+    /// @returns The host time, in `clock_tic()` tics.
+    uint64_t clock_correlation_to_host(const struct ClockCorrelation* self,
+                                       uint64_t hardware);
+
+    void clock_correlation_get_estimate(
+      const struct ClockCorrelation* self,
+      struct ClockCorrelationEstimate* estimate);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H_ACQUIRE_HAL_CLOCK_CORRELATION_V0
@@ -0,0 +1,439 @@
+#include "frame.pool.h"
+#include "camera.h"
+#include "logger.h"
+#include "platform.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG(...) aq_logger(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOGE(...) aq_logger(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            LOGE(__VA_ARGS__);                                                 \
+            goto Error;                                                        \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false:\n\t%s", #e)
+
+// Slots start on cache line boundaries so neighboring frames don't share
+// lines.
+#define SLOT_ALIGNMENT (64)
+
+struct frame_pool
+{
+    struct ImageShape shape;
+    uint8_t* slots;
+    size_t bytes_of_slot;
+    uint32_t slot_count;
+
+    // Free list. A Treiber stack of slot indices.
+    // The low 32 bits of `head` hold 1 + the index of the top slot, or 0 when
+    // the stack is empty. The high 32 bits are a tag that's incremented on
+    // every update, which guards against ABA.
+    _Atomic uint64_t head;
+    // `next[i]` holds 1 + the index of the slot below slot `i`, or 0.
+    _Atomic uint32_t* next;
+
+    _Atomic size_t in_use;
+    _Atomic size_t high_water_mark;
+    _Atomic uint64_t exhausted_count;
+};
+
+static size_t
+bytes_of_image(const struct ImageShape* shape)
+{
+    const size_t nelements =
+      (shape->strides.planes > 0)
+        ? (size_t)shape->strides.planes * shape->dims.planes
+        : (size_t)shape->dims.channels * shape->dims.width *
+            shape->dims.height * shape->dims.planes;
+    return nelements * bytes_of_type(shape->type);
+}
+
+static struct VideoFrame*
+slot_at(const struct frame_pool* self, uint32_t index)
+{
+    return (struct VideoFrame*)(self->slots +
+                                (size_t)index * self->bytes_of_slot);
+}
+
+static void
+push(struct frame_pool* self, uint32_t index)
+{
+    uint64_t head = atomic_load_explicit(&self->head, memory_order_relaxed);
+    uint64_t desired = 0;
+    do {
+        atomic_store_explicit(
+          &self->next[index], (uint32_t)head, memory_order_relaxed);
+        desired = (((head >> 32) + 1) << 32) | (index + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&self->head,
+                                                    &head,
+                                                    desired,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+// Returns 1 + the index of the popped slot, or 0 when the stack is empty.
+static uint32_t
+pop(struct frame_pool* self)
+{
+    uint64_t head = atomic_load_explicit(&self->head, memory_order_acquire);
+    uint64_t desired = 0;
+    do {
+        const uint32_t top = (uint32_t)head;
+        if (!top)
+            return 0;
+        const uint32_t next =
+          atomic_load_explicit(&self->next[top - 1], memory_order_relaxed);
+        desired = (((head >> 32) + 1) << 32) | next;
+    } while (!atomic_compare_exchange_weak_explicit(&self->head,
+                                                    &head,
+                                                    desired,
+                                                    memory_order_acquire,
+                                                    memory_order_acquire));
+    return (uint32_t)head;
+}
+
+enum DeviceStatusCode
+frame_pool_init(struct FramePool* self,
+                const struct ImageShape* shape,
+                size_t slot_count)
+{
+    struct frame_pool* pool = 0;
+    CHECK(self);
+    CHECK(shape);
+    self->impl = 0;
+    EXPECT(slot_count > 0 && slot_count < UINT32_MAX,
+           "Expected between 1 and %u slots. Got %llu.",
+           UINT32_MAX - 1,
+           (unsigned long long)slot_count);
+
+    const size_t bytes_of_slot =
+      (sizeof(struct VideoFrame) + bytes_of_image(shape) + SLOT_ALIGNMENT - 1) /
+      SLOT_ALIGNMENT * SLOT_ALIGNMENT;
+
+    CHECK(pool = malloc(sizeof(*pool) + slot_count * sizeof(*pool->next)));
+    *pool = (struct frame_pool){
+        .shape = *shape,
+        .bytes_of_slot = bytes_of_slot,
+        .slot_count = (uint32_t)slot_count,
+        .next = (_Atomic uint32_t*)(pool + 1),
+    };
+    // Large pages cut TLB misses when walking many frames. Prefaulting means
+    // the first frames acquired don't pay for page faults.
+    EXPECT(pool->slots = memory_alloc_aligned(
+             slot_count * bytes_of_slot,
+             SLOT_ALIGNMENT,
+             (enum AllocatorHint)(AllocatorHint_LargePage |
+                                  AllocatorHint_Prefault)),
+           "Failed to allocate %llu slots of %llu bytes.",
+           (unsigned long long)slot_count,
+           (unsigned long long)bytes_of_slot);
+
+    // Push in reverse so slots are handed out in address order.
+    atomic_init(&pool->head, 0);
+    atomic_init(&pool->in_use, 0);
+    atomic_init(&pool->high_water_mark, 0);
+    atomic_init(&pool->exhausted_count, 0);
+    for (uint32_t i = 0; i < pool->slot_count; ++i)
+        atomic_init(&pool->next[i], 0);
+    for (uint32_t i = pool->slot_count; i > 0; --i)
+        push(pool, i - 1);
+
+    self->impl = pool;
+    return Device_Ok;
+Error:
+    free(pool);
+    return Device_Err;
+}
+
+enum DeviceStatusCode
+frame_pool_init_for_camera(struct FramePool* self,
+                           const struct Camera* camera,
+                           size_t slot_count)
+{
+    struct ImageShape shape = { 0 };
+    CHECK(Device_Ok == camera_get_image_shape(camera, &shape));
+    return frame_pool_init(self, &shape, slot_count);
+Error:
+    return Device_Err;
+}
+
+void
+frame_pool_destroy(struct FramePool* self)
+{
+    if (self && self->impl) {
+        struct frame_pool* pool = (struct frame_pool*)self->impl;
+        memory_free(pool->slots);
+        free(pool);
+        self->impl = 0;
+    }
+}
+
+struct VideoFrame*
+frame_pool_acquire(struct FramePool* self)
+{
+    CHECK(self && self->impl);
+    struct frame_pool* pool = (struct frame_pool*)self->impl;
+
+    const uint32_t top = pop(pool);
+    if (!top) {
+        atomic_fetch_add_explicit(
+          &pool->exhausted_count, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    const size_t in_use =
+      atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed) + 1;
+    size_t mark =
+      atomic_load_explicit(&pool->high_water_mark, memory_order_relaxed);
+    while (mark < in_use &&
+           !atomic_compare_exchange_weak_explicit(&pool->high_water_mark,
+                                                  &mark,
+                                                  in_use,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+        ;
+
+    struct VideoFrame* frame = slot_at(pool, top - 1);
+    memset(frame, 0, sizeof(*frame));
+    frame->bytes_of_frame = pool->bytes_of_slot;
+    frame->shape = pool->shape;
+    return frame;
+Error:
+    return 0;
+}
+
+void
+frame_pool_release(struct FramePool* self, struct VideoFrame* frame)
+{
+    CHECK(self && self->impl);
+    if (!frame)
+        return;
+    struct frame_pool* pool = (struct frame_pool*)self->impl;
+    const size_t offset = (uint8_t*)frame - pool->slots;
+    EXPECT((uint8_t*)frame >= pool->slots &&
+             offset < pool->slot_count * pool->bytes_of_slot &&
+             offset % pool->bytes_of_slot == 0,
+           "Frame %p was not acquired from this pool.",
+           (void*)frame);
+    atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+    push(pool, (uint32_t)(offset / pool->bytes_of_slot));
+Error:;
+}
+
+enum DeviceStatusCode
+frame_pool_get_frame(struct FramePool* self,
+                     struct Camera* camera,
+                     struct VideoFrame** out)
+{
+    struct VideoFrame* frame = 0;
+    CHECK(out);
+    *out = 0;
+    EXPECT(frame = frame_pool_acquire(self), "Frame pool exhausted.");
+
+    struct ImageInfo info = { 0 };
+    size_t nbytes = frame->bytes_of_frame - sizeof(*frame);
+    CHECK(Device_Ok == camera_get_frame(camera, frame->data, &nbytes, &info));
+    if (nbytes == 0) {
+        frame_pool_release(self, frame);
+        return Device_Ok;
+    }
+
+    // The slot may be bigger than the image the camera sent.
+    const size_t bytes_of_frame = sizeof(*frame) + bytes_of_image(&info.shape);
+    EXPECT(bytes_of_frame <= frame_pool_bytes_of_slot(self),
+           "A %llu byte frame doesn't fit in a %llu byte slot.",
+           (unsigned long long)bytes_of_frame,
+           (unsigned long long)frame_pool_bytes_of_slot(self));
+    frame->bytes_of_frame = bytes_of_frame;
+    frame->shape = info.shape;
+    frame->hardware_frame_id = info.hardware_frame_id;
+    frame->timestamps.hardware = info.hardware_timestamp;
+    frame->timestamps.acq_thread = clock_tic(0);
+    *out = frame;
+    return Device_Ok;
+Error:
+    frame_pool_release(self, frame);
+    return Device_Err;
+}
+
+size_t
+frame_pool_bytes_of_slot(const struct FramePool* self)
+{
+    CHECK(self && self->impl);
+    return ((const struct frame_pool*)self->impl)->bytes_of_slot;
+Error:
+    return 0;
+}
+
+void
+frame_pool_get_occupancy(const struct FramePool* self,
+                         struct FramePoolOccupancy* occupancy)
+{
+    CHECK(self && self->impl);
+    CHECK(occupancy);
+    struct frame_pool* pool = (struct frame_pool*)self->impl;
+    *occupancy = (struct FramePoolOccupancy){
+        .slot_count = pool->slot_count,
+        .in_use = atomic_load_explicit(&pool->in_use, memory_order_relaxed),
+        .high_water_mark =
+          atomic_load_explicit(&pool->high_water_mark, memory_order_relaxed),
+        .exhausted_count =
+          atomic_load_explicit(&pool->exhausted_count, memory_order_relaxed),
+    };
+Error:;
+}
+
+//
+//  UNIT TESTS
+//
+
+#ifndef NO_UNIT_TESTS
+
+struct churn_args
+{
+    struct FramePool* pool;
+    int is_ok;
+};
+
+// Repeatedly acquires a few frames, stamps them and checks nobody else
+// touched them before releasing.
+static void
+churn(void* args_)
+{
+    struct churn_args* args = (struct churn_args*)args_;
+    struct VideoFrame* frames[4] = { 0 };
+    for (int iter = 0; iter < 10000; ++iter) {
+        for (int i = 0; i < 4; ++i) {
+            CHECK(frames[i] = frame_pool_acquire(args->pool));
+            frames[i]->frame_id = (uint64_t)(uintptr_t)args;
+            frames[i]->data[0] = (uint8_t)i;
+        }
+        for (int i = 0; i < 4; ++i) {
+            CHECK(frames[i]->frame_id == (uint64_t)(uintptr_t)args);
+            CHECK(frames[i]->data[0] == (uint8_t)i);
+            frame_pool_release(args->pool, frames[i]);
+            frames[i] = 0;
+        }
+    }
+    args->is_ok = 1;
+    return;
+Error:
+    args->is_ok = 0;
+}
+
+int
+unit_test__frame_pool_recycles_slots()
+{
+    struct FramePool pool = { 0 };
+    struct FramePoolOccupancy occupancy = { 0 };
+    struct VideoFrame* frames[8] = { 0 };
+    const struct ImageShape shape = {
+        .dims = { .channels = 1, .width = 64, .height = 48, .planes = 1 },
+        .strides = { .channels = 1, .width = 1, .height = 64, .planes = 3072 },
+        .type = SampleType_u16,
+    };
+    CHECK(Device_Ok == frame_pool_init(&pool, &shape, 8));
+    CHECK(frame_pool_bytes_of_slot(&pool) >=
+          sizeof(struct VideoFrame) + 64 * 48 * 2);
+    CHECK(frame_pool_bytes_of_slot(&pool) % SLOT_ALIGNMENT == 0);
+
+    for (int i = 0; i < 8; ++i) {
+        CHECK(frames[i] = frame_pool_acquire(&pool));
+        CHECK(((uintptr_t)frames[i]) % SLOT_ALIGNMENT == 0);
+        CHECK(frames[i]->bytes_of_frame == frame_pool_bytes_of_slot(&pool));
+        CHECK(frames[i]->shape.dims.width == 64);
+        memset(frames[i]->data, 0xff, 64 * 48 * 2);
+    }
+    CHECK(frame_pool_acquire(&pool) == 0);
+
+    frame_pool_get_occupancy(&pool, &occupancy);
+    CHECK(occupancy.slot_count == 8);
+    CHECK(occupancy.in_use == 8);
+    CHECK(occupancy.high_water_mark == 8);
+    CHECK(occupancy.exhausted_count == 1);
+
+    for (int i = 0; i < 8; ++i)
+        frame_pool_release(&pool, frames[i]);
+    frame_pool_get_occupancy(&pool, &occupancy);
+    CHECK(occupancy.in_use == 0);
+    CHECK(occupancy.high_water_mark == 8);
+
+    {
+        struct thread threads[2];
+        struct churn_args args[2] = { { .pool = &pool }, { .pool = &pool } };
+        for (int i = 0; i < 2; ++i) {
+            thread_init(threads + i);
+            CHECK(thread_create(threads + i, churn, args + i));
+        }
+        for (int i = 0; i < 2; ++i)
+            thread_join(threads + i);
+        CHECK(args[0].is_ok && args[1].is_ok);
+    }
+    frame_pool_get_occupancy(&pool, &occupancy);
+    CHECK(occupancy.in_use == 0);
+
+    frame_pool_destroy(&pool);
+    return 1;
+Error:
+    frame_pool_destroy(&pool);
+    return 0;
+}
+
+// Sends a 32x16 u8 image, smaller than the slots.
+static enum DeviceStatusCode
+small_camera_get_frame(struct Camera* self,
+                       void* im,
+                       size_t* nbytes,
+                       struct ImageInfo* info)
+{
+    (void)self;
+    *info = (struct ImageInfo){
+        .shape = {
+          .dims = { .channels = 1, .width = 32, .height = 16, .planes = 1 },
+          .strides = { .channels = 1, .width = 1, .height = 32, .planes = 512 },
+          .type = SampleType_u8,
+        },
+        .hardware_frame_id = 7,
+    };
+    CHECK(*nbytes >= 512);
+    memset(im, 1, 512);
+    *nbytes = 512;
+    return Device_Ok;
+Error:
+    return Device_Err;
+}
+
+int
+unit_test__frame_pool_get_frame_sizes_frames_by_shape()
+{
+    struct FramePool pool = { 0 };
+    struct VideoFrame* frame = 0;
+    struct Camera camera = { .get_frame = small_camera_get_frame };
+    const struct ImageShape shape = {
+        .dims = { .channels = 1, .width = 64, .height = 48, .planes = 1 },
+        .strides = { .channels = 1, .width = 1, .height = 64, .planes = 3072 },
+        .type = SampleType_u16,
+    };
+    CHECK(Device_Ok == frame_pool_init(&pool, &shape, 2));
+    CHECK(Device_Ok == frame_pool_get_frame(&pool, &camera, &frame));
+    CHECK(frame);
+    CHECK(frame->bytes_of_frame == sizeof(*frame) + 512);
+    CHECK(frame->shape.dims.width == 32);
+    CHECK(frame->hardware_frame_id == 7);
+    frame_pool_release(&pool, frame);
+
+    frame_pool_destroy(&pool);
+    return 1;
+Error:
+    frame_pool_release(&pool, frame);
+    frame_pool_destroy(&pool);
+    return 0;
+}
+
+#endif // NO_UNIT_TESTS
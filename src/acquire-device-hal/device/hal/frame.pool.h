@@ -0,0 +1,90 @@
+#ifndef H_ACQUIRE_HAL_FRAME_POOL_V0
+#define H_ACQUIRE_HAL_FRAME_POOL_V0
+
+#include "device/kit/camera.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /// A fixed number of equally sized `VideoFrame` slots that are recycled
+    /// without locks.
+    ///
+    /// Each slot holds a `VideoFrame` header followed by room for one image.
+    /// All the memory is allocated and faulted in by `frame_pool_init()`, so
+    /// acquiring and releasing slots never touches the heap.
+    ///
+    /// Any thread may acquire or release slots.
+    struct FramePool
+    {
+        void* impl;
+    };
+
+    struct FramePoolOccupancy
+    {
+        /// The total number of slots.
+        size_t slot_count;
+        /// The number of slots currently acquired.
+        size_t in_use;
+        /// The largest value `in_use` has reached.
+        size_t high_water_mark;
+        /// The number of times `frame_pool_acquire()` found no free slot.
+        uint64_t exhausted_count;
+    };
+
+    /// @brief Allocate `slot_count` slots, each big enough for one image of
+    ///        `shape`.
+    /// @returns Device_Ok on success, otherwise Device_Err.
+    enum DeviceStatusCode frame_pool_init(struct FramePool* self,
+                                          const struct ImageShape* shape,
+                                          size_t slot_count);
+
+    /// @brief Like `frame_pool_init()`, but the slots are sized for the image
+    ///        shape reported by `camera_get_image_shape()`.
+    enum DeviceStatusCode frame_pool_init_for_camera(
+      struct FramePool* self,
+      const struct Camera* camera,
+      size_t slot_count);
+
+    /// @brief Release all memory held by the pool.
+    /// @details Any frames still acquired from the pool become invalid.
+    void frame_pool_destroy(struct FramePool* self);
+
+    /// @brief Take a free slot from the pool.
+    /// @details The returned frame's `bytes_of_frame` is the size of the slot
+    ///          and its `shape` is the shape the pool was sized for. Other
+    ///          header fields are zero.
+    /// @returns A frame, or NULL when every slot is in use.
+    struct VideoFrame* frame_pool_acquire(struct FramePool* self);
+
+    /// @brief Return a frame obtained from `frame_pool_acquire()` to the pool.
+    void frame_pool_release(struct FramePool* self, struct VideoFrame* frame);
+
+    /// @brief Acquire a slot and fill it with the next frame from `camera`.
+    /// @details Fills the frame's shape, hardware frame id and timestamps,
+    ///          and sets `bytes_of_frame` to the header plus the bytes of the
+    ///          image the camera sent, which may be less than the slot.
+    ///          Assigning `frame_id` is left to the caller. When the camera
+    ///          has no frame ready, `*out` is set to NULL and the slot is
+    ///          returned to the pool.
+    /// @param[out] out The filled frame. Release it with
+    ///                 `frame_pool_release()`.
+    /// @returns Device_Ok on success. Device_Err when the pool is exhausted
+    ///          or the camera fails.
+    enum DeviceStatusCode frame_pool_get_frame(struct FramePool* self,
+                                               struct Camera* camera,
+                                               struct VideoFrame** out);
+
+    /// @returns The number of bytes in each slot, including the `VideoFrame`
+    ///          header.
+    size_t frame_pool_bytes_of_slot(const struct FramePool* self);
+
+    void frame_pool_get_occupancy(const struct FramePool* self,
+                                  struct FramePoolOccupancy* occupancy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H_ACQUIRE_HAL_FRAME_POOL_V0
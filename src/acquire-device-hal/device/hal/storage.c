@@ -228,11 +228,12 @@ Error:
 
 enum DeviceStatusCode
 storage_reserve_image_shape(struct Storage* self,
-                            const struct ImageShape* shape)
+                            const struct ImageShape* shape,
+                            uint64_t expected_frame_count)
 {
     CHECK(self);
     CHECK(self->reserve_image_shape);
-    self->reserve_image_shape(self, shape);
+    self->reserve_image_shape(self, shape, expected_frame_count);
     return Device_Ok;
 Error:
     return Device_Err;
@@ -72,9 +72,15 @@ extern "C"
 
     /// @brief Alert the storage device to expect a particular image shape.
     /// @param shape [in] The image shape to expect.
+    /// @param expected_frame_count [in] The number of frames expected in the
+    ///                             acquisition, or 0 if unknown. When known,
+    ///                             the storage device may preallocate space
+    ///                             for all of them, and trims what's unused
+    ///                             when stopped.
     enum DeviceStatusCode storage_reserve_image_shape(
       struct Storage* self,
-      const struct ImageShape* shape);
+      const struct ImageShape* shape,
+      uint64_t expected_frame_count);
 
 #ifdef __cplusplus
 }
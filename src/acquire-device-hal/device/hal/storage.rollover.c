@@ -0,0 +1,784 @@
+#include "storage.rollover.h"
+#include "storage.h"
+#include "logger.h"
+#include "platform.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG(...) aq_logger(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define LOGE(...) aq_logger(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            LOGE(__VA_ARGS__);                                                 \
+            goto Error;                                                        \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false:\n\t%s", #e)
+
+// Room for the "." and the decimal digits of a uint32_t.
+#define BYTES_OF_SEGMENT_SUFFIX (12)
+
+struct storage_rollover
+{
+    const struct DeviceManager* system;
+    struct DeviceIdentifier identifier;
+    // storage_open(), or a stand-in in the unit tests.
+    struct Storage* (*open)(const struct DeviceManager* system,
+                            const struct DeviceIdentifier* identifier);
+    // Settings for segment 0. Later segments change the filename and the
+    // first frame id.
+    struct StorageProperties settings;
+    uint64_t max_bytes_per_segment;
+    uint64_t max_frames_per_segment;
+    struct ImageShape shape;
+    int has_shape;
+    int is_running;
+
+    struct Storage* current;
+    uint32_t index;
+    // Frames appended before the current segment.
+    uint64_t frames_before;
+    uint64_t bytes_in_segment;
+    uint64_t frames_in_segment;
+
+    // The preparer thread retires `retiring` and opens `next`. Nothing else
+    // touches these, or `settings`, while `is_preparing` is set.
+    struct thread preparer;
+    int is_preparing;
+    struct Storage* next;
+    uint64_t next_frames_before;
+    struct Storage* retiring;
+};
+
+static size_t
+bytes_of_image(const struct ImageShape* shape)
+{
+    const size_t nelements =
+      (shape->strides.planes > 0)
+        ? (size_t)shape->strides.planes * shape->dims.planes
+        : (size_t)shape->dims.channels * shape->dims.width *
+            shape->dims.height * shape->dims.planes;
+    return nelements * bytes_of_type(shape->type);
+}
+
+// Writes the filename of segment `index` to `out`. Segment 0 keeps
+// `filename`. Later segments insert ".<index>" before the extension of the
+// last path component, or append it when there's no extension.
+// Returns the number of bytes written, including the terminating null, or 0
+// if `out` is too small.
+static size_t
+segment_filename(char* out,
+                 size_t bytes_of_out,
+                 const char* filename,
+                 uint32_t index)
+{
+    const size_t n = strlen(filename);
+    if (index == 0 || n == 0) {
+        if (n + 1 > bytes_of_out)
+            return 0;
+        memcpy(out, filename, n + 1); // NOLINT
+        return n + 1;
+    }
+
+    size_t base = n;
+    while (base > 0 && filename[base - 1] != '/' && filename[base - 1] != '\\')
+        --base;
+    const char* dot = strrchr(filename + base, '.');
+    // A leading dot names a hidden file rather than starting an extension.
+    const size_t stem = (dot && dot > filename + base)
+                          ? (size_t)(dot - filename)
+                          : n;
+    const int written = snprintf(out,
+                                 bytes_of_out,
+                                 "%.*s.%u%s",
+                                 (int)stem,
+                                 filename,
+                                 index,
+                                 filename + stem);
+    if (written < 0 || (size_t)written + 1 > bytes_of_out)
+        return 0;
+    return (size_t)written + 1;
+}
+
+// Returns 1 if a frame of `bytes_of_frame` bytes fits in a segment that
+// already holds `frames` frames and `bytes` bytes. An empty segment takes
+// any frame, so a frame bigger than the byte limit still gets written.
+static int
+frame_fits(uint64_t max_bytes,
+           uint64_t max_frames,
+           uint64_t bytes,
+           uint64_t frames,
+           uint64_t bytes_of_frame)
+{
+    if (frames == 0)
+        return 1;
+    return (max_frames == 0 || frames < max_frames) &&
+           (max_bytes == 0 || bytes + bytes_of_frame <= max_bytes);
+}
+
+// The number of frames expected in each segment, or 0 if that isn't known.
+static uint64_t
+frames_per_segment(const struct storage_rollover* self,
+                   uint64_t bytes_of_frame)
+{
+    uint64_t n = self->max_frames_per_segment;
+    if (self->max_bytes_per_segment && bytes_of_frame) {
+        uint64_t m = self->max_bytes_per_segment / bytes_of_frame;
+        m = m ? m : 1;
+        n = (n && n < m) ? n : m;
+    }
+    return n;
+}
+
+static uint64_t
+expected_bytes_of_frame(const struct storage_rollover* self)
+{
+    return self->has_shape
+             ? sizeof(struct VideoFrame) + bytes_of_image(&self->shape)
+             : 0;
+}
+
+// Fills `props` with the settings for segment `index`.
+// `props` must be zero initialized or previously initialized.
+static int
+segment_properties(const struct storage_rollover* self,
+                   uint32_t index,
+                   uint64_t frames_before,
+                   struct StorageProperties* props)
+{
+    char* filename = 0;
+    const size_t bytes_of_filename =
+      strlen(self->settings.filename.str) + BYTES_OF_SEGMENT_SUFFIX;
+
+    CHECK(storage_properties_copy(props, &self->settings));
+    CHECK(filename = malloc(bytes_of_filename));
+    const size_t n = segment_filename(
+      filename, bytes_of_filename, self->settings.filename.str, index);
+    CHECK(n);
+    CHECK(storage_properties_set_filename(props, filename, n));
+    props->first_frame_id =
+      (uint32_t)(self->settings.first_frame_id + frames_before);
+    free(filename);
+    return 1;
+Error:
+    free(filename);
+    return 0;
+}
+
+// Sets `storage` up as segment `index`. Setting properties may drop an
+// earlier reservation, so the image shape is always reserved again after.
+static int
+segment_configure(const struct storage_rollover* self,
+                  struct Storage* storage,
+                  uint32_t index,
+                  uint64_t frames_before)
+{
+    struct StorageProperties props = { 0 };
+    CHECK(segment_properties(self, index, frames_before, &props));
+    CHECK(Device_Ok == storage_set(storage, &props));
+    if (self->has_shape) {
+        CHECK(Device_Ok ==
+              storage_reserve_image_shape(
+                storage,
+                &self->shape,
+                frames_per_segment(self, expected_bytes_of_frame(self))));
+    }
+    storage_properties_destroy(&props);
+    return 1;
+Error:
+    storage_properties_destroy(&props);
+    return 0;
+}
+
+static struct Storage*
+segment_open(const struct storage_rollover* self,
+             uint32_t index,
+             uint64_t frames_before)
+{
+    struct Storage* storage = 0;
+    EXPECT(storage = self->open(self->system, &self->identifier),
+           "Failed to open storage segment %u.",
+           index);
+    CHECK(segment_configure(self, storage, index, frames_before));
+    return storage;
+Error:
+    if (storage)
+        storage_close(storage);
+    return 0;
+}
+
+static void
+segment_prepare(void* arg)
+{
+    struct storage_rollover* self = (struct storage_rollover*)arg;
+    if (self->retiring) {
+        storage_close(self->retiring);
+        self->retiring = 0;
+    }
+    // On failure `next` stays 0, and the segment is opened again on the
+    // append path, which reports the error.
+    self->next = segment_open(self, self->index + 1, self->next_frames_before);
+}
+
+static void
+preparer_join(struct storage_rollover* self)
+{
+    if (self->is_preparing) {
+        thread_join(&self->preparer);
+        self->is_preparing = 0;
+    }
+}
+
+// Closes the retired segment and opens the one after the current segment
+// on the preparer thread. Falls back to doing it on this thread if the
+// thread can't be started.
+static void
+preparer_launch(struct storage_rollover* self, uint64_t bytes_of_frame)
+{
+    if (!(self->max_bytes_per_segment || self->max_frames_per_segment))
+        return;
+    CHECK(!self->is_preparing && !self->next);
+    // If the limits cut this segment short, the prediction is fixed up when
+    // the segment is started.
+    self->next_frames_before =
+      self->frames_before + frames_per_segment(self, bytes_of_frame);
+    thread_init(&self->preparer);
+    self->is_preparing =
+      thread_create(&self->preparer, segment_prepare, self);
+    if (!self->is_preparing)
+        segment_prepare(self);
+Error:;
+}
+
+// Starts the next segment, which follows `frames_before` frames. The
+// position only moves to the new segment once it's running, so a failed
+// rollover can be retried.
+static enum DeviceStatusCode
+rollover(struct storage_rollover* self, uint64_t frames_before)
+{
+    struct Storage* next = 0;
+    const uint32_t index = self->index + 1;
+
+    preparer_join(self);
+    next = self->next;
+    self->next = 0;
+    if (!next) {
+        CHECK(next = segment_open(self, index, frames_before));
+    } else if (self->next_frames_before != frames_before) {
+        // The segment ended early, so the prepared first frame id is wrong.
+        CHECK(segment_configure(self, next, index, frames_before));
+    }
+    CHECK(Device_Ok == storage_start(next));
+
+    self->retiring = self->current;
+    self->current = next;
+    next = 0;
+    self->index = index;
+    self->frames_before = frames_before;
+    self->bytes_in_segment = 0;
+    self->frames_in_segment = 0;
+    return Device_Ok;
+Error:
+    if (next)
+        storage_close(next);
+    return Device_Err;
+}
+
+static enum DeviceStatusCode
+rollover_open(struct StorageRollover* self,
+              const struct DeviceManager* system,
+              const struct DeviceIdentifier* identifier,
+              const struct StorageProperties* settings,
+              uint64_t max_bytes_per_segment,
+              uint64_t max_frames_per_segment,
+              struct Storage* (*open)(const struct DeviceManager*,
+                                      const struct DeviceIdentifier*))
+{
+    struct storage_rollover* impl = 0;
+    CHECK(self);
+    self->impl = 0;
+    CHECK(system);
+    CHECK(identifier);
+    CHECK(settings);
+
+    CHECK(impl = calloc(1, sizeof(*impl)));
+    impl->system = system;
+    impl->identifier = *identifier;
+    impl->open = open;
+    impl->max_bytes_per_segment = max_bytes_per_segment;
+    impl->max_frames_per_segment = max_frames_per_segment;
+    CHECK(storage_properties_copy(&impl->settings, settings));
+    CHECK(impl->current = segment_open(impl, 0, 0));
+    self->impl = impl;
+    return Device_Ok;
+Error:
+    if (impl) {
+        storage_properties_destroy(&impl->settings);
+        free(impl);
+    }
+    return Device_Err;
+}
+
+enum DeviceStatusCode
+storage_rollover_open(struct StorageRollover* self,
+                      const struct DeviceManager* system,
+                      const struct DeviceIdentifier* identifier,
+                      const struct StorageProperties* settings,
+                      uint64_t max_bytes_per_segment,
+                      uint64_t max_frames_per_segment)
+{
+    return rollover_open(self,
+                         system,
+                         identifier,
+                         settings,
+                         max_bytes_per_segment,
+                         max_frames_per_segment,
+                         storage_open);
+}
+
+enum DeviceStatusCode
+storage_rollover_reserve_image_shape(struct StorageRollover* self,
+                                     const struct ImageShape* shape)
+{
+    CHECK(self && self->impl);
+    CHECK(shape);
+    struct storage_rollover* impl = (struct storage_rollover*)self->impl;
+    preparer_join(impl);
+    impl->shape = *shape;
+    impl->has_shape = 1;
+    CHECK(Device_Ok ==
+          storage_reserve_image_shape(
+            impl->current,
+            shape,
+            frames_per_segment(impl, expected_bytes_of_frame(impl))));
+    if (impl->next) {
+        CHECK(Device_Ok ==
+              storage_reserve_image_shape(
+                impl->next,
+                shape,
+                frames_per_segment(impl, expected_bytes_of_frame(impl))));
+    }
+    return Device_Ok;
+Error:
+    return Device_Err;
+}
+
+enum DeviceStatusCode
+storage_rollover_start(struct StorageRollover* self)
+{
+    CHECK(self && self->impl);
+    struct storage_rollover* impl = (struct storage_rollover*)self->impl;
+    CHECK(!impl->is_running);
+    CHECK(Device_Ok == storage_start(impl->current));
+    impl->is_running = 1;
+    return Device_Ok;
+Error:
+    return Device_Err;
+}
+
+enum DeviceStatusCode
+storage_rollover_append(struct StorageRollover* self,
+                        const struct VideoFrame* beg,
+                        const struct VideoFrame* end)
+{
+    CHECK(self && self->impl);
+    CHECK(beg <= end);
+    struct storage_rollover* impl = (struct storage_rollover*)self->impl;
+    CHECK(impl->is_running);
+
+    while (beg < end) {
+        // Gather the frames that fit in the current segment.
+        const struct VideoFrame* cur = beg;
+        uint64_t bytes = impl->bytes_in_segment;
+        uint64_t frames = impl->frames_in_segment;
+        while (cur < end && frame_fits(impl->max_bytes_per_segment,
+                                       impl->max_frames_per_segment,
+                                       bytes,
+                                       frames,
+                                       cur->bytes_of_frame)) {
+            CHECK(cur->bytes_of_frame >= sizeof(*cur));
+            bytes += cur->bytes_of_frame;
+            ++frames;
+            cur = (const struct VideoFrame*)((const uint8_t*)cur +
+                                             cur->bytes_of_frame);
+        }
+
+        if (cur > beg) {
+            const int is_first = impl->frames_in_segment == 0;
+            CHECK(Device_Ok == storage_append(impl->current, beg, cur));
+            impl->bytes_in_segment = bytes;
+            impl->frames_in_segment = frames;
+            // Retire the last segment, and get the next one ready, while
+            // this one fills up.
+            if (is_first)
+                preparer_launch(impl, beg->bytes_of_frame);
+            beg = cur;
+        }
+
+        if (beg < end) {
+            const uint64_t frames_before =
+              impl->frames_before + impl->frames_in_segment;
+            CHECK(Device_Ok == rollover(impl, frames_before));
+        }
+    }
+    return Device_Ok;
+Error:
+    return Device_Err;
+}
+
+enum DeviceStatusCode
+storage_rollover_stop(struct StorageRollover* self)
+{
+    enum DeviceStatusCode ecode = Device_Ok;
+    CHECK(self && self->impl);
+    struct storage_rollover* impl = (struct storage_rollover*)self->impl;
+    preparer_join(impl);
+    if (impl->retiring) {
+        storage_close(impl->retiring);
+        impl->retiring = 0;
+    }
+    if (impl->next) {
+        storage_close(impl->next);
+        impl->next = 0;
+    }
+    impl->is_running = 0;
+    ecode = storage_stop(impl->current);
+    return ecode;
+Error:
+    return Device_Err;
+}
+
+void
+storage_rollover_close(struct StorageRollover* self)
+{
+    if (self && self->impl) {
+        struct storage_rollover* impl = (struct storage_rollover*)self->impl;
+        storage_rollover_stop(self);
+        storage_close(impl->current);
+        storage_properties_destroy(&impl->settings);
+        free(impl);
+        self->impl = 0;
+    }
+}
+
+uint32_t
+storage_rollover_segment_index(const struct StorageRollover* self)
+{
+    CHECK(self && self->impl);
+    return ((const struct storage_rollover*)self->impl)->index;
+Error:
+    return 0;
+}
+
+//
+//  UNIT TESTS
+//
+
+#ifndef NO_UNIT_TESTS
+
+int
+unit_test__storage_rollover_names_segments()
+{
+    const struct
+    {
+        const char* filename;
+        uint32_t index;
+        const char* expected;
+    } cases[] = {
+        { "out.zarr", 0, "out.zarr" },
+        { "out.zarr", 1, "out.1.zarr" },
+        { "out.tar.gz", 12, "out.tar.12.gz" },
+        { "out", 3, "out.3" },
+        { "data.d/out", 2, "data.d/out.2" },
+        { "C:\\data.d\\out.tif", 2, "C:\\data.d\\out.2.tif" },
+        { "dir/.hidden", 1, "dir/.hidden.1" },
+        { "", 5, "" },
+    };
+    char out[64];
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        const size_t n = segment_filename(
+          out, sizeof(out), cases[i].filename, cases[i].index);
+        EXPECT(n == strlen(cases[i].expected) + 1 &&
+                 strcmp(out, cases[i].expected) == 0,
+               "Segment %u of \"%s\": expected \"%s\". Got \"%s\".",
+               cases[i].index,
+               cases[i].filename,
+               cases[i].expected,
+               n ? out : "(nothing)");
+    }
+    // Too small for the suffix.
+    CHECK(segment_filename(out, 9, "out.zarr", 1) == 0);
+    return 1;
+Error:
+    return 0;
+}
+
+int
+unit_test__storage_rollover_splits_on_limits()
+{
+    // No limits.
+    CHECK(frame_fits(0, 0, 1ULL << 40, 1ULL << 30, 100));
+    // Frame limit.
+    CHECK(frame_fits(0, 3, 200, 2, 100));
+    CHECK(!frame_fits(0, 3, 300, 3, 100));
+    // Byte limit, inclusive.
+    CHECK(frame_fits(300, 0, 200, 2, 100));
+    CHECK(!frame_fits(300, 0, 300, 3, 100));
+    // An empty segment takes a frame that's bigger than the byte limit.
+    CHECK(frame_fits(300, 0, 0, 0, 1000));
+    CHECK(!frame_fits(300, 0, 1000, 1, 1));
+    // Both limits: whichever comes first.
+    CHECK(!frame_fits(1000, 2, 200, 2, 100));
+    CHECK(!frame_fits(250, 10, 200, 2, 100));
+
+    {
+        struct storage_rollover r = { 0 };
+        CHECK(frames_per_segment(&r, 100) == 0);
+        r.max_frames_per_segment = 10;
+        CHECK(frames_per_segment(&r, 100) == 10);
+        r.max_bytes_per_segment = 550;
+        CHECK(frames_per_segment(&r, 100) == 5);
+        CHECK(frames_per_segment(&r, 1000) == 1);
+        r.max_frames_per_segment = 0;
+        CHECK(frames_per_segment(&r, 0) == 0);
+    }
+    return 1;
+Error:
+    return 0;
+}
+
+#include "device.manager.h"
+#include "driver.h"
+
+// A storage device that records what it's asked to do. Starting fails while
+// `failed_starts` is above 0.
+struct fake_segment
+{
+    struct Storage storage;
+    char filename[32];
+    uint32_t first_frame_id;
+    // 1 when the image shape was reserved after the properties were last set.
+    int is_reserved;
+    int is_started;
+    uint64_t first_appended_id;
+    uint64_t frame_count;
+};
+
+static struct fake_driver
+{
+    struct Driver driver;
+    struct fake_segment segments[8];
+    uint32_t count;
+    int failed_starts;
+} g_fake;
+
+static enum DeviceState
+fake_set(struct Storage* self_, const struct StorageProperties* settings)
+{
+    struct fake_segment* self = (struct fake_segment*)self_;
+    snprintf(
+      self->filename, sizeof(self->filename), "%s", settings->filename.str);
+    self->first_frame_id = settings->first_frame_id;
+    self->is_reserved = 0;
+    return DeviceState_Armed;
+}
+
+static enum DeviceState
+fake_start(struct Storage* self_)
+{
+    struct fake_segment* self = (struct fake_segment*)self_;
+    if (g_fake.failed_starts > 0) {
+        --g_fake.failed_starts;
+        return DeviceState_AwaitingConfiguration;
+    }
+    self->is_started = 1;
+    return DeviceState_Running;
+}
+
+static enum DeviceState
+fake_append(struct Storage* self_,
+            const struct VideoFrame* frame,
+            size_t* nbytes)
+{
+    struct fake_segment* self = (struct fake_segment*)self_;
+    const uint8_t* const end = (const uint8_t*)frame + *nbytes;
+    for (; (const uint8_t*)frame < end;
+         frame = (const struct VideoFrame*)((const uint8_t*)frame +
+                                            frame->bytes_of_frame)) {
+        if (!self->frame_count++)
+            self->first_appended_id = frame->frame_id;
+    }
+    return DeviceState_Running;
+}
+
+static enum DeviceState
+fake_stop(struct Storage* self_)
+{
+    return DeviceState_Armed;
+}
+
+static void
+fake_reserve_image_shape(struct Storage* self_,
+                         const struct ImageShape* shape,
+                         uint64_t expected_frame_count)
+{
+    ((struct fake_segment*)self_)->is_reserved = 1;
+}
+
+static enum DeviceStatusCode
+fake_driver_open(struct Driver* driver, uint64_t device_id, struct Device** out)
+{
+    if (g_fake.count == sizeof(g_fake.segments) / sizeof(g_fake.segments[0]))
+        return Device_Err;
+    struct fake_segment* segment = g_fake.segments + g_fake.count++;
+    *segment = (struct fake_segment){
+        .storage = { .state = DeviceState_AwaitingConfiguration,
+                     .set = fake_set,
+                     .start = fake_start,
+                     .append = fake_append,
+                     .stop = fake_stop,
+                     .reserve_image_shape = fake_reserve_image_shape },
+    };
+    *out = &segment->storage.device;
+    return Device_Ok;
+}
+
+static enum DeviceStatusCode
+fake_driver_describe(const struct Driver* driver,
+                     struct DeviceIdentifier* identifier,
+                     uint64_t i)
+{
+    *identifier = (struct DeviceIdentifier){ .device_id = (uint8_t)i,
+                                             .kind = DeviceKind_Storage };
+    return Device_Ok;
+}
+
+static enum DeviceStatusCode
+fake_driver_close(struct Driver* driver, struct Device* in)
+{
+    return Device_Ok;
+}
+
+static struct Storage*
+fake_open(const struct DeviceManager* system,
+          const struct DeviceIdentifier* identifier)
+{
+    struct Device* device = 0;
+    if (Device_Ok !=
+        driver_open_device(&g_fake.driver, identifier->device_id, &device))
+        return 0;
+    return (struct Storage*)device;
+}
+
+int
+unit_test__storage_rollover_appends_across_segments()
+{
+    // Segments hold 4 small frames. Frame 6 is as big as 3 small frames.
+    const size_t small = sizeof(struct VideoFrame) + 64;
+    const struct ImageShape shape = {
+        .dims = { .channels = 1, .width = 8, .height = 8, .planes = 1 },
+        .type = SampleType_u8,
+    };
+    const struct
+    {
+        const char* filename;
+        uint32_t first_frame_id;
+        uint64_t frame_count;
+    } expected[] = {
+        { "out.zarr", 0, 4 },
+        { "out.1.zarr", 4, 2 },
+        { "out.2.zarr", 6, 2 },
+        { "out.3.zarr", 8, 1 },
+    };
+    const struct DeviceManager system = { 0 };
+    const struct DeviceIdentifier identifier = { .kind = DeviceKind_Storage };
+    struct StorageProperties settings = { 0 };
+    struct StorageRollover rollover = { 0 };
+    struct VideoFrame* frames[9] = { 0 };
+    uint8_t* buf = 0;
+    size_t nbytes = 0;
+
+    g_fake = (struct fake_driver){
+        .driver = { .describe = fake_driver_describe,
+                    .open = fake_driver_open,
+                    .close = fake_driver_close },
+    };
+    CHECK(buf = malloc(11 * small));
+    for (int i = 0; i < 9; ++i) {
+        frames[i] = (struct VideoFrame*)(buf + nbytes);
+        *frames[i] = (struct VideoFrame){
+            .bytes_of_frame = (i == 6) ? 3 * small : small,
+            .shape = shape,
+            .frame_id = (uint64_t)i,
+        };
+        nbytes += frames[i]->bytes_of_frame;
+    }
+#define APPEND(b, e) storage_rollover_append(&rollover, frames[b], frames[e])
+
+    CHECK(storage_properties_set_filename(&settings, "out.zarr", 9));
+    CHECK(Device_Ok == rollover_open(&rollover,
+                                     &system,
+                                     &identifier,
+                                     &settings,
+                                     4 * small,
+                                     0,
+                                     fake_open));
+    CHECK(Device_Ok == storage_rollover_reserve_image_shape(&rollover, &shape));
+    CHECK(Device_Ok == storage_rollover_start(&rollover));
+    CHECK(Device_Ok == APPEND(0, 6));
+
+    // Segment 1 ends early, so the segment prepared for frame 8 is fixed up
+    // for frame 6, and then fails to start.
+    g_fake.failed_starts = 1;
+    CHECK(Device_Err == APPEND(6, 7));
+    // Retrying gives segment 2 the same first frame.
+    CHECK(Device_Ok == APPEND(6, 7));
+    // Segment 3 was prepared for frame 7, but segment 2 takes 2 frames.
+    CHECK(Device_Ok == APPEND(7, 8));
+    CHECK(Device_Ok ==
+          storage_rollover_append(
+            &rollover, frames[8], (struct VideoFrame*)(buf + nbytes)));
+#undef APPEND
+    CHECK(storage_rollover_segment_index(&rollover) == 3);
+    storage_rollover_close(&rollover);
+
+    {
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < g_fake.count; ++i) {
+            const struct fake_segment* s = g_fake.segments + i;
+            if (!s->is_started)
+                continue;
+            CHECK(n < sizeof(expected) / sizeof(expected[0]));
+            EXPECT(strcmp(s->filename, expected[n].filename) == 0 &&
+                     s->first_frame_id == expected[n].first_frame_id &&
+                     s->frame_count == expected[n].frame_count &&
+                     s->first_appended_id == expected[n].first_frame_id,
+                   "Segment %u: expected %s from frame %u with %u frames. "
+                   "Got %s from frame %u (first id %u) with %u frames.",
+                   n,
+                   expected[n].filename,
+                   expected[n].first_frame_id,
+                   (unsigned)expected[n].frame_count,
+                   s->filename,
+                   s->first_frame_id,
+                   (unsigned)s->first_appended_id,
+                   (unsigned)s->frame_count);
+            EXPECT(s->is_reserved, "Segment %u wasn't reserved.", n);
+            ++n;
+        }
+        CHECK(n == sizeof(expected) / sizeof(expected[0]));
+    }
+    storage_properties_destroy(&settings);
+    free(buf);
+    return 1;
+Error:
+    storage_rollover_close(&rollover);
+    storage_properties_destroy(&settings);
+    free(buf);
+    return 0;
+}
+
+#endif // NO_UNIT_TESTS
@@ -0,0 +1,79 @@
+#ifndef H_ACQUIRE_HAL_STORAGE_ROLLOVER_V0
+#define H_ACQUIRE_HAL_STORAGE_ROLLOVER_V0
+
+#include "device/kit/storage.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    struct DeviceManager;
+
+    /// Streams to a sequence of `Storage` segments instead of one huge file.
+    ///
+    /// A segment is closed, and the next one started, before a frame would
+    /// take it past `max_bytes_per_segment` or `max_frames_per_segment`.
+    /// Frames are never split between segments. Segment 0 uses the filename
+    /// from the settings. Segment `i` inserts `i` before the extension, so
+    /// "out.zarr" is followed by "out.1.zarr", "out.2.zarr" and so on.
+    ///
+    /// Each segment's `first_frame_id` is the settings' `first_frame_id` plus
+    /// the number of frames appended before that segment.
+    ///
+    /// The next segment is opened and configured on a background thread
+    /// while the current one is being written, and the old segment is
+    /// stopped there too, so a rollover only costs `storage_append()` a
+    /// `storage_start()`.
+    struct StorageRollover
+    {
+        void* impl;
+    };
+
+    /// @brief Open the first segment on the storage device identified by
+    ///        `identifier`, and configure it with `settings`.
+    /// @param[in] max_bytes_per_segment Bytes of frames per segment, or 0 for
+    ///                                  no limit.
+    /// @param[in] max_frames_per_segment Frames per segment, or 0 for no
+    ///                                   limit.
+    /// @returns Device_Ok on success, otherwise Device_Err.
+    enum DeviceStatusCode storage_rollover_open(
+      struct StorageRollover* self,
+      const struct DeviceManager* system,
+      const struct DeviceIdentifier* identifier,
+      const struct StorageProperties* settings,
+      uint64_t max_bytes_per_segment,
+      uint64_t max_frames_per_segment);
+
+    /// @brief Alert every segment to expect a particular image shape.
+    /// @details Segments are told to expect `max_frames_per_segment` frames,
+    ///          or as many as fit in `max_bytes_per_segment`.
+    enum DeviceStatusCode storage_rollover_reserve_image_shape(
+      struct StorageRollover* self,
+      const struct ImageShape* shape);
+
+    /// @brief Start the current segment.
+    enum DeviceStatusCode storage_rollover_start(struct StorageRollover* self);
+
+    /// @brief Append the frames in `[beg,end)`, rolling over to new segments
+    ///        as the limits are reached.
+    enum DeviceStatusCode storage_rollover_append(struct StorageRollover* self,
+                                                  const struct VideoFrame* beg,
+                                                  const struct VideoFrame* end);
+
+    /// @brief Stop the current segment, and discard any segment that was
+    ///        prepared but not started.
+    enum DeviceStatusCode storage_rollover_stop(struct StorageRollover* self);
+
+    /// @brief Stop and close every segment.
+    void storage_rollover_close(struct StorageRollover* self);
+
+    /// @returns The index of the segment being written, starting from 0.
+    uint32_t storage_rollover_segment_index(
+      const struct StorageRollover* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // H_ACQUIRE_HAL_STORAGE_ROLLOVER_V0
@@ -41,8 +41,16 @@ extern "C"
 
         /// @brief Alert the storage device to expect a particular image shape.
         /// @param shape [in] The image shape to expect.
+        /// @param expected_frame_count [in] The number of frames expected in
+        ///                             the acquisition, or 0 if unknown.
+        ///                             Drivers can use it to reserve the
+        ///                             space for the whole run up front with
+        ///                             `file_reserve()`, then give back
+        ///                             what's unused with `file_truncate()`
+        ///                             in `stop()`.
         void (*reserve_image_shape)(struct Storage* self,
-                                    const struct ImageShape* shape);
+                                    const struct ImageShape* shape,
+                                    uint64_t expected_frame_count);
     };
 
 #ifdef __cplusplus
@@ -65,8 +65,10 @@ extern "C"
     /// and filling out the struct fields.
     /// @returns 0 when `bytes_of_out` is not large enough, otherwise 1.
     /// @param[out] out The constructed StorageProperties object.
-    /// @param[in] first_frame_id (unused; aiming for future file rollover
-    /// support
+    /// @param[in] first_frame_id The id of the first frame written to the
+    ///                           file. When storage rolls over to a new file,
+    ///                           each file records the id of its own first
+    ///                           frame.
     /// @param[in] filename A c-style null-terminated string. The file to create
     ///                     for streaming.
     /// @param[in] bytes_of_filename Number of bytes in the `filename` buffer
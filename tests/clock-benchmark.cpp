@@ -0,0 +1,134 @@
+//! What reading the clock costs, the way per-frame timestamps do it with
+//! `clock_tic()`: first with the default clock, then after
+//! `clock_enable_tsc()`. Checks that neither clock goes backwards, including
+//! while the TSC clock is re-anchored. How long sleeps took by each clock,
+//! and how far the TSC clock drifted, are only reported, since they depend on
+//! how busy the machine is.
+#include "platform.h"
+#include "logger.h"
+
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expected %s", #e)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+const int call_count = 10000000;
+
+// Returns ns per clock_tic(). Times are checked as they go, so the calls
+// can't be optimized out.
+static double
+ns_per_call()
+{
+    struct clock clock;
+    uint64_t last = clock_tic(&clock);
+    int nbackwards = 0;
+    for (int i = 0; i < call_count; ++i) {
+        const uint64_t t = clock_tic(0);
+        nbackwards += (t < last);
+        last = t;
+    }
+    const double ms = clock_toc_ms(&clock);
+    EXPECT(nbackwards == 0, "The clock went backwards %d times.", nbackwards);
+    return 1e6 * ms / call_count;
+}
+
+// Reads the clock for 2 s, long enough to be re-anchored. Returns how far
+// it drifted from std::chrono::steady_clock, in ms.
+static double
+drift_ms()
+{
+    const auto start = std::chrono::steady_clock::now();
+    struct clock clock;
+    uint64_t last = clock_tic(&clock);
+    int nbackwards = 0;
+    while (clock_toc_ms(&clock) < 2000.0) {
+        const uint64_t t = clock_tic(0);
+        nbackwards += (t < last);
+        last = t;
+    }
+    const auto end = std::chrono::steady_clock::now();
+    const double elapsed_ms = clock_toc_ms(&clock);
+    EXPECT(nbackwards == 0, "The clock went backwards %d times.", nbackwards);
+    return elapsed_ms -
+           std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+static double
+sleep_ms(float delay_ms)
+{
+    struct clock clock;
+    clock_init(&clock);
+    clock_sleep_ms(0, delay_ms);
+    return clock_toc_ms(&clock);
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+    try {
+        const double default_ns = ns_per_call();
+        const double default_sleep_ms = sleep_ms(20.0f);
+
+        struct clock before;
+        clock_init(&before);
+        if (!clock_enable_tsc()) {
+            LOG("clock_tic(): %.1f ns per call. The TSC isn't available.",
+                default_ns);
+            return 0;
+        }
+        // Calibrating takes about 50 ms.
+        const double switch_ms = clock_toc_ms(&before);
+        CHECK(switch_ms > 0.0);
+
+        const double tsc_ns = ns_per_call();
+        const double tsc_sleep_ms = sleep_ms(20.0f);
+        LOG("Switching took %.1f ms. Sleeping 20 ms took %.3f ms by default "
+            "and %.3f ms with the TSC.",
+            switch_ms,
+            default_sleep_ms,
+            tsc_sleep_ms);
+        LOG("The TSC clock drifted %.3f us in 2 s.", 1e3 * drift_ms());
+
+        LOG("clock_tic(): %.1f ns per call by default, %.1f ns per call with "
+            "the TSC (%.2fx).",
+            default_ns,
+            tsc_ns,
+            default_ns / tsc_ns);
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    return 1;
+}
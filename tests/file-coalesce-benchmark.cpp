@@ -0,0 +1,149 @@
+//! How fast small records, like per-frame metadata, reach a file: one
+//! `file_write()` per record against a `file_coalescer` that gathers them into
+//! 1 MiB blocks. Checks that both files hold the same bytes.
+#include "platform.h"
+#include "file.coalescer.h"
+#include "logger.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+const size_t bytes_of_record = 64;
+const size_t record_count = 100000;
+const size_t bytes_of_block = 1 << 20;
+
+static void
+fill_record(uint8_t* record, size_t i)
+{
+    for (size_t k = 0; k < bytes_of_record; ++k)
+        record[k] = (uint8_t)(i + k);
+}
+
+static double
+write_directly(const char* path, size_t bytes_of_path)
+{
+    struct file file = {};
+    struct clock clock;
+    uint8_t record[bytes_of_record];
+    CHECK(file_create(&file, path, bytes_of_path));
+    clock_init(&clock);
+    for (size_t i = 0; i < record_count; ++i) {
+        fill_record(record, i);
+        CHECK(file_write(&file,
+                         i * bytes_of_record,
+                         record,
+                         record + bytes_of_record));
+    }
+    const double ms = clock_toc_ms(&clock);
+    file_close(&file);
+    return ms;
+}
+
+static double
+write_coalesced(const char* path, size_t bytes_of_path)
+{
+    struct file file = {};
+    struct file_coalescer coalescer = {};
+    struct file_coalescer_stats stats = {};
+    struct clock clock;
+    uint8_t record[bytes_of_record];
+    CHECK(file_create(&file, path, bytes_of_path));
+    CHECK(file_coalescer_init(&coalescer, &file, bytes_of_block, 0.0f));
+    clock_init(&clock);
+    for (size_t i = 0; i < record_count; ++i) {
+        fill_record(record, i);
+        CHECK(file_coalescer_write(&coalescer,
+                                   i * bytes_of_record,
+                                   record,
+                                   record + bytes_of_record));
+    }
+    CHECK(file_coalescer_flush(&coalescer));
+    const double ms = clock_toc_ms(&clock);
+    CHECK(file_coalescer_get_stats(&coalescer, &stats));
+    file_coalescer_destroy(&coalescer);
+    file_close(&file);
+
+    CHECK(stats.writes == record_count);
+    CHECK(stats.bytes == record_count * bytes_of_record);
+    LOG("%llu records in %llu writes (%.0f records per write).",
+        (unsigned long long)stats.writes,
+        (unsigned long long)stats.file_writes,
+        stats.coalescing_ratio);
+    return ms;
+}
+
+static std::vector<uint8_t>
+read_all(const char* path, size_t bytes_of_path)
+{
+    struct file file = {};
+    uint64_t nbytes = 0;
+    CHECK(file_open_read(&file, path, bytes_of_path));
+    CHECK(file_get_size(&file, &nbytes));
+    std::vector<uint8_t> out(nbytes);
+    const int is_ok = file_read(&file, 0, out.data(), out.data() + nbytes);
+    file_close(&file);
+    CHECK(is_ok);
+    return out;
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+    const char direct[] = "file-coalesce-benchmark.direct.bin";
+    const char coalesced[] = "file-coalesce-benchmark.coalesced.bin";
+    try {
+        const double direct_ms = write_directly(direct, sizeof(direct));
+        const double coalesced_ms =
+          write_coalesced(coalesced, sizeof(coalesced));
+        CHECK(read_all(direct, sizeof(direct)) ==
+              read_all(coalesced, sizeof(coalesced)));
+        LOG("%.0f records/s one write each, %.0f records/s coalesced "
+            "(%.2fx).",
+            record_count / (direct_ms * 1e-3),
+            record_count / (coalesced_ms * 1e-3),
+            direct_ms / coalesced_ms);
+        remove(direct);
+        remove(coalesced);
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    remove(direct);
+    remove(coalesced);
+    return 1;
+}
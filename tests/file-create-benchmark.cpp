@@ -0,0 +1,157 @@
+//! How many files a second a chunked store can create: one at a time on the
+//! caller's thread, the way `file_create()` is used today, against a
+//! `file_creator` with a few threads and `FileCreateFlag_NoLock`. Runs on
+//! disk, next to the test, and on tmpfs when `/dev/shm` is there.
+#include "platform.h"
+#include "file.creator.h"
+#include "logger.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <stdexcept>
+#include <vector>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+const int directory_count = 20;
+const int files_per_directory = 100;
+const size_t thread_count = 4;
+
+static std::string
+chunk_path(const std::string& root, int i)
+{
+    return root + "/" + std::to_string(i % directory_count) + "/" +
+           std::to_string(i / directory_count) + ".bin";
+}
+
+static double
+files_per_second(double ms)
+{
+    return directory_count * files_per_directory / (ms * 1e-3);
+}
+
+// The baseline. Each file's directory is made before the file, since the
+// caller doesn't know whether it exists yet.
+static double
+create_serially(const std::string& root)
+{
+    struct clock clock;
+    clock_init(&clock);
+    for (int i = 0; i < directory_count * files_per_directory; ++i) {
+        const std::string path = chunk_path(root, i);
+        const std::string directory = path.substr(0, path.rfind('/'));
+        CHECK(directory_create(directory.c_str()));
+        struct file file = {};
+        CHECK(file_create(&file, path.c_str(), path.size() + 1));
+        file_close(&file);
+    }
+    return clock_toc_ms(&clock);
+}
+
+// Submits every file up front, the way a store would submit the chunks of
+// the next few frames, then takes them in order.
+static double
+create_with_creator(const std::string& root)
+{
+    const int count = directory_count * files_per_directory;
+    std::vector<file_creation*> creations(count);
+    struct file_creator creator = {};
+    struct clock clock;
+    CHECK(file_creator_init(&creator, thread_count, FileCreateFlag_NoLock));
+    clock_init(&clock);
+    for (int i = 0; i < count; ++i) {
+        const std::string path = chunk_path(root, i);
+        CHECK(creations[i] = file_creator_submit(&creator, path.c_str()));
+    }
+    int nfailed = 0;
+    for (int i = 0; i < count; ++i) {
+        struct file file = {};
+        if (file_creation_take(creations[i], &file))
+            file_close(&file);
+        else
+            ++nfailed;
+    }
+    const double ms = clock_toc_ms(&clock);
+    file_creator_destroy(&creator);
+    EXPECT(nfailed == 0, "Failed to create %d files.", nfailed);
+    return ms;
+}
+
+static void
+run(const std::string& where, const std::string& root)
+{
+    std::filesystem::remove_all(root);
+    const double serial_ms = create_serially(root);
+    std::filesystem::remove_all(root);
+    const double creator_ms = create_with_creator(root);
+
+    size_t nfiles = 0;
+    for (const auto& entry :
+         std::filesystem::recursive_directory_iterator(root))
+        nfiles += entry.is_regular_file();
+    std::filesystem::remove_all(root);
+    EXPECT(nfiles == directory_count * files_per_directory,
+           "Expected %d files. Found %llu.",
+           directory_count * files_per_directory,
+           (unsigned long long)nfiles);
+
+    LOG("%s: %.0f files/s one at a time, %.0f files/s with %llu threads "
+        "(%.2fx).",
+        where.c_str(),
+        files_per_second(serial_ms),
+        files_per_second(creator_ms),
+        (unsigned long long)thread_count,
+        serial_ms / creator_ms);
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+    const std::string disk = "file-create-benchmark";
+    const std::string tmpfs = "/dev/shm/acquire-file-create-benchmark";
+    try {
+        run("disk", disk);
+        if (std::filesystem::is_directory("/dev/shm"))
+            run("tmpfs", tmpfs);
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    std::error_code ec;
+    std::filesystem::remove_all(disk, ec);
+    std::filesystem::remove_all(tmpfs, ec);
+    return 1;
+}
@@ -0,0 +1,113 @@
+//! Test that files created with FileCreateFlag_Direct reject misaligned
+//! writes, and that the unaligned end of the last write still reaches the
+//! file, without any padding, once it's closed.
+#include "platform.h"
+#include "logger.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+
+#define SIZED(str) str, sizeof(str)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+
+    const char filename[] = "file-direct-behavior.bin";
+    const size_t bytes_of_block = 4096;
+    const size_t nblocks = 64;
+    const size_t bytes_of_tail = 1000;
+    const size_t bytes_of_file = nblocks * bytes_of_block + bytes_of_tail;
+
+    uint8_t* data = 0;
+    remove(filename);
+    try {
+        CHECK(data = (uint8_t*)memory_alloc_aligned(
+                bytes_of_file + bytes_of_block,
+                bytes_of_block,
+                AllocatorHint_Default));
+        for (size_t i = 0; i < bytes_of_file; ++i)
+            data[i] = (uint8_t)(i * 131 + 7);
+
+        struct file file = {};
+        CHECK(file_create_with_flags(
+          &file, SIZED(filename), FileCreateFlag_Direct));
+
+        // The first half is written synchronously, the second half and the
+        // tail asynchronously.
+        const size_t half = nblocks / 2 * bytes_of_block;
+        CHECK(file_write(&file, 0, data, data + half));
+        CHECK(file_write_async(
+          &file, half, data + half, data + bytes_of_file, 0, 0));
+        CHECK(file_flush(&file));
+
+#ifndef __APPLE__
+        // Misaligned offsets, addresses and extra tails are rejected.
+        CHECK(!file_write(&file, 10, data, data + bytes_of_block));
+        CHECK(!file_write(&file, 0, data + 10, data + bytes_of_block + 10));
+        CHECK(!file_write(&file, 0, data, data + 10));
+        CHECK(!file_write_async(&file, 10, data, data + bytes_of_block, 0, 0));
+
+        // So are whole blocks over the held-back tail, or past it.
+        const size_t tail_offset = nblocks * bytes_of_block;
+        CHECK(!file_write(&file, tail_offset, data, data + bytes_of_block));
+        CHECK(!file_write(
+          &file, tail_offset + bytes_of_block, data, data + bytes_of_block));
+#endif
+        file_close(&file);
+
+        FILE* fp = fopen(filename, "rb");
+        CHECK(fp);
+        std::vector<uint8_t> actual(bytes_of_file + 1);
+        const size_t nread = fread(actual.data(), 1, actual.size(), fp);
+        fclose(fp);
+        EXPECT(nread == bytes_of_file,
+               "Expected %llu bytes. Got %llu.",
+               (unsigned long long)bytes_of_file,
+               (unsigned long long)nread);
+        CHECK(0 == memcmp(actual.data(), data, bytes_of_file));
+        memory_free(data);
+        remove(filename);
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    memory_free(data);
+    remove(filename);
+    return 1;
+}
@@ -0,0 +1,144 @@
+//! Test that a file's I/O counters add up to the writes made to it, whichever
+//! way they're written, and that files without counters report zeros.
+#include "platform.h"
+#include "logger.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+
+#define SIZED(str) str, sizeof(str)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+static uint64_t
+histogram_total(const file_io_stats& stats)
+{
+    uint64_t total = 0;
+    for (auto n : stats.latency_histogram)
+        total += n;
+    return total;
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+
+    const char filename[] = "file-io-stats-behavior.bin";
+    const size_t bytes_of_chunk = 64 << 10;
+    const int nchunks = 16;
+
+    remove(filename);
+    try {
+        std::vector<uint8_t> data(bytes_of_chunk * nchunks * 3);
+        for (size_t i = 0; i < data.size(); ++i)
+            data[i] = (uint8_t)(i * 7 + 3);
+
+        struct file file = {};
+        struct file_io_stats stats = {};
+        CHECK(file_create(&file, SIZED(filename)));
+
+        // Nothing is counted until it's turned on.
+        CHECK(file_write(&file, 0, data.data(), data.data() + bytes_of_chunk));
+        CHECK(file_get_io_stats(&file, &stats));
+        CHECK(stats.write_count == 0 && stats.bytes_written == 0);
+
+        CHECK(file_enable_io_stats(&file));
+        CHECK(file_enable_io_stats(&file)); // already on is fine
+
+        // file_write()
+        uint64_t offset = 0;
+        for (int i = 0; i < nchunks; ++i, offset += bytes_of_chunk) {
+            const uint8_t* beg = data.data() + offset;
+            CHECK(file_write(&file, offset, beg, beg + bytes_of_chunk));
+        }
+        // file_writev(), two segments per chunk
+        for (int i = 0; i < nchunks; ++i, offset += bytes_of_chunk) {
+            const uint8_t* beg = data.data() + offset;
+            const file_segment segments[] = {
+                { beg, beg + 100 },
+                { beg + 100, beg + bytes_of_chunk },
+            };
+            CHECK(file_writev(&file, offset, segments, 2));
+        }
+        // file_write_async()
+        for (int i = 0; i < nchunks; ++i, offset += bytes_of_chunk) {
+            const uint8_t* beg = data.data() + offset;
+            CHECK(file_write_async(
+              &file, offset, beg, beg + bytes_of_chunk, nullptr, nullptr));
+        }
+        CHECK(file_wait(&file));
+
+        CHECK(file_get_io_stats(&file, &stats));
+        EXPECT(stats.bytes_written == data.size(),
+               "Expected %llu bytes written. Got %llu.",
+               (unsigned long long)data.size(),
+               (unsigned long long)stats.bytes_written);
+        // At least one call per chunk. Short writes may add more.
+        CHECK(stats.write_count >= 3 * (uint64_t)nchunks);
+        CHECK(stats.write_count ==
+              3 * (uint64_t)nchunks + stats.short_write_count +
+                stats.zero_write_count);
+        CHECK(stats.error_count == 0);
+        CHECK(histogram_total(stats) == stats.write_count);
+        CHECK(stats.latency_ns_max > 0);
+        CHECK(stats.latency_ns_total >= stats.latency_ns_max);
+
+        const uint64_t p50 = file_io_stats_latency_us(&stats, 0.5);
+        const uint64_t p99 = file_io_stats_latency_us(&stats, 0.99);
+        CHECK(p50 > 0 && p50 <= p99);
+        LOG("%llu writes. Latency p50 <= %llu us, p99 <= %llu us, max %llu "
+            "us.",
+            (unsigned long long)stats.write_count,
+            (unsigned long long)p50,
+            (unsigned long long)p99,
+            (unsigned long long)(stats.latency_ns_max / 1000));
+        file_close(&file);
+
+        FILE* fp = fopen(filename, "rb");
+        CHECK(fp);
+        std::vector<uint8_t> actual(data.size());
+        CHECK(fread(actual.data(), 1, actual.size(), fp) == actual.size());
+        fclose(fp);
+        CHECK(0 == memcmp(actual.data(), data.data(), data.size()));
+
+        remove(filename);
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    remove(filename);
+    return 1;
+}
@@ -0,0 +1,98 @@
+//! Test that frames written through file_map_for_write() land in the file,
+//! including at offsets that aren't page aligned, and that the file grows to
+//! fit them.
+#include "platform.h"
+#include "logger.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+
+#define SIZED(str) str, sizeof(str)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+
+    const char filename[] = "file-map-behavior.bin";
+    const size_t bytes_of_header = 100;
+    const size_t bytes_of_slot = 5000;
+    const size_t nslots = 4;
+    const size_t bytes_of_file = bytes_of_header + nslots * bytes_of_slot;
+
+    remove(filename);
+    try {
+        std::vector<uint8_t> expected(bytes_of_file);
+        for (size_t i = 0; i < expected.size(); ++i)
+            expected[i] = (uint8_t)(i * 131 + 7);
+
+        struct file file = {};
+        CHECK(file_create(&file, SIZED(filename)));
+        CHECK(file_write(
+          &file, 0, expected.data(), expected.data() + bytes_of_header));
+        // Fill the slots out of order, the way a camera would write into
+        // them.
+        for (size_t k = 0; k < nslots; ++k) {
+            const size_t i = (k * 3) % nslots;
+            const uint64_t offset = bytes_of_header + i * bytes_of_slot;
+            uint8_t* slot = 0;
+            CHECK(slot = (uint8_t*)file_map_for_write(
+                    &file, offset, bytes_of_slot));
+            memcpy(slot, expected.data() + offset, bytes_of_slot);
+            CHECK(file_unmap(slot, bytes_of_slot));
+        }
+        CHECK(!file_map_for_write(&file, 0, 0));
+        file_close(&file);
+
+        FILE* fp = fopen(filename, "rb");
+        CHECK(fp);
+        std::vector<uint8_t> actual(bytes_of_file + 1);
+        const size_t nread = fread(actual.data(), 1, actual.size(), fp);
+        fclose(fp);
+        EXPECT(nread == bytes_of_file,
+               "Expected %llu bytes. Got %llu.",
+               (unsigned long long)bytes_of_file,
+               (unsigned long long)nread);
+        CHECK(0 == memcmp(actual.data(), expected.data(), bytes_of_file));
+        remove(filename);
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    remove(filename);
+    return 1;
+}
@@ -0,0 +1,106 @@
+//! Test that a file can be read back with file_read() and through views
+//! from file_map_for_read(), at offsets that aren't page aligned, and that
+//! reading past the end fails.
+#include "platform.h"
+#include "logger.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+
+#define SIZED(str) str, sizeof(str)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+
+    const char filename[] = "file-read-behavior.bin";
+    const size_t bytes_of_file = (3 << 20) + 123;
+
+    remove(filename);
+    try {
+        std::vector<uint8_t> expected(bytes_of_file);
+        for (size_t i = 0; i < expected.size(); ++i)
+            expected[i] = (uint8_t)(i * 131 + 7);
+        {
+            struct file file = {};
+            CHECK(file_create(&file, SIZED(filename)));
+            CHECK(file_write(
+              &file, 0, expected.data(), expected.data() + expected.size()));
+            file_close(&file);
+        }
+
+        struct file file = {};
+        CHECK(!file_open_read(&file, SIZED("does-not-exist")));
+        CHECK(file_open_read(&file, SIZED(filename)));
+        uint64_t nbytes = 0;
+        CHECK(file_get_size(&file, &nbytes));
+        CHECK(nbytes == bytes_of_file);
+
+        std::vector<uint8_t> actual(bytes_of_file);
+        CHECK(file_read(&file, 0, actual.data(), actual.data() + 1000));
+        CHECK(file_read(
+          &file, 1000, actual.data() + 1000, actual.data() + actual.size()));
+        CHECK(0 == memcmp(actual.data(), expected.data(), bytes_of_file));
+        CHECK(!file_read(&file,
+                         bytes_of_file - 10,
+                         actual.data(),
+                         actual.data() + 20));
+
+        const FileReadHint hints[] = { FileReadHint_Sequential,
+                                       FileReadHint_Random,
+                                       FileReadHint_WillNeed };
+        for (const auto hint : hints) {
+            const uint64_t offset = 4097 + 1000 * hint;
+            const size_t n = bytes_of_file - offset;
+            const uint8_t* view = 0;
+            CHECK(view =
+                    (const uint8_t*)file_map_for_read(&file, offset, n, hint));
+            CHECK(0 == memcmp(view, expected.data() + offset, n));
+            CHECK(file_unmap(view, n));
+        }
+        CHECK(!file_map_for_read(
+          &file, 1, bytes_of_file, FileReadHint_Sequential));
+        file_close(&file);
+        remove(filename);
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    remove(filename);
+    return 1;
+}
@@ -0,0 +1,96 @@
+//! Test that file_reserve() sets space aside without changing the size of
+//! the file, and that file_truncate() trims the file back down.
+#include "platform.h"
+#include "logger.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+
+#define SIZED(str) str, sizeof(str)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+static long
+size_of(const char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    CHECK(fp);
+    fseek(fp, 0, SEEK_END);
+    const long nbytes = ftell(fp);
+    fclose(fp);
+    return nbytes;
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+
+    const char filename[] = "file-reserve-behavior.bin";
+    remove(filename);
+    try {
+        std::vector<uint8_t> data(2000);
+        for (size_t i = 0; i < data.size(); ++i)
+            data[i] = (uint8_t)(i * 131 + 7);
+
+        struct file file = {};
+        CHECK(file_create(&file, SIZED(filename)));
+        CHECK(file_reserve(&file, 0, 8 << 20));
+        CHECK(file_reserve(&file, 0, 0));
+        CHECK(file_write(&file, 0, data.data(), data.data() + data.size()));
+        EXPECT(size_of(filename) == (long)data.size(),
+               "Expected the reservation to leave the size alone. Got %ld.",
+               size_of(filename));
+        CHECK(file_truncate(&file, 1000));
+        file_close(&file);
+
+        EXPECT(size_of(filename) == 1000,
+               "Expected 1000 bytes after truncating. Got %ld.",
+               size_of(filename));
+        FILE* fp = fopen(filename, "rb");
+        CHECK(fp);
+        std::vector<uint8_t> actual(1000);
+        const size_t nread = fread(actual.data(), 1, actual.size(), fp);
+        fclose(fp);
+        CHECK(nread == actual.size());
+        CHECK(0 == memcmp(actual.data(), data.data(), actual.size()));
+        remove(filename);
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    remove(filename);
+    return 1;
+}
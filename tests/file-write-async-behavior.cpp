@@ -0,0 +1,144 @@
+//! Test that writes started with file_write_async() all land in the file,
+//! whether or not they come from a registered buffer, and that their
+//! callbacks run exactly once.
+#include "platform.h"
+#include "logger.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+
+#define SIZED(str) str, sizeof(str)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+struct completions
+{
+    std::atomic<int> ok;
+    std::atomic<int> failed;
+};
+
+static void
+on_done(void* ctx, int is_ok)
+{
+    auto c = (completions*)ctx;
+    if (is_ok)
+        ++c->ok;
+    else
+        ++c->failed;
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+
+    const char filename[] = "file-write-async-behavior.bin";
+    const size_t bytes_of_chunk = 1 << 20;
+    const int nchunks = 100;
+
+    remove(filename);
+    try {
+        // Every chunk holds a different byte, so misplaced writes show up.
+        std::vector<uint8_t> registered(bytes_of_chunk * nchunks / 2);
+        std::vector<uint8_t> unregistered(bytes_of_chunk * nchunks / 2);
+        for (int i = 0; i < nchunks; ++i) {
+            auto& buf = (i % 2) ? unregistered : registered;
+            memset(buf.data() + (i / 2) * bytes_of_chunk, i, bytes_of_chunk);
+        }
+
+        completions c;
+        c.ok = 0;
+        c.failed = 0;
+        struct file file = {};
+        CHECK(file_create(&file, SIZED(filename)));
+        CHECK(file_register_buffer(
+          &file, registered.data(), registered.data() + registered.size()));
+
+        // Write the chunks out of order.
+        for (int k = 0; k < nchunks; ++k) {
+            const int i = (k * 37) % nchunks;
+            const auto& buf = (i % 2) ? unregistered : registered;
+            const uint8_t* beg = buf.data() + (i / 2) * bytes_of_chunk;
+            CHECK(file_write_async(&file,
+                                   (uint64_t)i * bytes_of_chunk,
+                                   beg,
+                                   beg + bytes_of_chunk,
+                                   on_done,
+                                   &c));
+        }
+        CHECK(file_flush(&file));
+        EXPECT(c.ok == nchunks && c.failed == 0,
+               "Expected %d successful completions. Got %d, and %d failures.",
+               nchunks,
+               c.ok.load(),
+               c.failed.load());
+
+        // Reversed ranges are rejected. Writes without callbacks, and empty
+        // writes, are fine.
+        CHECK(file_write_async(&file, 0, registered.data(), 0, 0, 0) == 0);
+        CHECK(file_write_async(&file,
+                               0,
+                               registered.data(),
+                               registered.data() + bytes_of_chunk,
+                               0,
+                               0));
+        CHECK(file_write_async(
+          &file, 0, registered.data(), registered.data(), on_done, &c));
+        CHECK(file_wait(&file));
+        CHECK(c.ok == nchunks + 1);
+        file_close(&file);
+
+        FILE* fp = fopen(filename, "rb");
+        CHECK(fp);
+        std::vector<uint8_t> actual(bytes_of_chunk);
+        for (int i = 0; i < nchunks; ++i) {
+            CHECK(fread(actual.data(), 1, actual.size(), fp) == actual.size());
+            const auto& buf = (i % 2) ? unregistered : registered;
+            EXPECT(0 == memcmp(actual.data(),
+                               buf.data() + (i / 2) * bytes_of_chunk,
+                               bytes_of_chunk),
+                   "Chunk %d doesn't match",
+                   i);
+        }
+        fclose(fp);
+        remove(filename);
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    remove(filename);
+    return 1;
+}
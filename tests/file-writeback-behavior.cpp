@@ -0,0 +1,107 @@
+//! Test that files with a write-back window keep writing correctly, and on
+//! Linux, that the window moves along behind the writes.
+#include "platform.h"
+#include "logger.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+
+#define SIZED(str) str, sizeof(str)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+
+    const char filename[] = "file-writeback-behavior.bin";
+    const size_t bytes_of_window = 1 << 20;
+    const size_t bytes_of_chunk = 256 << 10;
+    const size_t nchunks = 32;
+
+    remove(filename);
+    try {
+        std::vector<uint8_t> data(bytes_of_chunk * nchunks);
+        for (size_t i = 0; i < data.size(); ++i)
+            data[i] = (uint8_t)(i * 131 + 7);
+
+        struct file file = {};
+        struct file_writeback_stats stats = {};
+        CHECK(file_create(&file, SIZED(filename)));
+        CHECK(file_set_writeback_window(&file, bytes_of_window));
+
+        // The first half is written synchronously, the second asynchronously.
+        for (size_t i = 0; i < nchunks; ++i) {
+            const uint8_t* beg = data.data() + i * bytes_of_chunk;
+            if (i < nchunks / 2) {
+                CHECK(file_write(
+                  &file, i * bytes_of_chunk, beg, beg + bytes_of_chunk));
+            } else {
+                CHECK(file_write_async(
+                  &file, i * bytes_of_chunk, beg, beg + bytes_of_chunk, 0, 0));
+            }
+        }
+        CHECK(file_wait(&file));
+        CHECK(file_get_writeback_stats(&file, &stats));
+        LOG("Started %llu bytes, retired %llu bytes, waited %llu times.",
+            (unsigned long long)stats.bytes_started,
+            (unsigned long long)stats.bytes_retired,
+            (unsigned long long)stats.wait_count);
+#ifdef __linux__
+        // Every whole window was started, and all but the last retired.
+        CHECK(stats.bytes_started == data.size());
+        CHECK(stats.bytes_retired == data.size() - bytes_of_window);
+        CHECK(stats.bytes_in_flight == bytes_of_window);
+#endif
+        CHECK(stats.bytes_in_flight ==
+              stats.bytes_started - stats.bytes_retired);
+        file_close(&file);
+
+        FILE* fp = fopen(filename, "rb");
+        CHECK(fp);
+        std::vector<uint8_t> actual(data.size() + 1);
+        const size_t nread = fread(actual.data(), 1, actual.size(), fp);
+        fclose(fp);
+        CHECK(nread == data.size());
+        CHECK(0 == memcmp(actual.data(), data.data(), data.size()));
+        remove(filename);
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    remove(filename);
+    return 1;
+}
@@ -0,0 +1,93 @@
+//! Test that file_writev() writes every segment back to back, including
+//! empty segments and more segments than fit in one system call.
+#include "platform.h"
+#include "logger.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+
+#define SIZED(str) str, sizeof(str)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+
+    const char filename[] = "file-writev-behavior.bin";
+    remove(filename);
+    try {
+        // Segments of varying sizes, some empty, carved out of one buffer in
+        // a shuffled order so they aren't contiguous in memory.
+        const size_t nsegments = 200;
+        std::vector<uint8_t> data(nsegments * 1000);
+        for (size_t i = 0; i < data.size(); ++i)
+            data[i] = (uint8_t)(i * 131 + 7);
+        std::vector<struct file_segment> segments(nsegments);
+        std::vector<uint8_t> expected;
+        for (size_t k = 0; k < nsegments; ++k) {
+            const size_t i = (k * 73) % nsegments;
+            const uint8_t* beg = data.data() + i * 1000;
+            const size_t n = (k % 7 == 0) ? 0 : (k * 37) % 1000;
+            segments[k] = { beg, beg + n };
+            expected.insert(expected.end(), beg, beg + n);
+        }
+
+        struct file file = {};
+        CHECK(file_create(&file, SIZED(filename)));
+        CHECK(file_writev(&file, 10, segments.data(), segments.size()));
+        CHECK(file_writev(&file, 0, segments.data(), 0));
+        file_close(&file);
+
+        FILE* fp = fopen(filename, "rb");
+        CHECK(fp);
+        std::vector<uint8_t> actual(10 + expected.size() + 1);
+        const size_t nread = fread(actual.data(), 1, actual.size(), fp);
+        fclose(fp);
+        EXPECT(nread == 10 + expected.size(),
+               "Expected %llu bytes. Got %llu.",
+               (unsigned long long)(10 + expected.size()),
+               (unsigned long long)nread);
+        CHECK(0 ==
+              memcmp(actual.data() + 10, expected.data(), expected.size()));
+        remove(filename);
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    remove(filename);
+    return 1;
+}
@@ -0,0 +1,236 @@
+//! Test that blocks from memory_alloc() are usable for every allocator hint
+//! and that memory_query() reports what actually backs them.
+#include "platform.h"
+#include "logger.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+static const char*
+page_kind_as_string(enum MemoryPageKind kind)
+{
+    switch (kind) {
+        case MemoryPageKind_Default:
+            return "Default";
+        case MemoryPageKind_TransparentHuge:
+            return "TransparentHuge";
+        case MemoryPageKind_Large:
+            return "Large";
+        default:
+            return "(unknown)";
+    }
+}
+
+static void
+alloc_write_free(size_t nbytes, enum AllocatorHint hint)
+{
+    uint8_t* buf = (uint8_t*)memory_alloc(nbytes, hint);
+    EXPECT(buf, "Failed to allocate %llu bytes", (unsigned long long)nbytes);
+
+    struct memory_info info = {};
+    CHECK(memory_query(buf, &info));
+    LOG("hint %d: %llu bytes backed by %s pages of %llu bytes%s%s",
+        (int)hint,
+        (unsigned long long)nbytes,
+        page_kind_as_string(info.page_kind),
+        (unsigned long long)info.bytes_of_page,
+        info.is_prefaulted ? " (prefaulted)" : "",
+        info.is_locked ? " (locked)" : "");
+    CHECK(info.bytes_of_page >= 4096);
+    if (hint == AllocatorHint_Default)
+        CHECK(info.page_kind == MemoryPageKind_Default);
+    // Locking may legitimately fail when it exceeds the process' limits, but
+    // the block must still be prefaulted.
+    if (hint & (AllocatorHint_Prefault | AllocatorHint_Locked))
+        CHECK(info.is_prefaulted);
+
+    // every byte must be writable
+    memset(buf, 0xab, nbytes);
+    CHECK(buf[0] == 0xab);
+    CHECK(buf[nbytes - 1] == 0xab);
+    memory_free(buf);
+}
+
+static void
+aligned_alloc_write_free(size_t nbytes,
+                         size_t alignment,
+                         enum AllocatorHint hint)
+{
+    uint8_t* buf = (uint8_t*)memory_alloc_aligned(nbytes, alignment, hint);
+    EXPECT(buf,
+           "Failed to allocate %llu bytes aligned to %llu",
+           (unsigned long long)nbytes,
+           (unsigned long long)alignment);
+    EXPECT(((uintptr_t)buf & (alignment - 1)) == 0,
+           "Expected %p to be aligned to %llu bytes (hint %d)",
+           buf,
+           (unsigned long long)alignment,
+           (int)hint);
+    struct memory_info info = {};
+    CHECK(memory_query(buf, &info));
+    memset(buf, 0xab, nbytes);
+    CHECK(buf[nbytes - 1] == 0xab);
+    memory_free(buf);
+}
+
+// A block that's a whole number of pages maps just those pages, with nothing
+// extra for bookkeeping or alignment.
+static void
+exact_mapping(enum AllocatorHint hint)
+{
+    const size_t nbytes = 2ULL << 20;
+    uint8_t* buf = (uint8_t*)memory_alloc(nbytes, hint);
+    CHECK(buf);
+    struct memory_info info = {};
+    CHECK(memory_query(buf, &info));
+    LOG("hint %d: %llu bytes mapped for %llu bytes",
+        (int)hint,
+        (unsigned long long)info.bytes_of_mapping,
+        (unsigned long long)nbytes);
+    if (hint & AllocatorHint_Prefault)
+        CHECK(info.bytes_of_mapping);
+    // Heap blocks report 0.
+    if (info.bytes_of_mapping)
+        EXPECT(info.bytes_of_mapping == nbytes,
+               "Expected %llu bytes mapped. Got %llu.",
+               (unsigned long long)nbytes,
+               (unsigned long long)info.bytes_of_mapping);
+    memset(buf, 0xab, nbytes);
+    memory_free(buf);
+}
+
+static void
+wait_for_event(void* event)
+{
+    event_wait((struct event*)event);
+}
+
+// Every machine has at least one node, so this exercises the NUMA paths
+// everywhere.
+static void
+numa_placement()
+{
+    const int nnodes = memory_node_count();
+    LOG("NUMA nodes: %d. Current node: %d", nnodes, thread_current_node());
+    CHECK(nnodes >= 1);
+    CHECK(thread_current_node() >= 0 && thread_current_node() < nnodes);
+
+    for (int node = 0; node < nnodes; ++node) {
+        uint8_t* buf = (uint8_t*)memory_alloc_on_node(
+          3 << 20, 4096, AllocatorHint_Prefault, node);
+        EXPECT(buf, "Failed to allocate on node %d", node);
+        CHECK(((uintptr_t)buf & 4095) == 0);
+        struct memory_info info = {};
+        CHECK(memory_query(buf, &info));
+        EXPECT(info.node == node,
+               "Expected the block to be on node %d. Got %d.",
+               node,
+               info.node);
+        memset(buf, 0xab, 3 << 20);
+        memory_free(buf);
+    }
+    EXPECT(0 == memory_alloc_on_node(64, 64, AllocatorHint_Default, nnodes),
+           "Expected an allocation on a non-existent node to fail.");
+
+    {
+        uint8_t* buf = (uint8_t*)memory_alloc(
+          1 << 20,
+          (enum AllocatorHint)(AllocatorHint_NodeLocal |
+                               AllocatorHint_LargePage));
+        CHECK(buf);
+        struct memory_info info = {};
+        CHECK(memory_query(buf, &info));
+        CHECK(info.node >= 0 && info.node < nnodes);
+        memory_free(buf);
+    }
+
+    {
+        struct event event = {};
+        struct thread thread = {};
+        event_init(&event);
+        thread_init(&thread);
+        CHECK(thread_create(&thread, wait_for_event, &event));
+        CHECK(thread_bind_to_node(&thread, nnodes - 1));
+        CHECK(!thread_bind_to_node(&thread, nnodes));
+        event_notify_all(&event);
+        thread_join(&thread);
+        event_destroy(&event);
+    }
+    CHECK(thread_bind_to_node(0, 0));
+}
+
+int
+main(int argc, char** argv)
+{
+    logger_set_reporter(reporter);
+    try {
+        const int hints[] = {
+            AllocatorHint_Default,
+            AllocatorHint_LargePage,
+            AllocatorHint_Prefault,
+            AllocatorHint_Locked,
+            AllocatorHint_LargePage | AllocatorHint_Prefault,
+            AllocatorHint_LargePage | AllocatorHint_Locked,
+        };
+        for (const int hint : hints) {
+            alloc_write_free(1, (enum AllocatorHint)hint);
+            alloc_write_free(4096 + 17, (enum AllocatorHint)hint);
+            alloc_write_free(5ULL << 20, (enum AllocatorHint)hint);
+        }
+        for (const int hint : hints) {
+            for (const size_t alignment :
+                 { 1ULL, 64ULL, 4096ULL, 1ULL << 16, 2ULL << 20 }) {
+                const auto h = (enum AllocatorHint)hint;
+                aligned_alloc_write_free(1, alignment, h);
+                aligned_alloc_write_free((3ULL << 20) + 5, alignment, h);
+            }
+        }
+        exact_mapping(AllocatorHint_LargePage);
+        exact_mapping((enum AllocatorHint)(AllocatorHint_LargePage |
+                                           AllocatorHint_Prefault));
+        EXPECT(0 == memory_alloc_aligned(64, 3, AllocatorHint_Default),
+               "Expected alignments that aren't a power of two to be "
+               "rejected.");
+        EXPECT(0 == memory_alloc(1, (enum AllocatorHint)(1 << 30)),
+               "Expected unknown allocator hints to be rejected.");
+        numa_placement();
+        memory_free(0); // must be a no-op
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    return 1;
+}
@@ -0,0 +1,120 @@
+//! How steadily a software trigger can run at 1 kHz: with a `pacer`, and by
+//! sleeping for the rest of each period with `clock_sleep_ms()`, the way
+//! triggers were paced before. Reports the achieved period and jitter, which
+//! depend on how busy the machine is, and only fails when the pacer finishes
+//! early.
+#include "platform.h"
+#include "pacer.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expected %s", #e)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+const uint64_t period_ns = 1000000;
+const int tick_count = 500;
+
+static void
+report(const char* name, const struct pacer_stats& stats)
+{
+    LOG("%s: period %.3f us mean, %.3f us stddev, [%.3f, %.3f] us. %llu "
+        "missed.",
+        name,
+        1e-3 * stats.mean_period_ns,
+        1e-3 * stats.stddev_period_ns,
+        1e-3 * (double)stats.min_period_ns,
+        1e-3 * (double)stats.max_period_ns,
+        (unsigned long long)stats.missed);
+}
+
+static struct pacer_stats
+run_pacer()
+{
+    struct pacer pacer;
+    struct pacer_stats stats;
+    pacer_init(&pacer, period_ns, 0);
+    for (int i = 0; i < tick_count; ++i)
+        pacer_wait(&pacer);
+    const uint64_t end = clock_now_ns();
+    pacer_get_stats(&pacer, &stats);
+    CHECK(stats.ticks == (uint64_t)tick_count);
+    // Deadlines come from the start, so the total doesn't drift.
+    const uint64_t expected = pacer.start_ns + (pacer.index - 1) * period_ns;
+    EXPECT(end >= expected,
+           "Finished %llu ns early.",
+           (unsigned long long)(expected - end));
+    return stats;
+}
+
+// The same statistics for a loop that sleeps off the rest of each period.
+static struct pacer_stats
+run_sleep()
+{
+    struct clock clock;
+    struct pacer_stats stats = {};
+    double sum = 0, sum2 = 0;
+    uint64_t last = clock_tic(&clock);
+    stats.min_period_ns = UINT64_MAX;
+    for (int i = 0; i < tick_count; ++i) {
+        clock_sleep_ms(&clock, 1e-6f * (float)period_ns);
+        const uint64_t now = clock_now_ns();
+        const uint64_t period = now - last;
+        last = now;
+        stats.min_period_ns = std::min(stats.min_period_ns, period);
+        stats.max_period_ns = std::max(stats.max_period_ns, period);
+        sum += (double)period;
+        sum2 += (double)period * (double)period;
+    }
+    stats.ticks = tick_count;
+    stats.mean_period_ns = sum / tick_count;
+    stats.stddev_period_ns = std::sqrt(std::max(
+      0.0, sum2 / tick_count - stats.mean_period_ns * stats.mean_period_ns));
+    return stats;
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+    try {
+        report("clock_sleep_ms", run_sleep());
+        report("pacer", run_pacer());
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    return 1;
+}
@@ -0,0 +1,196 @@
+//! Several producers feeding one or more consumers through a `queue`, the
+//! multi-camera fan-in case, compared against a queue guarded by one mutex.
+//! Checks every item arrives exactly once and reports the throughput.
+#include "platform.h"
+#include "queue.h"
+#include "logger.h"
+
+#include <atomic>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+const uintptr_t items_per_producer = 100000;
+const size_t capacity = 1024;
+
+/// The baseline: a ring of pointers behind one lock.
+struct locked_queue
+{
+    struct lock lock;
+    struct condition_variable changed;
+    std::vector<void*> items;
+    size_t head, count;
+
+    locked_queue()
+      : items(capacity)
+      , head(0)
+      , count(0)
+    {
+        lock_init(&lock);
+        condition_variable_init(&changed);
+    }
+
+    void push(void* item)
+    {
+        lock_acquire(&lock);
+        while (count == items.size())
+            condition_variable_wait(&changed, &lock);
+        items[(head + count++) % items.size()] = item;
+        condition_variable_notify_all(&changed);
+        lock_release(&lock);
+    }
+
+    void* pop()
+    {
+        lock_acquire(&lock);
+        while (!count)
+            condition_variable_wait(&changed, &lock);
+        void* item = items[head];
+        head = (head + 1) % items.size();
+        --count;
+        condition_variable_notify_all(&changed);
+        lock_release(&lock);
+        return item;
+    }
+};
+
+struct lock_free_queue
+{
+    struct queue inner;
+
+    lock_free_queue()
+    {
+        CHECK(queue_init(&inner, capacity));
+    }
+    ~lock_free_queue() { queue_destroy(&inner); }
+
+    void push(void* item) { queue_push(&inner, item); }
+    void* pop() { return queue_pop(&inner); }
+};
+
+template<typename Q>
+struct context
+{
+    Q queue;
+    std::atomic<uint64_t> sum;
+};
+
+template<typename Q>
+struct producer_args
+{
+    context<Q>* ctx;
+    uintptr_t id;
+};
+
+// Items are never NULL, so NULL tells consumers to stop.
+template<typename Q>
+static void
+produce(void* args_)
+{
+    auto args = (producer_args<Q>*)args_;
+    for (uintptr_t i = 0; i < items_per_producer; ++i)
+        args->ctx->queue.push((void*)(args->id * items_per_producer + i + 1));
+}
+
+template<typename Q>
+static void
+consume(void* ctx_)
+{
+    auto ctx = (context<Q>*)ctx_;
+    uint64_t sum = 0;
+    while (void* item = ctx->queue.pop())
+        sum += (uintptr_t)item;
+    ctx->sum += sum;
+}
+
+template<typename Q>
+static double
+run(const char* name, int nproducers, int nconsumers)
+{
+    context<Q> ctx;
+    ctx.sum = 0;
+    std::vector<struct thread> producers(nproducers), consumers(nconsumers);
+    std::vector<producer_args<Q>> args(nproducers);
+
+    struct clock clock;
+    clock_init(&clock);
+    for (int i = 0; i < nconsumers; ++i) {
+        thread_init(&consumers[i]);
+        CHECK(thread_create(&consumers[i], consume<Q>, &ctx));
+    }
+    for (int i = 0; i < nproducers; ++i) {
+        args[i] = { &ctx, (uintptr_t)i };
+        thread_init(&producers[i]);
+        CHECK(thread_create(&producers[i], produce<Q>, &args[i]));
+    }
+    for (auto& t : producers)
+        thread_join(&t);
+    for (int i = 0; i < nconsumers; ++i)
+        ctx.queue.push(0);
+    for (auto& t : consumers)
+        thread_join(&t);
+    const double elapsed_ms = clock_toc_ms(&clock);
+
+    const uint64_t n = (uint64_t)nproducers * items_per_producer;
+    EXPECT(ctx.sum == n * (n + 1) / 2,
+           "%s: Expected the items to sum to %llu. Got %llu.",
+           name,
+           (unsigned long long)(n * (n + 1) / 2),
+           (unsigned long long)ctx.sum.load());
+    const double rate = 1e-3 * (double)n / elapsed_ms;
+    LOG("%-10s %d producers -> %d consumers: %8.3f Mitems/s",
+        name,
+        nproducers,
+        nconsumers,
+        rate);
+    return rate;
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+    try {
+        const int shapes[][2] = { { 1, 1 }, { 4, 1 }, { 4, 4 } };
+        for (const auto& shape : shapes) {
+            run<lock_free_queue>("lock-free", shape[0], shape[1]);
+            run<locked_queue>("locked", shape[0], shape[1]);
+        }
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    return 1;
+}
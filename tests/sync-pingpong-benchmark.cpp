@@ -0,0 +1,186 @@
+//! Compares `struct event` with the one-word `sync_event`: the cost of a set
+//! and wait when the event is already set, and the round-trip latency of two
+//! threads handing a turn back and forth. `sync_semaphore` plays ping-pong
+//! too.
+#include "platform.h"
+#include "sync.h"
+#include "logger.h"
+
+#include <cstdio>
+#include <stdexcept>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expected %s", #e)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+const int uncontended_count = 1000000;
+const int round_count = 20000;
+
+static void
+set_event(void* e)
+{
+    event_notify_all((struct event*)e);
+}
+
+static void
+wait_event(void* e)
+{
+    event_wait((struct event*)e);
+}
+
+static void
+set_sync_event(void* e)
+{
+    sync_event_set((struct sync_event*)e);
+}
+
+static void
+wait_sync_event(void* e)
+{
+    sync_event_wait((struct sync_event*)e);
+}
+
+static void
+post_semaphore(void* s)
+{
+    sync_semaphore_post((struct sync_semaphore*)s, 1);
+}
+
+static void
+wait_semaphore(void* s)
+{
+    sync_semaphore_wait((struct sync_semaphore*)s);
+}
+
+struct channel
+{
+    void (*set)(void*);
+    void (*wait)(void*);
+    void* ping;
+    void* pong;
+    int rounds;
+};
+
+static void
+echo(void* arg)
+{
+    auto* c = (struct channel*)arg;
+    for (int i = 0; i < round_count; ++i) {
+        c->wait(c->ping);
+        c->set(c->pong);
+        ++c->rounds;
+    }
+}
+
+// Mean ns per set and wait, from one thread, so nothing ever sleeps.
+static double
+uncontended_ns(const struct channel& c)
+{
+    const uint64_t start = clock_now_ns();
+    for (int i = 0; i < uncontended_count; ++i) {
+        c.set(c.ping);
+        c.wait(c.ping);
+    }
+    return (double)(clock_now_ns() - start) / uncontended_count;
+}
+
+// Mean ns for a turn to go to the other thread and back.
+static double
+round_trip_ns(struct channel& c)
+{
+    struct thread thread;
+    thread_init(&thread);
+    c.rounds = 0;
+    CHECK(thread_create(&thread, echo, &c));
+    const uint64_t start = clock_now_ns();
+    for (int i = 0; i < round_count; ++i) {
+        c.set(c.ping);
+        c.wait(c.pong);
+    }
+    const uint64_t elapsed = clock_now_ns() - start;
+    thread_join(&thread);
+    CHECK(c.rounds == round_count);
+    return (double)elapsed / round_count;
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+    struct event events[2];
+    event_init(events + 0);
+    event_init(events + 1);
+    try {
+        struct sync_event sync_events[2];
+        sync_event_init(sync_events + 0, 0);
+        sync_event_init(sync_events + 1, 0);
+        struct sync_semaphore semaphores[2];
+        sync_semaphore_init(semaphores + 0, 0);
+        sync_semaphore_init(semaphores + 1, 0);
+
+        struct channel legacy = {
+            set_event, wait_event, events + 0, events + 1, 0
+        };
+        struct channel fast = {
+            set_sync_event, wait_sync_event, sync_events + 0, sync_events + 1, 0
+        };
+        struct channel counted = {
+            post_semaphore, wait_semaphore, semaphores + 0, semaphores + 1, 0
+        };
+
+        const double legacy_set_ns = uncontended_ns(legacy);
+        const double fast_set_ns = uncontended_ns(fast);
+        LOG("Set and wait, uncontended: event %.1f ns, sync_event %.1f ns.",
+            legacy_set_ns,
+            fast_set_ns);
+
+        LOG("Round trip: event %.0f ns, sync_event %.0f ns, sync_semaphore "
+            "%.0f ns.",
+            round_trip_ns(legacy),
+            round_trip_ns(fast),
+            round_trip_ns(counted));
+
+        // Every set was consumed by a wait.
+        CHECK(!sync_event_wait_for(sync_events + 0, 0));
+        CHECK(!sync_event_wait_for(sync_events + 1, 0));
+        CHECK(!sync_semaphore_try_wait(semaphores + 0));
+        CHECK(!sync_semaphore_try_wait(semaphores + 1));
+
+        event_destroy(events + 0);
+        event_destroy(events + 1);
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    event_destroy(events + 0);
+    event_destroy(events + 1);
+    return 1;
+}
@@ -73,6 +73,25 @@ extern "C"
     int unit_test__device_kind_as_string__is_defined_for_all();
     int unit_test__sample_type_as_string__is_defined_for_all();
     int unit_test__bytes_of_type__is_defined_for_all();
+    int unit_test__frame_pool_recycles_slots();
+    int unit_test__frame_pool_get_frame_sizes_frames_by_shape();
+    int unit_test__storage_rollover_names_segments();
+    int unit_test__storage_rollover_splits_on_limits();
+    int unit_test__storage_rollover_appends_across_segments();
+    int unit_test__clock_correlation_follows_a_wrapping_counter();
+    int unit_test__ring_reservations_wrap_contiguously();
+    int unit_test__ring_passes_variable_sized_records_between_threads();
+    int unit_test__queue_is_fifo_and_bounded();
+    int unit_test__write_pool_writes_every_request();
+    int unit_test__striped_file_deals_stripes_round_robin();
+    int unit_test__io_stats_buckets_latencies_by_powers_of_two();
+    int unit_test__file_creator_creates_files_and_directories();
+    int unit_test__file_cache_evicts_least_recently_used();
+    int unit_test__file_cache_reacquires_while_evicting();
+    int unit_test__file_coalescer_gathers_sequential_writes();
+    int unit_test__file_coalescer_writes_after_max_delay();
+    int unit_test__pacer_never_returns_early_and_skips_missed_ticks();
+    int unit_test__sync_primitives_wait_and_wake();
 }
 
 int
@@ -99,6 +118,25 @@ main()
         CASE(unit_test__device_kind_as_string__is_defined_for_all),
         CASE(unit_test__sample_type_as_string__is_defined_for_all),
         CASE(unit_test__bytes_of_type__is_defined_for_all),
+        CASE(unit_test__frame_pool_recycles_slots),
+        CASE(unit_test__frame_pool_get_frame_sizes_frames_by_shape),
+        CASE(unit_test__storage_rollover_names_segments),
+        CASE(unit_test__storage_rollover_splits_on_limits),
+        CASE(unit_test__storage_rollover_appends_across_segments),
+        CASE(unit_test__clock_correlation_follows_a_wrapping_counter),
+        CASE(unit_test__ring_reservations_wrap_contiguously),
+        CASE(unit_test__ring_passes_variable_sized_records_between_threads),
+        CASE(unit_test__queue_is_fifo_and_bounded),
+        CASE(unit_test__write_pool_writes_every_request),
+        CASE(unit_test__striped_file_deals_stripes_round_robin),
+        CASE(unit_test__io_stats_buckets_latencies_by_powers_of_two),
+        CASE(unit_test__file_creator_creates_files_and_directories),
+        CASE(unit_test__file_cache_evicts_least_recently_used),
+        CASE(unit_test__file_cache_reacquires_while_evicting),
+        CASE(unit_test__file_coalescer_gathers_sequential_writes),
+        CASE(unit_test__file_coalescer_writes_after_max_delay),
+        CASE(unit_test__pacer_never_returns_early_and_skips_missed_ticks),
+        CASE(unit_test__sync_primitives_wait_and_wake),
 #undef CASE
     };
 
@@ -0,0 +1,122 @@
+//! `event_wait_for()` and `condition_variable_wait_for()` return 0 when they
+//! time out, no sooner than the timeout, and 1 when they're woken.
+#include "platform.h"
+#include "logger.h"
+
+#include <cstdio>
+#include <stdexcept>
+
+#define L (aq_logger)
+#define LOG(...) L(0, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define ERR(...) L(1, __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+#define EXPECT(e, ...)                                                         \
+    do {                                                                       \
+        if (!(e)) {                                                            \
+            char buf[1 << 8] = { 0 };                                          \
+            ERR(__VA_ARGS__);                                                  \
+            snprintf(buf, sizeof(buf) - 1, __VA_ARGS__);                       \
+            throw std::runtime_error(buf);                                     \
+        }                                                                      \
+    } while (0)
+#define CHECK(e) EXPECT(e, "Expression evaluated as false: %s", #e)
+
+void
+reporter(int is_error,
+         const char* file,
+         int line,
+         const char* function,
+         const char* msg)
+{
+    fprintf(is_error ? stderr : stdout,
+            "%s%s(%d) - %s: %s\n",
+            is_error ? "ERROR " : "",
+            file,
+            line,
+            function,
+            msg);
+}
+
+const uint64_t timeout_ns = 20000000;
+
+struct shared
+{
+    struct lock lock;
+    struct condition_variable changed;
+    struct event event;
+    int is_ready;
+};
+
+static void
+notify(void* arg)
+{
+    auto* s = (struct shared*)arg;
+    clock_sleep_ms(0, 5.0f);
+    lock_acquire(&s->lock);
+    s->is_ready = 1;
+    condition_variable_notify_all(&s->changed);
+    lock_release(&s->lock);
+    event_notify_all(&s->event);
+}
+
+static void
+expect_timeout(int is_woken, uint64_t start, const char* what)
+{
+    const uint64_t elapsed = clock_now_ns() - start;
+    EXPECT(!is_woken, "%s didn't time out.", what);
+    EXPECT(elapsed >= timeout_ns,
+           "%s timed out after %llu ns, before the %llu ns timeout.",
+           what,
+           (unsigned long long)elapsed,
+           (unsigned long long)timeout_ns);
+}
+
+int
+main()
+{
+    logger_set_reporter(reporter);
+    struct shared s = {};
+    struct thread thread = {};
+    lock_init(&s.lock);
+    condition_variable_init(&s.changed);
+    event_init(&s.event);
+    try {
+        // Nobody notifies, so both time out.
+        uint64_t start = clock_now_ns();
+        lock_acquire(&s.lock);
+        int is_woken = 0;
+        while (!s.is_ready && (is_woken = condition_variable_wait_for(
+                                 &s.changed, &s.lock, timeout_ns)))
+            ;
+        lock_release(&s.lock);
+        expect_timeout(is_woken, start, "condition_variable_wait_for()");
+
+        start = clock_now_ns();
+        expect_timeout(
+          event_wait_for(&s.event, timeout_ns), start, "event_wait_for()");
+
+        // Notified well within the timeout.
+        thread_init(&thread);
+        CHECK(thread_create(&thread, notify, &s));
+        lock_acquire(&s.lock);
+        while (!s.is_ready &&
+               condition_variable_wait_for(&s.changed, &s.lock, 1000000000))
+            ;
+        is_woken = s.is_ready;
+        lock_release(&s.lock);
+        CHECK(is_woken);
+        CHECK(event_wait_for(&s.event, 1000000000));
+        thread_join(&thread);
+
+        // Waiting reset the event.
+        CHECK(!event_wait_for(&s.event, 0));
+
+        event_destroy(&s.event);
+        return 0;
+    } catch (const std::exception& e) {
+        ERR("%s", e.what());
+    } catch (...) {
+        ERR("Unknown exception");
+    }
+    event_destroy(&s.event);
+    return 1;
+}